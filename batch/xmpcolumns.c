@@ -0,0 +1,441 @@
+#include "xmpcolumns.h"
+#include "../blocks/xmpblock.h"
+#include "../rdfxml/rdfxml.h"
+#include <stdio.h>  // fopen, fwrite, fclose
+#include <stdlib.h> // malloc, realloc, free
+#include <string.h> // memcpy, memcmp, strlen
+#include <stdint.h> // uint32_t
+#include <fcntl.h>  // open, for exclusive creation
+#include <unistd.h> // close, unlink
+
+size_t xmpcol_group_rows = 65536;
+size_t xmpcol_group_bytes = 16 << 20;
+
+////////////////////////////// HELPERS //////////////////////////////
+/// a growable array of bytes
+typedef struct {
+    char *ptr;
+    size_t len, cap;
+    int failed;
+} xmpcol_bytes;
+
+/// makes room for `len` more bytes; returns false if out of memory
+static int reserve(xmpcol_bytes *b, size_t len) {
+    if (b->failed) return 0;
+    if (b->len + len > b->cap) {
+        size_t want = 2*(b->len + len) + 256;
+        char *bigger = realloc(b->ptr, want);
+        if (!bigger) { b->failed = 1; return 0; }
+        b->ptr = bigger;
+        b->cap = want;
+    }
+    return 1;
+}
+static void put(xmpcol_bytes *b, const void *data, size_t len) {
+    if (!len || !reserve(b, len)) return;
+    memcpy(b->ptr + b->len, data, len);
+    b->len += len;
+}
+static void put_u8(xmpcol_bytes *b, unsigned val) {
+    unsigned char c = val;
+    put(b, &c, 1);
+}
+static void put_u32(xmpcol_bytes *b, uint32_t val) {
+    unsigned char c[4] = {val, val>>8, val>>16, val>>24};
+    put(b, c, 4);
+}
+static void put_slice(xmpcol_bytes *b, rdfxml_slice s) {
+    put(b, s.ptr, s.len);
+}
+////////////////////////////// HELPERS //////////////////////////////
+
+//////////////////////////// DICTIONARY /////////////////////////////
+/// distinct strings of one column in one row group, numbered from 0
+typedef struct {
+    xmpcol_bytes bytes;  // all strings, back to back
+    xmpcol_bytes ends;   // uint32_t end offset of each string in `bytes`
+    uint32_t count;
+    uint32_t *table;     // open addressing; each slot is an id + 1, or 0 if empty
+    size_t slots;
+} xmpcol_dict;
+
+static uint32_t hash(const char *p, size_t len) {
+    uint32_t h = 2166136261u;
+    for(size_t i=0; i<len; i+=1) h = (h ^ (unsigned char)p[i]) * 16777619u;
+    return h;
+}
+
+static rdfxml_slice dict_get(const xmpcol_dict *d, uint32_t id) {
+    const uint32_t *ends = (const uint32_t *)d->ends.ptr;
+    uint32_t start = id ? ends[id-1] : 0;
+    rdfxml_slice ans = {d->bytes.ptr + start, ends[id] - start};
+    return ans;
+}
+
+/// rebuilds the table with twice the slots once it is half full
+static int dict_grow(xmpcol_dict *d) {
+    if ((d->count + 1) * 2 <= d->slots) return 1;
+    size_t want = d->slots ? d->slots * 2 : 1024;
+    uint32_t *bigger = calloc(want, sizeof(uint32_t));
+    if (!bigger) return 0;
+    for(uint32_t id=0; id<d->count; id+=1) {
+        rdfxml_slice s = dict_get(d, id);
+        size_t at = hash(s.ptr, s.len) & (want - 1);
+        while (bigger[at]) at = (at + 1) & (want - 1);
+        bigger[at] = id + 1;
+    }
+    free(d->table);
+    d->table = bigger;
+    d->slots = want;
+    return 1;
+}
+
+/// the id of `s`, adding it if new; UINT32_MAX if out of memory
+static uint32_t dict_id(xmpcol_dict *d, const char *p, size_t len) {
+    if (!dict_grow(d)) return UINT32_MAX;
+    size_t at = hash(p, len) & (d->slots - 1);
+    for(; d->table[at]; at = (at + 1) & (d->slots - 1)) {
+        rdfxml_slice s = dict_get(d, d->table[at] - 1);
+        if (s.len == len && (!len || !memcmp(s.ptr, p, len))) return d->table[at] - 1;
+    }
+    put(&d->bytes, p, len);
+    uint32_t end = d->bytes.len;
+    put(&d->ends, &end, sizeof(end));
+    if (d->bytes.failed || d->ends.failed) return UINT32_MAX;
+    d->table[at] = d->count + 1;
+    return d->count++;
+}
+
+static void dict_clear(xmpcol_dict *d) {
+    d->bytes.len = d->ends.len = 0;
+    d->count = 0;
+    if (d->table) memset(d->table, 0, d->slots * sizeof(uint32_t));
+}
+
+static void dict_free(xmpcol_dict *d) {
+    free(d->bytes.ptr);
+    free(d->ends.ptr);
+    free(d->table);
+}
+
+/// count, then the end offset of each string, then the strings
+static void dict_write(xmpcol_bytes *out, const xmpcol_dict *d) {
+    put_u32(out, d->count);
+    const uint32_t *ends = (const uint32_t *)d->ends.ptr;
+    for(uint32_t i=0; i<d->count; i+=1) put_u32(out, ends[i]);
+    put(out, d->bytes.ptr, d->bytes.len);
+}
+//////////////////////////// DICTIONARY /////////////////////////////
+
+////////////////////////////// WRITER ///////////////////////////////
+struct xmpcol_writer {
+    FILE *f;
+    int failed;
+
+    // the current row group
+    xmpcol_dict files, properties, values, langs;
+    xmpcol_bytes format, width, height;   // one entry per file
+    xmpcol_bytes file, property, item, kind, value, lang; // one per row
+    size_t rows;
+
+    // the file rows are being added for
+    const char *filename;
+    int file_format, file_width, file_height;
+    uint32_t file_id; // in `files`, or UINT32_MAX if not yet in this group
+    long added;
+
+    // the rows of the packet being parsed, added once it has parsed; with
+    // xmpcol_dedupe, also kept with each distinct packet, to repeat
+    xmp_cache *cache;
+    xmpcol_bytes record;
+
+    xmpcol_bytes scratch;
+    xmpcol_bytes out;
+};
+
+xmpcol_writer *xmpcol_open(const char *dest) {
+    int fd = open(dest, O_WRONLY | O_EXCL | O_CREAT, 0644);
+    if (fd < 0) return NULL;
+    xmpcol_writer *w = calloc(1, sizeof(xmpcol_writer));
+    if (!w) { close(fd); unlink(dest); return NULL; }
+    w->f = fdopen(fd, "wb");
+    if (!w->f || fwrite("XMPCOLS1", 1, 8, w->f) != 8) {
+        if (w->f) fclose(w->f);
+        else close(fd);
+        unlink(dest);
+        free(w);
+        return NULL;
+    }
+    w->file_id = UINT32_MAX;
+    return w;
+}
+
+/// writes the current row group, if it has any files, and starts another
+static int flush_group(xmpcol_writer *w) {
+    if (!w->files.count) return 1;
+    xmpcol_bytes *out = &w->out;
+    out->len = 0;
+    put_u32(out, 0); // group length, filled in below
+    put_u32(out, w->rows);
+    dict_write(out, &w->files);
+    put(out, w->format.ptr, w->format.len);
+    put(out, w->width.ptr, w->width.len);
+    put(out, w->height.ptr, w->height.len);
+    put(out, w->file.ptr, w->file.len);
+    dict_write(out, &w->properties);
+    put(out, w->property.ptr, w->property.len);
+    put(out, w->item.ptr, w->item.len);
+    put(out, w->kind.ptr, w->kind.len);
+    dict_write(out, &w->values);
+    put(out, w->value.ptr, w->value.len);
+    dict_write(out, &w->langs);
+    put(out, w->lang.ptr, w->lang.len);
+    if (out->failed) return 0;
+    uint32_t length = out->len - 4;
+    unsigned char le[4] = {length, length>>8, length>>16, length>>24};
+    memcpy(out->ptr, le, 4);
+    if (fwrite(out->ptr, 1, out->len, w->f) != out->len) return 0;
+
+    dict_clear(&w->files);
+    dict_clear(&w->properties);
+    dict_clear(&w->values);
+    dict_clear(&w->langs);
+    w->format.len = w->width.len = w->height.len = 0;
+    w->file.len = w->property.len = w->item.len = w->kind.len = w->value.len = w->lang.len = 0;
+    w->rows = 0;
+    w->file_id = UINT32_MAX;
+    return 1;
+}
+
+static size_t group_bytes(const xmpcol_writer *w) {
+    return w->files.bytes.len + w->properties.bytes.len + w->values.bytes.len + w->langs.bytes.len;
+}
+
+/// makes sure the current file is listed in the current row group
+static int list_file(xmpcol_writer *w) {
+    if (w->file_id != UINT32_MAX) return 1;
+    uint32_t count = w->files.count;
+    w->file_id = dict_id(&w->files, w->filename, strlen(w->filename));
+    if (w->file_id == UINT32_MAX) return 0;
+    if (w->file_id < count) return 1; // the same name added twice
+    put_u8(&w->format, w->file_format);
+    put_u32(&w->width, w->file_width);
+    put_u32(&w->height, w->file_height);
+    return !w->format.failed && !w->width.failed && !w->height.failed;
+}
+
+/// the property path in query notation, skipping rdf:li steps
+static void put_property(xmpcol_bytes *b, const rdfxml_triple *t) {
+    for(size_t i=0; i<=t->depth; i+=1) {
+        const rdfxml_step *step = (i < t->depth) ? &t->path[i] : &t->predicate;
+        if (step->index) continue;
+        if (b->len) put(b, "/", 1);
+        put(b, "{", 1);
+        put_slice(b, step->ns);
+        put(b, "}", 1);
+        put_slice(b, step->local);
+    }
+}
+
+/// the rdf:li index nearest the end of the path, or 0
+static uint32_t item_of(const rdfxml_triple *t) {
+    if (t->predicate.index) return t->predicate.index;
+    for(size_t i=t->depth; i>0; i-=1) if (t->path[i-1].index) return t->path[i-1].index;
+    return 0;
+}
+
+static void put_row(xmpcol_writer *w, rdfxml_slice property, uint32_t item, int kind, rdfxml_slice value, rdfxml_slice lang) {
+    if (w->rows >= xmpcol_group_rows || group_bytes(w) >= xmpcol_group_bytes)
+        if (!flush_group(w)) goto fail;
+    if (!list_file(w)) goto fail;
+
+    uint32_t p = dict_id(&w->properties, property.ptr, property.len);
+    uint32_t v = dict_id(&w->values, value.ptr, value.len);
+    uint32_t l = dict_id(&w->langs, lang.ptr, lang.len);
+    if (p == UINT32_MAX || v == UINT32_MAX || l == UINT32_MAX) goto fail;
+
+    put_u32(&w->file, w->file_id);
+    put_u32(&w->property, p);
+    put_u32(&w->item, item);
+    put_u8(&w->kind, kind);
+    put_u32(&w->value, v);
+    put_u32(&w->lang, l);
+    if (w->file.failed || w->property.failed || w->item.failed || w->kind.failed
+    || w->value.failed || w->lang.failed) goto fail;
+    w->rows += 1;
+    w->added += 1;
+    return;
+
+fail:
+    w->failed = 1;
+}
+
+/// a row kept to be repeated for other files with the same packet
+static void record_slice(xmpcol_bytes *b, rdfxml_slice s) {
+    put_u32(b, s.len);
+    put_slice(b, s);
+}
+static uint32_t replay_u32(const char **p) {
+    const unsigned char *u = (const unsigned char *)*p;
+    *p += 4;
+    return u[0] | (u[1]<<8) | (u[2]<<16) | ((uint32_t)u[3]<<24);
+}
+static rdfxml_slice replay_slice(const char **p) {
+    rdfxml_slice ans;
+    ans.len = replay_u32(p);
+    ans.ptr = *p;
+    *p += ans.len;
+    return ans;
+}
+
+static int add_row(const rdfxml_triple *t, void *user) {
+    xmpcol_writer *w = user;
+    // rdf:type of rdf:Bag, rdf:Seq, and rdf:Alt is structure, not data
+    if (t->object_ns.len) return 0;
+
+    xmpcol_bytes *s = &w->scratch;
+    s->len = 0;
+    put_property(s, t);
+    size_t split = s->len;
+    if (t->object_kind == RDFXML_LITERAL) {
+        if (reserve(s, t->object.len + 1)) s->len += rdfxml_unescape(t->object, s->ptr + s->len);
+    } else {
+        if (t->object_kind == RDFXML_NODEID) put(s, "_:", 2);
+        put_slice(s, t->object);
+    }
+    if (s->failed) { w->failed = 1; return 1; }
+    rdfxml_slice property = {s->ptr, split}, value = {s->ptr + split, s->len - split};
+    uint32_t item = item_of(t);
+
+    record_slice(&w->record, property);
+    put_u32(&w->record, item);
+    put_u8(&w->record, t->object_kind);
+    record_slice(&w->record, value);
+    record_slice(&w->record, t->lang);
+    return w->record.failed;
+}
+
+/// adds the rows recorded by add_row from `p` to `end`
+static void replay_rows(xmpcol_writer *w, const char *p, const char *end) {
+    while (p < end && !w->failed) {
+        rdfxml_slice property = replay_slice(&p);
+        uint32_t item = replay_u32(&p);
+        int kind = (unsigned char)*p++;
+        rdfxml_slice value = replay_slice(&p);
+        rdfxml_slice lang = replay_slice(&p);
+        put_row(w, property, item, kind, value, lang);
+    }
+}
+
+/// adds the rows of one packet, none if it is not well-formed RDF/XML; with
+/// `shared` (a packet from the writer's xmp_cache), reuses those of an
+/// identical earlier packet
+static void add_rows(xmpcol_writer *w, const char *packet, int shared) {
+    void **cached = shared ? xmp_cache_value(packet) : NULL;
+    if (cached && *cached) {
+        const size_t *rows = *cached;
+        replay_rows(w, (const char *)(rows + 1), (const char *)(rows + 1) + rows[0]);
+        return;
+    }
+    w->record.len = 0;
+    int parsed = rdfxml_parse(packet, strlen(packet), add_row, w);
+    if (w->record.failed) { w->failed = 1; return; }
+    if (!parsed) w->record.len = 0; // rather than the rows before the error
+    if (cached) {
+        size_t *rows = malloc(sizeof(size_t) + w->record.len);
+        if (!rows) { w->failed = 1; return; }
+        rows[0] = w->record.len;
+        if (w->record.len) memcpy(rows + 1, w->record.ptr, w->record.len);
+        *cached = rows;
+    }
+    replay_rows(w, w->record.ptr, w->record.ptr + w->record.len);
+}
+
+/// starts the rows of a new file
+static int begin_file(xmpcol_writer *w, const char *filename, int format, int width, int height) {
+    w->filename = filename;
+    w->file_format = format;
+    w->file_width = width;
+    w->file_height = height;
+    w->file_id = UINT32_MAX;
+    w->added = 0;
+    if (group_bytes(w) >= xmpcol_group_bytes && !flush_group(w)) w->failed = 1;
+    return !w->failed && list_file(w);
+}
+
+long xmpcol_add_packet(xmpcol_writer *w, const char *filename, int format, int width, int height, const char *packet) {
+    if (w->failed || !begin_file(w, filename, format, width, height)) return -1;
+    if (packet) add_rows(w, packet, 0);
+    return w->failed ? -1 : w->added;
+}
+
+/// the reader for a file starting with the `got` bytes at `head`, or XMPCOL_NONE
+static int guess_format(const unsigned char *head, size_t got) {
+    if (got >= 4 && !memcmp(head, "GIF8", 4)) return XMPCOL_GIF;
+    if (got >= 4 && !memcmp(head, "\x89PNG", 4)) return XMPCOL_PNG;
+    if (got >= 2 && head[0] == 0xFF && head[1] == 0xD8) return XMPCOL_JPEG;
+    if (got >= 12 && !memcmp(head, "RIFF", 4) && !memcmp(head+8, "WEBP", 4)) return XMPCOL_WEBP;
+    if (got >= 4 && (!memcmp(head, "II*\0", 4) || !memcmp(head, "MM\0*", 4))) return XMPCOL_TIFF;
+    if (got >= 8 && (!memcmp(head+4, "ftyp", 4) || !memcmp(head+4, "jP  ", 4))) return XMPCOL_ISOBMF;
+    return XMPCOL_NONE;
+}
+
+long xmpcol_add_file(xmpcol_writer *w, const char *filename) {
+    static xmp_rdata (*const readers[])(const char *) = {
+        NULL, xmp_from_gif, xmp_from_isobmf, xmp_from_jpeg, xmp_from_png,
+        xmp_from_webp, xmp_from_tiff, xmp_from_svg, xmp_from_other,
+    };
+    xmp_rdata dat = {0, 0, 0, NULL, 0, 0, NULL};
+    unsigned char head[12];
+    FILE *f = fopen(filename, "rb");
+    if (!f) return xmpcol_add_packet(w, filename, XMPCOL_NONE, 0, 0, NULL);
+    size_t got = fread(head, 1, sizeof(head), f);
+    fclose(f);
+
+    // the format its first bytes say, else SVG, else any file with a packet
+    int tries[3] = {guess_format(head, got), XMPCOL_SVG, XMPCOL_OTHER}, format = XMPCOL_NONE;
+    xmp_cache *old = xmp_use_cache(w->cache);
+    for(int i=0; i<3 && format == XMPCOL_NONE; i+=1) {
+        if (tries[i] == XMPCOL_NONE) continue;
+        dat = readers[tries[i]](filename);
+        if (dat.error != XMP_ERR_FORMAT) format = tries[i];
+        else {
+            for(size_t k=0; k<dat.num_packets; k+=1) if (!w->cache) free(dat.packets[k]);
+            free(dat.packets);
+            free(dat.spans);
+            dat = (xmp_rdata){0, 0, 0, NULL, 0, 0, NULL};
+        }
+    }
+    xmp_use_cache(old);
+    if (format != XMPCOL_NONE && dat.width <= 0) dat.width = dat.height = -1; // not found
+
+    if (w->failed || !begin_file(w, filename, format, dat.width, dat.height)) w->failed = 1;
+    for(size_t i=0; i<dat.num_packets; i+=1) {
+        if (!w->failed && dat.packets[i]) add_rows(w, dat.packets[i], w->cache != NULL);
+        if (!w->cache) free(dat.packets[i]);
+    }
+    free(dat.packets);
+    free(dat.spans); // packets over xmp_max_packet_bytes are listed without rows
+    return w->failed ? -1 : w->added;
+}
+
+int xmpcol_dedupe(xmpcol_writer *w) {
+    if (!w->cache) w->cache = xmp_cache_new(free);
+    return w->cache != NULL;
+}
+
+int xmpcol_close(xmpcol_writer *w) {
+    int ok = !w->failed && flush_group(w);
+    ok = !fclose(w->f) && ok;
+    dict_free(&w->files);
+    dict_free(&w->properties);
+    dict_free(&w->values);
+    dict_free(&w->langs);
+    xmpcol_bytes *arrays[] = {&w->format, &w->width, &w->height, &w->file, &w->property,
+        &w->item, &w->kind, &w->value, &w->lang, &w->record, &w->scratch, &w->out};
+    for(size_t i=0; i<sizeof(arrays)/sizeof(*arrays); i+=1) free(arrays[i]->ptr);
+    xmp_cache_free(w->cache);
+    free(w);
+    return ok;
+}
+////////////////////////////// WRITER ///////////////////////////////
@@ -0,0 +1,58 @@
+#include <stddef.h> // for size_t
+
+/**
+ * Writes the XMP of many files as one table, with a row per RDF statement:
+ * (file, format, width, height, property, item, kind, value, lang).
+ * See README.md for the file layout.
+ *
+ * Rows are buffered in row groups, each with its own dictionaries, and
+ * written when a group reaches xmpcol_group_rows rows or xmpcol_group_bytes
+ * bytes of strings, so memory use does not grow with the number of files.
+ */
+typedef struct xmpcol_writer xmpcol_writer;
+
+/// The container a file's XMP was found in
+enum {
+    XMPCOL_NONE,   ///< not a recognized format, or no XMP found
+    XMPCOL_GIF,
+    XMPCOL_ISOBMF, ///< AVIF, HEIC, JPEG 2000
+    XMPCOL_JPEG,
+    XMPCOL_PNG,
+    XMPCOL_WEBP,
+    XMPCOL_TIFF,
+    XMPCOL_SVG,
+    XMPCOL_OTHER,  ///< found by scanning for an xpacket wrapper
+};
+
+// runtime-changeable configuration; both must be >= 1
+extern size_t xmpcol_group_rows;  // 65536 by default
+extern size_t xmpcol_group_bytes; // 16 MiB by default
+
+/// Creates `dest`, which must not already exist. Returns NULL on failure.
+xmpcol_writer *xmpcol_open(const char *dest);
+
+/**
+ * Reads the XMP of `filename` with the xmp_from_ function for the format its
+ * first bytes show (else as SVG, else as any file with an xpacket wrapper),
+ * and adds a row for each statement in it. A file with no XMP is still
+ * listed, with no rows, as is one that could not be read; a packet that is
+ * not well-formed RDF/XML adds no rows.
+ * returns the number of rows added, or -1 if writing failed.
+ */
+long xmpcol_add_file(xmpcol_writer *w, const char *filename);
+
+/// Like xmpcol_add_file, for a packet that was already read.
+/// returns the number of rows added, or -1 if writing failed.
+long xmpcol_add_packet(xmpcol_writer *w, const char *filename, int format, int width, int height, const char *packet);
+
+/**
+ * Makes later xmpcol_add_file calls keep each distinct packet they read (see
+ * xmp_cache in blocks/xmpblock.h) with the rows it produced, and repeat those
+ * rows for files with an identical packet instead of parsing it again.
+ * Memory then grows with the number of distinct packets.
+ * returns false if out of memory.
+ */
+int xmpcol_dedupe(xmpcol_writer *w);
+
+/// Writes any buffered rows and closes the file. returns true on success.
+int xmpcol_close(xmpcol_writer *w);
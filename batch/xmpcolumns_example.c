@@ -0,0 +1,118 @@
+#include "xmpcolumns.h"
+#include "../blocks/xmpblock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+static uint32_t u32(const unsigned char *p) {
+    return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+/// a dictionary as written by xmpcol_close: count, end offsets, bytes
+typedef struct { uint32_t count; const unsigned char *ends; const char *bytes; } dict;
+static const unsigned char *read_dict(const unsigned char *p, dict *d) {
+    d->count = u32(p);
+    d->ends = p + 4;
+    d->bytes = (const char *)(p + 4 + 4*d->count);
+    return (const unsigned char *)d->bytes + (d->count ? u32(d->ends + 4*(d->count-1)) : 0);
+}
+static void print_entry(const dict *d, uint32_t id) {
+    uint32_t start = id ? u32(d->ends + 4*(id-1)) : 0;
+    fwrite(d->bytes + start, 1, u32(d->ends + 4*id) - start, stdout);
+}
+
+/// prints an .xmpcol file as tab-separated values, one row group at a time
+static int dump(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return 0;
+    char magic[8];
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, "XMPCOLS1", 8)) { fclose(f); return 0; }
+    puts("file\tformat\twidth\theight\tproperty\titem\tkind\tvalue\tlang");
+    unsigned char head[4];
+    while (fread(head, 1, 4, f) == 4) {
+        uint32_t length = u32(head);
+        unsigned char *group = malloc(length);
+        if (!group || fread(group, 1, length, f) != length) { free(group); fclose(f); return 0; }
+
+        const unsigned char *p = group;
+        uint32_t rows = u32(p); p += 4;
+        dict files, properties, values, langs;
+        p = read_dict(p, &files);
+        const unsigned char *format = p; p += files.count;
+        const unsigned char *width = p; p += 4*files.count;
+        const unsigned char *height = p; p += 4*files.count;
+        const unsigned char *file = p; p += 4*rows;
+        p = read_dict(p, &properties);
+        const unsigned char *property = p; p += 4*rows;
+        const unsigned char *item = p; p += 4*rows;
+        const unsigned char *kind = p; p += rows;
+        p = read_dict(p, &values);
+        const unsigned char *value = p; p += 4*rows;
+        p = read_dict(p, &langs);
+        const unsigned char *lang = p;
+
+        for(uint32_t i=0; i<rows; i+=1) {
+            uint32_t fi = u32(file + 4*i);
+            print_entry(&files, fi);
+            printf("\t%u\t%d\t%d\t", format[fi], (int)u32(width + 4*fi), (int)u32(height + 4*fi));
+            print_entry(&properties, u32(property + 4*i));
+            printf("\t%u\t%u\t", u32(item + 4*i), kind[i]);
+            print_entry(&values, u32(value + 4*i));
+            putchar('\t');
+            print_entry(&langs, u32(lang + 4*i));
+            putchar('\n');
+        }
+        free(group);
+    }
+    fclose(f);
+    return 1;
+}
+
+/// usage: xmpcolumns_example [-u] output.xmpcol [file ...]
+///    or: xmpcolumns_example -d input.xmpcol
+/// With no files listed, reads file names from standard input, one per line.
+/// -u parses each distinct packet only once (see xmpcol_dedupe).
+/// Compiled with XMP_STATS defined (for xmpblock.c too), also prints totals of
+/// the work reading the files took (see xmp_stats).
+int main(int argc, char *argv[]) {
+    if (argc == 3 && !strcmp(argv[1], "-d")) return !dump(argv[2]);
+    int dedupe = (argc > 1 && !strcmp(argv[1], "-u"));
+    argc -= dedupe;
+    argv += dedupe;
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s [-u] output.xmpcol [file ...]\n       %s -d input.xmpcol\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    xmpcol_writer *w = xmpcol_open(argv[1]);
+    if (!w) { fprintf(stderr, "WARNING: %s already exists, not modified\n", argv[1]); return 1; }
+    if (dedupe && !xmpcol_dedupe(w)) { xmpcol_close(w); return 1; }
+    long rows = 0;
+    xmp_stats stats = {0};
+    xmp_use_stats(&stats);
+    if (argc > 2) {
+        for(int i=2; i<argc && rows >= 0; i+=1) {
+            long added = xmpcol_add_file(w, argv[i]);
+            rows = (added < 0) ? -1 : rows + added;
+        }
+    } else {
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t len;
+        while (rows >= 0 && (len = getline(&line, &cap, stdin)) > 0) {
+            if (line[len-1] == '\n') line[len-1] = '\0';
+            long added = xmpcol_add_file(w, line);
+            rows = (added < 0) ? -1 : rows + added;
+        }
+        free(line);
+    }
+    if (!xmpcol_close(w) || rows < 0) { fprintf(stderr, "failed writing %s\n", argv[1]); return 1; }
+    printf("wrote %ld rows to %s\n", rows, argv[1]);
+#ifdef XMP_STATS
+    fprintf(stderr, "%llu xmp_from_ calls: %llu packets; %llu bytes read in %llu reads, %llu seeks, %llu allocations; "
+        "%.3f s walking, %.3f s extracting\n", stats.calls, stats.packets, stats.bytes_read, stats.reads,
+        stats.seeks, stats.allocations, stats.ns_walking * 1e-9, stats.ns_extracting * 1e-9);
+#endif
+    return 0;
+}
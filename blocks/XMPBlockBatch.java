@@ -0,0 +1,117 @@
+/**
+ * Reads the XMP of many files at once with <code>XMPBlockReader</code>.
+ *
+ * <p>
+ * <code>XMPBlockBatch.readAll(filenames, threads, handler)</code> reads
+ * each file on one of <code>threads</code> worker threads of a
+ * <code>ForkJoinPool</code>, so at most that many files are open at once,
+ * and takes filenames from the <code>Iterable</code> (or <code>Stream</code>)
+ * only as workers become free, so it may be arbitrarily long.
+ * <p>
+ * Each worker reads files that fit into its own reusable buffer of
+ * <code>buffer_bytes</code> instead of mapping them, as a mapping costs
+ * more to set up and tear down than a small file costs to read.
+ * The packets handed to the handler are slices of that buffer, so are only
+ * valid until the handler returns; copy any that are needed after that.
+ *
+ * <p>
+ * This is file is in the public domain and comes with NO WARRANTY
+ * of any kind.
+ */
+
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.channels.FileChannel;
+import java.nio.file.Paths;
+import java.nio.file.StandardOpenOption;
+import java.util.Iterator;
+import java.util.concurrent.ArrayBlockingQueue;
+import java.util.concurrent.BlockingQueue;
+import java.util.concurrent.ForkJoinPool;
+import java.util.concurrent.Semaphore;
+import java.util.concurrent.atomic.AtomicReference;
+import java.util.stream.Stream;
+
+public class XMPBlockBatch {
+    /** files larger than this are mapped instead of read into a buffer */
+    public static int buffer_bytes = 8<<20;
+
+    /**
+     * Called once per file, on a worker thread, so possibly on several threads at once.
+     * Exactly one of <code>read</code> and <code>error</code> is non-null;
+     * anything reading the file throws, even unchecked, arrives as <code>error</code>.
+     */
+    public interface Handler {
+        void handle(String filename, XMPBlockReader read, IOException error);
+    }
+
+    /**
+     * Reads <code>filename</code> into <code>buffer</code> if it fits, else maps it.
+     * The packets found are only valid until <code>buffer</code> is next used.
+     */
+    public static XMPBlockReader read(String filename, ByteBuffer buffer) throws IOException {
+        try (FileChannel c = FileChannel.open(Paths.get(filename), StandardOpenOption.READ)) {
+            long size = c.size();
+            if (size > buffer.capacity())
+                return new XMPBlockReader(c.map(FileChannel.MapMode.READ_ONLY, 0, Math.min(size, Integer.MAX_VALUE)), filename);
+            buffer.clear();
+            while (buffer.position() < size && c.read(buffer) >= 0) {}
+            buffer.flip();
+            return new XMPBlockReader(buffer, filename);
+        }
+    }
+
+    /**
+     * Reads every file of <code>filenames</code>, <code>threads</code> at a time,
+     * and returns once all have been given to <code>handler</code>.
+     * A file that cannot be read is passed to the handler with its error
+     * and does not stop the others.
+     * If the handler throws, no more files are started, and the first
+     * exception is rethrown once those in progress are done.
+     */
+    public static void readAll(Iterable<String> filenames, int threads, Handler handler) throws InterruptedException {
+        if (threads < 1) throw new IllegalArgumentException("threads must be at least 1");
+        // one buffer per file in progress; tasks waiting for a worker do not hold one
+        BlockingQueue<ByteBuffer> buffers = new ArrayBlockingQueue<ByteBuffer>(threads);
+        for(int i=0; i<threads; i+=1) buffers.add(ByteBuffer.allocateDirect(buffer_bytes));
+        // at most this many files taken from `filenames` and not yet done
+        int queued = 2*threads;
+        Semaphore room = new Semaphore(queued);
+        AtomicReference<RuntimeException> thrown = new AtomicReference<RuntimeException>();
+
+        ForkJoinPool pool = new ForkJoinPool(threads);
+        try {
+            Iterator<String> it = filenames.iterator();
+            while (thrown.get() == null && it.hasNext()) {
+                String filename = it.next();
+                room.acquire();
+                pool.execute(() -> {
+                    ByteBuffer taken = buffers.poll(); // only empty if the pool ran extra threads
+                    ByteBuffer buffer = (taken != null) ? taken : ByteBuffer.allocateDirect(buffer_bytes);
+                    try {
+                        if (thrown.get() != null) return;
+                        XMPBlockReader read = null;
+                        IOException error = null;
+                        try { read = read(filename, buffer); }
+                        catch (IOException e) { error = e; }
+                        catch (RuntimeException e) { error = new IOException(e); }
+                        handler.handle(filename, read, error);
+                    } catch (RuntimeException e) {
+                        thrown.compareAndSet(null, e);
+                    } finally {
+                        buffers.offer(buffer);
+                        room.release();
+                    }
+                });
+            }
+            room.acquire(queued); // all done
+        } finally {
+            pool.shutdown();
+        }
+        if (thrown.get() != null) throw thrown.get();
+    }
+
+    public static void readAll(Stream<String> filenames, int threads, Handler handler) throws InterruptedException {
+        readAll((Iterable<String>)filenames::iterator, threads, handler);
+    }
+}
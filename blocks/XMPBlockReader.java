@@ -15,22 +15,29 @@
  * Note that the SVG spec includes XMP packets, but this file does not (yet) support SVG.
  * 
  * <p>
- * This implementation makes no particular effort to be efficient
- * or to conform to Java's recommended style, instead using a
- * procedural approach that can be mirrored in non-OO languages like C.
+ * This implementation does not conform to Java's recommended style,
+ * instead using a procedural approach that can be mirrored in non-OO
+ * languages like C.
  * <p>
- * JPEG parsing in particular is implemented by reading 2 bytes at
- * a time, which with Java's <code>RandomAccessFile</code> is
- * very inefficient.
+ * The file is mapped into memory once and parsed from there, so the
+ * byte-at-a-time reading the parsers do (JPEG's in particular) costs
+ * an array access rather than a system call. The format is chosen by
+ * the file's first bytes, and the packets found are slices of the
+ * mapping rather than copies.
  * 
  * <p>
  * This is file is in the public domain and comes with NO WARRANTY
  * of any kind.
  */
 
+import java.util.HashSet;
 import java.util.List;
-import java.io.RandomAccessFile;
+import java.util.Set;
 import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.channels.FileChannel;
+import java.nio.file.Paths;
+import java.nio.file.StandardOpenOption;
 
 /**
  * <code>new XMPBlockReader("path/to/imagefile.end")</code>
@@ -40,53 +47,135 @@ import java.io.IOException;
  * <li><code>format</code> is a string name of the file format
  *   (or <code>null</code> if file type unrecognized).</li>
  * <li><code>width</code> and <code>height</code> are in pixels (if recognized, 0 otherwise).</li>
- * <li><code>packets</code>, a <code>java.util.List</code> containing one <code>byte[]</code> for each XMP packet found.</li>
+ * <li><code>packets</code>, a <code>java.util.List</code> containing one read-only
+ *   <code>ByteBuffer</code> for each XMP packet found, sharing memory with the file's mapping.</li>
  * </ul>
+ * 
+ * <code>new XMPBlockReader(buffer, name)</code> does the same for a file
+ * already in memory, and its packets share memory with <code>buffer</code>.
  */
 public class XMPBlockReader {
     public int width, height;
-    public List<byte[]> packets;
+    public List<ByteBuffer> packets;
     public String format, filename;
     
     private static final java.nio.charset.Charset UTF8 = java.nio.charset.Charset.forName("UTF-8");
     
-    private RandomAccessFile f;
+    private Source f;
     private boolean littleendian;
 
     public XMPBlockReader(String filename) throws IOException {
+        this(map(filename), filename);
+    }
+
+    // `data` from its position to its limit is the file; `filename` is only used by toString
+    public XMPBlockReader(ByteBuffer data, String filename) throws IOException {
         this.filename = filename;
-        f = new RandomAccessFile(filename, "r");
-        packets = new java.util.LinkedList<byte[]>();
-
-        if (loadPNG()) { f.close(); f = null; return; } else f.seek(0);
-        if (loadWEBP()) { f.close(); f = null; return; } else f.seek(0);
-        if (loadGIF()) { f.close(); f = null; return; } else f.seek(0);
-        if (loadJPEG()) { f.close(); f = null; return; } else f.seek(0);
-        if (loadISOBMF()) { f.close(); f = null; return; } else f.seek(0);
-        if (loadTIFF()) { f.close(); f = null; return; } else f.seek(0);
-        if (loadOther()) { f.close(); f = null; return; } else f.seek(0);
-        format = null;
-
-        f.close(); f = null;
+        f = new Source(data.slice().asReadOnlyBuffer());
+        packets = new java.util.ArrayList<ByteBuffer>();
+
+        byte[] magic = new byte[12]; // zeros past the end of a short file
+        f.read(magic, 0, 12);
+        f.seek(0);
+        boolean found = false;
+        if (magic[0] == (byte)0x89 && !memcmp(magic, 1, "PNG", 3)) found = loadPNG();
+        else if (!memcmp(magic, "RIFF", 4) && !memcmp(magic, 8, "WEBP", 4)) found = loadWEBP();
+        else if (!memcmp(magic, "GIF8", 4)) found = loadGIF();
+        else if (magic[0] == (byte)0xFF && magic[1] == (byte)0xD8) found = loadJPEG();
+        else if (!memcmp(magic, 4, "ftyp", 4) || !memcmp(magic, 4, "jP  ", 4)) found = loadISOBMF();
+        else if (!memcmp(magic, "II*\0", 4) || !memcmp(magic, "MM\0*", 4)) found = loadTIFF();
+        if (!found) {
+            // unrecognized, or failed to parse: look for a wrapped packet anywhere
+            width = height = 0;
+            packets.clear();
+            f.seek(0);
+            if (!loadOther()) format = null;
+        }
+        f = null;
+    }
+
+    // files over 2GB are mapped only as far as a ByteBuffer can reach
+    private static ByteBuffer map(String filename) throws IOException {
+        try (FileChannel c = FileChannel.open(Paths.get(filename), StandardOpenOption.READ)) {
+            return c.map(FileChannel.MapMode.READ_ONLY, 0, Math.min(c.size(), Integer.MAX_VALUE));
+        }
     }
 
     //////////////////////////// HELPERS ////////////////////////////
+    /**
+     * The file's bytes, with the methods of <code>RandomAccessFile</code>
+     * the parsers use, which behave the same at the end of the file:
+     * reads return -1 or fewer bytes than asked for.
+     */
+    private static final class Source {
+        private final ByteBuffer b;
+        Source(ByteBuffer b) { this.b = b; }
+
+        int read() { return b.hasRemaining() ? b.get() & 0xFF : -1; }
+        int read(byte[] buf) { return read(buf, 0, buf.length); }
+        int read(byte[] buf, int off, int len) {
+            if (len == 0) return 0;
+            if (!b.hasRemaining()) return -1;
+            if (len > b.remaining()) len = b.remaining();
+            b.get(buf, off, len);
+            return len;
+        }
+        int skipBytes(int n) {
+            if (n <= 0) return 0;
+            if (n > b.remaining()) n = b.remaining();
+            b.position(b.position() + n);
+            return n;
+        }
+        void seek(long pos) throws IOException {
+            if (pos < 0) throw new IOException("Negative seek offset");
+            b.position((int)Math.min(pos, b.limit()));
+        }
+        long getFilePointer() { return b.position(); }
+        long length() { return b.limit(); }
+
+        // the byte at `pos`, without moving
+        int at(long pos) { return b.get((int)pos) & 0xFF; }
+        // whether the bytes at `pos` are `s`
+        boolean startsWith(long pos, String s) {
+            if (pos < 0 || pos + s.length() > b.limit()) return false;
+            for(int i=0; i<s.length(); i+=1) if (at(pos+i) != s.charAt(i)) return false;
+            return true;
+        }
+        // bytes [start, end), sharing memory with the file
+        ByteBuffer slice(long start, long end) {
+            ByteBuffer ans = b.duplicate();
+            ans.limit((int)end);
+            ans.position((int)start);
+            return ans.slice();
+        }
+    }
+
+    // -1 at the end of the file; the bytes are combined as unsigned, so a
+    // high bit set in the last byte read never makes the result negative
     private int ru8() throws IOException { return f.read(); }
     private int ru16() throws IOException {
-        if (littleendian) return f.read() | (f.read()<<8);
-        else return (f.read()<<8) | f.read();
+        int a = f.read(), b = f.read();
+        if ((a|b) < 0) return -1;
+        if (littleendian) return a | (b<<8);
+        else return (a<<8) | b;
     }
     private int ru24() throws IOException {
-        if (littleendian) return f.read() | (f.read()<<8) | (f.read()<<16);
-        else return (f.read()<<16) | (f.read()<<8) | f.read();
+        int a = f.read(), b = f.read(), c = f.read();
+        if ((a|b|c) < 0) return -1;
+        if (littleendian) return a | (b<<8) | (c<<16);
+        else return (a<<16) | (b<<8) | c;
     }
     private long ru32() throws IOException {
-        if (littleendian) return f.read() | (f.read()<<8) | (f.read()<<16) | (f.read()<<24);
-        else return (f.read()<<24) | (f.read()<<16) | (f.read()<<8) | f.read();
+        long a = f.read(), b = f.read(), c = f.read(), d = f.read();
+        if ((a|b|c|d) < 0) return -1;
+        if (littleendian) return a | (b<<8) | (c<<16) | (d<<24);
+        else return (a<<24) | (b<<16) | (c<<8) | d;
     }
     private long ru64() throws IOException {
-        if (littleendian) return ru32() | (ru32()<<32);
-        else return (ru32()<<32) | ru32();
+        long a = ru32(), b = ru32();
+        if ((a|b) < 0) return -1;
+        if (littleendian) return a | (b<<32);
+        else return (a<<32) | b;
     }
     private static boolean memcmp(byte[] buf, String a, int len) {
         if (a.length() != len) return true;
@@ -102,10 +191,10 @@ public class XMPBlockReader {
         }
         return false;
     }
-    private static int strstr(byte[] haystack, byte[] needle) {
+    private static int strstr(ByteBuffer haystack, byte[] needle) {
         int ni = 0;
-        for(int hi=0; hi<haystack.length; hi+=1) {
-            if (haystack[hi] == needle[ni]) {
+        for(int hi=0; hi<haystack.limit(); hi+=1) {
+            if (haystack.get(hi) == needle[ni]) {
                 ni += 1;
                 if (ni == needle.length) return hi+1-ni;
             } else {
@@ -119,59 +208,36 @@ public class XMPBlockReader {
 
 
     //////////////////////////// WRAPPING ///////////////////////////
-    private byte[] read_block(long fpos, long size) throws IOException {
-        byte[] buf = new byte[256];
-        long start = fpos, end = fpos + size;
+    private ByteBuffer read_block(long fpos, long size) throws IOException {
+        if (fpos < 0) throw new IOException("Negative seek offset");
+        long start = fpos, end = Math.min(fpos + size, f.length());
+        f.seek(fpos + size); // the block is read in place, so this is where reading continues
 
         // skip leading whitespace
-        f.seek(start);
-        while (Character.isWhitespace(ru8()) && start < end) start += 1;
+        while (start < end && Character.isWhitespace(f.at(start))) start += 1;
 
         // if present, skip xpacket header (even if malformed)
-        f.seek(start);
-        f.read(buf, 0, 16);
-        if (!memcmp(buf, "<?xpacket begin=", 16)) {
-            while (ru8() != '?') {}
-            if (ru8() != '>') return null;
-            start = f.getFilePointer();
+        if (f.startsWith(start, "<?xpacket begin=")) {
+            long i = start + 16;
+            while (i < end && f.at(i) != '?') i += 1;
+            if (i+1 >= end || f.at(i+1) != '>') return null;
+            start = i + 2;
             // and whitespace after it
-            while (Character.isWhitespace(ru8()) && start < end) start += 1;
+            while (start < end && Character.isWhitespace(f.at(start))) start += 1;
         }
 
         // skip trailing whitespace
-        int i = -1;
-        while(i < 0 && end > start) {
-            f.seek(end - buf.length);
-            f.read(buf);
-            for(i=buf.length-1; i>=0 && Character.isWhitespace(buf[i]); i-=1)
-                end -= 1;
-        }
+        while (end > start && Character.isWhitespace(f.at(end-1))) end -= 1;
         // if present, skip xpacket footer (even if malformed)
-        f.seek(end-19);
-        f.read(buf, 0, 19);
-        if (!memcmp(buf, "<?xpacket end=", 14) && !memcmp(buf, 17, "?>", 2)) {
+        if (end - start >= 19 && f.startsWith(end-19, "<?xpacket end=") && f.startsWith(end-2, "?>")) {
             end -= 19;
             // skip more trailing whitespace
-            i = -1;
-            while(i < 0 && end > start) {
-                f.seek(end-buf.length);
-                f.read(buf, 0, buf.length);
-                for(i=buf.length-1; i>=0 && Character.isWhitespace(buf[i]); i-=1)
-                    end -= 1;
-            }
-        }
-        if (end > start) {
-            byte[] ans = new byte[(int)(end-start)];
-            f.seek(start);
-            f.read(ans, 0, (int)(end-start));
-            f.seek(fpos + size);
-            return ans;
-        } else {
-            f.seek(fpos + size);
-            return null;
+            while (end > start && Character.isWhitespace(f.at(end-1))) end -= 1;
         }
+        if (end > start) return f.slice(start, end);
+        else return null;
     }
-    byte[] read_block_delim(long fpos, int delim) throws IOException {
+    ByteBuffer read_block_delim(long fpos, int delim) throws IOException {
         f.seek(fpos);
         while (ru8() != delim && f.getFilePointer() < f.length()) {}
         return read_block(fpos, f.getFilePointer()-fpos-1);
@@ -220,8 +286,8 @@ public class XMPBlockReader {
                     byte[] appid = new byte[11];
                     f.read(appid, 0, 11);
                     if (!memcmp(appid, "XMP DataXMP", 11)) {
-                        byte[] packet = read_block_delim(f.getFilePointer(), 1);
-                        packets.add(packet);
+                        ByteBuffer packet = read_block_delim(f.getFilePointer(), 1);
+                        if (packet != null) packets.add(packet);
                         f.skipBytes(1); // delimiter, already processed
                         byte[] trailer = new byte[257];
                         f.read(trailer, 0, 257);
@@ -266,8 +332,11 @@ public class XMPBlockReader {
         else if (memcmp(endflag, "II", 2)) return false;
         if (ru16() != 42) return false;;
 
+        // a corrupt file can chain IFDs into a loop, so each is read once
+        Set<Long> seen = new HashSet<>();
         long offset = ru32();
         while(offset > 0) {
+            if (!seen.add(offset)) { offset = 0; break; }
             f.seek(offset);
             int ifd_count = ru16();
             if (ifd_count < 0) return false;
@@ -282,21 +351,15 @@ public class XMPBlockReader {
                     if (type == 3 && !littleendian) width = (int)(value>>16)&0xFFFF;
                     else if (type == 3 && littleendian) width = (int)value&0xFFFF;
                     else if (type == 4) width = (int)value;
-                    else {
-                        System.err.println("Unexpected image width type "+type);
-                        return false;
-                    }
+                    else return false; // dimensions are SHORT or LONG
                 } else if (tag == 257) {
                     if (type == 3 && !littleendian) height = (int)(value>>16)&0xFFFF;
                     else if (type == 3 && littleendian) height = (int)value&0xFFFF;
                     else if (type == 4) height = (int)value;
-                    else {
-                        System.err.println("Unexpected image height type "+type);
-                        return false;
-                    }
+                    else return false; // dimensions are SHORT or LONG
                 } else if (tag == 700 && (type == 1 || type == 7) && length > 4) {
                     long back = f.getFilePointer();
-                    byte[] xmp = read_block(value, length);
+                    ByteBuffer xmp = read_block(value, length);
                     if (xmp != null) packets.add(xmp);
                     f.seek(back);
                 }
@@ -332,7 +395,8 @@ public class XMPBlockReader {
                 else midx = 0;
             }
             long end = f.getFilePointer() - magic.length();
-            packets.add(read_block(start, end-start));
+            ByteBuffer xmp = read_block(start, end-start);
+            if (xmp != null) packets.add(xmp);
             width = -1;
             height = -1;
             format = "unknown image";
@@ -455,7 +519,7 @@ public class XMPBlockReader {
                     uuid[13] == (byte)0xE3 &&
                     uuid[14] == (byte)0xAF &&
                     uuid[15] == (byte)0xAC) {
-                    byte[] xmp = read_block(f.getFilePointer(), box.length-16);
+                    ByteBuffer xmp = read_block(f.getFilePointer(), box.length-16);
                     if (xmp != null) packets.add(xmp);
                 }
             }
@@ -478,10 +542,12 @@ public class XMPBlockReader {
             int m1 = ru8();
             if (m0 == 0xFF && m1 == 0xE1) {
                 int len = ru16();
+                long seg = f.getFilePointer() - 2; // segments are measured from their length field
+                if (len < 2) return false;
                 byte[] buf = new byte[35];
                 int got = f.read(buf, 0, 35);
                 if (got > 28 && !memcmp(buf, "http://ns.adobe.com/xap/1.0/", 28)) {
-                    byte[] packet = read_block(f.getFilePointer() + 29-got, len-31);
+                    ByteBuffer packet = read_block(f.getFilePointer() + 29-got, len-31);
                     if (packet != null) packets.add(packet);
                 } else if (got > 34 && !memcmp(buf, "http://ns.adobe.com/xmp/extension/", 34)) {
                     // XMP spec says JPEG has two packets, standard and extended; that the extended's GUID is marked; and that the extended follows the standard. But it fails to state that it has *only* two packets, or that all parts of the extended packet must be provided, or that the extended can't be moved earlier.
@@ -491,19 +557,23 @@ public class XMPBlockReader {
                     // 3. all that GUID's parts are present
                     // As I have yet to find an extended XMP in the wild, I haven't been able to test these assumptions
                     if (packets.size() == 0) {
-                        System.err.println("WARNING: extended XMP found with no standard XMP; extended ignored");
+                        // extended XMP with no standard XMP is ignored
                         f.skipBytes(len - 2 - got);
                     } else {
-                        byte[] guid = new byte[33];
+                        byte[] guid = new byte[32];
                         f.read(guid, 0, 32);
-                        guid[32] = '\0';
                         if (strstr(packets.get(0), guid) >= 0) {
                             long ext_len = ru32();
-                            if (extended == null) extended = new byte[(int)ext_len];
                             long ext_off = ru32();
-                            f.read(extended, (int)ext_off, len-77);
+                            // each part must fit the file and the total every part agrees on
+                            if (len < 77 || ext_len < 0 || ext_len > f.length()) return false;
+                            if (extended != null && ext_len != extended.length) return false;
+                            if (ext_off < 0 || ext_off + (len-77) > ext_len) return false;
+                            if (seg + len > f.length()) return false; // the part is cut short
+                            if (extended == null) extended = new byte[(int)ext_len];
+                            if (f.read(extended, (int)ext_off, len-77) != len-77) return false;
                         } else {
-                            System.err.println("WARNING: extended XMP found with GUID not matching XMP; ignored");
+                            // extended XMP with a GUID not matching the standard XMP is ignored
                             f.skipBytes(len - 2 - got);
                         }
                     }
@@ -527,7 +597,7 @@ public class XMPBlockReader {
             }
             m0 = m1;
         }
-        if (extended != null) packets.add(extended);
+        if (extended != null) packets.add(ByteBuffer.wrap(extended).asReadOnlyBuffer());
         format = "JPEG";
         return true;
     }
@@ -622,7 +692,7 @@ public class XMPBlockReader {
         width = (int)ru32(); crc=feed_crc_u32(crc, width);
         height = (int)ru32(); crc=feed_crc_u32(crc, height);
         f.read(buf, 0, 5); crc=feed_crc_buf(crc, buf, 5);
-        if ((int)ru32() != finish_crc(crc)) return false;
+        if (ru32() != finish_crc(crc)) return false;
 
         while(f.getFilePointer() < f.length()) {
             long length = ru32();
@@ -632,7 +702,7 @@ public class XMPBlockReader {
             if (!memcmp(buf, "iTXt", 4) && length > 22) {
                 f.read(buf, 0, 22);
                 if (!memcmp(buf, "XML:com.adobe.xmp\0\0\0\0\0", 22)) {
-                    byte[] xmp = read_block(f.getFilePointer(), length-22);
+                    ByteBuffer xmp = read_block(f.getFilePointer(), length-22);
                     if (xmp != null) packets.add(xmp);
                 } else {
                     f.skipBytes((int)length-22);
@@ -686,7 +756,7 @@ public class XMPBlockReader {
             if (f.read(fourcc, 0, 4) != 4) break;
             length = ru32();
             if (!memcmp(fourcc, "XMP ", 4)) {
-                byte[] xmp = read_block(f.getFilePointer(), length);
+                ByteBuffer xmp = read_block(f.getFilePointer(), length);
                 if (xmp != null) packets.add(xmp);
             } else {
                 f.skipBytes((int)length);
@@ -708,9 +778,9 @@ public class XMPBlockReader {
         tmp.append(format); tmp.append(" file with ");
         tmp.append(packets.size());
         tmp.append(packets.size() == 1 ? " XMP packet" : " XMP packets");
-        for(byte[] packet : packets) {
+        for(ByteBuffer packet : packets) {
             tmp.append("\n ----- packet -----\n");
-            tmp.append(new String(packet, UTF8));
+            tmp.append(UTF8.decode(packet.duplicate()));
             tmp.append("\n ------------------");
         }
         return tmp.toString();
@@ -0,0 +1,113 @@
+/**
+ * JMH benchmarks of <code>XMPBlockReader</code> and <code>XMPBlockBatch</code>,
+ * on the files <code>xmpblock_bench -k</code> leaves behind, so that the
+ * Java readers can be compared with the C ones on the same files.
+ * See ../README.md for how to build and run them.
+ *
+ * <p>
+ * Every benchmark reads all the files of one <code>format</code>, and
+ * reports how many it read as the secondary score <code>files</code>,
+ * in files per second as the C benchmark's <code>read_files_per_s</code> is.
+ *
+ * <p>
+ * This is file is in the public domain and comes with NO WARRANTY
+ * of any kind.
+ */
+
+import java.io.File;
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.List;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.atomic.AtomicLong;
+
+import org.openjdk.jmh.annotations.*;
+import org.openjdk.jmh.infra.Blackhole;
+
+@State(Scope.Thread) // so that each thread has its own buffer
+@BenchmarkMode(Mode.Throughput)
+@OutputTimeUnit(TimeUnit.SECONDS)
+@Warmup(iterations = 3, time = 1)
+@Measurement(iterations = 5, time = 1)
+@Fork(1)
+public class XMPBlockReaderBench {
+    /** the directory xmpblock_bench -k made (xmpblock_bench.XXXXXX) */
+    @Param("")
+    public String dir;
+
+    @Param({"gif", "jpeg", "jpeg_extended", "png", "webp_vp8", "webp_vp8l", "webp_vp8x", "tiff", "dng", "heic", "avif", "jp2", "other"})
+    public String format;
+
+    /** worker threads for the batch benchmark */
+    @Param("4")
+    public int threads;
+
+    private String[] files;
+    private ByteBuffer buffer;
+
+    /**
+     * The files the C benchmark read: its copies (outN.format) written with
+     * xmp_to_, or for read-only formats the one it generated (base.format).
+     */
+    @Setup
+    public void setup() throws IOException {
+        File[] all = new File(dir).listFiles();
+        if (all == null) throw new IOException("no directory "+dir+"; run xmpblock_bench -k and pass -p dir=...");
+        List<String> out = new ArrayList<String>();
+        String base = null;
+        for(File f : all) {
+            String name = f.getName();
+            if (name.startsWith("out") && name.endsWith("."+format)) out.add(f.getPath());
+            else if (name.equals("base."+format)) base = f.getPath();
+        }
+        if (out.isEmpty() && base != null) out.add(base);
+        if (out.isEmpty()) throw new IOException("no "+format+" files in "+dir);
+        files = out.toArray(new String[0]);
+        Arrays.sort(files);
+        buffer = ByteBuffer.allocateDirect(XMPBlockBatch.buffer_bytes);
+
+        // what the C benchmark checks: every file has its packet
+        for(String name : files) {
+            XMPBlockReader r = new XMPBlockReader(name);
+            if (r.format == null || r.packets.isEmpty()) throw new IOException(name+": no XMP found");
+        }
+    }
+
+    /** each file mapped, as new XMPBlockReader(filename) does */
+    @Benchmark
+    public void mapped(Blackhole bh, Counted n) throws IOException {
+        for(String name : files) bh.consume(new XMPBlockReader(name).packets);
+        n.files += files.length;
+    }
+
+    /** each file read into one reused buffer, as XMPBlockBatch's workers do */
+    @Benchmark
+    public void buffered(Blackhole bh, Counted n) throws IOException {
+        for(String name : files) bh.consume(XMPBlockBatch.read(name, buffer).packets);
+        n.files += files.length;
+    }
+
+    /** all the files at once with XMPBlockBatch.readAll, on `threads` threads */
+    @Benchmark
+    public long batch(Counted n) throws InterruptedException {
+        AtomicLong bytes = new AtomicLong();
+        XMPBlockBatch.readAll(Arrays.asList(files), threads, (name, read, error) -> {
+            if (error != null) throw new RuntimeException(error);
+            for(ByteBuffer packet : read.packets) bytes.addAndGet(packet.remaining());
+        });
+        n.files += files.length;
+        return bytes.get();
+    }
+
+    /** reported by JMH as the rate "files", beside the per-call score */
+    @State(Scope.Thread)
+    @AuxCounters(AuxCounters.Type.OPERATIONS)
+    public static class Counted {
+        public long files;
+
+        @Setup(Level.Iteration)
+        public void reset() { files = 0; }
+    }
+}
@@ -1,37 +1,553 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L // fdopen, fmemopen, pwrite, clock_gettime
+#endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // fopencookie, for xmp_use_io
+#endif
+#ifndef _DARWIN_C_SOURCE
+#define _DARWIN_C_SOURCE // funopen, for xmp_use_io
+#endif
 #include "xmpblock.h"
-#include <stdio.h>  // fopen, fclose, fread, fseek, ftell, getc, NULL
+#include <stdio.h>  // fopen, fmemopen, fopencookie, fclose, fread, fseek, ftell, getc, NULL
 #include <stdlib.h> // malloc, realloc, free, getdelim, size_t
 #include <string.h> // memcmp, strcmp
-#include <unistd.h> // unlink, if failure writing
+#include <unistd.h> // unlink, if failure writing; pwrite; ftruncate
 #include <fcntl.h>  // open, for exclusive creation
+#include <sys/stat.h> // fstat, for file sizes
 #include <ctype.h>  // isspace
+#include <stdint.h> // uint64_t
+#include <stddef.h> // offsetof
+#include <errno.h>  // EEXIST
+#include <time.h>   // clock_gettime, for budgets
+#include <limits.h> // LONG_MAX
+#ifdef __linux__
+#include <sys/ioctl.h>    // ioctl, for FIEMAP
+#include <linux/fs.h>     // FS_IOC_FIEMAP
+#include <linux/fiemap.h> // struct fiemap
+#endif
 
 // runtime-changeable configuration; must be >= 1; 2000 recommended
 int xmp_writable_padding = 2000;
+// runtime-changeable limits per call; 0 for none
+long xmp_max_scan_bytes = 0;
+long xmp_max_milliseconds = 0;
+long xmp_max_packet_bytes = 0;
+
+/////////////////////////////// STATS ///////////////////////////////
+void xmp_stats_add(xmp_stats *into, const xmp_stats *from) {
+    unsigned long long *a = (unsigned long long *)into;
+    const unsigned long long *b = (const unsigned long long *)from;
+    for(size_t i=0; i<sizeof(xmp_stats)/sizeof(unsigned long long); i+=1) a[i] += b[i];
+}
+
+#ifdef XMP_STATS
+static _Thread_local xmp_stats *current_stats;
+static _Thread_local int open_files;                // of the call in progress
+static _Thread_local unsigned long long call_start, call_phases;
+static _Thread_local int in_phase;
+
+xmp_stats *xmp_use_stats(xmp_stats *stats) {
+    xmp_stats *old = current_stats;
+    current_stats = stats;
+    return old;
+}
+
+static unsigned long long stats_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static void stats_enter(void) {
+    if (current_stats && !open_files++) {
+        call_start = stats_now();
+        call_phases = current_stats->ns_extracting + current_stats->ns_copying;
+    }
+}
+static void stats_leave(void) {
+    if (current_stats && open_files > 0 && !--open_files) {
+        unsigned long long phases = current_stats->ns_extracting + current_stats->ns_copying - call_phases;
+        current_stats->calls += 1;
+        current_stats->ns_walking += stats_now() - call_start - phases;
+    }
+}
+
+/// when a phase starts, or 0 if not counting (or already in a phase)
+static unsigned long long phase_begin(void) {
+    if (!current_stats || in_phase) return 0;
+    in_phase = 1;
+    return stats_now();
+}
+static void phase_end(unsigned long long since, size_t field) { // field is an offsetof(xmp_stats, ns_...)
+    if (!since) return;
+    in_phase = 0;
+    if (current_stats) *(unsigned long long *)((char *)current_stats + field) += stats_now() - since;
+}
+
+// stdio and allocation are counted by replacing them, for the rest of this file, with these
+static FILE *counted_fopen(const char *name, const char *mode) {
+    FILE *f = fopen(name, mode);
+    if (f) stats_enter();
+    return f;
+}
+static FILE *counted_fmemopen(void *buf, size_t size, const char *mode) {
+    FILE *f = fmemopen(buf, size, mode);
+    if (f) stats_enter();
+    return f;
+}
+static FILE *open_io(const xmp_io *io);
+static FILE *counted_open_io(const xmp_io *io) {
+    FILE *f = open_io(io);
+    if (f) stats_enter();
+    return f;
+}
+static FILE *counted_fdopen(int fd, const char *mode) {
+    FILE *f = fdopen(fd, mode);
+    if (f) stats_enter();
+    return f;
+}
+static int counted_fclose(FILE *f) {
+    int ans = fclose(f);
+    stats_leave();
+    return ans;
+}
+static size_t counted_fread(void *p, size_t size, size_t count, FILE *f) {
+    size_t got = fread(p, size, count, f);
+    if (current_stats) { current_stats->reads += 1; current_stats->bytes_read += got * size; }
+    return got;
+}
+static int counted_getc(FILE *f) {
+    int c = getc(f);
+    if (current_stats) { current_stats->reads += 1; current_stats->bytes_read += (c != EOF); }
+    return c;
+}
+static size_t counted_fwrite(const void *p, size_t size, size_t count, FILE *f) {
+    size_t put = fwrite(p, size, count, f);
+    if (current_stats) { current_stats->writes += 1; current_stats->bytes_written += put * size; }
+    return put;
+}
+static int counted_putc(int c, FILE *f) {
+    if (current_stats) { current_stats->writes += 1; current_stats->bytes_written += 1; }
+    return putc(c, f);
+}
+static int counted_fputs(const char *s, FILE *f) {
+    if (current_stats) { current_stats->writes += 1; current_stats->bytes_written += strlen(s); }
+    return fputs(s, f);
+}
+static ssize_t counted_pwrite(int fd, const void *p, size_t n, off_t at) {
+    ssize_t put = pwrite(fd, p, n, at);
+    if (current_stats) { current_stats->writes += 1; current_stats->bytes_written += (put > 0) ? put : 0; }
+    return put;
+}
+static int counted_fseek(FILE *f, long offset, int whence) {
+    if (current_stats) current_stats->seeks += 1;
+    return fseek(f, offset, whence);
+}
+static void *counted_malloc(size_t n) {
+    if (current_stats) current_stats->allocations += 1;
+    return malloc(n);
+}
+static void *counted_calloc(size_t n, size_t size) {
+    if (current_stats) current_stats->allocations += 1;
+    return calloc(n, size);
+}
+static void *counted_realloc(void *p, size_t n) {
+    if (current_stats) current_stats->allocations += 1;
+    return realloc(p, n);
+}
+#undef getc
+#undef putc
+#define fopen counted_fopen
+#define fdopen counted_fdopen
+#define fmemopen counted_fmemopen
+#define open_io(io) counted_open_io(io)
+#define fclose counted_fclose
+#define fread counted_fread
+#define getc counted_getc
+#define fwrite counted_fwrite
+#define putc counted_putc
+#define fputs counted_fputs
+#define pwrite counted_pwrite
+#define fseek counted_fseek
+#define malloc counted_malloc
+#define calloc counted_calloc
+#define realloc counted_realloc
+
+#define STAT(field, n) do { if (current_stats) current_stats->field += (n); } while (0)
+#define CALL_BEGIN() stats_enter()
+#define CALL_END() stats_leave()
+#else
+xmp_stats *xmp_use_stats(xmp_stats *stats) { return NULL; }
+
+#define STAT(field, n) ((void)0)
+#define CALL_BEGIN() ((void)0)
+#define CALL_END() ((void)0)
+#endif
+/////////////////////////////// STATS ///////////////////////////////
+
+////////////////////////////// ERRORS ///////////////////////////////
+static _Thread_local int last_error;
+static _Thread_local long long deadline; // CLOCK_MONOTONIC ns, or 0 if none
+
+int xmp_last_error(void) { return last_error; }
+
+// oddities in a file that do not stop it being read, printed only if
+// compiled with XMP_DEBUG, as nothing per file should go to stderr otherwise
+#ifdef XMP_DEBUG
+#define debug(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define debug(...) ((void)0)
+#endif
+
+const char *xmp_error_string(int error) {
+    switch(error) {
+        case XMP_OK: return "no error";
+        case XMP_ERR_OPEN: return "could not open file";
+        case XMP_ERR_EXISTS: return "destination already exists";
+        case XMP_ERR_FORMAT: return "not a file of this format";
+        case XMP_ERR_MALFORMED: return "malformed or truncated file";
+        case XMP_ERR_MEMORY: return "out of memory";
+        case XMP_ERR_BUDGET: return "reached xmp_max_scan_bytes";
+        case XMP_ERR_TIMEOUT: return "reached xmp_max_milliseconds";
+        case XMP_ERR_WRITE: return "could not write destination";
+        case XMP_ERR_NO_ROOM: return "no room to update in place";
+        case XMP_ERR_TOO_LARGE: return "packet over xmp_max_packet_bytes";
+        default: return "unknown error";
+    }
+}
+
+static long long now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ll + t.tv_nsec;
+}
+
+/// records why the current call failed, keeping the first reason; returns false
+static int fail(int error) {
+    if (!last_error) last_error = error;
+    return 0;
+}
+
+static void begin_call(void) {
+    last_error = XMP_OK;
+    deadline = (xmp_max_milliseconds > 0) ? now_ns() + xmp_max_milliseconds * 1000000ll : 0;
+}
+
+/// false (with the error recorded) once the call has run out of time or moved
+/// past xmp_max_scan_bytes of `f`. Called once per chunk, or per 64 KiB of
+/// byte-at-a-time scanning, so that no loop can outlast the budgets.
+static int within_budget(FILE *f) {
+    if (xmp_max_scan_bytes > 0 && ftell(f) > xmp_max_scan_bytes) return fail(XMP_ERR_BUDGET);
+    if (deadline && now_ns() > deadline) return fail(XMP_ERR_TIMEOUT);
+    return 1;
+}
+
+static _Thread_local const void *memory_data;
+static _Thread_local size_t memory_length;
+
+const void *xmp_use_memory(const void *data, size_t length) {
+    const void *old = memory_data;
+    memory_data = data;
+    memory_length = length;
+    return old;
+}
+
+xmp_rdata xmp_from_memory(xmp_rdata (*reader)(const char *filename), const void *data, size_t length) {
+    const void *old_data = memory_data;
+    size_t old_length = memory_length;
+    xmp_use_memory(length ? data : "", length);
+    xmp_rdata ans = reader(NULL);
+    xmp_use_memory(old_data, old_length);
+    return ans;
+}
+
+static _Thread_local const xmp_io *current_io;
+
+const xmp_io *xmp_use_io(const xmp_io *io) {
+    const xmp_io *old = current_io;
+    current_io = io;
+    return old;
+}
+
+xmp_rdata xmp_from_io(xmp_rdata (*reader)(const char *filename), const xmp_io *io) {
+    const xmp_io *old = xmp_use_io(io);
+    xmp_rdata ans = reader(NULL);
+    xmp_use_io(old);
+    return ans;
+}
+
+static _Thread_local int probing; // readers stop once they have the dimensions
+
+xmp_rdata xmp_probe_dimensions(xmp_rdata (*reader)(const char *filename), const char *filename) {
+    int old = probing;
+    probing = 1;
+    xmp_rdata ans = reader(filename);
+    probing = old;
+    return ans;
+}
+
+static _Thread_local int locating; // readers list where each packet they read was, too
+
+int xmp_use_locations(int on) {
+    int old = locating;
+    locating = on;
+    return old;
+}
+
+/// an xmp_io as a read-only stream, so that every reader can use it unchanged
+typedef struct {
+    const xmp_io *io;
+    long pos;
+    long kept_at, kept_length; // the last read of at most a stdio buffer
+    char kept[BUFSIZ];
+} io_stream;
+
+static long io_read(io_stream *s, char *buf, size_t n) {
+    // stdio drops its buffer on any seek of such a stream, even within the
+    // buffer, so refilling it from the last read saves a request per seek
+    if (s->pos >= s->kept_at && s->pos < s->kept_at + s->kept_length) {
+        size_t have = s->kept_at + s->kept_length - s->pos;
+        if (n > have) n = have;
+        memcpy(buf, s->kept + (s->pos - s->kept_at), n);
+        s->pos += n;
+        return n;
+    }
+    int keep = n <= sizeof(s->kept);
+    long got = s->io->read_at(s->io->ctx, s->pos, keep ? s->kept : buf, n);
+    if (got <= 0) return got;
+    if (keep) {
+        s->kept_at = s->pos;
+        s->kept_length = got;
+        memcpy(buf, s->kept, got);
+    }
+    s->pos += got;
+    return got;
+}
+static int io_seek(io_stream *s, long long *offset, int whence) {
+    long long to = *offset;
+    if (whence == SEEK_CUR) to += s->pos;
+    else if (whence == SEEK_END) {
+        long size = s->io->size(s->io->ctx);
+        if (size < 0) return -1;
+        to += size;
+    }
+    if (to < 0 || to > LONG_MAX) return -1;
+    s->pos = (long)to;
+    *offset = to;
+    return 0;
+}
+static int io_close(void *s) {
+    free(s);
+    return 0;
+}
+
+#if defined(__linux__)
+#ifdef __GLIBC__
+typedef off64_t cookie_off;
+#else
+typedef off_t cookie_off;
+#endif
+static ssize_t io_cookie_read(void *s, char *buf, size_t n) { return io_read(s, buf, n); }
+static int io_cookie_seek(void *s, cookie_off *offset, int whence) {
+    long long at = *offset;
+    if (io_seek(s, &at, whence)) return -1;
+    *offset = at;
+    return 0;
+}
+static FILE *(open_io)(const xmp_io *io) {
+    io_stream *s = malloc(sizeof(io_stream));
+    if (!s) return NULL;
+    s->io = io;
+    s->pos = s->kept_at = s->kept_length = 0;
+    cookie_io_functions_t calls = {io_cookie_read, NULL, io_cookie_seek, io_close};
+    FILE *f = fopencookie(s, "rb", calls);
+    if (!f) free(s);
+    return f;
+}
+#elif defined(__APPLE__)
+static int io_funread(void *s, char *buf, int n) { return (int)io_read(s, buf, n); }
+static fpos_t io_funseek(void *s, fpos_t offset, int whence) {
+    long long at = offset;
+    return io_seek(s, &at, whence) ? -1 : at;
+}
+static FILE *(open_io)(const xmp_io *io) {
+    io_stream *s = malloc(sizeof(io_stream));
+    if (!s) return NULL;
+    s->io = io;
+    s->pos = s->kept_at = s->kept_length = 0;
+    FILE *f = funopen(s, io_funread, NULL, io_funseek, io_close);
+    if (!f) free(s);
+    return f;
+}
+#else
+static FILE *(open_io)(const xmp_io *io) { return NULL; }
+#endif
+
+/// the memory given to xmp_use_memory, as an xmp_io: fmemopen refuses to seek
+/// past the end, where a file reads EOF, so readers would go on from short of it
+static long memory_read_at(void *ctx, long offset, void *buf, size_t length) {
+    if (offset < 0) return -1;
+    if ((size_t)offset >= memory_length) return 0;
+    if (length > memory_length - offset) length = memory_length - offset;
+    memcpy(buf, (const char *)memory_data + offset, length);
+    return length;
+}
+static long memory_size(void *ctx) { return memory_length; }
+static const xmp_io memory_io = {memory_read_at, memory_size, NULL};
+
+/// the file to read from, or the memory or xmp_io given to xmp_use_ in its place
+static FILE *open_source(const char *filename, const char *mode) {
+    if (current_io && !strcmp(mode, "rb")) return open_io(current_io);
+    if (memory_data && !strcmp(mode, "rb")) {
+        FILE *f = open_io(&memory_io);
+        return f ? f : fmemopen((void *)memory_data, memory_length, "rb"); // without fopencookie or funopen
+    }
+    FILE *f = fopen(filename, mode);
+    // glibc seeks within what it has buffered only once a stream has been
+    // seeked, so seek now rather than have the first short skip read again
+    if (f) fseek(f, 0, SEEK_SET);
+    return f;
+}
+
+static FILE *begin_read(const char *filename, const char *mode) {
+    begin_call();
+    FILE *f = open_source(filename, mode);
+    if (!f) fail(XMP_ERR_OPEN);
+    return f;
+}
+
+long xmp_read_span(const char *filename, const xmp_span *span, long from, void *buf, size_t n) {
+    FILE *f = begin_read(filename, "rb");
+    if (!f) return -1;
+    if (from < 0 || from > span->length) n = 0, fail(XMP_ERR_MALFORMED);
+    else if (n > (size_t)(span->length - from)) n = span->length - from;
+    fseek(f, span->offset + from, SEEK_SET);
+    size_t got = fread(buf, 1, n, f);
+    fclose(f);
+    if (got < n) fail(XMP_ERR_MALFORMED);
+    return last_error ? -1 : (long)got;
+}
+
+/// opens `ref` for reading and creates `dest`, which must not already exist
+static int begin_write(const char *ref, const char *dest, FILE **f, FILE **t) {
+    begin_call();
+    *f = open_source(ref, "rb");
+    if (!*f) return fail(XMP_ERR_OPEN);
+    int fd = open(dest, O_WRONLY | O_EXCL | O_CREAT, 0644);
+    if (fd < 0) {
+        fclose(*f);
+        return fail(errno == EEXIST ? XMP_ERR_EXISTS : XMP_ERR_OPEN);
+    }
+    *t = fdopen(fd, "wb");
+    if (!*t) {
+        close(fd);
+        unlink(dest);
+        fclose(*f);
+        return fail(XMP_ERR_OPEN);
+    }
+    return 1;
+}
+
+/// closes both files of a writer, removing `dest` unless all of it was written
+static int end_write(FILE *f, FILE *t, const char *dest, int ok) {
+    fclose(f);
+    if (fclose(t) && ok) ok = fail(XMP_ERR_WRITE);
+    if (!ok) {
+        fail(XMP_ERR_MALFORMED);
+        unlink(dest);
+    }
+    return ok;
+}
+////////////////////////////// ERRORS ///////////////////////////////
 
 ////////////////////////////// HELPERS //////////////////////////////
+static char *cache_intern(char *packet);
+static void drop_packet(char *packet);
+
+/// the length of `f`, leaving its position alone; fstat if it is a file, as
+/// stdio reads the last block of a file to seek to its end
+static long file_size(FILE *f) {
+    struct stat st;
+    int fd = fileno(f);
+    if (fd >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode)) return st.st_size;
+    long at = ftell(f);
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, at, SEEK_SET);
+    return size;
+}
+
 static void add_packet(xmp_rdata *to, char *packet) {
+    if (!packet) return;
+    packet = cache_intern(packet);
+    if (!packet) { fail(XMP_ERR_MEMORY); return; }
+    char **grown = realloc(to->packets, (to->num_packets + 1) * sizeof(char*));
+    if (!grown) { drop_packet(packet); fail(XMP_ERR_MEMORY); return; }
+    STAT(packets, 1);
+    to->packets = grown;
+    to->packets[to->num_packets] = packet;
     to->num_packets += 1;
-    to->packets = realloc(to->packets, to->num_packets * sizeof(char*));
-    to->packets[to->num_packets - 1] = packet;
 }
 
+/// the number of packets too large to read that `to` has spans of
+static size_t large_packets(const xmp_rdata *to) {
+    return to->num_spans ? to->spans[to->num_spans-1].packet + 1 : 0;
+}
+
+static void add_span(xmp_rdata *to, size_t packet, long at, long offset, long length) {
+    xmp_span *grown = realloc(to->spans, (to->num_spans + 1) * sizeof(xmp_span));
+    if (!grown) { fail(XMP_ERR_MEMORY); return; }
+    to->spans = grown;
+    to->spans[to->num_spans] = (xmp_span){packet, at, offset, length};
+    to->num_spans += 1;
+}
+
+/// for a reader that failed: frees what it found and records why
+static void discard(xmp_rdata *ans) {
+    for(size_t i=0; i<ans->num_packets; i+=1) drop_packet(ans->packets[i]);
+    free(ans->packets);
+    ans->packets = NULL;
+    ans->num_packets = 0;
+    free(ans->spans);
+    ans->spans = NULL;
+    ans->num_spans = 0;
+    ans->width = ans->height = 0;
+    fail(XMP_ERR_MALFORMED);
+}
+
+/// what a reader returns: nothing, if anything failed
+static xmp_rdata end_read(FILE *f, xmp_rdata ans) {
+    if (f) fclose(f);
+    if (last_error) discard(&ans);
+    ans.error = last_error;
+    return ans;
+}
+
+// unsigned values, or -1 if the file ends first
 static long ru8(FILE *f, int littleendian) { return getc(f); }
+// C leaves the order of calls within an expression unspecified, so each byte is read into its own variable first
 static long ru16(FILE *f, int littleendian) {
-    if (littleendian) return getc(f) | (getc(f)<<8);
-    else return (getc(f)<<8) | getc(f);
+    unsigned long a = getc(f), b = getc(f);
+    if ((a | b) > 0xFF) return -1; // EOF
+    if (littleendian) return a | (b<<8);
+    else return (a<<8) | b;
 }
 static long ru24(FILE *f, int littleendian) {
-    if (littleendian) return getc(f) | (getc(f)<<8) | (getc(f)<<16);
-    else return (getc(f)<<16) | (getc(f)<<8) | getc(f);
+    unsigned long a = getc(f), b = getc(f), c = getc(f);
+    if ((a | b | c) > 0xFF) return -1;
+    if (littleendian) return a | (b<<8) | (c<<16);
+    else return (a<<16) | (b<<8) | c;
 }
 static long ru32(FILE *f, int littleendian) {
-    if (littleendian) return getc(f) | (getc(f)<<8) | (getc(f)<<16) | (getc(f)<<24);
-    else return (getc(f)<<24) | (getc(f)<<16) | (getc(f)<<8) | getc(f);
+    unsigned long a = getc(f), b = getc(f), c = getc(f), d = getc(f);
+    if ((a | b | c | d) > 0xFF) return -1;
+    if (littleendian) return a | (b<<8) | (c<<16) | (d<<24);
+    else return (a<<24) | (b<<16) | (c<<8) | d;
 }
 static size_t ru64(FILE *f, int le) {
-    if (le) return ((size_t)ru32(f,le)) | (((size_t)ru32(f,le))<<32);
-    else return (((size_t)ru32(f,le))<<32) | ((size_t)ru32(f,le));
+    size_t a = (unsigned)ru32(f,le), b = (unsigned)ru32(f,le);
+    if (le) return a | (b<<32);
+    else return (a<<32) | b;
 }
 
 static void wu8(unsigned char val, FILE *f, int littleendian) { putc(val, f); }
@@ -82,14 +598,407 @@ static _Thread_local char copy_buffer[4096];
 static int copy_bytes(FILE *from, FILE *to, size_t bytes) {
     while(bytes > 0) {
         size_t got = fread(copy_buffer, 1, sizeof(copy_buffer) > bytes ? bytes : sizeof(copy_buffer), from);
-        if (got == 0) return 0;
-        if (got != fwrite(copy_buffer, 1, got, to)) return 0;
+        if (got == 0) return fail(XMP_ERR_MALFORMED);
+        if (got != fwrite(copy_buffer, 1, got, to)) return fail(XMP_ERR_WRITE);
         bytes -= got;
     }
     return 1;
 }
+#ifdef XMP_STATS
+static int timed_copy_bytes(FILE *from, FILE *to, size_t bytes) {
+    unsigned long long t = phase_begin();
+    int ans = copy_bytes(from, to, bytes);
+    phase_end(t, offsetof(xmp_stats, ns_copying));
+    return ans;
+}
+#define copy_bytes timed_copy_bytes
+#endif
 ////////////////////////////// HELPERS //////////////////////////////
 
+/////////////////////////////// CACHE ///////////////////////////////
+// XXH64, which can be computed a piece at a time as a packet is read
+#define XXH_P1 11400714785074694791ull
+#define XXH_P2 14029467366897019727ull
+#define XXH_P3 1609587929392839161ull
+#define XXH_P4 9650029242287828579ull
+#define XXH_P5 2870177450012600261ull
+
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char buf[32];
+    size_t buffered;
+} xxh64_state;
+
+static uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+static uint64_t le64(const unsigned char *p) {
+    uint64_t ans = 0;
+    for(int i=7; i>=0; i-=1) ans = (ans << 8) | p[i];
+    return ans;
+}
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    return rotl64(acc + input * XXH_P2, 31) * XXH_P1;
+}
+static uint64_t xxh64_merge(uint64_t acc, uint64_t v) {
+    return (acc ^ xxh64_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+static void xxh64_init(xxh64_state *s) {
+    s->v[0] = XXH_P1 + XXH_P2;
+    s->v[1] = XXH_P2;
+    s->v[2] = 0;
+    s->v[3] = -XXH_P1;
+    s->total = 0;
+    s->buffered = 0;
+}
+static void xxh64_update(xxh64_state *s, const unsigned char *p, size_t len) {
+    s->total += len;
+    if (s->buffered) {
+        size_t take = 32 - s->buffered < len ? 32 - s->buffered : len;
+        memcpy(s->buf + s->buffered, p, take);
+        s->buffered += take;
+        p += take;
+        len -= take;
+        if (s->buffered < 32) return;
+        for(int i=0; i<4; i+=1) s->v[i] = xxh64_round(s->v[i], le64(s->buf + 8*i));
+        s->buffered = 0;
+    }
+    for(; len >= 32; p += 32, len -= 32)
+        for(int i=0; i<4; i+=1) s->v[i] = xxh64_round(s->v[i], le64(p + 8*i));
+    memcpy(s->buf, p, len);
+    s->buffered = len;
+}
+static uint64_t xxh64_digest(const xxh64_state *s) {
+    uint64_t h;
+    if (s->total >= 32) {
+        h = rotl64(s->v[0], 1) + rotl64(s->v[1], 7) + rotl64(s->v[2], 12) + rotl64(s->v[3], 18);
+        for(int i=0; i<4; i+=1) h = xxh64_merge(h, s->v[i]);
+    } else {
+        h = XXH_P5;
+    }
+    h += s->total;
+    const unsigned char *p = s->buf, *end = s->buf + s->buffered;
+    for(; p + 8 <= end; p += 8)
+        h = rotl64(h ^ xxh64_round(0, le64(p)), 27) * XXH_P1 + XXH_P4;
+    if (p + 4 <= end) {
+        h = rotl64(h ^ ((le64(p) & 0xFFFFFFFFull) * XXH_P1), 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for(; p < end; p += 1)
+        h = rotl64(h ^ (*p * XXH_P5), 11) * XXH_P1;
+    h ^= h >> 33; h *= XXH_P2;
+    h ^= h >> 29; h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/// a packet owned by a cache, stored just after its header
+typedef struct xmp_cache_entry {
+    struct xmp_cache_entry *next; // in the same bucket
+    uint64_t hash;
+    size_t length;
+    void *value;
+    char packet[];
+} xmp_cache_entry;
+
+struct xmp_cache {
+    void (*free_value)(void *value);
+    xmp_cache_entry **buckets;
+    size_t num_buckets, count, hits;
+};
+
+static _Thread_local xmp_cache *current_cache;
+/// the entry add_block most recently filled and hashed, not yet interned
+static _Thread_local xmp_cache_entry *pending_entry;
+
+static xmp_cache_entry *entry_of(const char *packet) {
+    return (xmp_cache_entry *)(packet - offsetof(xmp_cache_entry, packet));
+}
+
+xmp_cache *xmp_cache_new(void (*free_value)(void *value)) {
+    xmp_cache *c = calloc(1, sizeof(xmp_cache));
+    if (c) c->free_value = free_value;
+    return c;
+}
+
+void xmp_cache_free(xmp_cache *c) {
+    if (!c) return;
+    for(size_t i=0; i<c->num_buckets; i+=1) {
+        xmp_cache_entry *e = c->buckets[i];
+        while (e) {
+            xmp_cache_entry *next = e->next;
+            if (e->value && c->free_value) c->free_value(e->value);
+            free(e);
+            e = next;
+        }
+    }
+    free(c->buckets);
+    if (current_cache == c) current_cache = NULL;
+    free(c);
+}
+
+xmp_cache *xmp_use_cache(xmp_cache *c) {
+    xmp_cache *old = current_cache;
+    current_cache = c;
+    return old;
+}
+
+void **xmp_cache_value(const char *packet) { return &entry_of(packet)->value; }
+unsigned long long xmp_cache_hash(const char *packet) { return entry_of(packet)->hash; }
+void xmp_cache_stats(const xmp_cache *c, size_t *packets, size_t *hits) {
+    if (packets) *packets = c->count;
+    if (hits) *hits = c->hits;
+}
+
+/// an entry for a packet of `length` bytes, to be filled and then interned
+static xmp_cache_entry *cache_reserve(size_t length) {
+    xmp_cache_entry *e = malloc(sizeof(xmp_cache_entry) + length + 1);
+    if (!e) return NULL;
+    e->next = NULL;
+    e->length = length;
+    e->value = NULL;
+    return e;
+}
+
+/// with a cache in use, replaces `packet` (which it frees) with the cached
+/// copy of the same bytes, adding one if needed; without one, returns it
+static char *cache_intern(char *packet) {
+    xmp_cache *c = current_cache;
+    if (!c || !packet) return packet;
+
+    xmp_cache_entry *e;
+    if (pending_entry && pending_entry->packet == packet) {
+        // hashed as add_block read it
+        e = pending_entry;
+    } else {
+        size_t length = strlen(packet);
+        e = cache_reserve(length);
+        if (!e) { free(packet); return NULL; }
+        memcpy(e->packet, packet, length + 1);
+        free(packet);
+        xxh64_state h;
+        xxh64_init(&h);
+        xxh64_update(&h, (const unsigned char *)e->packet, length);
+        e->hash = xxh64_digest(&h);
+    }
+    pending_entry = NULL;
+
+    if (c->num_buckets) {
+        for(xmp_cache_entry *old = c->buckets[e->hash & (c->num_buckets - 1)]; old; old = old->next) {
+            if (old->hash == e->hash && old->length == e->length && !memcmp(old->packet, e->packet, e->length)) {
+                c->hits += 1;
+                free(e);
+                return old->packet;
+            }
+        }
+    }
+
+    if (c->count >= c->num_buckets) {
+        size_t want = c->num_buckets ? 2 * c->num_buckets : 256;
+        xmp_cache_entry **bigger = calloc(want, sizeof(xmp_cache_entry *));
+        if (bigger) {
+            for(size_t i=0; i<c->num_buckets; i+=1) {
+                while (c->buckets[i]) {
+                    xmp_cache_entry *moving = c->buckets[i];
+                    c->buckets[i] = moving->next;
+                    moving->next = bigger[moving->hash & (want - 1)];
+                    bigger[moving->hash & (want - 1)] = moving;
+                }
+            }
+            free(c->buckets);
+            c->buckets = bigger;
+            c->num_buckets = want;
+        } else if (!c->num_buckets) {
+            free(e);
+            return NULL;
+        }
+    }
+    xmp_cache_entry **bucket = &c->buckets[e->hash & (c->num_buckets - 1)];
+    e->next = *bucket;
+    *bucket = e;
+    c->count += 1;
+    return e->packet;
+}
+
+/// frees a packet from a failed xmp_from_ call; a cache owns its packets
+static void drop_packet(char *packet) {
+    if (!current_cache) free(packet);
+}
+/////////////////////////////// CACHE ///////////////////////////////
+
+//////////////////////////// COALESCING /////////////////////////////
+#define COALESCED_BLOCKS 4
+#define COALESCED_FIRST 4096 // fetched by a miss away from the last fetch
+
+struct xmp_coalescer {
+    xmp_io io; // reading through the coalescer
+    xmp_io inner;
+    size_t block_bytes;
+    long size; // of the source; -2 until asked
+    long next; // where the last fetch ended
+    size_t window; // what the last fetch asked for
+    unsigned long long clock;
+    struct {
+        long offset, length;     // what of the source it holds; length 0 if nothing
+        unsigned long long used; // clock when last read, to replace the least recent
+        char *data;              // block_bytes, allocated when first needed
+    } kept[COALESCED_BLOCKS];
+};
+
+static long coalesced_size(void *ctx) {
+    xmp_coalescer *c = ctx;
+    if (c->size == -2) c->size = c->inner.size(c->inner.ctx);
+    return c->size;
+}
+
+static long coalesced_read_at(void *ctx, long offset, void *buf, size_t length) {
+    xmp_coalescer *c = ctx;
+    if (offset < 0) return -1;
+    long size = coalesced_size(c);
+    char *out = buf;
+    size_t done = 0;
+    while (done < length) {
+        long at = offset + (long)done, got;
+        if (size >= 0 && at >= size) break;
+        int k, oldest = 0;
+        for(k=0; k<COALESCED_BLOCKS; k+=1) {
+            if (c->kept[k].offset <= at && at < c->kept[k].offset + c->kept[k].length) break;
+            if (c->kept[k].used < c->kept[oldest].used) oldest = k;
+        }
+        if (k < COALESCED_BLOCKS) { // fetched already
+            size_t n = c->kept[k].offset + c->kept[k].length - at;
+            if (n > length - done) n = length - done;
+            memcpy(out + done, c->kept[k].data + (at - c->kept[k].offset), n);
+            c->kept[k].used = ++c->clock;
+            done += n;
+            continue;
+        }
+        if (!c->kept[oldest].data && length - done < c->block_bytes)
+            c->kept[oldest].data = malloc(c->block_bytes);
+        if (length - done >= c->block_bytes || !c->kept[oldest].data) {
+            // no smaller than a block, so no use keeping (or out of memory to keep it)
+            got = c->inner.read_at(c->inner.ctx, at, out + done, length - done);
+            if (got > 0) done += got;
+        } else {
+            // a window from `at`, stopping short of the end and of any kept after
+            // it: a block at the start of the source, where most formats keep
+            // their metadata; twice the last if it carries on from the last;
+            // else as little as is likely to hold a chunk header or an IFD,
+            // but never less than was asked for
+            if (!at) c->window = c->block_bytes;
+            else if (at == c->next) c->window = (c->window < c->block_bytes / 2) ? 2 * c->window : c->block_bytes;
+            else c->window = (COALESCED_FIRST < c->block_bytes) ? COALESCED_FIRST : c->block_bytes;
+            if (c->window < length - done) c->window = length - done;
+            size_t n = c->window;
+            if (size >= 0 && (size_t)(size - at) < n) n = size - at;
+            for(int j=0; j<COALESCED_BLOCKS; j+=1)
+                if (c->kept[j].length && c->kept[j].offset > at && (size_t)(c->kept[j].offset - at) < n)
+                    n = c->kept[j].offset - at;
+            got = c->inner.read_at(c->inner.ctx, at, c->kept[oldest].data, n);
+            c->kept[oldest].offset = at;
+            c->kept[oldest].length = (got > 0) ? got : 0;
+            c->kept[oldest].used = ++c->clock;
+            c->next = at + c->kept[oldest].length;
+        }
+        if (got <= 0) return (got < 0 && !done) ? -1 : (long)done;
+    }
+    return (long)done;
+}
+
+xmp_coalescer *xmp_coalescer_new(const xmp_io *inner, size_t block_bytes) {
+    xmp_coalescer *c = calloc(1, sizeof(xmp_coalescer));
+    if (!c) return NULL;
+    c->io = (xmp_io){coalesced_read_at, coalesced_size, c};
+    c->inner = *inner;
+    c->block_bytes = block_bytes ? block_bytes : 64<<10;
+    c->size = -2;
+    c->next = -1;
+    return c;
+}
+
+const xmp_io *xmp_coalescer_io(xmp_coalescer *c) {
+    return &c->io;
+}
+
+void xmp_coalescer_free(xmp_coalescer *c) {
+    if (!c) return;
+    for(int k=0; k<COALESCED_BLOCKS; k+=1) free(c->kept[k].data);
+    free(c);
+}
+//////////////////////////// COALESCING /////////////////////////////
+
+///////////////////////////// ORDERING //////////////////////////////
+typedef struct {
+    char *filename;
+    size_t given;               // where the caller had it, to keep ties in their order
+    int rank;                   // 0 placed by extent, 1 by inode, 2 not at all
+    unsigned long long dev, at; // the device, and the offset on it or the inode
+} placed_file;
+
+static int by_place(const void *a, const void *b) {
+    const placed_file *x = a, *y = b;
+    if (x->rank != y->rank) return x->rank - y->rank;
+    if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+    if (x->at != y->at) return x->at < y->at ? -1 : 1;
+    return x->given < y->given ? -1 : x->given > y->given;
+}
+
+/// where on its device the first byte of the file open as `fd` is, or -1 if unknown
+static long long first_extent(int fd) {
+#if defined(__linux__) && defined(FS_IOC_FIEMAP)
+    union {
+        struct fiemap map;
+        char room[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } q;
+    memset(&q, 0, sizeof(q));
+    q.map.fm_length = FIEMAP_MAX_OFFSET;
+    q.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &q.map) || !q.map.fm_mapped_extents) return -1;
+    // not yet allocated, or kept in the inode, have no place of their own
+    if (q.map.fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)) return -1;
+    return q.map.fm_extents[0].fe_physical;
+#elif defined(F_LOG2PHYS)
+    struct log2phys where = {0};
+    if (fcntl(fd, F_LOG2PHYS, &where) == -1) return -1;
+    return where.l2p_devoffset;
+#else
+    (void)fd;
+    return -1;
+#endif
+}
+
+long xmp_order_by_location(char **filenames, size_t count) {
+    placed_file *files = malloc(count * sizeof(placed_file) + 1);
+    if (!files) return -1;
+    struct stat st;
+    for(size_t i=0; i<count; i+=1) {
+        placed_file *f = &files[i];
+        *f = (placed_file){filenames[i], i, 2, 0, 0};
+        if (stat(f->filename, &st) || !S_ISREG(st.st_mode)) continue;
+        f->rank = 1;
+        f->dev = st.st_dev;
+        f->at = st.st_ino;
+    }
+    // inode order is both the fallback and the cheapest order to open them in
+    qsort(files, count, sizeof(placed_file), by_place);
+    long by_extent = 0;
+    for(size_t i=0; i<count && files[i].rank == 1; i+=1) {
+        int fd = open(files[i].filename, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) continue;
+        long long at = first_extent(fd);
+        close(fd);
+        if (at < 0) continue;
+        files[i].rank = 0;
+        files[i].at = at;
+        by_extent += 1;
+    }
+    if (by_extent) qsort(files, count, sizeof(placed_file), by_place);
+    for(size_t i=0; i<count; i+=1) filenames[i] = files[i].filename;
+    free(files);
+    return by_extent;
+}
+///////////////////////////// ORDERING //////////////////////////////
+
 ////////////////////////////// WRAPPING /////////////////////////////
 static size_t place_block(FILE *t, const char *data, int wrap, int pad) {
     long old = ftell(t);
@@ -104,6 +1013,15 @@ static size_t place_block(FILE *t, const char *data, int wrap, int pad) {
     }
     return ftell(t) - old;
 }
+#ifdef XMP_STATS
+static size_t timed_place_block(FILE *t, const char *data, int wrap, int pad) {
+    unsigned long long since = phase_begin();
+    size_t ans = place_block(t, data, wrap, pad);
+    phase_end(since, offsetof(xmp_stats, ns_copying));
+    return ans;
+}
+#define place_block timed_place_block
+#endif
 static size_t placed_size_of_block(const char *data, int wrap, int pad) {
     size_t wrote = 0;
     if (wrap) wrote += 54;
@@ -112,9 +1030,29 @@ static size_t placed_size_of_block(const char *data, int wrap, int pad) {
     if (wrap) wrote += 20;
     return wrote;
 }
-static char *read_block(FILE *f, long fpos, long size) {
+/// `end` moved back past whitespace (and to the end of the file, if past it), but not before `start`
+static long trim_end(FILE *f, long start, long end) {
+    long size = file_size(f);
+    if (end > size) end = size;
+    char buf[256];
+    while (end > start) {
+        long from = (end - start > (long)sizeof(buf)) ? end - (long)sizeof(buf) : start;
+        fseek(f, from, SEEK_SET);
+        long got = fread(buf, 1, end - from, f);
+        if (got < end - from) { end = from + got; continue; }
+        while (got > 0 && isspace((unsigned char)buf[got-1])) got -= 1;
+        if (got > 0) return from + got;
+        end = from;
+    }
+    return end;
+}
+/// adds the packet stored in `size` bytes at `fpos` to `to`, without surrounding
+/// whitespace or xpacket wrapper, or just where it is if over xmp_max_packet_bytes
+static void add_block(xmp_rdata *to, FILE *f, long fpos, long size) {
     char buf[256];
     long start = fpos, end = fpos + size;
+    size_t found = to->num_packets;
+    if (xmp_max_scan_bytes > 0 && end > xmp_max_scan_bytes) { fail(XMP_ERR_BUDGET); return; }
 
     // skip leading whitespace
     fseek(f, start, SEEK_SET);
@@ -122,62 +1060,129 @@ static char *read_block(FILE *f, long fpos, long size) {
     
     // if present, skip xpacket header (even if malformed)
     fseek(f, start, SEEK_SET);
-    fread(buf, 1, 16, f);
-    if (!memcmp(buf, "<?xpacket begin=", 16)) {
-        while (getc(f) != '?') {}
-        if (getc(f) != '>') return 0;
+    if (end - start >= 16 && fread(buf, 1, 16, f) == 16 && !memcmp(buf, "<?xpacket begin=", 16)) {
+        // an unterminated header leaves no packet, but reading goes on after the block
+        int c;
+        while ((c = getc(f)) != '?')
+            if (c == EOF || ftell(f) >= end) { fseek(f, fpos + size, SEEK_SET); return; }
+        if (getc(f) != '>') { fseek(f, fpos + size, SEEK_SET); return; }
         start = ftell(f);
         // and whitespace after it
         while (isspace(getc(f)) && start < end) start += 1;
     }
     
     // skip trailing whitespace
-    int i = -1;
-    while(i < 0 && end > start) {
-        fseek(f, end-sizeof(buf), SEEK_SET);
-        fread(buf, 1, sizeof(buf), f);
-        for(i=sizeof(buf)-1; i>=0 && isspace(buf[i]); i-=1)
-            end -= 1;
-    }
+    end = trim_end(f, start, end);
     // if present, skip xpacket footer (even if malformed)
     fseek(f, end-19, SEEK_SET);
-    fread(buf, 1, 19, f); 
-    if (!memcmp(buf, "<?xpacket end=", 14) && !memcmp(buf+17, "?>", 2)) {
-        end -= 19;
-        // skip more trailing whitespace
-        i = -1;
-        while(i < 0 && end > start) {
-            fseek(f, end-sizeof(buf), SEEK_SET);
-            fread(buf, 1, sizeof(buf), f);
-            for(i=sizeof(buf)-1; i>=0 && isspace(buf[i]); i-=1)
-                end -= 1;
-        }
+    if (end - start >= 19 && fread(buf, 1, 19, f) == 19
+        && !memcmp(buf, "<?xpacket end=", 14) && !memcmp(buf+17, "?>", 2)) {
+        // and more trailing whitespace
+        end = trim_end(f, start, end - 19);
     }
-    if (end > start) {
+    if (xmp_max_packet_bytes > 0 && !locating && end - start > xmp_max_packet_bytes) {
+        add_span(to, large_packets(to), 0, start, end - start);
+        fseek(f, fpos + size, SEEK_SET);
+    } else if (end > start && current_cache) {
+        // hash each piece as it arrives rather than in a second pass
+        xmp_cache_entry *e = cache_reserve(end-start);
+        if (!e) { fail(XMP_ERR_MEMORY); return; }
+        xxh64_state h;
+        xxh64_init(&h);
+        fseek(f, start, SEEK_SET);
+        for(long done = 0; done < end-start; ) {
+            long want = (end-start-done > 65536) ? 65536 : end-start-done;
+            size_t got = fread(e->packet + done, 1, want, f);
+            if (!got) { memset(e->packet + done, 0, end-start-done); break; }
+            xxh64_update(&h, (const unsigned char *)e->packet + done, got);
+            done += got;
+        }
+        e->packet[end-start] = '\0';
+        e->hash = xxh64_digest(&h);
+        pending_entry = e;
+        fseek(f, fpos + size, SEEK_SET);
+        add_packet(to, e->packet);
+    } else if (end > start) {
         char *ans = malloc(end-start+1);
+        if (!ans) { fail(XMP_ERR_MEMORY); return; }
         fseek(f, start, SEEK_SET);
-        fread(ans, 1, end-start, f);
-        ans[end-start] = '\0';
+        ans[fread(ans, 1, end-start, f)] = '\0';
         fseek(f, fpos + size, SEEK_SET);
-        return ans;
+        add_packet(to, ans);
     } else {
         fseek(f, fpos + size, SEEK_SET);
-        return 0;
     }
+    if (locating && to->num_packets > found) add_span(to, found, 0, start, end - start);
+}
+#ifdef XMP_STATS
+static void timed_add_block(xmp_rdata *to, FILE *f, long fpos, long size) {
+    unsigned long long since = phase_begin();
+    add_block(to, f, fpos, size);
+    phase_end(since, offsetof(xmp_stats, ns_extracting));
 }
-static char *read_block_delim(FILE *f, long fpos, char delim, size_t *end) {
+#define add_block timed_add_block
+#endif
+static void add_block_delim(xmp_rdata *to, FILE *f, long fpos, char delim, size_t *end) {
     fseek(f, fpos, SEEK_SET);
     while (getc(f) != delim && !feof(f)) {}
     if (end) *end = ftell(f)-1;
-    return read_block(f, fpos, ftell(f)-fpos-1);
+    add_block(to, f, fpos, ftell(f)-fpos-1);
 }
+#ifdef XMP_STATS
+static void timed_add_block_delim(xmp_rdata *to, FILE *f, long fpos, char delim, size_t *end) {
+    unsigned long long since = phase_begin();
+    add_block_delim(to, f, fpos, delim, end);
+    phase_end(since, offsetof(xmp_stats, ns_extracting));
+}
+#define add_block_delim timed_add_block_delim
+#endif
+/// like add_block, but for a packet already in memory; `buf` must have room
+/// for `len+1` bytes and is either returned (trimmed in place) or freed
+static char *trim_block(char *buf, size_t len) {
+    size_t start = 0, end = len;
+
+    while (start < end && isspace((unsigned char)buf[start])) start += 1;
+    if (end - start >= 16 && !memcmp(buf+start, "<?xpacket begin=", 16)) {
+        while (start < end && buf[start] != '?') start += 1;
+        start += 1;
+        while (start < end && buf[start] != '?') start += 1;
+        if (start + 1 >= end || buf[start+1] != '>') { free(buf); return 0; }
+        start += 2;
+        while (start < end && isspace((unsigned char)buf[start])) start += 1;
+    }
+
+    while (end > start && isspace((unsigned char)buf[end-1])) end -= 1;
+    if (end - start >= 19 && !memcmp(buf+end-19, "<?xpacket end=", 14) && !memcmp(buf+end-2, "?>", 2)) {
+        end -= 19;
+        while (end > start && isspace((unsigned char)buf[end-1])) end -= 1;
+    }
+
+    if (end > start) {
+        memmove(buf, buf+start, end-start);
+        buf[end-start] = '\0';
+        return buf;
+    } else {
+        free(buf);
+        return 0;
+    }
+}
+#ifdef XMP_STATS
+static char *timed_trim_block(char *buf, size_t len) {
+    unsigned long long since = phase_begin();
+    char *ans = trim_block(buf, len);
+    phase_end(since, offsetof(xmp_stats, ns_extracting));
+    return ans;
+}
+#define trim_block timed_trim_block
+#endif
 ////////////////////////////// WRAPPING /////////////////////////////
 
 
 //////////////////////////////// GIF ////////////////////////////////
 xmp_rdata xmp_from_gif(const char *filename) {
-    FILE *f = fopen(filename, "rb");
-    xmp_rdata ans = {0, 0, 0, NULL};
+    xmp_rdata ans = {0, 0, 0, NULL, 0, 0, NULL};
+    FILE *f = begin_read(filename, "rb");
+    if (!f) return end_read(f, ans);
     int endian = 1;
 
     char header[6];
@@ -185,16 +1190,18 @@ xmp_rdata xmp_from_gif(const char *filename) {
     int mode = 0;
     if (memcmp(header, "GIF89a", 6) == 0) mode = 2;
     if (memcmp(header, "GIF87a", 6) == 0) mode = 1;
-    if (!mode) goto malformed;
+    if (!mode) goto not_format;
 
     ans.width = ru16(f, endian);
     ans.height = ru16(f, endian);
-    if (mode < 2) goto end;
+    if (ans.height < 0) goto malformed; // the file ends within the dimensions
+    if (mode < 2 || probing) goto end;
     unsigned char flags = ru8(f, endian);
     fseek(f, 2, SEEK_CUR);
     if (flags & 0x80) fseek(f, 6<<(flags&0x7), SEEK_CUR);
 
     for(;;) {
+        if (!within_budget(f)) goto malformed;
         unsigned char intro = ru8(f, endian);
         if (intro == 0x3B) goto end;
         else if (intro == 0x2C) {
@@ -216,8 +1223,7 @@ xmp_rdata xmp_from_gif(const char *filename) {
                 char appid[11]; fread(appid, 1, 11, f);
                 if (!memcmp(appid, "XMP DataXMP", 11)) {
                     size_t len = 0;
-                    char *packet = read_block_delim(f, ftell(f), 1, &len);
-                    add_packet(&ans, packet);
+                    add_block_delim(&ans, f, ftell(f), 1, &len);
                     getc(f); // delimiter, already processed
                     unsigned char trailer[257]; fread(trailer, 1, 257, f);
                     for(int i=0; i<256; i+=1) if (trailer[i] != 0xFF - i) goto malformed;
@@ -245,48 +1251,42 @@ xmp_rdata xmp_from_gif(const char *filename) {
         }
     }
 
+not_format:
+    fail(XMP_ERR_FORMAT);
 malformed:
-    if (ans.packets) {
-        char **p = ans.packets;
-        while (*p) { free(*p); *p=NULL; p+=1; }
-        free(ans.packets);
-        ans.packets = NULL;
-    }
-    ans.width = ans.height = 0;
+    discard(&ans);
 
 end:
-    fclose(f);
-    return ans;
+    return end_read(f, ans);
 }
 
 int xmp_to_gif(const char *ref, const char *dest, const char *xmp) {
-    int fd = open(dest, O_WRONLY | O_EXCL | O_CREAT, 0644);
-    if (fd < 0) return 0;
     char bigbuf[258];
-    FILE *f = fopen(ref, "rb");
-    FILE *t = fdopen(fd, "wb");
+    FILE *f, *t;
+    if (!begin_write(ref, dest, &f, &t)) return 0;
     int endian = 1;
     int wrote_xmp = (xmp == NULL);
 
-    fseek(f, 6, SEEK_CUR);
+    if (fread(bigbuf, 1, 6, f) != 6 || memcmp(bigbuf, "GIF8", 4)) goto not_format;
     fwrite("GIF89a", 1, 6, t);
 
-    copy_bytes(f,t,4);
+    if (!copy_bytes(f,t,4)) goto malformed;
     unsigned char flags = ru8(f, endian);
     wu8(flags, t, endian);
-    if (flags & 0x80) copy_bytes(f, t, 2 + (6<<(flags&0x7)));
-    else copy_bytes(f, t, 2);
+    if (!copy_bytes(f, t, 2 + ((flags & 0x80) ? (6<<(flags&0x7)) : 0))) goto malformed;
 
     for(;;) {
+        if (!within_budget(f)) goto malformed;
         unsigned char intro = ru8(f, endian);
         if (intro == 0x3B) {
             if (!wrote_xmp) {
                 wu8(0x21, t, endian);
                 wu8(0xFF, t, endian);
+                wu8(11, t, endian);
                 fwrite("XMP DataXMP", 1, 11, t);
                 place_block(t, xmp, 1, xmp_writable_padding);
                 bigbuf[0] = 1; bigbuf[256] = bigbuf[257] = 0;
-                for(int i=0; i<256; i+=1) bigbuf[i] = 0xFF - i;
+                for(int i=0; i<256; i+=1) bigbuf[i+1] = 0xFF - i;
                 fwrite(bigbuf, 1, 258, t);
             }
             wu8(intro, t, endian);
@@ -299,8 +1299,8 @@ int xmp_to_gif(const char *ref, const char *dest, const char *xmp) {
             unsigned char flag = ru8(f, endian);
             wu8(flag, t, endian);
             if (flag&0x80) 
-                if (!copy_bytes(f, t, (6<<(flags&0x7)))) goto malformed;
-            copy_bytes(f, t, 1);
+                if (!copy_bytes(f, t, (6<<(flag&0x7)))) goto malformed;
+            if (!copy_bytes(f, t, 1)) goto malformed;
             unsigned char length = ru8(f, endian);
             wu8(length, t, endian);
             while(length) {
@@ -320,6 +1320,7 @@ int xmp_to_gif(const char *ref, const char *dest, const char *xmp) {
                     while(length) {
                         fseek(f, length, SEEK_CUR);
                         length = ru8(f, endian);
+                        if (feof(f)) goto malformed;
                     }
                     if (!wrote_xmp) {
                         wu8(0x21, t, endian);
@@ -335,6 +1336,8 @@ int xmp_to_gif(const char *ref, const char *dest, const char *xmp) {
                 } else {
                     wu8(0x21, t, endian);
                     wu8(0xFF, t, endian);
+                    wu8(tmp, t, endian);
+                    fwrite(bigbuf, 1, 11, t);
                     unsigned char length = ru8(f, endian);
                     wu8(length, t, endian);
                     while(length) {
@@ -359,19 +1362,13 @@ int xmp_to_gif(const char *ref, const char *dest, const char *xmp) {
         }
     }
 
-
+not_format:
+    fail(XMP_ERR_FORMAT);
 malformed:
-    fclose(f);
-    fclose(t);
-    close(fd);
-    unlink(dest);
-    return 0;
+    return end_write(f, t, dest, 0);
 
 end:
-    fclose(f);
-    fclose(t);
-    close(fd);
-    return 1;
+    return end_write(f, t, dest, 1);
 }
 //////////////////////////////// GIF ////////////////////////////////
 
@@ -391,23 +1388,222 @@ static isobmf_box isobmf_read_box(FILE *f, long end) {
     return box;
 }
 
+/// reads a big-endian unsigned integer of 0, 4, or 8 bytes, as used by iloc
+static long isobmf_read_sized(FILE *f, int size) {
+    if (size == 4) return ru32(f, 0) & 0xFFFFFFFFl;
+    if (size == 8) return ru64(f, 0);
+    return 0;
+}
+
+// HEIF stores XMP as an item with item_type "mime" and content_type
+// "application/rdf+xml"; the item's bytes are located by iloc extents.
+typedef struct {
+    long offset, length; // absolute file position and length of the bytes
+    long fpos;           // where the extent_offset field is stored in iloc
+} isobmf_extent;
+typedef struct {
+    unsigned id;
+    int method;          // iloc construction_method: 0 = file, 1 = idat
+    long base;
+    size_t num_extents;
+    isobmf_extent *extents;
+} isobmf_item;
+typedef struct {
+    int offset_size, length_size; // of iloc's extent fields, in bytes
+    size_t count;
+    isobmf_item *items;
+} isobmf_items;
+
+static void isobmf_free_items(isobmf_items *items) {
+    for(size_t i=0; i<items->count; i+=1) free(items->items[i].extents);
+    free(items->items);
+    items->items = NULL;
+    items->count = 0;
+}
+
+/**
+ * Finds the XMP items listed in `iinf` and resolves their extents using
+ * `iloc` (and `idat`, if construction_method 1 is used).
+ * Boxes not present should have length -1. Returns 0 if malformed.
+ */
+static int isobmf_xmp_items(FILE *f, isobmf_box iinf, isobmf_box iloc, isobmf_box idat, isobmf_items *items) {
+    static const char rdfxml[] = "application/rdf+xml";
+    unsigned *ids = NULL;
+    size_t num_ids = 0;
+
+    items->count = 0;
+    items->items = NULL;
+    if (iinf.length < 0 || iloc.length < 0) return 1;
+
+    fseek(f, iinf.fpos, SEEK_SET);
+    int version = ru8(f, 0);
+    fseek(f, 3, SEEK_CUR);
+    long count = version ? ru32(f, 0) : ru16(f, 0);
+    for(long i=0; i<count && ftell(f) < iinf.fpos+iinf.length; i+=1) {
+        isobmf_box infe = isobmf_read_box(f, iinf.fpos+iinf.length);
+        if (infe.length < 0 || infe.length + infe.fpos > iinf.fpos+iinf.length) goto malformed;
+        if (!memcmp(infe.type, "infe", 4) && infe.length > 12) {
+            int v = ru8(f, 0);
+            fseek(f, 3, SEEK_CUR);
+            if (v >= 2) {
+                unsigned id = (v == 2) ? ru16(f, 0) : ru32(f, 0);
+                ru16(f, 0); // item_protection_index
+                char type[4]; fread(type, 1, 4, f);
+                if (!memcmp(type, "mime", 4)) {
+                    int c;
+                    // item_name, then content_type, both NUL-terminated
+                    do c = getc(f); while (c > 0 && ftell(f) < infe.fpos+infe.length);
+                    size_t k = 0;
+                    while ((c = getc(f)) > 0 && ftell(f) <= infe.fpos+infe.length)
+                        if (k < sizeof(rdfxml) && c == rdfxml[k]) k += 1; else k = sizeof(rdfxml);
+                    if (c == 0 && k == sizeof(rdfxml)-1) {
+                        unsigned *grown = realloc(ids, (num_ids+1) * sizeof(unsigned));
+                        if (!grown) { fail(XMP_ERR_MEMORY); goto malformed; }
+                        ids = grown;
+                        ids[num_ids++] = id;
+                    }
+                }
+            }
+        }
+        fseek(f, infe.fpos+infe.length, SEEK_SET);
+    }
+    if (!num_ids) return 1;
+
+    fseek(f, iloc.fpos, SEEK_SET);
+    version = ru8(f, 0);
+    fseek(f, 3, SEEK_CUR);
+    int sizes = ru16(f, 0);
+    items->offset_size = (sizes>>12) & 0xF;
+    items->length_size = (sizes>>8) & 0xF;
+    int base_size = (sizes>>4) & 0xF;
+    int index_size = (version == 1 || version == 2) ? sizes & 0xF : 0;
+    if (version > 2
+        || (items->offset_size & ~12) || (items->length_size & ~12)
+        || (base_size & ~12) || (index_size & ~12)) goto malformed;
+    count = (version < 2) ? ru16(f, 0) : ru32(f, 0);
+    for(long i=0; i<count; i+=1) {
+        if (ftell(f) >= iloc.fpos+iloc.length) goto malformed;
+        isobmf_item item;
+        item.id = (version < 2) ? ru16(f, 0) : ru32(f, 0);
+        item.method = (version == 1 || version == 2) ? (ru16(f, 0) & 0xF) : 0;
+        ru16(f, 0); // data_reference_index
+        item.base = isobmf_read_sized(f, base_size);
+        item.num_extents = ru16(f, 0);
+        item.extents = NULL;
+
+        int wanted = 0;
+        for(size_t j=0; j<num_ids; j+=1) if (ids[j] == item.id) wanted = 1;
+        if (wanted && item.method == 1 && idat.length < 0) wanted = 0;
+        if (wanted && item.method > 1) wanted = 0; // item-relative extents unsupported
+        if (wanted) {
+            item.extents = calloc(item.num_extents, sizeof(isobmf_extent));
+            if (!item.extents && item.num_extents) { fail(XMP_ERR_MEMORY); goto malformed; }
+        }
+
+        for(size_t j=0; j<item.num_extents; j+=1) {
+            if (ftell(f) >= iloc.fpos+iloc.length) { free(item.extents); goto malformed; }
+            if (index_size) isobmf_read_sized(f, index_size);
+            long fpos = ftell(f);
+            long offset = isobmf_read_sized(f, items->offset_size);
+            long length = isobmf_read_sized(f, items->length_size);
+            if (!wanted) continue;
+            item.extents[j].fpos = fpos;
+            item.extents[j].offset = item.base + offset + (item.method == 1 ? idat.fpos : 0);
+            item.extents[j].length = length;
+        }
+        if (feof(f)) { free(item.extents); goto malformed; }
+        if (wanted) {
+            isobmf_item *grown = realloc(items->items, (items->count+1) * sizeof(isobmf_item));
+            if (!grown) { free(item.extents); fail(XMP_ERR_MEMORY); goto malformed; }
+            items->items = grown;
+            items->items[items->count++] = item;
+        }
+    }
+    free(ids);
+    return 1;
+
+malformed:
+    free(ids);
+    isobmf_free_items(items);
+    return 0;
+}
+
+/// reads and concatenates all of an item's extents into `to`
+/// `unread` is how much of the file is left to extract: packets do not overlap,
+/// so items adding up to more than the file are malformed (and would let a
+/// small file cost quadratic time)
+static void isobmf_add_item(xmp_rdata *to, FILE *f, isobmf_item *item, long fsize, long *unread) {
+    size_t total = 0;
+    for(size_t i=0; i<item->num_extents; i+=1) {
+        long length = item->extents[i].length;
+        if (length == 0) length = fsize - item->extents[i].offset; // rest of file
+        if (length < 0 || item->extents[i].offset < 0 || item->extents[i].offset + length > fsize) return;
+        total += length;
+    }
+    if (total > (size_t)*unread) { fail(XMP_ERR_MALFORMED); return; }
+    *unread -= total;
+    if (item->num_extents == 1 && item->extents[0].length > 0) {
+        add_block(to, f, item->extents[0].offset, item->extents[0].length);
+        return;
+    }
+    if (xmp_max_packet_bytes > 0 && !locating && total > (size_t)xmp_max_packet_bytes) {
+        size_t packet = large_packets(to);
+        long at = 0;
+        for(size_t i=0; i<item->num_extents; i+=1) {
+            long length = item->extents[i].length;
+            if (length == 0) length = fsize - item->extents[i].offset;
+            add_span(to, packet, at, item->extents[i].offset, length);
+            at += length;
+        }
+        return;
+    }
+    char *ans = malloc(total + 1);
+    if (!ans) { fail(XMP_ERR_MEMORY); return; }
+    size_t got = 0;
+    for(size_t i=0; i<item->num_extents; i+=1) {
+        long length = item->extents[i].length;
+        if (length == 0) length = fsize - item->extents[i].offset;
+        fseek(f, item->extents[i].offset, SEEK_SET);
+        got += fread(ans + got, 1, length, f);
+    }
+    size_t found = to->num_packets;
+    add_packet(to, trim_block(ans, got));
+    if (locating && to->num_packets > found) {
+        long at = 0;
+        for(size_t i=0; i<item->num_extents; i+=1) {
+            long length = item->extents[i].length;
+            if (length == 0) length = fsize - item->extents[i].offset;
+            add_span(to, found, at, item->extents[i].offset, length);
+            at += length;
+        }
+    }
+}
+#ifdef XMP_STATS
+static void timed_isobmf_add_item(xmp_rdata *to, FILE *f, isobmf_item *item, long fsize, long *unread) {
+    unsigned long long since = phase_begin();
+    isobmf_add_item(to, f, item, fsize, unread);
+    phase_end(since, offsetof(xmp_stats, ns_extracting));
+}
+#define isobmf_add_item timed_isobmf_add_item
+#endif
+
 xmp_rdata xmp_from_isobmf(const char *filename) {
-    FILE *f = fopen(filename, "rb");
-    xmp_rdata ans = {0, 0, 0, NULL};
+    xmp_rdata ans = {0, 0, 0, NULL, 0, 0, NULL};
+    FILE *f = begin_read(filename, "rb");
+    if (!f) return end_read(f, ans);
     int endian = 0;
     int format = 0; // 0 = unknown, 1 = JPEG2000, 2 = HEIC, 3 = AVIF
     
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    long fsize = file_size(f);
+    long unread = fsize;
     
     isobmf_box box = isobmf_read_box(f, fsize);
     if (!memcmp(box.type, "jP  ", 4) && box.length == 4) {
         char bit[4];
         fread(bit, 1, 4, f);
         if (!memcmp(bit, "\r\n\x87\n", 4)) format = 1;
-        else goto malformed;
-    } else if (!memcmp(box.type, "ftyp", 4) && box.length >= 12) {
+        else goto not_format;
+    } else if (!memcmp(box.type, "ftyp", 4) && box.length >= 12 && box.fpos + box.length <= fsize) {
         fseek(f, box.fpos + 8, SEEK_SET);
         char bit[4];
         for(int i=0; i<(box.length-8)>>2; i+=1) {
@@ -418,11 +1614,12 @@ xmp_rdata xmp_from_isobmf(const char *filename) {
                 format = 3;
             }
         }
-    } else goto malformed; // add other cases if other isobmf supported
+    } else goto not_format; // add other cases if other isobmf supported
 
     fseek(f, box.length + box.fpos, SEEK_SET);
     
     for(;;) {
+        if (!within_budget(f)) goto malformed;
         box = isobmf_read_box(f, fsize);
         if (box.length < 0) goto end;
         if (box.length + box.fpos > fsize) goto malformed;
@@ -437,14 +1634,19 @@ xmp_rdata xmp_from_isobmf(const char *filename) {
                 }
                 fseek(f, inner.fpos+inner.length, SEEK_SET);
             }
+            if (probing) goto end;
             fseek(f, box.fpos+box.length, SEEK_SET);
         } else if ((format == 2 || format == 3) && !memcmp(box.type, "meta", 4)) {
-            fseek(f, 4, SEEK_CUR); // skip 4 bytes, not sure why
+            isobmf_box iinf = {-1}, iloc = {-1}, idat = {-1};
+            fseek(f, 4, SEEK_CUR); // FullBox version and flags
             while(ftell(f) < box.fpos+box.length) {
                 isobmf_box inner = isobmf_read_box(f, box.length + box.fpos);
                 if (inner.length < 0) goto malformed;
                 if (inner.length + inner.fpos > box.length + box.fpos) goto malformed;
+                if (!memcmp(inner.type, "iinf", 4)) iinf = inner;
+                else if (!memcmp(inner.type, "iloc", 4)) iloc = inner;
                 if (!memcmp(inner.type, "idat", 4)) {
+                    idat = inner;
                     fseek(f, inner.fpos+4, SEEK_SET);
                     ans.width = ru16(f, endian);
                     ans.height = ru16(f, endian);
@@ -452,9 +1654,11 @@ xmp_rdata xmp_from_isobmf(const char *filename) {
                 else if (!memcmp(inner.type, "iprp", 4)) {
                     while(ftell(f) < inner.fpos+inner.length) {
                         isobmf_box in2 = isobmf_read_box(f, inner.length + inner.fpos);
+                        if (in2.length < 0 || in2.length + in2.fpos > inner.length + inner.fpos) goto malformed;
                         if (!memcmp(in2.type, "ipco", 4)) {
                             while(ftell(f) < in2.fpos+in2.length) {
                                 isobmf_box in3 = isobmf_read_box(f, in2.length + in2.fpos);
+                                if (in3.length < 0 || in3.length + in3.fpos > in2.length + in2.fpos) goto malformed;
                                 if (!memcmp(in3.type, "ispe", 4)) {
                                     fseek(f, in3.fpos+4, SEEK_SET);
                                     ans.width = ru32(f, endian);
@@ -469,32 +1673,34 @@ xmp_rdata xmp_from_isobmf(const char *filename) {
                 }
                 fseek(f, inner.fpos+inner.length, SEEK_SET);
             }
+            if (probing) goto end;
+            isobmf_items items;
+            if (!isobmf_xmp_items(f, iinf, iloc, idat, &items)) goto malformed;
+            for(size_t i=0; i<items.count; i+=1) {
+                isobmf_add_item(&ans, f, &items.items[i], fsize, &unread);
+            }
+            isobmf_free_items(&items);
+            if (last_error) goto malformed;
             fseek(f, box.fpos+box.length, SEEK_SET);
-        } else if (!memcmp(box.type, "uuid", 4)) {
+        } else if (!memcmp(box.type, "uuid", 4) && !probing) {
             unsigned char uuid[16];
             fread(uuid, 1, 16, f);
             unsigned char ref[16] = {0xBE, 0x7A, 0xCF, 0xCB, 0x97, 0xA9, 0x42, 0xE8, 0x9C, 0x71, 0x99, 0x94, 0x91, 0xE3, 0xAF, 0xAC};
             if (!memcmp(uuid, ref, 16)) {
-                char *xmp = read_block(f, ftell(f), box.length-16);
-                if (xmp) add_packet(&ans, xmp);
+                add_block(&ans, f, ftell(f), box.length-16);
             }
         }
         fseek(f, box.length + box.fpos, SEEK_SET);
     }
     goto end;
 
+not_format:
+    fail(XMP_ERR_FORMAT);
 malformed:
-    if (ans.packets) {
-        char **p = ans.packets;
-        while (*p) { free(*p); *p=NULL; p+=1; }
-        free(ans.packets);
-        ans.packets = NULL;
-    }
-    ans.width = ans.height = 0;
+    discard(&ans);
 
 end:
-    fclose(f);
-    return ans;
+    return end_read(f, ans);
 }
 
 static void isobmf_write_xmp(FILE *t, const char *xmp) {
@@ -509,20 +1715,18 @@ static void isobmf_write_xmp(FILE *t, const char *xmp) {
 int xmp_to_isobmf(const char *ref, const char *dest, const char *xmp) {
     static const unsigned char refuuid[16] = {0xBE, 0x7A, 0xCF, 0xCB, 0x97, 0xA9, 0x42, 0xE8, 0x9C, 0x71, 0x99, 0x94, 0x91, 0xE3, 0xAF, 0xAC};
 
-    int fd = open(dest, O_WRONLY | O_EXCL | O_CREAT, 0644);
-    if (fd < 0) return 0;
-    FILE *f = fopen(ref, "rb");
-    FILE *t = fdopen(fd, "wb");
+    FILE *f, *t;
+    if (!begin_write(ref, dest, &f, &t)) return 0;
     int endian = 0;
     int wrote_xmp = (xmp == NULL);
 
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    long fsize = file_size(f);
     
     while (!feof(f)) {
+        if (!within_budget(f)) goto malformed;
         unsigned length1 = ru32(f, endian);
         if (length1 == -1) break;
+        if (length1 > 1 && length1 < 8) goto malformed;
         if (length1 == 0 && !wrote_xmp) {
             // length 0 mean "to end of file". I can convert to a numeric length, but every jp2 file I've checked used 0 for the jp2c box, so I've decided not to change that. If this is the last box, write XMP before it (and if it was XMP it will be skipped below)
             isobmf_write_xmp(t, xmp);
@@ -562,39 +1766,171 @@ int xmp_to_isobmf(const char *ref, const char *dest, const char *xmp) {
     goto end;
 
 malformed:
-    fclose(f);
-    fclose(t);
-    unlink(dest);
-    return 0;
+    return end_write(f, t, dest, 0);
 
 end:
-    fclose(f);
-    fclose(t);
+    return end_write(f, t, dest, 1);
+}
+static void isobmf_write_sized(long val, FILE *t, int size) {
+    if (size == 4) wu32(val, t, 0);
+    else if (size == 8) wu64(val, t, 0);
+}
+
+int xmp_update_isobmf(const char *filename, const char *xmp) {
+    static const unsigned char refuuid[16] = {0xBE, 0x7A, 0xCF, 0xCB, 0x97, 0xA9, 0x42, 0xE8, 0x9C, 0x71, 0x99, 0x94, 0x91, 0xE3, 0xAF, 0xAC};
+
+    FILE *f = begin_read(filename, "r+b");
+    if (!f) return 0;
+    isobmf_items items = {0, 0, 0, NULL};
+    long uuid_fpos = -1, uuid_length = 0;
+    long last_header = -1;
+
+    long fsize = file_size(f);
+
+    for(;;) {
+        if (!within_budget(f)) goto malformed;
+        long header = ftell(f);
+        isobmf_box box = isobmf_read_box(f, fsize);
+        if (box.length < 0) break;
+        if (box.length + box.fpos > fsize) goto malformed;
+        last_header = header;
+        if (!memcmp(box.type, "meta", 4) && !items.count) {
+            isobmf_box iinf = {-1}, iloc = {-1}, idat = {-1};
+            fseek(f, 4, SEEK_CUR);
+            while(ftell(f) < box.fpos+box.length) {
+                isobmf_box inner = isobmf_read_box(f, box.length + box.fpos);
+                if (inner.length < 0) goto malformed;
+                if (inner.length + inner.fpos > box.length + box.fpos) goto malformed;
+                if (!memcmp(inner.type, "iinf", 4)) iinf = inner;
+                else if (!memcmp(inner.type, "iloc", 4)) iloc = inner;
+                else if (!memcmp(inner.type, "idat", 4)) idat = inner;
+                fseek(f, inner.fpos+inner.length, SEEK_SET);
+            }
+            if (!isobmf_xmp_items(f, iinf, iloc, idat, &items)) goto malformed;
+        } else if (!memcmp(box.type, "uuid", 4) && box.length >= 16 && uuid_fpos < 0) {
+            unsigned char uuid[16];
+            fread(uuid, 1, 16, f);
+            if (!memcmp(uuid, refuuid, 16)) {
+                uuid_fpos = box.fpos + 16;
+                uuid_length = box.length - 16;
+            }
+        }
+        fseek(f, box.fpos+box.length, SEEK_SET);
+    }
+
+    long needed = placed_size_of_block(xmp, 1, 1);
+    if (items.count) {
+        isobmf_item *item = &items.items[0];
+        if (items.count != 1 || item->num_extents != 1 || item->method != 0) goto no_room;
+        isobmf_extent *ext = &item->extents[0];
+        if (ext->offset < 0 || ext->length < 0 || ext->offset + ext->length > fsize) goto malformed;
+        if (ext->length >= needed) {
+            // fits where the old packet was: overwrite, padding to the same length
+            fseek(f, ext->offset, SEEK_SET);
+            place_block(f, xmp, 1, ext->length - needed + 1);
+        } else {
+            // does not fit: append a new mdat holding the packet and
+            // repoint the existing iloc extent at it, which has fixed-width fields
+            long length = placed_size_of_block(xmp, 1, xmp_writable_padding);
+            long offset = fsize + 8 - item->base;
+            if (!items.offset_size || !items.length_size || last_header < 0) goto no_room;
+            if (items.offset_size == 4 && offset > 0xFFFFFFFFl) goto no_room;
+            if (items.length_size == 4 && length > 0xFFFFFFFFl) goto no_room;
+            if (8 + length > 0xFFFFFFFFl) goto no_room;
+
+            // a last box with length 0 would swallow the appended box
+            fseek(f, last_header, SEEK_SET);
+            if (ru32(f, 0) == 0) {
+                if (fsize - last_header > 0xFFFFFFFFl) goto no_room;
+                fseek(f, last_header, SEEK_SET);
+                wu32(fsize - last_header, f, 0);
+            }
+
+            fseek(f, fsize, SEEK_SET);
+            wu32(8 + length, f, 0);
+            fwrite("mdat", 1, 4, f);
+            place_block(f, xmp, 1, xmp_writable_padding);
+            // only point iloc at the new mdat once it is known to be written
+            if (fflush(f) || ferror(f)) {
+                if (ftruncate(fileno(f), fsize)) {} // drop the partial mdat, if it can be
+                fail(XMP_ERR_WRITE);
+                goto malformed;
+            }
+
+            fseek(f, ext->fpos, SEEK_SET);
+            isobmf_write_sized(offset, f, items.offset_size);
+            isobmf_write_sized(length, f, items.length_size);
+        }
+    } else if (uuid_fpos >= 0 && uuid_length >= needed) {
+        fseek(f, uuid_fpos, SEEK_SET);
+        place_block(f, xmp, 1, uuid_length - needed + 1);
+    } else goto no_room;
+
+    isobmf_free_items(&items);
+    if (fclose(f)) return fail(XMP_ERR_WRITE);
     return 1;
+
+no_room:
+    fail(XMP_ERR_NO_ROOM);
+malformed:
+    fail(XMP_ERR_MALFORMED);
+    isobmf_free_items(&items);
+    fclose(f);
+    return 0;
 }
 /////////////////////////////// ISOBMF //////////////////////////////
 
 //////////////////////////////// JPEG ///////////////////////////////
 xmp_rdata xmp_from_jpeg(const char *filename) {
-    FILE *f = fopen(filename, "rb");
-    xmp_rdata ans = {0, 0, 0, NULL};
+    xmp_rdata ans = {0, 0, 0, NULL, 0, 0, NULL};
+    FILE *f = begin_read(filename, "rb");
+    if (!f) return end_read(f, ans);
     int endian = 0;
     char *extended = NULL;
+    long extended_len = 0;
+    long extended_span = -1; // the large packet it is, if over xmp_max_packet_bytes
+    unsigned long steps = 0;
+
+    if (ru8(f, endian) != 0xFF) goto not_format;
+    if (ru8(f, endian) != 0xD8) goto not_format;
+
+    if (probing) {
+        // segment by segment to the first frame header, which is the image's:
+        // thumbnails are inside the segments skipped over
+        for(;;) {
+            if (!within_budget(f)) goto malformed;
+            long m0 = ru8(f, endian), m1 = ru8(f, endian);
+            while (m1 == 0xFF) m1 = ru8(f, endian); // fill bytes
+            if (m0 != 0xFF || m1 < 0) goto malformed;
+            if (0xC0 <= m1 && m1 <= 0xCF && m1 != 0xC4 && m1 != 0xCC) {
+                fseek(f, 3, SEEK_CUR);
+                ans.height = ru16(f, endian); // 0 if given by a DNL after the first scan
+                ans.width = ru16(f, endian);
+                goto end;
+            }
+            if (m1 == 0xD9 || m1 == 0xDA) goto end; // no frame before the image data
+            if (m1 == 0x01 || (0xD0 <= m1 && m1 <= 0xD7)) continue; // no length
+            long len = ru16(f, endian);
+            if (len < 2) goto malformed;
+            fseek(f, len - 2, SEEK_CUR);
+        }
+    }
 
-    if (ru8(f, endian) != 0xFF) goto malformed;
-    if (ru8(f, endian) != 0xD8) goto malformed;
-    
+    long fsize = file_size(f);
 
     long m0 = ru8(f, endian);
     while(!feof(f) && m0 >= 0) {
+        if (!(++steps & 0xFFFF) && !within_budget(f)) goto malformed;
         long m1 = ru8(f, endian);
         if (m0 == 0xFF && m1 == 0xE1) {
             long len = ru16(f, endian);
+            long seg = ftell(f) - 2; // segments are measured from their length field
+            if (len < 2) goto malformed;
             char buf[35];
             size_t got = fread(buf, 1, 35, f);
             if (got > 28 && !strncmp(buf, "http://ns.adobe.com/xap/1.0/", 29)) {
-                char *packet = read_block(f, ftell(f) + 29-got, len-31);
-                if (packet) add_packet(&ans, packet);
+                add_block(&ans, f, ftell(f) + 29-got, len-31);
+                fseek(f, seg + len, SEEK_SET);
             } else if (got > 34 && !strncmp(buf, "http://ns.adobe.com/xmp/extension/", 35)) {
                 // XMP spec says JPEG has two packets, standard and extended; that the extended's GUID is marked; and that the extended follows the standard. But it fails to state that it has *only* two packets, or that all parts of the extended packet must be provided, or that the extended can't be moved earlier.
                 // To avoid needing a GUID:packet mapping, I assume:
@@ -603,59 +1939,76 @@ xmp_rdata xmp_from_jpeg(const char *filename) {
                 // 3. all that GUID's parts are present
                 // As I have yet to find an extended XMP in the wild, I haven't been able to test these assumptions
                 if (!ans.packets) {
-                    fprintf(stderr, "WARNING: extended XMP found with no standard XMP; extended ignored\n");
-                    fseek(f, len - 2 - got, SEEK_CUR);
+                    debug("extended XMP found with no standard XMP; extended ignored\n");
+                    fseek(f, seg + len, SEEK_SET);
                 } else {
                     char guid[33];
-                    fread(guid, 1, 32, f);
+                    if (fread(guid, 1, 32, f) != 32) goto malformed; // the part is cut short
                     guid[32] = '\0';
-                    if (strstr(ans.packets[0], guid)) {
+                    if (strlen(guid) == 32 && strstr(ans.packets[0], guid)) { // all of it, not to a NUL
                         long ext_len = ru32(f, endian);
-                        if (!extended) extended = calloc(ext_len, 1);
                         long ext_off = ru32(f, endian);
-                        fread(extended + ext_off, 1, len-77, f);
+                        // every part must agree on the total, and none may write past it
+                        if (len < 77 || ext_len < 0 || ext_len > fsize) goto malformed;
+                        if ((extended || extended_span >= 0) && ext_len != extended_len) goto malformed;
+                        if (ext_off < 0 || ext_off + (len-77) > ext_len) goto malformed;
+                        if (seg + len > fsize) goto malformed; // the part is cut short
+                        if (xmp_max_packet_bytes > 0 && !locating && ext_len > xmp_max_packet_bytes) {
+                            if (extended_span < 0) extended_span = large_packets(&ans);
+                            extended_len = ext_len;
+                            add_span(&ans, extended_span, ext_off, ftell(f), len-77);
+                            fseek(f, seg + len, SEEK_SET);
+                        } else {
+                            if (!extended) {
+                                extended = calloc(ext_len+1, 1);
+                                if (!extended) { fail(XMP_ERR_MEMORY); goto malformed; }
+                                extended_len = ext_len;
+                            }
+                            if (locating) add_span(&ans, (size_t)-1, ext_off, ftell(f), len-77); // numbered once added
+                            if (fread(extended + ext_off, 1, len-77, f) != (size_t)(len-77)) goto malformed;
+                        }
                     } else {
-                        fprintf(stderr, "WARNING: extended XMP found with GUID not matching XMP; ignored\n");
-                        fseek(f, len - 2 - got, SEEK_CUR);
+                        debug("extended XMP found with GUID not matching XMP; ignored\n");
+                        fseek(f, seg + len, SEEK_SET);
                     }
                 }
             } else {
-                fseek(f, len - 2 - got, SEEK_CUR);
+                fseek(f, seg + len, SEEK_SET);
             }
         } else if (m0 == 0xFF && 0xC0 <= m1 && m1 <= 0xCF
             && m1 != 0xC4
             && m1 != 0xCC
         ) {
             fseek(f, 3, SEEK_CUR);
-            // can contain thumbnails, so look for max
-            unsigned tmp = ru16(f, endian);
+            // can contain thumbnails, so look for max, which -1 at EOF never is
+            long tmp = ru16(f, endian);
             if (tmp > ans.height) ans.height = tmp;
             tmp = ru16(f, endian);
             if (tmp > ans.width) ans.width = tmp;
         } else if (m0 == 0xFF && m1 == 0xDC) {
             fseek(f, 2, SEEK_CUR);
-            unsigned tmp = ru16(f, endian);
+            long tmp = ru16(f, endian);
             if (tmp > ans.height) ans.height = tmp;
         }
         m0 = m1;
     }
-    if (extended) add_packet(&ans, extended);
+    if (extended) {
+        size_t found = ans.num_packets;
+        add_packet(&ans, extended);
+        for(size_t i=0; i<ans.num_spans; i+=1)
+            if (ans.spans[i].packet == (size_t)-1) ans.spans[i].packet = found;
+    }
     goto end;
     
 
+not_format:
+    fail(XMP_ERR_FORMAT);
 malformed:
-    if (ans.packets) {
-        char **p = ans.packets;
-        while (*p) { free(*p); *p=NULL; p+=1; }
-        free(ans.packets);
-        ans.packets = NULL;
-    }
+    discard(&ans);
     if (extended) free(extended);
-    ans.width = ans.height = 0;
 
 end:
-    fclose(f);
-    return ans;
+    return end_read(f, ans);
 }
 
 static void jpeg_write_xmp(FILE *t, const char *xmp, const char *ext) {
@@ -665,6 +2018,16 @@ static void jpeg_write_xmp(FILE *t, const char *xmp, const char *ext) {
     fwrite("http://ns.adobe.com/xap/1.0/", 1, 29, t);
     place_block(t, xmp, 1, xmp_writable_padding);
     if (ext) {
+        // each part is tagged with the GUID the standard packet gives as
+        // xmpNote:HasExtendedXMP, which is what readers match parts against
+        char guid[32];
+        memset(guid, '0', 32);
+        const char *at = strstr(xmp, "HasExtendedXMP");
+        if (at) {
+            at += 14;
+            while (*at && strchr("=\"'> \t\r\n", *at)) at += 1;
+            if (strlen(at) >= 32) memcpy(guid, at, 32);
+        }
         size_t total = strlen(ext);
         size_t parts = total/65400 + 1;
         for(int i=0; i<parts; i+=1) {
@@ -672,53 +2035,60 @@ static void jpeg_write_xmp(FILE *t, const char *xmp, const char *ext) {
             size_t end = total*(i+1)/parts;
             wu8(0xFF, t, 0);
             wu8(0xE1, t, 0);
-            wu16((end-start)+37, t, 0);
+            wu16((end-start)+77, t, 0);
             fwrite("http://ns.adobe.com/xmp/extension/", 1, 35, t);
-            fwrite(ext-start, 1, (end-start), t);
+            fwrite(guid, 1, 32, t);
+            wu32(total, t, 0);
+            wu32(start, t, 0);
+            fwrite(ext+start, 1, (end-start), t);
         }
     }
 }
 int xmp_to_jpeg_ext(const char *ref, const char *dest, const char *xmp, const char *ext) {
 
-    int fd = open(dest, O_WRONLY | O_EXCL | O_CREAT, 0644);
-    if (fd < 0) return 0;
-    FILE *f = fopen(ref, "rb");
-    FILE *t = fdopen(fd, "wb");
+    FILE *f, *t;
+    if (!begin_write(ref, dest, &f, &t)) return 0;
     int endian = 0;
     int wrote_xmp = (xmp == NULL);
+    unsigned long steps = 0;
 
-    if (ru8(f,endian) == 0xFF) wu8(0xFF, t, endian); else goto malformed;
-    if (ru8(f,endian) == 0xD8) wu8(0xD8, t, endian); else goto malformed;
+    if (ru8(f,endian) == 0xFF) wu8(0xFF, t, endian); else goto not_format;
+    if (ru8(f,endian) == 0xD8) wu8(0xD8, t, endian); else goto not_format;
     
     long m0 = ru8(f, endian);
     while (!feof(f) && m0 >= 0) {
+        if (!(++steps & 0xFFFF) && !within_budget(f)) goto malformed;
         long m1 = ru8(f, endian);
         if (m0 == 0xFF && m1 == 0xE1) {
             long len = ru16(f, endian);
+            long seg = ftell(f) - 2; // segments are measured from their length field
+            if (len < 2) goto malformed;
             char buf[35];
             size_t got = fread(buf, 1, 35, f);
             if (got > 28 && !strncmp(buf, "http://ns.adobe.com/xap/1.0/", 29)) {
-                fseek(f, len - 2 - got, SEEK_CUR);
+                fseek(f, seg + len, SEEK_SET);
                 if (!wrote_xmp) jpeg_write_xmp(t, xmp, ext);
                 wrote_xmp = 1;
             } else if (got > 34 && !strncmp(buf, "http://ns.adobe.com/xmp/extension/", 35)) {
-                fseek(f, len - 2 - got, SEEK_CUR);
+                fseek(f, seg + len, SEEK_SET);
             } else {
-                fseek(f, -4 - got, SEEK_CUR);
-                copy_bytes(f, t, len+2);
+                fseek(f, seg - 2, SEEK_SET);
+                if (!copy_bytes(f, t, len+2)) goto malformed;
             }
             m1 = ru8(f, endian);
         }
         else if (m0 == 0xFF && m1 == 0xED && !wrote_xmp) {
             long len = ru16(f, endian);
+            long seg = ftell(f) - 2; // segments are measured from their length field
+            if (len < 2) goto malformed;
             char buf[14];
             size_t got = fread(buf, 1, 14, f);
             if (got > 13 && !strncmp(buf, "Photoshop 3.0", 14)) {
                 jpeg_write_xmp(t, xmp, ext);
                 wrote_xmp = 1;
             }
-            fseek(f, -4 - got, SEEK_CUR);
-            copy_bytes(f, t, len+2);
+            fseek(f, seg - 2, SEEK_SET);
+            if (!copy_bytes(f, t, len+2)) goto malformed;
             m1 = ru8(f, endian);
         }
         else if (m0 == 0xFF && 0xC0 <= m1 && m1 <= 0xCF
@@ -736,17 +2106,14 @@ int xmp_to_jpeg_ext(const char *ref, const char *dest, const char *xmp, const ch
         m0 = m1;
     }
     goto end;
-    
+
+not_format:
+    fail(XMP_ERR_FORMAT);
 malformed:
-    fclose(f);
-    fclose(t);
-    unlink(dest);
-    return 0;
+    return end_write(f, t, dest, 0);
 
 end:
-    fclose(f);
-    fclose(t);
-    return 1;
+    return end_write(f, t, dest, 1);
 }
 int xmp_to_jpeg(const char *ref, const char *dest, const char *xmp) {
     return xmp_to_jpeg_ext(ref, dest, xmp, NULL);
@@ -811,7 +2178,7 @@ static unsigned feed_crc_str(unsigned c, const char *s) {
     return c;
 }
 static unsigned init_crc() { return 0xffffffffu; }
-static unsigned feed_crc_u32(unsigned c, unsigned short x) {
+static unsigned feed_crc_u32(unsigned c, unsigned x) {
     c = crc_table[(c^((x>>24)&0xFF)) & 0xff] ^ (c>>8);
     c = crc_table[(c^((x>>16)&0xFF)) & 0xff] ^ (c>>8);
     c = crc_table[(c^((x>>8)&0xFF)) & 0xff] ^ (c>>8);
@@ -821,34 +2188,36 @@ static unsigned feed_crc_u32(unsigned c, unsigned short x) {
 static unsigned finish_crc(unsigned c) { return c ^ 0xffffffffu; }
 
 xmp_rdata xmp_from_png(const char *filename) {
-    FILE *f = fopen(filename, "rb");
-    xmp_rdata ans = {0, 0, 0, NULL};
+    xmp_rdata ans = {0, 0, 0, NULL, 0, 0, NULL};
+    FILE *f = begin_read(filename, "rb");
+    if (!f) return end_read(f, ans);
     int endian = 0;
     unsigned crc;
     unsigned char buf[22];
 
     fread(buf, 1, 8, f);
-    if (memcmp(buf, "\x89PNG\r\n\x1a\n", 8)) goto malformed;
+    if (memcmp(buf, "\x89PNG\r\n\x1a\n", 8)) goto not_format;
     
-    if (ru32(f, endian) != 13) goto malformed;
+    if (ru32(f, endian) != 13) goto not_format;
     crc = init_crc();
     fread(buf, 1, 4, f); crc=feed_crc_buf(crc, buf, 4);
-    if (memcmp(buf, "IHDR", 4)) goto malformed;
+    if (memcmp(buf, "IHDR", 4)) goto not_format;
     ans.width = ru32(f, endian); crc=feed_crc_u32(crc, ans.width);
     ans.height = ru32(f, endian); crc=feed_crc_u32(crc, ans.height);
     fread(buf, 1, 5, f); crc=feed_crc_buf(crc, buf, 5);
     if (ru32(f, endian) != finish_crc(crc)) goto malformed;
+    if (probing) goto end;
     
     while(!feof(f)) {
-        unsigned length = ru32(f, endian);
-        if (feof(f) || length < 0) break;
+        if (!within_budget(f)) goto malformed;
+        long length = ru32(f, endian);
+        if (length < 0) break;
         if (length > 0x7fffffff) goto malformed;
         fread(buf, 1, 4, f);
         if (!memcmp(buf, "iTXt", 4) && length > 22) {
             fread(buf, 1, 22, f);
             if (!memcmp(buf, "XML:com.adobe.xmp\0\0\0\0\0", 22)) {
-                char *xmp = read_block(f, ftell(f), length-22);
-                if (xmp) add_packet(&ans, xmp);
+                add_block(&ans, f, ftell(f), length-22);
             } else {
                 fseek(f, length-22, SEEK_CUR);
             }
@@ -861,29 +2230,24 @@ xmp_rdata xmp_from_png(const char *filename) {
     goto end;
     
 
+not_format:
+    fail(XMP_ERR_FORMAT);
 malformed:
-    if (ans.packets) {
-        char **p = ans.packets;
-        while (*p) { free(*p); *p=NULL; p+=1; }
-        free(ans.packets);
-        ans.packets = NULL;
-    }
-    ans.width = ans.height = 0;
+    discard(&ans);
 
 end:
-    fclose(f);
-    return ans;
+    return end_read(f, ans);
 }
 
 int xmp_to_png(const char *ref, const char *dest, const char *xmp) {
-    int fd = open(dest, O_WRONLY | O_EXCL | O_CREAT, 0644);
-    if (fd < 0) return 0;
-    FILE *f = fopen(ref, "rb");
-    FILE *t = fdopen(fd, "wb");
+    FILE *f, *t;
+    if (!begin_write(ref, dest, &f, &t)) return 0;
     int endian = 0;
 
     char buf[22];
 
+    if (fread(buf, 1, 8, f) != 8 || memcmp(buf, "\x89PNG\r\n\x1a\n", 8)) goto not_format;
+    fseek(f, 0, SEEK_SET);
     if (!copy_bytes(f, t, 33)) goto malformed;
 
     if (xmp) {
@@ -903,8 +2267,9 @@ int xmp_to_png(const char *ref, const char *dest, const char *xmp) {
     }
     
     while(!feof(f)) {
-        unsigned length = ru32(f, endian);
-        if (feof(f) || length < 0) break;
+        if (!within_budget(f)) goto malformed;
+        long length = ru32(f, endian);
+        if (length < 0) break;
         if (length > 0x7fffffff) goto malformed;
         fread(buf, 1, 4, f);
         if (!memcmp(buf, "iTXt", 4) && length > 22) {
@@ -921,36 +2286,33 @@ int xmp_to_png(const char *ref, const char *dest, const char *xmp) {
         }
     }
     goto end;
-    
+
+not_format:
+    fail(XMP_ERR_FORMAT);
 malformed:
-    fclose(f);
-    fclose(t);
-    unlink(dest);
-    return 0;
+    return end_write(f, t, dest, 0);
 
 end:
-    fclose(f);
-    fclose(t);
-    return 1;
+    return end_write(f, t, dest, 1);
 }
 //////////////////////////////// PNG ////////////////////////////////
 
 //////////////////////////////// WEBP ///////////////////////////////
 xmp_rdata xmp_from_webp(const char *filename) {
-    FILE *f = fopen(filename, "rb");
-    xmp_rdata ans = {0, 0, 0, NULL};
+    xmp_rdata ans = {0, 0, 0, NULL, 0, 0, NULL};
+    FILE *f = begin_read(filename, "rb");
+    if (!f) return end_read(f, ans);
     int endian = 1;
     char variant[4], fourcc[4];
 
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    long fsize = file_size(f);
     
     fread(variant, 1, 4, f);
-    if (memcmp(variant, "RIFF", 4)) goto malformed;
-    if (ru32(f, endian) != fsize-8) goto malformed;
+    if (memcmp(variant, "RIFF", 4)) goto not_format;
+    long riff_length = ru32(f, endian);
     fread(variant, 1, 4, f);
-    if (memcmp(variant, "WEBP", 4)) goto malformed;
+    if (memcmp(variant, "WEBP", 4)) goto not_format; // other RIFF files are not malformed WebP
+    if (riff_length < 0 || riff_length != fsize-8) goto malformed;
     fread(variant, 1, 4, f);
     unsigned length = ru32(f, endian);
     
@@ -969,16 +2331,17 @@ xmp_rdata xmp_from_webp(const char *filename) {
         fseek(f, 4, SEEK_CUR);
         ans.width = 1 + ru24(f, endian);
         ans.height = 1 + ru24(f, endian);
+        if (probing) goto end;
         fseek(f, length - 10, SEEK_CUR);
         if (length & 1) fseek(f, 1, SEEK_CUR);
-    } else goto malformed;
+    } else goto not_format;
     
     while(!feof(f)) {
+        if (!within_budget(f)) goto malformed;
         if (fread(fourcc, 1, 4, f) != 4) break;
         unsigned length = ru32(f, endian);
         if (!memcmp(fourcc, "XMP ", 4)) {
-            char *xmp = read_block(f, ftell(f), length);
-            if (xmp) add_packet(&ans, xmp);
+            add_block(&ans, f, ftell(f), length);
         } else {
             fseek(f, length, SEEK_CUR);
         }
@@ -986,29 +2349,26 @@ xmp_rdata xmp_from_webp(const char *filename) {
     }
     goto end;
 
+not_format:
+    fail(XMP_ERR_FORMAT);
 malformed:
-    if (ans.packets) {
-        char **p = ans.packets;
-        while (*p) { free(*p); *p=NULL; p+=1; }
-        free(ans.packets);
-        ans.packets = NULL;
-    }
-    ans.width = ans.height = 0;
+    discard(&ans);
 
 end:
-    fclose(f);
-    return ans;
+    return end_read(f, ans);
 }
 
 int xmp_to_webp(const char *ref, const char *dest, const char *xmp) {
-    int fd = open(dest, O_WRONLY | O_EXCL | O_CREAT, 0644);
-    if (fd < 0) return 0;
-    FILE *f = fopen(ref, "rb");
-    FILE *t = fdopen(fd, "wb");
+    FILE *f, *t;
+    if (!begin_write(ref, dest, &f, &t)) return 0;
     int endian = 1;
 
     char fourcc[4], variant[4];
 
+    if (fread(variant, 1, 4, f) != 4 || memcmp(variant, "RIFF", 4)) goto not_format;
+    fseek(f, 8, SEEK_SET);
+    if (fread(variant, 1, 4, f) != 4 || memcmp(variant, "WEBP", 4)) goto not_format;
+    fseek(f, 0, SEEK_SET);
     if (!copy_bytes(f, t, 12)) goto malformed;
     fread(variant, 1, 4, f);
     unsigned length = ru32(f, endian);
@@ -1026,7 +2386,7 @@ int xmp_to_webp(const char *ref, const char *dest, const char *xmp) {
         wu24(height-1, t, endian);
         
         fseek(f, -18, SEEK_CUR);
-        copy_bytes(f,t,length+8 + (length&1));
+        if (!copy_bytes(f,t,length+8 + (length&1))) goto malformed;
     } else if (!memcmp(variant, "VP8L", 4)) {
         if (ru8(f,endian) != 0x2F) goto malformed;
         unsigned packed = ru32(f, endian);
@@ -1042,24 +2402,25 @@ int xmp_to_webp(const char *ref, const char *dest, const char *xmp) {
         wu24(height-1, t, endian);
         
         fseek(f, -13, SEEK_CUR);
-        copy_bytes(f,t,length+8 + (length&1));
+        if (!copy_bytes(f,t,length+8 + (length&1))) goto malformed;
     } else if (!memcmp(variant, "VP8X", 4)) {
         fwrite(variant, 1, 4, t);
         wu32(length, t, endian);
         wu8(4|ru8(f,endian), t, endian);
-        copy_bytes(f, t, length-1 + (length&1));
+        if (!copy_bytes(f, t, length-1 + (length&1))) goto malformed;
 
         while(!feof(f)) {
+            if (!within_budget(f)) goto malformed;
             if (fread(fourcc, 1, 4, f) != 4) break;
             unsigned length = ru32(f, endian);
             if (!memcmp(fourcc, "XMP ", 4)) {
                 fseek(f,length + (length&1),SEEK_CUR);
             } else {
                 fseek(f, -8, SEEK_CUR);
-                copy_bytes(f,t,length+8 + (length&1));
+                if (!copy_bytes(f,t,length+8 + (length&1))) goto malformed;
             }
         }
-    } else goto malformed;
+    } else goto not_format;
     
     fwrite("XMP ", 1, 4, t);
     length = placed_size_of_block(xmp, 1, xmp_writable_padding);
@@ -1072,192 +2433,543 @@ int xmp_to_webp(const char *ref, const char *dest, const char *xmp) {
     wu32(fsize-8, t, endian);
 
     goto end;
-    
+
+not_format:
+    fail(XMP_ERR_FORMAT);
 malformed:
-    fclose(f);
-    fclose(t);
-    unlink(dest);
-    return 0;
+    return end_write(f, t, dest, 0);
 
 end:
-    fclose(f);
-    fclose(t);
-    return 1;
+    return end_write(f, t, dest, 1);
 }
 //////////////////////////////// WEBP ///////////////////////////////
 
 
 
 //////////////////////////////// TIFF ///////////////////////////////
+static unsigned bu16(const unsigned char *p, int littleendian) {
+    if (littleendian) return p[0] | (p[1]<<8);
+    else return (p[0]<<8) | p[1];
+}
+static unsigned long bu32(const unsigned char *p, int littleendian) {
+    if (littleendian) return p[0] | (p[1]<<8) | ((unsigned long)p[2]<<16) | ((unsigned long)p[3]<<24);
+    else return ((unsigned long)p[0]<<24) | ((unsigned long)p[1]<<16) | (p[2]<<8) | p[3];
+}
+
+/**
+ * The IFDs of a TIFF found so far, in the order they are to be read. Besides
+ * the IFD0 → IFD1 → ... chain, IFDs point to SubIFDs (DNG's full-size images)
+ * and the EXIF IFD, so they form a graph a corrupt file can loop; `seen` is an
+ * open-addressed set of the same offsets (0, where the header is, marks an
+ * empty slot) so that each IFD is queued once.
+ */
+typedef struct {
+    long *order;
+    size_t count, next;
+    long *seen;
+    size_t capacity; // of seen, a power of 2 at least twice count
+} tiff_ifds;
+
+/// returns false if out of memory
+static int tiff_queue(tiff_ifds *q, long offset) {
+    if (2*(q->count+1) > q->capacity) {
+        size_t capacity = q->capacity ? 2*q->capacity : 64;
+        long *seen = calloc(capacity, sizeof(long));
+        long *order = realloc(q->order, capacity/2 * sizeof(long));
+        if (order) q->order = order;
+        if (!seen || !order) { free(seen); return fail(XMP_ERR_MEMORY); }
+        for(size_t i=0; i<q->count; i+=1) {
+            size_t j = (q->order[i] * 0x9E3779B97F4A7C15ull) >> 32 & (capacity-1);
+            while(seen[j]) j = (j+1) & (capacity-1);
+            seen[j] = q->order[i];
+        }
+        free(q->seen);
+        q->seen = seen;
+        q->capacity = capacity;
+    }
+    size_t j = (offset * 0x9E3779B97F4A7C15ull) >> 32 & (q->capacity-1);
+    while(q->seen[j]) {
+        if (q->seen[j] == offset) return 1;
+        j = (j+1) & (q->capacity-1);
+    }
+    q->seen[j] = offset;
+    q->order[q->count++] = offset;
+    return 1;
+}
+
 xmp_rdata xmp_from_tiff(const char *filename) {
-    FILE *f = fopen(filename, "rb");
-    xmp_rdata ans = {0, 0, 0, NULL};
+    xmp_rdata ans = {0, 0, 0, NULL, 0, 0, NULL};
+    FILE *f = begin_read(filename, "rb");
+    if (!f) return end_read(f, ans);
+    tiff_ifds ifds = {NULL, 0, 0, NULL, 0};
+    unsigned char *table = NULL, *offsets = NULL;
+    size_t table_size = 0;
     
-    static const char length_of_type[13] = {
+    static const char length_of_type[14] = {
         -1, // unused
         1, 1, 2, 4, 8, // unsigned byte/ascii/short/int/rational
         1, 1, 2, 4, 8, // signed byte/undef/short/int/rational
-        4, 8 // float
+        4, 8, // float
+        4 // IFD offset (TIFF Technical Note 1)
     };
     /*
-    static const char *name_of_type[13] = {
+    static const char *name_of_type[14] = {
         "error",
         "u8", "ascii", "u16", "u32", "ru32/u32",
         "i8", "binary", "i16", "i32", "ri32/i32",
-        "float", "double"
+        "float", "double",
+        "ifd"
     };
     */
     
     char endflag[2]; fread(endflag, 1, 2, f);
     int endian = 1;
     if (!memcmp(endflag, "MM", 2)) endian = 0;
-    else if (memcmp(endflag, "II", 2)) goto malformed;
-    if (ru16(f, endian) != 42) goto malformed;
-    
-    long offset = ru32(f, endian);
-    while(offset > 0) {
+    else if (memcmp(endflag, "II", 2)) goto not_format;
+    if (ru16(f, endian) != 42) goto not_format;
+
+    long first = ru32(f, endian);
+    long fsize = file_size(f);
+
+    // IFDs, arrays of IFD offsets, and packets do not overlap, so together
+    // fit in the file; this also bounds the work of a file of looping IFDs
+    long unread = fsize;
+    int reduced = 1; // whether the dimensions found are of a reduced-resolution image
+    if (first && !tiff_queue(&ifds, first)) goto end;
+    while(ifds.next < ifds.count) {
+        long offset = ifds.order[ifds.next++];
+        if (offset < 8 || offset > fsize - 2 || !within_budget(f)) goto malformed;
         fseek(f, offset, SEEK_SET);
-        int ifd_count = ru16(f, endian);
-        if (ifd_count < 0) goto malformed;
-        for(int i=0; i<ifd_count; i+=1) {
-            int tag = ru16(f, endian);
-            int type = ru16(f, endian);
-            if (type <= 0 || type > 12) goto malformed;
-            unsigned count = ru32(f, endian);
-            unsigned length = count * length_of_type[type];
-            unsigned value = ru32(f, endian);
-            if (tag == 256) {
-                if (type == 3 && !endian) ans.width = (value>>16)&0xFFFF;
-                else if (type == 3 && endian) ans.width = value&0xFFFF;
-                else if (type == 4) ans.width = value;
-                else {
-                    fprintf(stderr, "Unexpected image width type %d\n", type);
-                    goto malformed;
+        long ifd_count = ru16(f, endian);
+        if (2 + 12*ifd_count > unread) goto malformed;
+        unread -= 2 + 12*ifd_count;
+
+        // the whole entry table, and the next IFD's offset, in one read
+        size_t bytes = 12*ifd_count + 4;
+        unsigned char *grown;
+        if (bytes > table_size) {
+            grown = realloc(table, bytes);
+            if (!grown) { fail(XMP_ERR_MEMORY); goto end; }
+            table = grown;
+            table_size = bytes;
+        }
+        size_t got = fread(table, 1, bytes, f);
+        if (got < bytes - 4) goto malformed;
+        if (got < bytes) memset(table + bytes - 4, 0, 4); // a missing last offset ends the chain
+
+        long width = 0, height = 0, subfile = 0;
+        for(long i=0; i<ifd_count; i+=1) {
+            const unsigned char *e = table + 12*i;
+            int tag = bu16(e, endian);
+            int type = bu16(e+2, endian);
+            if (type <= 0 || type > 13) goto malformed;
+            unsigned long long count = bu32(e+4, endian);
+            unsigned long long length = count * length_of_type[type];
+            unsigned long value = bu32(e+8, endian);
+            if (tag == 254 && type == 4) subfile = value;
+            else if (tag == 256 || tag == 257) {
+                long *to = (tag == 256) ? &width : &height;
+                if (type == 3) *to = bu16(e+8, endian);
+                else if (type == 4) *to = value;
+                else goto malformed; // dimensions are SHORT or LONG
+            } else if ((tag == 330 || (tag == 34665 && !probing)) && (type == 4 || type == 13) && count > 0) {
+                // SubIFDs, or the EXIF IFD; more than one offset is stored elsewhere
+                if (tag == 34665) count = 1;
+                if (count == 1) {
+                    if (value && !tiff_queue(&ifds, value)) goto end;
+                    continue;
                 }
-            } else if (tag == 257) {
-                if (type == 3 && !endian) ans.height = (value>>16)&0xFFFF;
-                else if (type == 3 && endian) ans.height = value&0xFFFF;
-                else if (type == 4) ans.height = value;
-                else {
-                    fprintf(stderr, "Unexpected image height type %d\n", type);
-                    goto malformed;
+                if (length > (unsigned long long)unread || value + length > (unsigned long long)fsize) goto malformed;
+                unread -= length;
+                grown = realloc(offsets, length);
+                if (!grown) { fail(XMP_ERR_MEMORY); goto end; }
+                offsets = grown;
+                fseek(f, value, SEEK_SET);
+                if (fread(offsets, 1, length, f) != length) goto malformed;
+                for(unsigned long long j=0; j<count; j+=1) {
+                    long sub = bu32(offsets + 4*j, endian);
+                    if (sub && !tiff_queue(&ifds, sub)) goto end;
                 }
-            } else if (tag == 700 && (type == 1 || type == 7) && length > 4) {
-                long back = ftell(f);
-                char *xmp = read_block(f, value, length);
-                if (xmp) add_packet(&ans, xmp);
-                fseek(f, back, SEEK_SET);
+            } else if (tag == 700 && (type == 1 || type == 7) && length > 4 && !probing) {
+                if (length > (unsigned long long)unread || value + length > (unsigned long long)fsize) goto malformed;
+                unread -= length;
+                add_block(&ans, f, value, length);
+                if (last_error) goto end;
             }
         }
-        offset = ru32(f, endian);
+        // the first full-resolution image's, else the first image's
+        if (width && height && reduced && (!ans.width || !(subfile & 1))) {
+            ans.width = width;
+            ans.height = height;
+            reduced = subfile & 1;
+            if (probing && !reduced) goto end;
+        }
+
+        long next = bu32(table + 12*ifd_count, endian);
+        if (next && !tiff_queue(&ifds, next)) goto end;
     }
-    if (offset == 0) goto end;
+    goto end;
 
+not_format:
+    fail(XMP_ERR_FORMAT);
 malformed:
-    if (ans.packets) {
-        char **p = ans.packets;
-        while (*p) { free(*p); *p=NULL; p+=1; }
-        free(ans.packets);
-        ans.packets = NULL;
-    }
-    ans.width = ans.height = 0;
+    discard(&ans);
 
 end:
-    fclose(f);
-    return ans;
+    free(ifds.order);
+    free(ifds.seen);
+    free(table);
+    free(offsets);
+    return end_read(f, ans);
 }
 //////////////////////////////// TIFF ///////////////////////////////
 
 //////////////////////////////// SVG ////////////////////////////////
+// SVG is scanned as a stream of tags without building a tree; only enough
+// XML is understood to skip comments, CDATA, processing instructions,
+// DOCTYPE, and quoted attribute values (which may hold large base64 images).
+typedef struct {
+    int width, height;       // from the root element; -1 if not in pixels
+    long root_end;           // just after the root <svg ...> tag; -1 if not SVG
+    int empty;               // root was <svg ... />
+    long meta_close;         // the '<' of </metadata>; -1 if none
+    long xmp_start, xmp_end; // the first x:xmpmeta element; -1 if none
+} svg_layout;
+
+/// consumes input through the first occurrence of `end` (at most 3 characters)
+static int svg_skip_past(FILE *f, const char *end) {
+    size_t len = strlen(end);
+    char window[3] = {0, 0, 0};
+    int c;
+    while ((c = getc(f)) != EOF) {
+        window[0] = window[1]; window[1] = window[2]; window[2] = c;
+        if (!memcmp(window + 3 - len, end, len)) return 1;
+    }
+    return 0;
+}
+
+/// called after a '<'; returns 1 if an element tag whose name (with a
+/// leading '/' for end tags) was put in `name`, 0 if a non-element
+/// construct was skipped, and -1 on end of file
+static int svg_open_tag(FILE *f, char *name, size_t cap) {
+    int c = getc(f);
+    if (c == '!') {
+        c = getc(f);
+        if (c == '-') return svg_skip_past(f, "-->") ? 0 : -1;
+        if (c == '[') return svg_skip_past(f, "]]>") ? 0 : -1;
+        int depth = 0; // DOCTYPE may have a bracketed internal subset
+        while ((c = getc(f)) != EOF) {
+            if (c == '[') depth += 1;
+            else if (c == ']') depth -= 1;
+            else if (c == '>' && depth <= 0) return 0;
+        }
+        return -1;
+    }
+    if (c == '?') return svg_skip_past(f, "?>") ? 0 : -1;
+    size_t n = 0;
+    while (c != EOF && !isspace(c) && c != '>' && (c != '/' || n == 0)) {
+        if (n+1 < cap) name[n++] = c;
+        c = getc(f);
+    }
+    name[n] = '\0';
+    if (c == EOF) return -1;
+    ungetc(c, f);
+    return 1;
+}
+
+/// converts an SVG length to pixels (at 96 per inch); -1 if relative
+static int svg_length(const char *value) {
+    char *unit;
+    double x = strtod(value, &unit);
+    if (unit == value || x <= 0) return -1;
+    while (isspace((unsigned char)*unit)) unit += 1;
+    if (!*unit || !strcmp(unit, "px")) return (int)(x + 0.5);
+    if (!strcmp(unit, "in")) return (int)(x*96 + 0.5);
+    if (!strcmp(unit, "cm")) return (int)(x*96/2.54 + 0.5);
+    if (!strcmp(unit, "mm")) return (int)(x*96/25.4 + 0.5);
+    if (!strcmp(unit, "pt")) return (int)(x*96/72 + 0.5);
+    if (!strcmp(unit, "pc")) return (int)(x*16 + 0.5);
+    return -1;
+}
+
+/// consumes the rest of a tag; returns 1 if it was self-closing, 0 if not,
+/// -1 on end of file. Parses width and height attributes if asked.
+static int svg_finish_tag(FILE *f, int *width, int *height) {
+    char attr[16], value[32];
+    size_t an = 0;
+    int c, prev = 0;
+    while ((c = getc(f)) != EOF) {
+        if (c == '"' || c == '\'') {
+            int quote = c;
+            size_t vn = 0;
+            while ((c = getc(f)) != EOF && c != quote)
+                if (vn+1 < sizeof(value)) value[vn++] = c;
+            if (c == EOF) return -1;
+            value[vn] = '\0';
+            attr[an] = '\0';
+            if (width && !strcmp(attr, "width")) *width = svg_length(value);
+            if (height && !strcmp(attr, "height")) *height = svg_length(value);
+            an = 0;
+        } else if (c == '>') {
+            return prev == '/';
+        } else if (!isspace(c) && c != '=' && c != '/') {
+            if (an+1 < sizeof(attr)) attr[an++] = c;
+        }
+        if (!isspace(c)) prev = c;
+    }
+    return -1;
+}
+
+static const char *svg_local_name(const char *name) {
+    const char *colon = strrchr(name, ':');
+    return colon ? colon + 1 : name;
+}
+
+/**
+ * Scans an SVG up to the end of its first metadata element, noting where
+ * XMP is and could be placed. If `ans` is not NULL, every x:xmpmeta element
+ * in that metadata element is added to it. Returns 0 if not an SVG.
+ */
+static int svg_scan(FILE *f, svg_layout *at, xmp_rdata *ans) {
+    char name[64];
+    int c, in_meta = 0;
+    long in_xmp = -1;
+    unsigned long tags = 0;
+
+    at->width = at->height = -1;
+    at->root_end = at->meta_close = at->xmp_start = at->xmp_end = -1;
+    at->empty = 0;
+
+    for(;;) {
+        while ((c = getc(f)) != EOF && c != '<') {
+            if (at->root_end < 0 && !isspace(c) && c != 0xEF && c != 0xBB && c != 0xBF)
+                return 0; // only whitespace and a UTF-8 BOM may precede the root
+        }
+        if (c == EOF) return at->root_end >= 0;
+        long start = ftell(f) - 1;
+        int kind = svg_open_tag(f, name, sizeof(name));
+        if (kind < 0) return at->root_end >= 0;
+        if (kind == 0) continue;
+        if (!(++tags & 0xFF) && !within_budget(f)) return 0;
+
+        if (at->root_end < 0) {
+            if (strcmp(svg_local_name(name), "svg")) return 0;
+            int closed = svg_finish_tag(f, &at->width, &at->height);
+            if (closed < 0) return 0;
+            at->root_end = ftell(f);
+            if (closed) { at->empty = 1; return 1; }
+            if (ans && probing) return 1;
+            continue;
+        }
+
+        int closed = svg_finish_tag(f, NULL, NULL);
+        if (closed < 0) return 1;
+        const char *local = svg_local_name(name[0] == '/' ? name+1 : name);
+        if (name[0] == '/') {
+            if (in_xmp >= 0 && !strcmp(local, "xmpmeta")) {
+                long end = ftell(f);
+                if (at->xmp_start < 0) { at->xmp_start = in_xmp; at->xmp_end = end; }
+                if (ans) {
+                    add_block(ans, f, in_xmp, end - in_xmp);
+                }
+                in_xmp = -1;
+            } else if (in_meta && !strcmp(local, "metadata")) {
+                at->meta_close = start;
+                return 1;
+            }
+        } else if (!in_meta && !closed && !strcmp(local, "metadata")) {
+            in_meta = 1;
+        } else if (in_meta && in_xmp < 0 && !closed && !strcmp(local, "xmpmeta")) {
+            in_xmp = start;
+        }
+    }
+}
+
+xmp_rdata xmp_from_svg(const char *filename) {
+    xmp_rdata ans = {0, 0, 0, NULL, 0, 0, NULL};
+    FILE *f = begin_read(filename, "rb");
+    if (!f) return end_read(f, ans);
+    svg_layout at;
+
+    if (!svg_scan(f, &at, &ans)) goto not_format;
+    ans.width = at.width;
+    ans.height = at.height;
+    goto end;
+
+not_format:
+    fail(XMP_ERR_FORMAT);
+
+end:
+    return end_read(f, ans);
+}
+
+int xmp_to_svg(const char *ref, const char *dest, const char *xmp) {
+    FILE *f, *t;
+    if (!begin_write(ref, dest, &f, &t)) return 0;
+    svg_layout at;
+
+    if (!svg_scan(f, &at, NULL)) goto not_format;
+    if (at.empty) { fail(XMP_ERR_NO_ROOM); goto malformed; }
+
+    long fsize = file_size(f);
+    fseek(f, 0, SEEK_SET);
+
+    // SVG's XMP is an element of the document, so no xpacket wrapper or padding
+    if (at.xmp_start >= 0) {
+        if (!copy_bytes(f, t, at.xmp_start)) goto malformed;
+        if (xmp) place_block(t, xmp, 0, 0);
+        fseek(f, at.xmp_end, SEEK_SET);
+        if (!copy_bytes(f, t, fsize - at.xmp_end)) goto malformed;
+    } else if (!xmp) {
+        if (!copy_bytes(f, t, fsize)) goto malformed;
+    } else if (at.meta_close >= 0) {
+        if (!copy_bytes(f, t, at.meta_close)) goto malformed;
+        place_block(t, xmp, 0, 0);
+        if (!copy_bytes(f, t, fsize - at.meta_close)) goto malformed;
+    } else {
+        if (!copy_bytes(f, t, at.root_end)) goto malformed;
+        fputs("<metadata>", t);
+        place_block(t, xmp, 0, 0);
+        fputs("</metadata>", t);
+        if (!copy_bytes(f, t, fsize - at.root_end)) goto malformed;
+    }
+    goto end;
+
+not_format:
+    fail(XMP_ERR_FORMAT);
+malformed:
+    return end_write(f, t, dest, 0);
+
+end:
+    return end_write(f, t, dest, 1);
+}
 //////////////////////////////// SVG ////////////////////////////////
 
 /////////////////////////////// OTHER ///////////////////////////////
-xmp_rdata xmp_from_other(const char *filename) {
-    FILE *f = fopen(filename, "rb");
-    xmp_rdata ans = {0, 0, 0, NULL};
-    
-    const char *magic = "W5M0MpCehiHzreSzNTczkc9d'?>";
+/// consumes input through `magic`, in which `'` also matches `"`; if
+/// `read_only` is given, `w` also matches `r`, setting it. Returns false at
+/// the end of the file or budget.
+static int skip_past_magic(FILE *f, const char *magic, int *read_only) {
     int midx = 0;
-    while(magic[midx] && !feof(f)) {
+    long steps = 0;
+    while (magic[midx]) {
         int c = getc(f);
+        if (c == EOF) return 0;
+        if (!(++steps & 0xFFFF) && !within_budget(f)) return 0;
         if (c == magic[midx]) midx += 1;
         else if (c == '"' && magic[midx] == '\'') midx += 1;
+        else if (c == 'r' && magic[midx] == 'w' && read_only) { midx += 1; *read_only = 1; }
         else midx = 0;
     }
-    if (!magic[midx]) {
-        long start = ftell(f);
-        magic = "<?xpacket end='w'?>";
-        midx = 0;
-        while(magic[midx] && !feof(f)) {
-            int c = getc(f);
-            if (c == magic[midx]) midx += 1;
-            else if (c == '"' && magic[midx] == '\'') midx += 1;
-            else if (c == 'r' && magic[midx] == 'w') midx += 1;
-            else midx = 0;
-        }
-        long end = ftell(f) - 19;
-        add_packet(&ans, read_block(f, start, end-start));
+    return 1;
+}
+static const char *const header_magic = "W5M0MpCehiHzreSzNTczkc9d'?>";
+static const char *const trailer_magic = "<?xpacket end='w'?>";
+
+xmp_rdata xmp_from_other(const char *filename) {
+    xmp_rdata ans = {0, 0, 0, NULL, 0, 0, NULL};
+    FILE *f = begin_read(filename, "rb");
+    if (!f) return end_read(f, ans);
+    if (probing) { // nothing to find
         ans.width = -1;
         ans.height = -1;
+        goto end;
     }
-    fclose(f);
-    return ans;
+
+    if (!skip_past_magic(f, header_magic, NULL)) goto not_format;
+    long start = ftell(f);
+    int read_only = 0;
+    if (!skip_past_magic(f, trailer_magic, &read_only)) goto malformed;
+    long end = ftell(f) - 19;
+    add_block(&ans, f, start, end-start);
+    ans.width = -1;
+    ans.height = -1;
+    goto end;
+
+not_format:
+    fail(XMP_ERR_FORMAT);
+malformed:
+    discard(&ans);
+end:
+    return end_read(f, ans);
 }
 
 int xmp_to_other(const char *ref, const char *dest, const char *xmp) {
-    int fd = open(dest, O_WRONLY | O_EXCL | O_CREAT, 0644);
-    if (fd < 0) return 0;
-    FILE *f = fopen(ref, "rb");
-    FILE *t = fdopen(fd, "wb");
+    FILE *f, *t;
+    if (!begin_write(ref, dest, &f, &t)) return 0;
 
     size_t needed = strlen(xmp);
-    while (!feof(f)) {
-        const char *magic = "W5M0MpCehiHzreSzNTczkc9d'?>";
-        int midx = 0;
-        while(magic[midx] && !feof(f)) {
-            int c = getc(f);
-            if (c == magic[midx]) midx += 1;
-            else if (c == '"' && magic[midx] == '\'') midx += 1;
-            else midx = 0;
-        }
-        if (!magic[midx]) {
-            long start = ftell(f);
-            magic = "<?xpacket end='w'?>";
-            midx = 0;
-            int ok = 1;
-            while(magic[midx] && !feof(f)) {
-                int c = getc(f);
-                if (c == magic[midx]) midx += 1;
-                else if (c == '"' && magic[midx] == '\'') midx += 1;
-                else if (c == 'r' && magic[midx] == 'w') { midx += 1; ok = 0; }
-                else midx = 0;
-            }
-            long end = ftell(f) - 19;
-            if (ok && !magic[midx] && end-start >= needed) {
-                fseek(f, 0, SEEK_SET);
-                copy_bytes(f, t, start);
-                fputs(xmp, t);
-                for(size_t i=needed; i<end-start; i+=1)
-                    putc((i%100) ? ' ' : '\n', t);
-
-                fseek(f, 0, SEEK_END);
-                long fsize = ftell(f);
-                fseek(f, end, SEEK_SET);
-                copy_bytes(f, t, fsize-end);
-                
-                goto end;
-            }
+    int found = 0;
+    while (skip_past_magic(f, header_magic, NULL)) {
+        long start = ftell(f);
+        int read_only = 0;
+        if (!skip_past_magic(f, trailer_magic, &read_only)) break;
+        long end = ftell(f) - 19;
+        found = 1;
+        if (!read_only && end-start >= needed) {
+            fseek(f, 0, SEEK_SET);
+            if (!copy_bytes(f, t, start)) goto malformed;
+            fputs(xmp, t);
+            for(size_t i=needed; i<end-start; i+=1)
+                putc((i%100) ? ' ' : '\n', t);
+
+            fseek(f, 0, SEEK_END);
+            long fsize = ftell(f);
+            fseek(f, end, SEEK_SET);
+            if (!copy_bytes(f, t, fsize-end)) goto malformed;
+            goto end;
         }
     }
+    fail(found ? XMP_ERR_NO_ROOM : XMP_ERR_FORMAT);
 
-    fclose(f);
-    fclose(t);
-    unlink(dest);
-    return 0;
+malformed:
+    return end_write(f, t, dest, 0);
 
 end:
+    return end_write(f, t, dest, 1);
+}
+
+char *xmp_packet_in_place(const char *filename, long *offset, size_t *length) {
+    FILE *f = begin_read(filename, "rb");
+    if (!f) return NULL;
+
+    // iTXt chunks have a CRC, so PNG cannot be edited by overwriting the packet
+    unsigned char sig[8];
+    if (fread(sig, 1, 8, f) == 8 && !memcmp(sig, "\x89PNG\r\n\x1A\n", 8)) goto none;
+    fseek(f, 0, SEEK_SET);
+
+    while (skip_past_magic(f, header_magic, NULL)) {
+        long start = ftell(f);
+        int read_only = 0;
+        if (!skip_past_magic(f, trailer_magic, &read_only)) break;
+        if (read_only) continue;
+
+        long end = ftell(f);
+        if (xmp_max_packet_bytes > 0 && end - start > xmp_max_packet_bytes) { fail(XMP_ERR_TOO_LARGE); goto none; }
+        char *ans = malloc(end - start);
+        if (!ans) { fail(XMP_ERR_MEMORY); goto none; }
+        fseek(f, start, SEEK_SET);
+        if (fread(ans, 1, end - start, f) != (size_t)(end - start)) { free(ans); goto none; }
+        fclose(f);
+        *offset = start;
+        *length = end - start;
+        return ans;
+    }
+
+none:
+    fail(XMP_ERR_FORMAT);
     fclose(f);
-    fclose(t);
+    return NULL;
+}
+
+int xmp_update_in_place(const char *filename, long offset, const char *packet, size_t length) {
+    begin_call();
+    int fd = open(filename, O_WRONLY);
+    if (fd < 0) return fail(XMP_ERR_OPEN);
+    CALL_BEGIN();
+    ssize_t wrote = pwrite(fd, packet, length, offset);
+    CALL_END();
+    if (close(fd) || wrote != (ssize_t)length) return fail(XMP_ERR_WRITE);
     return 1;
 }
 /////////////////////////////// OTHER ///////////////////////////////
@@ -1,20 +1,206 @@
 #include <stddef.h> // for size_t
 
+/**
+ * Where a piece of a packet over xmp_max_packet_bytes is, so that the caller
+ * can stream it (as with xmp_read_span) instead of having it in memory.
+ * Most such packets are one span, without surrounding whitespace or xpacket
+ * wrapper; a packet stored in pieces (as HEIF items and extended JPEG XMP may
+ * be) is several spans with the same `packet`, exactly as stored.
+ */
+typedef struct {
+    size_t packet; ///< which of the file's large packets, counting from 0 (see xmp_use_locations)
+    long at;       ///< where in the packet this piece goes
+    long offset;   ///< where in the file it is
+    long length;
+} xmp_span;
+
 /**
  * The data returned by the xmp_from_... functions.
  * `packets` is a malloced array of malloced strings.
  * `width` and `packet` will both be 0 if the file was in the wrong format.
  * `width` will be -1 if packet found but size of image unknown
+ * `error` is why the file could not be read (see xmp_last_error), or XMP_OK.
+ * `spans` is a malloced array locating packets too large to read, if any.
  */
 typedef struct {
     int width;
     int height;
     size_t num_packets;
     char **packets;
+    int error;
+    size_t num_spans;
+    xmp_span *spans;
 } xmp_rdata;
 
 extern int xmp_writable_padding; // 2000 recommended by XMP spec; 1 most compact
 
+// runtime-changeable limits on each call, to bound the cost of corrupt files; 0 for none
+extern long xmp_max_scan_bytes;   // furthest into a file a call will look
+extern long xmp_max_milliseconds; // longest a call will run before giving up
+extern long xmp_max_packet_bytes; // longer packets are returned as spans, not read
+// (extended JPEG XMP is only found if the standard packet it extends, at most 64 KiB, is read)
+
+/// Why a call failed. The first problem found ends the call.
+enum {
+    XMP_OK,
+    XMP_ERR_OPEN,      ///< a file could not be opened
+    XMP_ERR_EXISTS,    ///< the destination already exists
+    XMP_ERR_FORMAT,    ///< not a file of the function's format
+    XMP_ERR_MALFORMED, ///< the function's format, but corrupt or truncated
+    XMP_ERR_MEMORY,
+    XMP_ERR_BUDGET,    ///< would have looked past xmp_max_scan_bytes
+    XMP_ERR_TIMEOUT,   ///< ran longer than xmp_max_milliseconds
+    XMP_ERR_WRITE,     ///< writing the destination failed
+    XMP_ERR_NO_ROOM,   ///< an in-place update does not fit; rewrite the file instead
+    XMP_ERR_TOO_LARGE, ///< the packet is over xmp_max_packet_bytes
+};
+
+/// The error of the last xmp_from_, xmp_to_, or xmp_update_ call on this thread.
+int xmp_last_error(void);
+const char *xmp_error_string(int error);
+
+/**
+ * An optional store of distinct packets, for batches in which many files
+ * carry byte-identical XMP. While a cache is in use, packets returned by the
+ * xmp_from_ functions are owned by it: a packet seen before is returned as
+ * the same pointer as before, and callers must not free packets (though they
+ * still free the `packets` array). Packets are hashed with XXH64 as they are
+ * read. A cache is not thread-safe; use one per thread.
+ */
+typedef struct xmp_cache xmp_cache;
+
+/// `free_value`, if not NULL, is called on each non-NULL xmp_cache_value when freed
+xmp_cache *xmp_cache_new(void (*free_value)(void *value));
+void xmp_cache_free(xmp_cache *cache);
+
+/// Makes xmp_from_ calls on this thread use `cache` (or none, if NULL).
+/// Returns the cache that was in use before.
+xmp_cache *xmp_use_cache(xmp_cache *cache);
+
+/// For a packet returned while a cache was in use: a place to keep a value
+/// derived from it, such as its parse, initially NULL and shared by every
+/// file with the same packet.
+void **xmp_cache_value(const char *packet);
+unsigned long long xmp_cache_hash(const char *packet);
+
+/// Distinct packets stored, and times a packet was found already stored.
+void xmp_cache_stats(const xmp_cache *cache, size_t *packets, size_t *hits);
+
+/**
+ * Counters for finding where the time in a batch goes. They are only filled
+ * in if xmpblock.c is compiled with XMP_STATS defined; otherwise nothing is
+ * counted and the xmp_ functions cost no more than without them.
+ * Reads and writes are calls to stdio, which buffers them, not system calls.
+ * A call lasts from the first file it opens to the last it closes, and its
+ * time not spent extracting packets or copying is counted as walking.
+ */
+typedef struct {
+    unsigned long long calls;
+    unsigned long long bytes_read, bytes_written;
+    unsigned long long reads, writes, seeks;
+    unsigned long long allocations;   ///< malloc, calloc, and realloc by this library
+    unsigned long long packets;       ///< returned by xmp_from_ calls
+    unsigned long long ns_walking;    ///< in the container's structure
+    unsigned long long ns_extracting; ///< reading out and trimming packets
+    unsigned long long ns_copying;    ///< copying the rest of the file, and placing packets
+} xmp_stats;
+
+/// Makes xmp_ calls on this thread add to `stats` (or to none, if NULL); zero
+/// it before a call to see that call alone. Returns the stats in use before.
+xmp_stats *xmp_use_stats(xmp_stats *stats);
+
+/// Adds `from` to `into`, as for totals over threads each with their own stats.
+void xmp_stats_add(xmp_stats *into, const xmp_stats *from);
+
+/**
+ * Makes xmp_from_ and xmp_to_ calls on this thread read the `length` bytes at
+ * `data` instead of opening the file they are given to read (a reader's
+ * `filename`, a writer's `ref`), until called with NULL. Nothing is copied,
+ * so `data` must stay valid meanwhile. Returns the data in use before.
+ */
+const void *xmp_use_memory(const void *data, size_t length);
+
+/// Runs one of the xmp_from_ functions on `length` bytes at `data`.
+xmp_rdata xmp_from_memory(xmp_rdata (*reader)(const char *filename), const void *data, size_t length);
+
+/**
+ * A source of bytes by offset, such as a blob store serving ranged reads,
+ * to read in place of a file. `read_at` reads up to `length` bytes starting
+ * `offset` bytes in, returning how many it read (fewer only at the end of the
+ * source) or -1 on failure; `size` returns the length of the source, or -1.
+ * Both are given `ctx`, and are called only on the thread making the xmp_ call.
+ */
+typedef struct {
+    long (*read_at)(void *ctx, long offset, void *buf, size_t length);
+    long (*size)(void *ctx);
+    void *ctx;
+} xmp_io;
+
+/**
+ * Makes xmp_from_ and xmp_to_ calls on this thread read from `io` instead of
+ * the file they are given to read, as xmp_use_memory does, until called with
+ * NULL. `io` must stay valid meanwhile. Returns the source in use before.
+ * Reading from an xmp_io needs fopencookie (Linux) or funopen (macOS);
+ * elsewhere calls fail with XMP_ERR_OPEN.
+ */
+const xmp_io *xmp_use_io(const xmp_io *io);
+
+/// Runs one of the xmp_from_ functions on `io`.
+xmp_rdata xmp_from_io(xmp_rdata (*reader)(const char *filename), const xmp_io *io);
+
+/**
+ * Sits in front of an xmp_io whose requests are costly, merging the many
+ * small reads a walk makes into few large ones: a read missing what was
+ * fetched before fetches `block_bytes` (0 for 64 KiB) from where it starts,
+ * so a JPEG's APP segments or a TIFF IFD arrive in one request. The last few
+ * blocks fetched are kept; reads of at least `block_bytes` (usually packets)
+ * go straight to `inner` without being kept. One coalescer serves one source
+ * on one thread at a time; returns NULL if out of memory.
+ */
+typedef struct xmp_coalescer xmp_coalescer;
+xmp_coalescer *xmp_coalescer_new(const xmp_io *inner, size_t block_bytes);
+/// The xmp_io reading through `c`, valid until xmp_coalescer_free.
+const xmp_io *xmp_coalescer_io(xmp_coalescer *c);
+void xmp_coalescer_free(xmp_coalescer *c);
+
+/**
+ * Runs one of the xmp_from_ functions only as far as the image's width and
+ * height, which it returns without packets. PNG, GIF, and WebP stop within
+ * their first 30 bytes; JPEG at its first frame header, skipping whole
+ * segments (and the thumbnails in them); ISOBMF after its jp2h or meta box;
+ * TIFF at its first full-resolution IFD; SVG after its root element.
+ * xmp_from_other has no dimensions to find, so returns -1 without reading.
+ * May be combined with xmp_use_memory and xmp_use_io.
+ */
+xmp_rdata xmp_probe_dimensions(xmp_rdata (*reader)(const char *filename), const char *filename);
+
+/**
+ * Makes xmp_from_ calls on this thread (while `on`) also list in `spans` where
+ * each packet they read was in the file, a span's `packet` being its index in
+ * `packets`, and its spans being as they would be for a large packet.
+ * Packets over xmp_max_packet_bytes are then read like any other.
+ * Returns whether packets were being located before.
+ */
+int xmp_use_locations(int on);
+
+/**
+ * Sorts `count` filenames into the order of where their data starts on disk,
+ * so that reading them in turn sweeps across a spinning disk (or a tape-like
+ * cold store) instead of seeking back and forth as directory order does.
+ * Files whose first extent can be found (with FIEMAP on Linux, F_LOG2PHYS on
+ * macOS) come first, by its offset on their device; then the rest, by device
+ * and inode number, which most file systems allocate roughly in disk order;
+ * then those that are not regular files, in the order given. Costs a stat
+ * and an open per file. Returns how many were ordered by extent, or -1 if
+ * out of memory, leaving the order unchanged.
+ */
+long xmp_order_by_location(char **filenames, size_t count);
+
+/// Reads up to `n` bytes of `span`, starting `from` bytes into it, from the
+/// file it was found in (or from memory or an xmp_io, while xmp_use_ is in effect).
+/// returns the number of bytes read, 0 at the end of the span, or -1 on failure.
+long xmp_read_span(const char *filename, const xmp_span *span, long from, void *buf, size_t n);
+
 
 xmp_rdata xmp_from_gif(const char *filename);
 xmp_rdata xmp_from_isobmf(const char *filename);
@@ -22,6 +208,7 @@ xmp_rdata xmp_from_jpeg(const char *filename);
 xmp_rdata xmp_from_png(const char *filename);
 xmp_rdata xmp_from_webp(const char *filename);
 xmp_rdata xmp_from_tiff(const char *filename);
+xmp_rdata xmp_from_svg(const char *filename);
 xmp_rdata xmp_from_other(const char *filename);
 
 /// returns true on success, false on failure.
@@ -31,7 +218,27 @@ int xmp_to_isobmf(const char *ref, const char *dest, const char *xmp);
 int xmp_to_jpeg(const char *ref, const char *dest, const char *xmp);
 int xmp_to_png(const char *ref, const char *dest, const char *xmp);
 int xmp_to_webp(const char *ref, const char *dest, const char *xmp);
+int xmp_to_svg(const char *ref, const char *dest, const char *xmp);
 int xmp_to_other(const char *ref, const char *dest, const char *xmp);
 
+/// Rewrites the XMP of an AVIF/HEIC file in place, without copying the file.
+/// The XMP item (or uuid box) is overwritten if it has room; otherwise a new
+/// XMP item extent is appended to the end of the file and iloc repointed to it.
+/// returns true on success, false if the file needs xmp_to_isobmf instead.
+int xmp_update_isobmf(const char *filename, const char *xmp);
+
+/**
+ * Finds the first writable (`<?xpacket end="w"?>`) packet in a file of any
+ * format except PNG, whose chunks are checksummed. Returns a malloced copy of
+ * its bytes from just after the xpacket header through the trailer, not
+ * NUL-terminated, and sets `offset` and `length` to where they are in the file;
+ * or NULL if there is no such packet.
+ */
+char *xmp_packet_in_place(const char *filename, long *offset, size_t *length);
+
+/// Overwrites bytes returned by xmp_packet_in_place, after editing them without
+/// changing their length (as by the rdfxml_patch_ functions), with one write.
+int xmp_update_in_place(const char *filename, long offset, const char *packet, size_t length);
+
 /// JPEG requires long XMP packets (over 64000 characters) to be split into two
 int xmp_to_jpeg_ext(const char *ref, const char *dest, const char *xmp, const char *ext);
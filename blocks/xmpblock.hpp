@@ -0,0 +1,832 @@
+/**
+ * A header-only C++20 reader for the XMP packets of the same containers as
+ * xmpblock.c (all but SVG, which is not a container), walking them the same
+ * way but over bytes already in memory: a file mapped with xmp::read_file,
+ * or a caller's buffer with xmp::read.
+ *
+ *     xmp::result r = xmp::read_file("photo.jpg");
+ *     if (!r.error) for (std::string_view packet : r.packets) ...
+ *
+ * Packets are views, without surrounding whitespace or xpacket wrapper, of
+ * the bytes read; only a packet stored in pieces (extended JPEG XMP, a HEIF
+ * item of several extents) is copied, into memory the result owns. A result
+ * is move-only, and its packets are valid for as long as it is and, for
+ * xmp::read, the caller's buffer is.
+ *
+ * Each format is a policy type whose byte order is a template argument of
+ * the cursor reading it, so no integer read tests the byte order at run
+ * time; TIFF's II or MM picks one of two instantiations once per file.
+ * xmp::read<xmp::png>(bytes) reads a known format with no dispatch at all,
+ * and xmp::read(bytes) picks one by the first bytes.
+ *
+ * xmp::rdata is a move-only owner of what the C functions return, for
+ * callers of xmpblock.c itself, which must then be linked in.
+ */
+#ifndef XMPBLOCK_HPP
+#define XMPBLOCK_HPP
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include "xmpblock.h"
+}
+
+namespace xmp {
+
+using bytes = std::span<const unsigned char>;
+
+////////////////////////////// CURSOR ///////////////////////////////
+/// Reads integers stored in byte order `E`. Reading past the end gives 0
+/// and sets `overrun`, as reading at EOF does in xmpblock.c.
+template <std::endian E>
+struct cursor {
+    bytes data;
+    size_t pos = 0;
+    bool overrun = false;
+
+    constexpr explicit cursor(bytes data, size_t pos = 0) : data(data), pos(pos) {}
+
+    constexpr size_t size() const { return data.size(); }
+    constexpr size_t left() const { return pos < data.size() ? data.size() - pos : 0; }
+    constexpr bool at_end() const { return pos >= data.size(); }
+
+    constexpr void seek(size_t to) { pos = std::min(to, data.size()); }
+    constexpr void skip(size_t n) {
+        if (n > left()) { pos = data.size(); overrun = true; }
+        else pos += n;
+    }
+
+    template <size_t N>
+    constexpr uint64_t get() {
+        if (left() < N) { pos = data.size(); overrun = true; return 0; }
+        uint64_t v = 0;
+        for (size_t i = 0; i < N; i += 1) {
+            if constexpr (E == std::endian::little) v |= uint64_t(data[pos+i]) << (8*i);
+            else v = (v << 8) | data[pos+i];
+        }
+        pos += N;
+        return v;
+    }
+    constexpr unsigned u8() { return get<1>(); }
+    constexpr unsigned u16() { return get<2>(); }
+    constexpr unsigned u24() { return get<3>(); }
+    constexpr uint32_t u32() { return get<4>(); }
+    constexpr uint64_t u64() { return get<8>(); }
+
+    /// whether the next bytes are `tag`, consuming them either way
+    template <size_t N>
+    constexpr bool is(const char (&tag)[N]) {
+        bool ans = left() >= N-1 && std::equal(tag, tag + N-1, data.begin() + pos,
+            [](char t, unsigned char d) { return static_cast<unsigned char>(t) == d; });
+        skip(N-1);
+        return ans;
+    }
+};
+////////////////////////////// CURSOR ///////////////////////////////
+
+////////////////////////////// RESULT ///////////////////////////////
+/// A read-only mapping of a whole file, unmapped when destroyed.
+class mapped_file {
+  public:
+    mapped_file() = default;
+    explicit mapped_file(const char *filename) {
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            length = st.st_size;
+            if (length == 0) ok = true;
+            else {
+                void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) { addr = p; ok = true; }
+            }
+        }
+        ::close(fd);
+    }
+    mapped_file(mapped_file &&o) noexcept
+        : addr(std::exchange(o.addr, nullptr)), length(std::exchange(o.length, 0)), ok(std::exchange(o.ok, false)) {}
+    mapped_file &operator=(mapped_file &&o) noexcept {
+        if (this != &o) {
+            unmap();
+            addr = std::exchange(o.addr, nullptr);
+            length = std::exchange(o.length, 0);
+            ok = std::exchange(o.ok, false);
+        }
+        return *this;
+    }
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+    ~mapped_file() { unmap(); }
+
+    explicit operator bool() const { return ok; }
+    bytes data() const { return {static_cast<const unsigned char *>(addr), addr ? length : 0}; }
+
+  private:
+    void unmap() { if (addr) munmap(addr, length); addr = nullptr; }
+    void *addr = nullptr;
+    size_t length = 0;
+    bool ok = false;
+};
+
+/// What a reader found. `error` is one of xmpblock.h's XMP_OK or XMP_ERR_
+/// codes; if it is not XMP_OK, nothing else is set.
+class result {
+  public:
+    int width = 0, height = 0;
+    int error = XMP_OK;
+    std::vector<std::string_view> packets;
+
+    result() = default;
+    result(result &&) noexcept = default;
+    result &operator=(result &&) noexcept = default;
+    result(const result &) = delete;
+    result &operator=(const result &) = delete;
+
+    /// adds `packet` unless it is empty
+    void add(std::string_view packet) { if (!packet.empty()) packets.push_back(packet); }
+    /// memory of `n` zeroed bytes, owned by this result, for a packet to be assembled in
+    char *own(size_t n) {
+        owned.push_back(std::make_unique<char[]>(n));
+        return owned.back().get();
+    }
+    /// as discard does in xmpblock.c: drops what was found and records why
+    void fail(int why) {
+        width = height = 0;
+        packets.clear();
+        owned.clear();
+        error = why;
+    }
+
+  private:
+    friend result read_file(const char *filename);
+    std::vector<std::unique_ptr<char[]>> owned; // unique_ptr, so views survive moves
+    mapped_file file;
+};
+
+/// Owns an xmp_rdata from the C functions: frees its packets (unless a cache
+/// owned them when it was read), packet array, and spans when destroyed.
+class rdata {
+  public:
+    explicit rdata(xmp_rdata d) : d(d) {
+        xmp_cache *c = xmp_use_cache(nullptr);
+        xmp_use_cache(c);
+        cached = (c != nullptr);
+    }
+    rdata(rdata &&o) noexcept : d(std::exchange(o.d, xmp_rdata{})), cached(o.cached) {}
+    rdata &operator=(rdata &&o) noexcept {
+        if (this != &o) { release(); d = std::exchange(o.d, xmp_rdata{}); cached = o.cached; }
+        return *this;
+    }
+    rdata(const rdata &) = delete;
+    rdata &operator=(const rdata &) = delete;
+    ~rdata() { release(); }
+
+    const xmp_rdata *operator->() const { return &d; }
+    std::span<char *const> packets() const { return {d.packets, d.num_packets}; }
+    std::span<const xmp_span> spans() const { return {d.spans, d.num_spans}; }
+
+  private:
+    void release() {
+        if (!cached) for (char *p : packets()) std::free(p);
+        std::free(d.packets);
+        std::free(d.spans);
+        d = xmp_rdata{};
+    }
+    xmp_rdata d;
+    bool cached;
+};
+////////////////////////////// RESULT ///////////////////////////////
+
+///////////////////////////// WRAPPING //////////////////////////////
+constexpr bool is_space(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+/// `block` without surrounding whitespace or xpacket wrapper, as trim_block in
+/// xmpblock.c; empty if nothing is left or the wrapper's header is unterminated
+constexpr std::string_view trim_block(std::string_view s) {
+    size_t start = 0, end = s.size();
+    while (start < end && is_space(s[start])) start += 1;
+    if (s.substr(start).starts_with("<?xpacket begin=")) {
+        while (start < end && s[start] != '?') start += 1;
+        start += 1;
+        while (start < end && s[start] != '?') start += 1;
+        if (start + 1 >= end || s[start+1] != '>') return {};
+        start += 2;
+        while (start < end && is_space(s[start])) start += 1;
+    }
+    while (end > start && is_space(s[end-1])) end -= 1;
+    if (end - start >= 19 && s.substr(end-19, 14) == "<?xpacket end=" && s.substr(end-2, 2) == "?>") {
+        end -= 19;
+        while (end > start && is_space(s[end-1])) end -= 1;
+    }
+    return s.substr(start, end - start);
+}
+
+/// the `length` bytes of `b` at `at`, or as many of them as there are
+inline std::string_view view(bytes b, size_t at, uint64_t length) {
+    if (at > b.size()) return {};
+    return {reinterpret_cast<const char *>(b.data()) + at, size_t(std::min<uint64_t>(length, b.size() - at))};
+}
+inline std::string_view block(bytes b, size_t at, uint64_t length) { return trim_block(view(b, at, length)); }
+
+inline bool starts(bytes b, size_t at, std::string_view s) {
+    return at <= b.size() && view(b, at, s.size()) == s;
+}
+///////////////////////////// WRAPPING //////////////////////////////
+
+///////////////////////////// FORMATS ///////////////////////////////
+/// A container: `matches` tests its first bytes, and `read` fills in a
+/// result, returning XMP_OK or why it failed.
+template <class F>
+concept format = requires(bytes b, result &r) {
+    { F::name } -> std::convertible_to<std::string_view>;
+    { F::matches(b) } -> std::same_as<bool>;
+    { F::read(b, r) } -> std::same_as<int>;
+};
+
+struct gif {
+    static constexpr std::string_view name = "GIF";
+    static bool matches(bytes b) { return starts(b, 0, "GIF87a") || starts(b, 0, "GIF89a"); }
+
+    static bool skip_sub_blocks(cursor<std::endian::little> &c) {
+        for (unsigned len = c.u8(); len; len = c.u8()) c.skip(len);
+        return !c.overrun;
+    }
+    static int read(bytes b, result &r) {
+        cursor<std::endian::little> c(b, 6);
+        r.width = c.u16();
+        r.height = c.u16();
+        if (c.overrun) return XMP_ERR_MALFORMED; // the file ends within the dimensions
+        if (b[4] == '7') return XMP_OK;
+        unsigned flags = c.u8();
+        c.skip(2);
+        if (flags & 0x80) c.skip(6 << (flags & 0x7));
+        for (;;) {
+            unsigned intro = c.u8();
+            if (c.overrun) return XMP_ERR_MALFORMED;
+            if (intro == 0x3B) return XMP_OK;
+            if (intro == 0x2C) {
+                c.skip(8);
+                flags = c.u8();
+                if (flags & 0x80) c.skip(6 << (flags & 0x7));
+                c.skip(1);
+                if (!skip_sub_blocks(c)) return XMP_ERR_MALFORMED;
+            } else if (intro == 0x21) {
+                if (c.u8() == 0xFF) {
+                    if (c.u8() != 11) return XMP_ERR_MALFORMED;
+                    if (c.is("XMP DataXMP")) {
+                        // the packet's bytes are its sub-blocks, up to the magic trailer's 1
+                        auto rest = b.subspan(c.pos);
+                        size_t len = std::find(rest.begin(), rest.end(), 1) - rest.begin();
+                        r.add(block(b, c.pos, len));
+                        c.skip(len + 1);
+                        for (unsigned i = 0; i < 256; i += 1) if (c.u8() != 0xFF - i) return XMP_ERR_MALFORMED;
+                        if (c.u8() != 0 || c.overrun) return XMP_ERR_MALFORMED;
+                    } else if (!skip_sub_blocks(c)) return XMP_ERR_MALFORMED;
+                } else if (!skip_sub_blocks(c)) return XMP_ERR_MALFORMED;
+            } else return XMP_ERR_MALFORMED;
+        }
+    }
+};
+
+struct png {
+    static constexpr std::string_view name = "PNG";
+    static bool matches(bytes b) { return starts(b, 0, "\x89PNG\r\n\x1A\n"); }
+
+    static constexpr std::array<uint32_t, 256> crc_table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t n = 0; n < 256; n += 1) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k += 1) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    static constexpr uint32_t crc(bytes b) {
+        uint32_t c = 0xFFFFFFFFu;
+        for (unsigned char x : b) c = crc_table[(c ^ x) & 0xFF] ^ (c >> 8);
+        return c ^ 0xFFFFFFFFu;
+    }
+
+    static int read(bytes b, result &r) {
+        cursor<std::endian::big> c(b, 8);
+        if (c.u32() != 13 || !c.is("IHDR")) return XMP_ERR_FORMAT;
+        r.width = c.u32();
+        r.height = c.u32();
+        c.skip(5);
+        if (c.overrun || c.u32() != crc(b.subspan(12, 17))) return XMP_ERR_MALFORMED;
+        while (!c.at_end()) {
+            uint32_t length = c.u32();
+            if (c.overrun) break;
+            if (length > 0x7fffffff) return XMP_ERR_MALFORMED;
+            size_t data = c.pos + 4;
+            if (c.is("iTXt") && length > 22 && starts(b, data, {"XML:com.adobe.xmp\0\0\0\0\0", 22}))
+                r.add(block(b, data + 22, length - 22));
+            c.seek(data);
+            c.skip(length);
+            c.skip(4); // CRC
+        }
+        return XMP_OK;
+    }
+};
+
+struct webp {
+    static constexpr std::string_view name = "WEBP";
+    static bool matches(bytes b) { return starts(b, 0, "RIFF") && starts(b, 8, "WEBP"); }
+
+    static int read(bytes b, result &r) {
+        cursor<std::endian::little> c(b, 4);
+        if (c.u32() != b.size() - 8) return XMP_ERR_MALFORMED;
+        c.skip(4);
+        size_t variant = c.pos;
+        c.skip(4);
+        uint32_t length = c.u32();
+        if (starts(b, variant, "VP8 ")) {
+            c.skip(6);
+            r.width = c.u16();
+            r.height = c.u16();
+            return XMP_OK;
+        } else if (starts(b, variant, "VP8L")) {
+            if (c.u8() != 0x2F) return XMP_ERR_MALFORMED;
+            uint32_t packed = c.u32();
+            r.width = 1 + (packed & 0x3FFF);
+            r.height = 1 + ((packed>>14) & 0x3FFF);
+            return XMP_OK;
+        } else if (!starts(b, variant, "VP8X")) return XMP_ERR_FORMAT;
+        c.skip(4);
+        r.width = 1 + c.u24();
+        r.height = 1 + c.u24();
+        c.skip(uint32_t(length - 10));
+        if (length & 1) c.skip(1);
+        while (c.left() >= 4) {
+            bool xmp = c.is("XMP ");
+            uint32_t length = c.u32();
+            if (xmp) r.add(block(b, c.pos, length));
+            c.skip(length);
+            if (length & 1) c.skip(1);
+        }
+        return XMP_OK;
+    }
+};
+
+struct jpeg {
+    static constexpr std::string_view name = "JPEG";
+    static bool matches(bytes b) { return starts(b, 0, "\xFF\xD8"); }
+
+    static int read(bytes b, result &r) {
+        cursor<std::endian::big> c(b, 2);
+        char *extended = nullptr;
+        uint32_t extended_len = 0;
+        unsigned m0 = c.u8();
+        while (!c.at_end()) {
+            unsigned m1 = c.u8();
+            if (m0 == 0xFF && m1 == 0xE1) {
+                size_t seg = c.pos; // segments are measured from their length field
+                unsigned len = c.u16();
+                if (len < 2) return XMP_ERR_MALFORMED;
+                if (starts(b, seg + 2, {"http://ns.adobe.com/xap/1.0/", 29})) {
+                    r.add(block(b, seg + 31, len < 31 ? 0 : len - 31));
+                } else if (starts(b, seg + 2, {"http://ns.adobe.com/xmp/extension/", 35}) && !r.packets.empty()) {
+                    // as in xmpblock.c: one extended packet, whose GUID the standard packet names
+                    c.seek(seg + 37);
+                    std::string_view guid = view(b, c.pos, 32);
+                    c.skip(32);
+                    if (guid.size() != 32) return XMP_ERR_MALFORMED; // the part is cut short
+                    // searched as far as a NUL, as xmpblock.c's string ends there
+                    std::string_view standard = r.packets[0].substr(0, r.packets[0].find('\0'));
+                    if (standard.find(guid) != std::string_view::npos) {
+                        uint32_t ext_len = c.u32(), ext_off = c.u32();
+                        if (len < 77 || ext_len > b.size()) return XMP_ERR_MALFORMED;
+                        if (extended && ext_len != extended_len) return XMP_ERR_MALFORMED;
+                        if (uint64_t(ext_off) + (len-77) > ext_len) return XMP_ERR_MALFORMED;
+                        if (seg + len > b.size()) return XMP_ERR_MALFORMED; // the part is cut short
+                        if (!extended) { extended = r.own(ext_len + 1); extended_len = ext_len; }
+                        std::string_view part = view(b, c.pos, len - 77);
+                        std::copy(part.begin(), part.end(), extended + ext_off);
+                    }
+                }
+                c.seek(seg + len);
+            } else if (m0 == 0xFF && 0xC0 <= m1 && m1 <= 0xCF && m1 != 0xC4 && m1 != 0xCC) {
+                c.skip(3);
+                // can contain thumbnails, so look for max
+                r.height = std::max<int>(r.height, c.u16());
+                r.width = std::max<int>(r.width, c.u16());
+            } else if (m0 == 0xFF && m1 == 0xDC) {
+                c.skip(2);
+                r.height = std::max<int>(r.height, c.u16());
+            }
+            m0 = m1;
+        }
+        if (extended) r.add({extended, std::char_traits<char>::length(extended)});
+        return XMP_OK;
+    }
+};
+
+struct isobmf {
+    static constexpr std::string_view name = "ISOBMF";
+    static bool matches(bytes b) { return starts(b, 4, "ftyp") || starts(b, 4, "jP  "); }
+
+    using cur = cursor<std::endian::big>;
+    struct box { int64_t length; std::string_view type; size_t fpos; };
+    struct extent { uint64_t offset, length; };
+    using item = std::vector<extent>;
+
+    /// length is of the contents, and negative if the file ends before it;
+    /// as in xmpblock.c, a box whose type is cut short still has its length
+    static box read_box(cur &c, size_t end) {
+        box ans;
+        ans.length = c.u32();
+        bool ended = c.overrun;
+        ans.type = view(c.data, c.pos, 4);
+        c.skip(4);
+        if (ans.length == 1) {
+            ans.length = int64_t(c.u64()) - 8;
+            ended = c.overrun;
+        }
+        ans.fpos = c.pos;
+        if (ended) ans.length = -1;
+        else if (ans.length == 0) ans.length = end - ans.fpos;
+        else if (ans.length > 0) ans.length -= 8;
+        return ans;
+    }
+    static bool inside(const box &in, const box &out) {
+        return in.length >= 0 && in.fpos + in.length <= out.fpos + out.length;
+    }
+    static uint64_t sized(cur &c, int size) {
+        if (size == 4) return c.u32();
+        if (size == 8) return c.u64();
+        return 0;
+    }
+
+    /// 0 = unknown, 2 = HEIC, 3 = AVIF, from the contents of ftyp
+    static int brands(bytes ftyp) {
+        int format = 0;
+        for (size_t at = 8; at + 4 <= ftyp.size(); at += 4) {
+            std::string_view brand = view(ftyp, at, 4);
+            if (brand == "heic") format = 2;
+            else if (brand == "avif") format = 3;
+        }
+        return format;
+    }
+
+    /// the dimensions in the contents of a jp2h box
+    static int read_jp2h(bytes jp2h, result &r) {
+        box all = {int64_t(jp2h.size()), {}, 0};
+        cur c(jp2h);
+        while (c.pos < jp2h.size()) {
+            box inner = read_box(c, jp2h.size());
+            if (!inside(inner, all)) return XMP_ERR_MALFORMED;
+            if (inner.type == "ihdr") {
+                r.height = c.u32();
+                r.width = c.u32();
+            }
+            c.seek(inner.fpos + inner.length);
+        }
+        return XMP_OK;
+    }
+
+    /// the dimensions, and the extents of the XMP items, in the contents of a
+    /// meta box that starts `base` bytes into the file
+    static int read_meta(bytes meta, uint64_t base, result &r, std::vector<item> &items) {
+        box all = {int64_t(meta.size()), {}, 0};
+        box iinf = {-1, {}, 0}, iloc = {-1, {}, 0}, idat = {-1, {}, 0};
+        cur c(meta, 4); // FullBox version and flags
+        while (c.pos < meta.size()) {
+            box inner = read_box(c, meta.size());
+            if (!inside(inner, all)) return XMP_ERR_MALFORMED;
+            if (inner.type == "iinf") iinf = inner;
+            else if (inner.type == "iloc") iloc = inner;
+            if (inner.type == "idat") {
+                idat = inner;
+                c.seek(inner.fpos + 4);
+                r.width = c.u16();
+                r.height = c.u16();
+            } else if (inner.type == "iprp") {
+                while (c.pos < inner.fpos + inner.length) {
+                    box in2 = read_box(c, inner.fpos + inner.length);
+                    if (!inside(in2, inner)) return XMP_ERR_MALFORMED;
+                    if (in2.type == "ipco") {
+                        while (c.pos < in2.fpos + in2.length) {
+                            box in3 = read_box(c, in2.fpos + in2.length);
+                            if (!inside(in3, in2)) return XMP_ERR_MALFORMED;
+                            if (in3.type == "ispe") {
+                                c.seek(in3.fpos + 4);
+                                r.width = c.u32();
+                                r.height = c.u32();
+                            }
+                            c.seek(in3.fpos + in3.length);
+                        }
+                    }
+                    c.seek(in2.fpos + in2.length);
+                }
+            }
+            c.seek(inner.fpos + inner.length);
+        }
+        return find_items(meta, base, iinf, iloc, idat, items);
+    }
+
+    /// the XMP items of iinf, with their extents from iloc, as isobmf_xmp_items in xmpblock.c
+    static int find_items(bytes meta, uint64_t base, const box &iinf, const box &iloc, const box &idat, std::vector<item> &items) {
+        if (iinf.length < 0 || iloc.length < 0) return XMP_OK;
+        std::vector<uint32_t> ids;
+        cur c(meta, iinf.fpos);
+        unsigned version = c.u8();
+        c.skip(3);
+        uint32_t count = version ? c.u32() : c.u16();
+        for (uint32_t i = 0; i < count && c.pos < iinf.fpos + iinf.length; i += 1) {
+            box infe = read_box(c, iinf.fpos + iinf.length);
+            if (!inside(infe, iinf)) return XMP_ERR_MALFORMED;
+            if (infe.type == "infe" && infe.length > 12) {
+                unsigned v = c.u8();
+                c.skip(3);
+                if (v >= 2) {
+                    uint32_t id = (v == 2) ? c.u16() : c.u32();
+                    c.skip(2); // item_protection_index
+                    if (c.is("mime")) {
+                        // item_name, then content_type, both NUL-terminated
+                        std::string_view rest = view(meta, c.pos, infe.fpos + infe.length - c.pos);
+                        size_t name_end = rest.find('\0');
+                        if (name_end != std::string_view::npos && rest.substr(name_end + 1).starts_with({"application/rdf+xml\0", 20}))
+                            ids.push_back(id);
+                    }
+                }
+            }
+            c.seek(infe.fpos + infe.length);
+        }
+        if (ids.empty()) return XMP_OK;
+
+        c.seek(iloc.fpos);
+        version = c.u8();
+        c.skip(3);
+        unsigned sizes = c.u16();
+        int offset_size = (sizes>>12) & 0xF, length_size = (sizes>>8) & 0xF, base_size = (sizes>>4) & 0xF;
+        int index_size = (version == 1 || version == 2) ? sizes & 0xF : 0;
+        if (version > 2 || (offset_size & ~12) || (length_size & ~12) || (base_size & ~12) || (index_size & ~12))
+            return XMP_ERR_MALFORMED;
+        count = (version < 2) ? c.u16() : c.u32();
+        for (uint32_t i = 0; i < count; i += 1) {
+            if (c.pos >= iloc.fpos + iloc.length) return XMP_ERR_MALFORMED;
+            uint32_t id = (version < 2) ? c.u16() : c.u32();
+            unsigned method = (version == 1 || version == 2) ? (c.u16() & 0xF) : 0;
+            c.skip(2); // data_reference_index
+            uint64_t origin = sized(c, base_size);
+            unsigned num_extents = c.u16();
+            bool wanted = std::find(ids.begin(), ids.end(), id) != ids.end()
+                && method <= 1 && !(method == 1 && idat.length < 0); // item-relative extents unsupported
+            item extents;
+            for (unsigned j = 0; j < num_extents; j += 1) {
+                if (c.pos >= iloc.fpos + iloc.length) return XMP_ERR_MALFORMED;
+                sized(c, index_size);
+                uint64_t offset = sized(c, offset_size), length = sized(c, length_size);
+                if (wanted) extents.push_back({origin + offset + (method == 1 ? base + idat.fpos : 0), length});
+            }
+            if (c.overrun) return XMP_ERR_MALFORMED;
+            if (wanted) items.push_back(std::move(extents));
+        }
+        return XMP_OK;
+    }
+
+    /// whether all of `extents` are in a file of `size` bytes, once lengths
+    /// of 0 (the rest of the file) are resolved; `total` is their sum
+    static bool locate(item &extents, uint64_t size, uint64_t &total) {
+        total = 0;
+        for (auto &e : extents) {
+            if (e.length == 0) e.length = size - std::min(e.offset, size);
+            if (e.offset > size || e.length > size - e.offset) return false;
+            total += e.length;
+        }
+        return true;
+    }
+    /// `unread` is how much of the file is left to extract: packets do not overlap
+    static int add_item(bytes b, result &r, item &extents, uint64_t &unread) {
+        uint64_t total;
+        if (!locate(extents, b.size(), total)) return XMP_OK;
+        if (total > unread) return XMP_ERR_MALFORMED;
+        unread -= total;
+        if (extents.size() == 1) { r.add(block(b, extents[0].offset, extents[0].length)); return XMP_OK; }
+        char *packet = r.own(total + 1);
+        size_t at = 0;
+        for (auto &e : extents) {
+            std::string_view part = view(b, e.offset, e.length);
+            at = std::copy(part.begin(), part.end(), packet + at) - packet;
+        }
+        r.add(trim_block({packet, at}));
+        return XMP_OK;
+    }
+
+    static constexpr unsigned char xmp_uuid[16] = {0xBE, 0x7A, 0xCF, 0xCB, 0x97, 0xA9, 0x42, 0xE8, 0x9C, 0x71, 0x99, 0x94, 0x91, 0xE3, 0xAF, 0xAC};
+
+    static int read(bytes b, result &r) {
+        cur c(b);
+        int format = 0; // 0 = unknown, 1 = JPEG2000, 2 = HEIC, 3 = AVIF
+        uint64_t unread = b.size();
+        box top = read_box(c, b.size());
+        if (top.type == "jP  " && top.length == 4) {
+            if (!c.is("\r\n\x87\n")) return XMP_ERR_FORMAT;
+            format = 1;
+        } else if (top.type == "ftyp" && top.length >= 12 && top.fpos + top.length <= b.size()) {
+            format = brands(b.subspan(top.fpos, top.length));
+        } else return XMP_ERR_FORMAT;
+        c.seek(top.fpos + top.length);
+
+        for (;;) {
+            box bx = read_box(c, b.size());
+            if (bx.length < 0) return XMP_OK;
+            if (bx.fpos + bx.length > b.size()) return XMP_ERR_MALFORMED;
+            bytes contents = b.subspan(bx.fpos, bx.length);
+            int err = XMP_OK;
+            if (format == 1 && bx.type == "jp2h") {
+                err = read_jp2h(contents, r);
+            } else if ((format == 2 || format == 3) && bx.type == "meta") {
+                std::vector<item> items;
+                err = read_meta(contents, bx.fpos, r, items);
+                for (size_t i = 0; !err && i < items.size(); i += 1) err = add_item(b, r, items[i], unread);
+            } else if (bx.type == "uuid" && bx.length > 16 && std::equal(xmp_uuid, xmp_uuid + 16, contents.begin())) {
+                r.add(block(b, bx.fpos + 16, bx.length - 16));
+            }
+            if (err) return err;
+            c.seek(bx.fpos + bx.length);
+        }
+    }
+};
+
+struct tiff {
+    static constexpr std::string_view name = "TIFF";
+    static bool matches(bytes b) { return starts(b, 0, {"II*\0", 4}) || starts(b, 0, {"MM\0*", 4}); }
+
+    static int read(bytes b, result &r) {
+        if (b[0] == 'I') return walk<std::endian::little>(b, r);
+        else return walk<std::endian::big>(b, r);
+    }
+
+    /// every IFD reachable from the header, as xmp_from_tiff in xmpblock.c
+    template <std::endian E>
+    static int walk(bytes b, result &r) {
+        static constexpr char length_of_type[14] = {-1, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8, 4};
+        cursor<E> c(b, 4);
+        std::vector<size_t> order;
+        std::unordered_set<size_t> seen;
+        auto queue = [&](size_t offset) { if (offset && seen.insert(offset).second) order.push_back(offset); };
+        queue(c.u32());
+        if (c.overrun) return XMP_ERR_MALFORMED;
+
+        // IFDs, arrays of IFD offsets, and packets do not overlap, so together fit in the file
+        uint64_t unread = b.size();
+        bool reduced = true; // whether the dimensions found are of a reduced-resolution image
+        for (size_t next = 0; next < order.size(); next += 1) {
+            size_t offset = order[next];
+            if (offset < 8 || offset + 2 > b.size()) return XMP_ERR_MALFORMED;
+            c.seek(offset);
+            uint64_t count = c.u16();
+            if (2 + 12*count > unread) return XMP_ERR_MALFORMED;
+            unread -= 2 + 12*count;
+            if (c.left() < 12*count) return XMP_ERR_MALFORMED;
+
+            int width = 0, height = 0;
+            uint32_t subfile = 0;
+            for (uint64_t i = 0; i < count; i += 1) {
+                unsigned tag = c.u16(), type = c.u16();
+                if (type == 0 || type > 13) return XMP_ERR_MALFORMED;
+                uint64_t n = c.u32();
+                uint64_t length = n * length_of_type[type];
+                size_t at = c.pos;
+                uint32_t value = c.u32();
+                if (tag == 254 && type == 4) subfile = value;
+                else if (tag == 256 || tag == 257) {
+                    int &to = (tag == 256) ? width : height;
+                    if (type == 3) { c.seek(at); to = c.u16(); c.seek(at + 4); }
+                    else if (type == 4) to = value;
+                    else return XMP_ERR_MALFORMED;
+                } else if ((tag == 330 || tag == 34665) && (type == 4 || type == 13) && n > 0) {
+                    // SubIFDs, or the EXIF IFD; more than one offset is stored elsewhere
+                    if (tag == 34665 || n == 1) { queue(value); continue; }
+                    if (length > unread || value + length > b.size()) return XMP_ERR_MALFORMED;
+                    unread -= length;
+                    cursor<E> offsets(b, value);
+                    for (uint64_t j = 0; j < n; j += 1) queue(offsets.u32());
+                } else if (tag == 700 && (type == 1 || type == 7) && length > 4) {
+                    if (length > unread || value + length > b.size()) return XMP_ERR_MALFORMED;
+                    unread -= length;
+                    r.add(block(b, value, length));
+                }
+            }
+            // the first full-resolution image's, else the first image's
+            if (width && height && reduced && (!r.width || !(subfile & 1))) {
+                r.width = width;
+                r.height = height;
+                reduced = subfile & 1;
+            }
+            queue(c.u32()); // 0, so ending the chain, if missing
+        }
+        return XMP_OK;
+    }
+};
+
+/// any file with an xpacket wrapper: the first packet, found by scanning
+struct other {
+    static constexpr std::string_view name = "unknown image";
+    static bool matches(bytes) { return true; }
+
+    static constexpr std::string_view header_magic = "W5M0MpCehiHzreSzNTczkc9d'?>";
+    static constexpr std::string_view trailer_magic = "<?xpacket end='w'?>";
+
+    /// Finds the end of `magic`, in which `'` also matches `"` (and, if
+    /// `read_only` is given, `w` also matches `r`, setting it), in bytes
+    /// given to `feed` in order, a piece at a time.
+    struct magic_scan {
+        std::string_view magic;
+        bool *read_only = nullptr;
+        size_t midx = 0;
+
+        /// how many bytes of `b` there are through the end of the magic, or 0 if it is not in them
+        size_t feed(bytes b) {
+            for (size_t i = 0; i < b.size(); i += 1) {
+                unsigned char c = b[i];
+                if (c == magic[midx]) midx += 1;
+                else if (c == '"' && magic[midx] == '\'') midx += 1;
+                else if (c == 'r' && magic[midx] == 'w' && read_only) { midx += 1; *read_only = true; }
+                else midx = 0;
+                if (midx == magic.size()) return i + 1;
+            }
+            return 0;
+        }
+    };
+    /// the position just past `magic` at or after `from`, or 0 if absent
+    static size_t skip_past_magic(bytes b, size_t from, std::string_view magic, bool *read_only = nullptr) {
+        size_t n = magic_scan{magic, read_only}.feed(b.subspan(std::min(from, b.size())));
+        return n ? from + n : 0;
+    }
+    static int read(bytes b, result &r) {
+        size_t start = skip_past_magic(b, 0, header_magic);
+        if (!start) return XMP_ERR_FORMAT;
+        bool read_only = false;
+        size_t end = skip_past_magic(b, start, trailer_magic, &read_only);
+        if (!end) return XMP_ERR_MALFORMED;
+        r.add(block(b, start, end - 19 - start));
+        r.width = -1;
+        r.height = -1;
+        return XMP_OK;
+    }
+};
+///////////////////////////// FORMATS ///////////////////////////////
+
+////////////////////////////// READING //////////////////////////////
+/// Reads `b` as format F, as xmp_from_ does for that format.
+template <format F>
+result read(bytes b) {
+    result r;
+    int err = F::matches(b) ? F::read(b, r) : XMP_ERR_FORMAT;
+    if (err) r.fail(err);
+    return r;
+}
+
+/// Reads `b` as the first of `F...` it matches, or as `other` if none does
+/// or that one finds it is not of its format after all; formats whose
+/// signatures overlap must be listed most specific first.
+template <format... F>
+result read_any(bytes b) {
+    result r;
+    int err = XMP_ERR_FORMAT;
+    bool matched = ((F::matches(b) && (err = F::read(b, r), true)) || ...);
+    if (!matched || err == XMP_ERR_FORMAT) {
+        r = result();
+        err = other::read(b, r);
+    }
+    if (err) r.fail(err);
+    return r;
+}
+
+/// Reads `b` as whichever format its first bytes say it is.
+inline result read(bytes b) { return read_any<png, webp, gif, jpeg, isobmf, tiff>(b); }
+
+/// Maps and reads `filename`; the result keeps the mapping its packets view.
+inline result read_file(const char *filename) {
+    mapped_file file(filename);
+    if (!file) { result r; r.fail(XMP_ERR_OPEN); return r; }
+    result r = read(file.data());
+    r.file = std::move(file);
+    return r;
+}
+////////////////////////////// READING //////////////////////////////
+
+} // namespace xmp
+
+#endif
@@ -0,0 +1,830 @@
+/**
+ * Coroutines reading XMP as xmpblock.hpp does, without blocking a thread
+ * per file:
+ *
+ *     xmp::result r = co_await xmp::read_async("photo.jpg", executor);
+ *
+ * Each container is walked as xmpblock.hpp walks it, but every read the walk
+ * makes (the first bytes; each box, chunk, segment, or IFD header; each
+ * packet) is an awaitable I/O request handed to an executor, which resumes
+ * the walk once the bytes are in. Reads go through a window of at least
+ * xmp::async_readahead bytes, so that most small header reads are served
+ * from memory without suspending.
+ *
+ * xmp::thread_pool performs requests with blocking system calls on its own
+ * threads, and resumes coroutines there. xmp::uring submits them to an
+ * io_uring (Linux 5.6 or later) and resumes coroutines on the one thread
+ * calling its run(), so that a single thread can keep thousands of reads in
+ * flight. Any other event loop can implement xmp::executor.
+ *
+ *     xmp::uring ring;
+ *     for (auto &name : names) xmp::spawn(xmp::read_async(name, ring), [&](xmp::result r) { ... });
+ *     ring.run();
+ *
+ * Packets are copied into memory the result owns, as no mapping is kept.
+ */
+#ifndef XMPBLOCK_ASYNC_HPP
+#define XMPBLOCK_ASYNC_HPP
+
+#include "xmpblock.hpp"
+
+#include <cerrno>
+#include <condition_variable>
+#include <coroutine>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include <atomic>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define XMP_HAVE_URING 1
+#endif
+
+namespace xmp {
+
+/// the least each file's window reads at once
+inline size_t async_readahead = 16 << 10;
+
+////////////////////////////// TASKS ////////////////////////////////
+/// A coroutine giving a T, started by co_awaiting it, which resumes its
+/// awaiter when done (rethrowing anything it threw).
+template <class T>
+class task {
+  public:
+    struct promise_type {
+        T value{};
+        std::exception_ptr thrown;
+        std::coroutine_handle<> awaiter;
+
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept {
+            struct resume_awaiter {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept { return h.promise().awaiter; }
+                void await_resume() noexcept {}
+            };
+            return resume_awaiter{};
+        }
+        void return_value(T v) { value = std::move(v); }
+        void unhandled_exception() { thrown = std::current_exception(); }
+    };
+
+    task(task &&o) noexcept : h(std::exchange(o.h, {})) {}
+    task &operator=(task &&) = delete;
+    task(const task &) = delete;
+    ~task() { if (h) h.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        h.promise().awaiter = awaiter;
+        return h;
+    }
+    T await_resume() {
+        if (h.promise().thrown) std::rethrow_exception(h.promise().thrown);
+        return std::move(h.promise().value);
+    }
+
+  private:
+    explicit task(std::coroutine_handle<promise_type> h) : h(h) {}
+    std::coroutine_handle<promise_type> h;
+};
+
+namespace detail {
+struct detached {
+    struct promise_type {
+        detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+}
+
+/// Starts `t`, returning when it first waits, and calls `done` with its
+/// value when it finishes, on whichever thread resumed it last. Neither
+/// may throw.
+template <class T, class F>
+void spawn(task<T> t, F done) {
+    [](task<T> t, F done) -> detail::detached { done(co_await std::move(t)); }(std::move(t), std::move(done));
+}
+////////////////////////////// TASKS ////////////////////////////////
+
+//////////////////////////// EXECUTORS //////////////////////////////
+/// One I/O request: an executor performs it, sets `result` as the system
+/// call would have returned, or to -errno, and then resumes `waiter`.
+struct io_request {
+    enum kind { open, read, close } op;
+    int fd = -1;
+    const char *path = nullptr; // to open
+    void *buf = nullptr;        // to read into
+    size_t length = 0;
+    uint64_t offset = 0;
+    int64_t result = 0;
+    std::coroutine_handle<> waiter = nullptr;
+};
+
+class executor {
+  public:
+    virtual ~executor() = default;
+    /// performs `r`, and then resumes r.waiter; `r` lives until then
+    virtual void submit(io_request &r) = 0;
+};
+
+/// `co_await io{ex, request}` waits for `ex` to perform `request`, giving its result
+struct io {
+    executor &ex;
+    io_request req;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) { req.waiter = h; ex.submit(req); }
+    int64_t await_resume() const noexcept { return req.result; }
+};
+
+/// performs `r` with a blocking system call
+inline void perform_blocking(io_request &r) {
+    switch (r.op) {
+    case io_request::open: r.result = ::open(r.path, O_RDONLY | O_CLOEXEC); break;
+    case io_request::read:
+        do r.result = ::pread(r.fd, r.buf, r.length, r.offset);
+        while (r.result < 0 && errno == EINTR);
+        break;
+    case io_request::close: r.result = ::close(r.fd); break;
+    }
+    if (r.result < 0) r.result = -errno;
+}
+
+/// Performs requests with blocking system calls on `threads` threads, and
+/// resumes their coroutines there. Waits for all requests when destroyed.
+class thread_pool final : public executor {
+  public:
+    explicit thread_pool(unsigned threads = std::max(1u, std::thread::hardware_concurrency())) {
+        for (unsigned i = 0; i < threads; i += 1) workers.emplace_back([this] { work(); });
+    }
+    ~thread_pool() {
+        { std::lock_guard<std::mutex> lock(m); stopping = true; }
+        ready.notify_all();
+        for (auto &t : workers) t.join();
+    }
+    thread_pool(const thread_pool &) = delete;
+    thread_pool &operator=(const thread_pool &) = delete;
+
+    void submit(io_request &r) override {
+        { std::lock_guard<std::mutex> lock(m); queue.push_back(&r); }
+        ready.notify_one();
+    }
+
+  private:
+    void work() {
+        for (;;) {
+            io_request *r;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                ready.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                r = queue.front();
+                queue.pop_front();
+            }
+            perform_blocking(*r);
+            r->waiter.resume();
+        }
+    }
+
+    std::mutex m;
+    std::condition_variable ready;
+    std::deque<io_request *> queue;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+/// the executor of read_async calls that name none: a thread_pool of one thread per core
+inline executor &default_executor() {
+    static thread_pool pool;
+    return pool;
+}
+
+#ifdef XMP_HAVE_URING
+/// Performs requests with an io_uring, set up with system calls directly
+/// rather than liburing, and resumes their coroutines on the thread calling
+/// run() or poll(); submit must be called on that thread too, as it is from
+/// coroutines it resumes. Requests beyond the rings' room wait their turn.
+/// False if the kernel has no io_uring (or forbids it).
+class uring final : public executor {
+  public:
+    explicit uring(unsigned entries = 256) {
+        io_uring_params p{};
+        ring = int(syscall(__NR_io_uring_setup, entries, &p));
+        if (ring < 0) return;
+        sq_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_bytes = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        sqes_bytes = p.sq_entries * sizeof(io_uring_sqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sq_bytes = cq_bytes = std::max(sq_bytes, cq_bytes);
+        sq_map = map(sq_bytes, IORING_OFF_SQ_RING);
+        cq_map = single ? sq_map : map(cq_bytes, IORING_OFF_CQ_RING);
+        sqes = static_cast<io_uring_sqe *>(map(sqes_bytes, IORING_OFF_SQES));
+        if (!sq_map || !cq_map || !sqes) { release(); return; }
+
+        char *sq = static_cast<char *>(sq_map), *cq = static_cast<char *>(cq_map);
+        sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+        sq_entries = p.sq_entries;
+        cq_entries = p.cq_entries;
+    }
+    ~uring() { release(); }
+    uring(const uring &) = delete;
+    uring &operator=(const uring &) = delete;
+
+    explicit operator bool() const { return ring >= 0; }
+
+    void submit(io_request &r) override { waiting.push_back(&r); }
+
+    /// performs requests, resuming their coroutines, until there are none
+    void run() { while (pending()) step(true); }
+    /// resumes the coroutines of requests already performed, without waiting; gives how many
+    size_t poll() { return step(false); }
+    /// requests submitted and not yet performed
+    size_t pending() const { return in_flight + waiting.size(); }
+
+  private:
+    void *map(size_t bytes, uint64_t offset) {
+        void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, offset);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+    void release() {
+        if (sqes) munmap(sqes, sqes_bytes);
+        if (cq_map && cq_map != sq_map) munmap(cq_map, cq_bytes);
+        if (sq_map) munmap(sq_map, sq_bytes);
+        if (ring >= 0) ::close(ring);
+        sqes = nullptr;
+        sq_map = cq_map = nullptr;
+        ring = -1;
+    }
+
+    /// queues what waiting requests fit, submits them, and resumes what is done
+    size_t step(bool wait) {
+        unsigned tail = *sq_tail;
+        unsigned head = std::atomic_ref<unsigned>(*sq_head).load(std::memory_order_acquire);
+        // at most as many in flight as completions fit, so none are dropped
+        while (!waiting.empty() && tail - head < sq_entries && in_flight < cq_entries) {
+            io_request &r = *waiting.front();
+            waiting.pop_front();
+            unsigned i = tail & sq_mask;
+            io_uring_sqe &e = sqes[i];
+            std::memset(&e, 0, sizeof e);
+            switch (r.op) {
+            case io_request::open:
+                e.opcode = IORING_OP_OPENAT;
+                e.fd = AT_FDCWD;
+                e.addr = reinterpret_cast<uintptr_t>(r.path);
+                e.open_flags = O_RDONLY | O_CLOEXEC;
+                break;
+            case io_request::read:
+                e.opcode = IORING_OP_READ;
+                e.fd = r.fd;
+                e.addr = reinterpret_cast<uintptr_t>(r.buf);
+                e.len = unsigned(std::min<size_t>(r.length, 1u << 30)); // a short read, as pread may give
+                e.off = r.offset;
+                break;
+            case io_request::close:
+                e.opcode = IORING_OP_CLOSE;
+                e.fd = r.fd;
+                break;
+            }
+            e.user_data = reinterpret_cast<uintptr_t>(&r);
+            sq_array[i] = i;
+            tail += 1;
+            in_flight += 1;
+        }
+        std::atomic_ref<unsigned>(*sq_tail).store(tail, std::memory_order_release);
+
+        unsigned to_submit = tail - head;
+        unsigned min_complete = (wait && in_flight) ? 1 : 0;
+        if (to_submit || min_complete) {
+            unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+            while (syscall(__NR_io_uring_enter, ring, to_submit, min_complete, flags, nullptr, 0) < 0 && errno == EINTR) {}
+        }
+
+        size_t done = 0;
+        for (unsigned h = *cq_head; h != std::atomic_ref<unsigned>(*cq_tail).load(std::memory_order_acquire); ) {
+            io_uring_cqe &c = cqes[h & cq_mask];
+            io_request *r = reinterpret_cast<io_request *>(c.user_data);
+            r->result = c.res;
+            h += 1;
+            std::atomic_ref<unsigned>(*cq_head).store(h, std::memory_order_release);
+            in_flight -= 1;
+            done += 1;
+            r->waiter.resume(); // may submit more, or finish and free `r`
+        }
+        return done;
+    }
+
+    int ring = -1;
+    void *sq_map = nullptr, *cq_map = nullptr;
+    size_t sq_bytes = 0, cq_bytes = 0, sqes_bytes = 0;
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_array = nullptr, sq_mask = 0, sq_entries = 0;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr, cq_mask = 0, cq_entries = 0;
+    io_uring_sqe *sqes = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    unsigned in_flight = 0;
+    std::deque<io_request *> waiting;
+};
+#endif
+//////////////////////////// EXECUTORS //////////////////////////////
+
+/////////////////////////////// FILES ///////////////////////////////
+/// A file read by coroutines, through a window of the bytes last read.
+/// A read error looks like the end of the file, as it does to stdio.
+class async_file {
+  public:
+    async_file(executor &ex, int fd, uint64_t size) : ex(ex), fd(fd), length(size) {}
+    uint64_t size() const { return length; }
+
+    /// `co_await f.read(offset, n)` gives the `n` bytes at `offset`, or fewer
+    /// at the end of the file; they are valid until the next read
+    struct window_read {
+        async_file &f;
+        uint64_t offset;
+        size_t n;
+        io_request req{.op = io_request::read};
+
+        bool await_ready() {
+            n = offset < f.length ? std::min<uint64_t>(n, f.length - offset) : 0;
+            return n == 0 || (offset >= f.window_at && offset + n <= f.window_at + f.window_len);
+        }
+        void await_suspend(std::coroutine_handle<> h) {
+            size_t want = std::min<uint64_t>(std::max(n, async_readahead), f.length - offset);
+            if (f.window.size() < want) f.window.resize(want);
+            f.window_len = 0;
+            req.fd = f.fd;
+            req.buf = f.window.data();
+            req.length = want;
+            req.offset = offset;
+            req.waiter = h;
+            f.ex.submit(req);
+        }
+        bytes await_resume() {
+            if (req.waiter) {
+                f.window_at = offset;
+                f.window_len = req.result > 0 ? req.result : 0;
+            }
+            if (n == 0 || offset < f.window_at || offset - f.window_at >= f.window_len) return {};
+            size_t at = offset - f.window_at;
+            return bytes(f.window).subspan(at, std::min(n, f.window_len - at));
+        }
+    };
+    window_read read(uint64_t offset, size_t n) { return {*this, offset, n}; }
+
+    /// `co_await f.byte(offset)` gives the byte at `offset`, or -1 past the end
+    struct byte_read : window_read {
+        int await_resume() {
+            bytes b = window_read::await_resume();
+            return b.empty() ? -1 : b[0];
+        }
+    };
+    byte_read byte(uint64_t offset) { return {{*this, offset, 1}}; }
+
+    /// reads the `n` bytes at `offset` into `to`, without the window, giving how many there were
+    task<size_t> read_into(char *to, uint64_t offset, size_t n) {
+        n = offset < length ? std::min<uint64_t>(n, length - offset) : 0;
+        size_t got = 0;
+        if (offset >= window_at && offset - window_at < window_len) {
+            got = std::min(n, window_len - size_t(offset - window_at));
+            std::memcpy(to, window.data() + (offset - window_at), got);
+        }
+        while (got < n) {
+            io_request req{.op = io_request::read, .fd = fd, .buf = to + got, .length = n - got, .offset = offset + got};
+            int64_t r = co_await io{ex, req};
+            if (r <= 0) break;
+            got += r;
+        }
+        co_return got;
+    }
+
+  private:
+    executor &ex;
+    int fd;
+    uint64_t length;
+    std::vector<unsigned char> window;
+    uint64_t window_at = 0;
+    size_t window_len = 0;
+};
+
+/// adds the packet of the `n` bytes at `offset`, as xmp::block finds it; gives the bytes read
+inline task<size_t> add_block(async_file &f, result &r, uint64_t offset, uint64_t n) {
+    n = offset < f.size() ? std::min(n, f.size() - offset) : 0;
+    if (!n) co_return 0;
+    char *packet = r.own(n);
+    size_t got = co_await f.read_into(packet, offset, n);
+    r.add(trim_block({packet, got}));
+    co_return got;
+}
+/////////////////////////////// FILES ///////////////////////////////
+
+////////////////////////////// WALKERS //////////////////////////////
+/// `async_reader<F>::read(f, r)` walks `f` as `F::read` walks bytes in memory.
+template <class F>
+struct async_reader;
+
+template <>
+struct async_reader<gif> {
+    static task<bool> skip_sub_blocks(async_file &f, uint64_t &pos) {
+        for (;;) {
+            int len = co_await f.byte(pos);
+            if (len < 0) co_return false;
+            pos += 1 + len;
+            if (!len) co_return true;
+        }
+    }
+    /// the position of the first `byte` at or after `pos`, or the end of the file
+    static task<uint64_t> find(async_file &f, uint64_t pos, unsigned char byte) {
+        while (pos < f.size()) {
+            bytes w = co_await f.read(pos, async_readahead);
+            if (w.empty()) break;
+            auto at = std::find(w.begin(), w.end(), byte);
+            if (at != w.end()) co_return pos + (at - w.begin());
+            pos += w.size();
+        }
+        co_return f.size();
+    }
+    static task<int> read(async_file &f, result &r) {
+        bytes h = co_await f.read(0, 13);
+        cursor<std::endian::little> c(h, 6);
+        r.width = c.u16();
+        r.height = c.u16();
+        if (c.overrun) co_return XMP_ERR_MALFORMED; // the file ends within the dimensions
+        if (h[4] == '7') co_return XMP_OK;
+        unsigned flags = c.u8();
+        uint64_t pos = 13;
+        if (flags & 0x80) pos += 6 << (flags & 0x7);
+        for (;;) {
+            int intro = co_await f.byte(pos++);
+            if (intro < 0) co_return XMP_ERR_MALFORMED;
+            if (intro == 0x3B) co_return XMP_OK;
+            if (intro == 0x2C) {
+                pos += 8;
+                int image_flags = co_await f.byte(pos++);
+                if (image_flags > 0 && (image_flags & 0x80)) pos += 6 << (image_flags & 0x7);
+                pos += 1;
+                if (!co_await skip_sub_blocks(f, pos)) co_return XMP_ERR_MALFORMED;
+            } else if (intro == 0x21) {
+                if (co_await f.byte(pos++) == 0xFF) {
+                    if (co_await f.byte(pos++) != 11) co_return XMP_ERR_MALFORMED;
+                    bytes id = co_await f.read(pos, 11);
+                    pos += 11;
+                    if (view(id, 0, 11) == "XMP DataXMP") {
+                        // the packet's bytes are its sub-blocks, up to the magic trailer's 1
+                        uint64_t end = co_await find(f, pos, 1);
+                        co_await add_block(f, r, pos, end - pos);
+                        bytes trailer = co_await f.read(end + 1, 257);
+                        pos = end + 1 + 257;
+                        if (trailer.size() < 257 || trailer[256] != 0) co_return XMP_ERR_MALFORMED;
+                        for (unsigned i = 0; i < 256; i += 1) if (trailer[i] != 0xFF - i) co_return XMP_ERR_MALFORMED;
+                    } else if (!co_await skip_sub_blocks(f, pos)) co_return XMP_ERR_MALFORMED;
+                } else if (!co_await skip_sub_blocks(f, pos)) co_return XMP_ERR_MALFORMED;
+            } else co_return XMP_ERR_MALFORMED;
+        }
+    }
+};
+
+template <>
+struct async_reader<png> {
+    static task<int> read(async_file &f, result &r) {
+        bytes h = co_await f.read(0, 33);
+        cursor<std::endian::big> c(h, 8);
+        if (c.u32() != 13 || !c.is("IHDR")) co_return XMP_ERR_FORMAT;
+        r.width = c.u32();
+        r.height = c.u32();
+        c.skip(5);
+        if (c.overrun || c.u32() != png::crc(h.subspan(12, 17))) co_return XMP_ERR_MALFORMED;
+        for (uint64_t pos = 33; pos < f.size(); ) {
+            bytes chunk = co_await f.read(pos, 30); // length, type, and an iTXt's keyword
+            cursor<std::endian::big> ch(chunk);
+            uint32_t length = ch.u32();
+            if (ch.overrun) break;
+            if (length > 0x7fffffff) co_return XMP_ERR_MALFORMED;
+            if (ch.is("iTXt") && length > 22 && starts(chunk, 8, {"XML:com.adobe.xmp\0\0\0\0\0", 22}))
+                co_await add_block(f, r, pos + 30, length - 22);
+            pos += 12 + uint64_t(length);
+        }
+        co_return XMP_OK;
+    }
+};
+
+template <>
+struct async_reader<webp> {
+    static task<int> read(async_file &f, result &r) {
+        bytes h = co_await f.read(0, 30);
+        cursor<std::endian::little> c(h, 4);
+        if (c.u32() != f.size() - 8) co_return XMP_ERR_MALFORMED;
+        c.skip(8);
+        uint32_t length = c.u32();
+        if (starts(h, 12, "VP8 ")) {
+            c.skip(6);
+            r.width = c.u16();
+            r.height = c.u16();
+            co_return XMP_OK;
+        } else if (starts(h, 12, "VP8L")) {
+            if (c.u8() != 0x2F) co_return XMP_ERR_MALFORMED;
+            uint32_t packed = c.u32();
+            r.width = 1 + (packed & 0x3FFF);
+            r.height = 1 + ((packed>>14) & 0x3FFF);
+            co_return XMP_OK;
+        } else if (!starts(h, 12, "VP8X")) co_return XMP_ERR_FORMAT;
+        c.skip(4);
+        r.width = 1 + c.u24();
+        r.height = 1 + c.u24();
+        uint64_t pos = 30 + uint64_t(uint32_t(length - 10)) + (length & 1);
+        while (pos + 4 <= f.size()) {
+            bytes chunk = co_await f.read(pos, 8);
+            cursor<std::endian::little> ch(chunk);
+            bool xmp = ch.is("XMP ");
+            uint32_t length = ch.u32();
+            if (xmp) co_await add_block(f, r, pos + 8, length);
+            pos += 8 + uint64_t(length) + (length & 1);
+        }
+        co_return XMP_OK;
+    }
+};
+
+template <>
+struct async_reader<jpeg> {
+    static task<int> read(async_file &f, result &r) {
+        char *extended = nullptr;
+        uint32_t extended_len = 0;
+        uint64_t pos = 2;
+        int m0 = co_await f.byte(pos++);
+        while (pos < f.size()) {
+            int m1 = co_await f.byte(pos++);
+            if (m0 == 0xFF && m1 == 0xE1) {
+                uint64_t seg = pos; // segments are measured from their length field
+                bytes h = co_await f.read(seg, 77); // length, extension id, GUID, and extended length and offset
+                cursor<std::endian::big> c(h);
+                unsigned len = c.u16();
+                if (len < 2) co_return XMP_ERR_MALFORMED;
+                if (starts(h, 2, {"http://ns.adobe.com/xap/1.0/", 29})) {
+                    co_await add_block(f, r, seg + 31, len < 31 ? 0 : len - 31);
+                } else if (starts(h, 2, {"http://ns.adobe.com/xmp/extension/", 35}) && !r.packets.empty()) {
+                    std::string_view guid = view(h, 37, 32);
+                    if (guid.size() != 32) co_return XMP_ERR_MALFORMED; // the part is cut short
+                    // searched as far as a NUL, as xmpblock.c's string ends there
+                    std::string_view standard = r.packets[0].substr(0, r.packets[0].find('\0'));
+                    if (standard.find(guid) != std::string_view::npos) {
+                        c.seek(69);
+                        uint32_t ext_len = c.u32(), ext_off = c.u32();
+                        if (len < 77 || ext_len > f.size()) co_return XMP_ERR_MALFORMED;
+                        if (extended && ext_len != extended_len) co_return XMP_ERR_MALFORMED;
+                        if (uint64_t(ext_off) + (len-77) > ext_len) co_return XMP_ERR_MALFORMED;
+                        if (seg + len > f.size()) co_return XMP_ERR_MALFORMED; // the part is cut short
+                        if (!extended) { extended = r.own(ext_len + 1); extended_len = ext_len; }
+                        co_await f.read_into(extended + ext_off, seg + 77, len - 77);
+                    }
+                }
+                pos = std::min<uint64_t>(seg + len, f.size());
+            } else if (m0 == 0xFF && 0xC0 <= m1 && m1 <= 0xCF && m1 != 0xC4 && m1 != 0xCC) {
+                bytes h = co_await f.read(pos + 3, 4);
+                cursor<std::endian::big> c(h);
+                // can contain thumbnails, so look for max
+                r.height = std::max<int>(r.height, c.u16());
+                r.width = std::max<int>(r.width, c.u16());
+                pos += 7;
+            } else if (m0 == 0xFF && m1 == 0xDC) {
+                bytes h = co_await f.read(pos + 2, 2);
+                r.height = std::max<int>(r.height, cursor<std::endian::big>(h).u16());
+                pos += 4;
+            }
+            m0 = m1;
+        }
+        if (extended) r.add({extended, std::char_traits<char>::length(extended)});
+        co_return XMP_OK;
+    }
+};
+
+template <>
+struct async_reader<isobmf> {
+    using box = isobmf::box;
+
+    /// the header of the box at `pos`, with `fpos` in the file
+    static task<box> read_box(async_file &f, uint64_t pos) {
+        bytes h = co_await f.read(pos, 16);
+        isobmf::cur c(h);
+        box ans = isobmf::read_box(c, f.size() - pos);
+        ans.fpos += pos;
+        co_return ans;
+    }
+    static task<int> add_item(async_file &f, result &r, isobmf::item &extents, uint64_t &unread) {
+        uint64_t total;
+        if (!isobmf::locate(extents, f.size(), total)) co_return XMP_OK;
+        if (total > unread) co_return XMP_ERR_MALFORMED;
+        unread -= total;
+        char *packet = r.own(total + 1);
+        size_t at = 0;
+        for (auto &e : extents) at += co_await f.read_into(packet + at, e.offset, e.length);
+        r.add(trim_block({packet, at}));
+        co_return XMP_OK;
+    }
+    static task<int> read(async_file &f, result &r) {
+        int format = 0; // 0 = unknown, 1 = JPEG2000, 2 = HEIC, 3 = AVIF
+        uint64_t unread = f.size();
+        bytes h = co_await f.read(0, 16);
+        isobmf::cur c(h);
+        box top = isobmf::read_box(c, f.size());
+        if (top.type == "jP  " && top.length == 4) {
+            if (!starts(h, 8, "\r\n\x87\n")) co_return XMP_ERR_FORMAT;
+            format = 1;
+        } else if (top.type == "ftyp" && top.length >= 12 && top.fpos + top.length <= f.size()) {
+            format = isobmf::brands(co_await f.read(top.fpos, top.length));
+        } else co_return XMP_ERR_FORMAT;
+
+        for (uint64_t pos = top.fpos + top.length; ; ) {
+            box bx = co_await read_box(f, pos);
+            if (bx.length < 0) co_return XMP_OK;
+            if (bx.fpos + bx.length > f.size()) co_return XMP_ERR_MALFORMED;
+            // bx.type is in the window, so is looked at before reading on
+            enum { other, jp2h, meta, uuid } kind = other;
+            if (format == 1 && bx.type == "jp2h") kind = jp2h;
+            else if ((format == 2 || format == 3) && bx.type == "meta") kind = meta;
+            else if (bx.type == "uuid" && bx.length > 16) kind = uuid;
+
+            int err = XMP_OK;
+            if (kind == jp2h) {
+                err = isobmf::read_jp2h(co_await f.read(bx.fpos, bx.length), r);
+            } else if (kind == meta) {
+                std::vector<isobmf::item> items;
+                err = isobmf::read_meta(co_await f.read(bx.fpos, bx.length), bx.fpos, r, items);
+                for (size_t i = 0; !err && i < items.size(); i += 1) err = co_await add_item(f, r, items[i], unread);
+            } else if (kind == uuid) {
+                bytes id = co_await f.read(bx.fpos, 16);
+                if (id.size() == 16 && std::equal(id.begin(), id.end(), isobmf::xmp_uuid))
+                    co_await add_block(f, r, bx.fpos + 16, bx.length - 16);
+            }
+            if (err) co_return err;
+            pos = bx.fpos + bx.length;
+        }
+    }
+};
+
+template <>
+struct async_reader<tiff> {
+    static task<int> read(async_file &f, result &r) {
+        bytes h = co_await f.read(0, 1);
+        if (h[0] == 'I') co_return co_await walk<std::endian::little>(f, r);
+        else co_return co_await walk<std::endian::big>(f, r);
+    }
+
+    /// every IFD reachable from the header, as tiff::walk
+    template <std::endian E>
+    static task<int> walk(async_file &f, result &r) {
+        static constexpr char length_of_type[14] = {-1, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8, 4};
+        std::vector<uint64_t> order;
+        std::unordered_set<uint64_t> seen;
+        auto queue = [&](uint64_t offset) { if (offset && seen.insert(offset).second) order.push_back(offset); };
+        bytes h = co_await f.read(4, 4);
+        if (h.size() < 4) co_return XMP_ERR_MALFORMED;
+        queue(cursor<E>(h).u32());
+
+        // IFDs, arrays of IFD offsets, and packets do not overlap, so together fit in the file
+        uint64_t unread = f.size();
+        bool reduced = true; // whether the dimensions found are of a reduced-resolution image
+        std::vector<unsigned char> table; // as reading on replaces the window
+        for (size_t next = 0; next < order.size(); next += 1) {
+            uint64_t offset = order[next];
+            if (offset < 8 || offset + 2 > f.size()) co_return XMP_ERR_MALFORMED;
+            uint64_t count = cursor<E>(co_await f.read(offset, 2)).u16();
+            if (2 + 12*count > unread) co_return XMP_ERR_MALFORMED;
+            unread -= 2 + 12*count;
+            if (f.size() - offset - 2 < 12*count) co_return XMP_ERR_MALFORMED;
+            bytes t = co_await f.read(offset + 2, 12*count + 4);
+            table.assign(t.begin(), t.end());
+
+            cursor<E> c(table);
+            int width = 0, height = 0;
+            uint32_t subfile = 0;
+            for (uint64_t i = 0; i < count; i += 1) {
+                unsigned tag = c.u16(), type = c.u16();
+                if (type == 0 || type > 13) co_return XMP_ERR_MALFORMED;
+                uint64_t n = c.u32();
+                uint64_t length = n * length_of_type[type];
+                size_t at = c.pos;
+                uint32_t value = c.u32();
+                if (tag == 254 && type == 4) subfile = value;
+                else if (tag == 256 || tag == 257) {
+                    int &to = (tag == 256) ? width : height;
+                    if (type == 3) { c.seek(at); to = c.u16(); c.seek(at + 4); }
+                    else if (type == 4) to = value;
+                    else co_return XMP_ERR_MALFORMED;
+                } else if ((tag == 330 || tag == 34665) && (type == 4 || type == 13) && n > 0) {
+                    // SubIFDs, or the EXIF IFD; more than one offset is stored elsewhere
+                    if (tag == 34665 || n == 1) { queue(value); continue; }
+                    if (length > unread || value + length > f.size()) co_return XMP_ERR_MALFORMED;
+                    unread -= length;
+                    cursor<E> offsets(co_await f.read(value, length));
+                    for (uint64_t j = 0; j < n; j += 1) queue(offsets.u32());
+                } else if (tag == 700 && (type == 1 || type == 7) && length > 4) {
+                    if (length > unread || value + length > f.size()) co_return XMP_ERR_MALFORMED;
+                    unread -= length;
+                    co_await add_block(f, r, value, length);
+                }
+            }
+            // the first full-resolution image's, else the first image's
+            if (width && height && reduced && (!r.width || !(subfile & 1))) {
+                r.width = width;
+                r.height = height;
+                reduced = subfile & 1;
+            }
+            queue(c.u32()); // 0, so ending the chain, if missing
+        }
+        co_return XMP_OK;
+    }
+};
+
+template <>
+struct async_reader<other> {
+    /// the position just past `magic` at or after `pos`, or 0 if absent
+    static task<uint64_t> skip_past_magic(async_file &f, uint64_t pos, std::string_view magic, bool *read_only = nullptr) {
+        other::magic_scan scan{magic, read_only};
+        while (pos < f.size()) {
+            bytes w = co_await f.read(pos, async_readahead);
+            if (w.empty()) break;
+            size_t n = scan.feed(w);
+            if (n) co_return pos + n;
+            pos += w.size();
+        }
+        co_return 0;
+    }
+    static task<int> read(async_file &f, result &r) {
+        uint64_t start = co_await skip_past_magic(f, 0, other::header_magic);
+        if (!start) co_return XMP_ERR_FORMAT;
+        bool read_only = false;
+        uint64_t end = co_await skip_past_magic(f, start, other::trailer_magic, &read_only);
+        if (!end) co_return XMP_ERR_MALFORMED;
+        co_await add_block(f, r, start, end - 19 - start);
+        r.width = -1;
+        r.height = -1;
+        co_return XMP_OK;
+    }
+};
+////////////////////////////// WALKERS //////////////////////////////
+
+////////////////////////////// READING //////////////////////////////
+/// Walks `f` as the first of `F...` its first bytes match, or as `other` if
+/// none does or that one finds it is not of its format after all, as read_any.
+template <format... F>
+task<int> read_any_async(async_file &f, result &r) {
+    bytes head = co_await f.read(0, 16);
+    std::optional<task<int>> walk; // made, but not started, while `head` is valid
+    (void)((F::matches(head) && (walk.emplace(async_reader<F>::read(f, r)), true)) || ...);
+    if (walk) {
+        int err = co_await std::move(*walk);
+        if (err != XMP_ERR_FORMAT) co_return err;
+        r = result();
+    }
+    co_return co_await async_reader<other>::read(f, r);
+}
+
+/// Reads `filename` as xmp::read_file does, performing its I/O on `ex`.
+inline task<result> read_async(std::string filename, executor &ex = default_executor()) {
+    result r;
+    int64_t fd = co_await io{ex, {.op = io_request::open, .path = filename.c_str()}};
+    if (fd < 0) {
+        r.fail(XMP_ERR_OPEN);
+        co_return r;
+    }
+    int err = XMP_ERR_OPEN;
+    std::exception_ptr thrown;
+    struct stat st;
+    try {
+        if (fstat(int(fd), &st) == 0) { // of an open file, so does not wait on the disk
+            async_file f(ex, int(fd), st.st_size);
+            err = co_await read_any_async<png, webp, gif, jpeg, isobmf, tiff>(f, r);
+        }
+    } catch (...) {
+        thrown = std::current_exception();
+    }
+    co_await io{ex, {.op = io_request::close, .fd = int(fd)}};
+    if (thrown) std::rethrow_exception(thrown);
+    if (err) r.fail(err);
+    co_return r;
+}
+////////////////////////////// READING //////////////////////////////
+
+} // namespace xmp
+
+#endif
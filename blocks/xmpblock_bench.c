@@ -0,0 +1,676 @@
+#include "xmpblock.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+// counts every allocation, including those made by stdio for the library
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static unsigned long allocations;
+void *malloc(size_t size) { allocations += 1; return __libc_malloc(size); }
+void *calloc(size_t count, size_t size) { allocations += 1; return __libc_calloc(count, size); }
+void *realloc(void *ptr, size_t size) { allocations += 1; return __libc_realloc(ptr, size); }
+#define COUNTS_ALLOCATIONS 1
+#endif
+
+// set by command-line options
+static long file_bytes = 1<<20;   // filler bytes in each generated file
+static long packet_bytes = 4096;  // length of the XMP written
+static long chunks = 8;           // skippable chunks the filler is split across
+static int repeat = 50;           // files written and read per format
+static int keep = 0;              // leave generated files for inspection
+
+static char *packet, *standard, *extended;
+
+///////////////////////////// MEASURING /////////////////////////////
+static double seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/// read and write system calls made so far, from /proc/self/io, or -1.
+/// Reading it costs one counted read, which the caller subtracts.
+static long syscalls(void) {
+    char buf[512];
+    int fd = open("/proc/self/io", O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t got = read(fd, buf, sizeof(buf)-1);
+    close(fd);
+    if (got <= 0) return -1;
+    buf[got] = '\0';
+    char *r = strstr(buf, "syscr: "), *w = strstr(buf, "syscw: ");
+    if (!r || !w) return -1;
+    return atol(r+7) + atol(w+7);
+}
+
+typedef struct {
+    double seconds;
+    long syscalls;        // -1 if unknown
+    long allocations;     // -1 if unknown
+} sample;
+
+static void start(sample *s) {
+    s->syscalls = syscalls();
+#ifdef COUNTS_ALLOCATIONS
+    s->allocations = allocations;
+#else
+    s->allocations = -1;
+#endif
+    s->seconds = seconds();
+}
+
+static void stop(sample *s) {
+    s->seconds = seconds() - s->seconds;
+#ifdef COUNTS_ALLOCATIONS
+    s->allocations = allocations - s->allocations;
+#endif
+    long now = syscalls();
+    s->syscalls = (now < 0 || s->syscalls < 0) ? -1 : now - s->syscalls - 1;
+}
+
+static void print_per_file(const char *name, long total) {
+    if (total < 0) printf(",\"%s\":null", name);
+    else printf(",\"%s\":%.1f", name, total / (double)repeat);
+}
+
+/// a local stand-in for a store serving ranged reads, counting the requests
+/// made of it and the bytes they return
+typedef struct {
+    int fd;
+    long size;
+    long requests, bytes;
+} mock_store;
+
+static long mock_read_at(void *ctx, long offset, void *buf, size_t length) {
+    mock_store *m = ctx;
+    ssize_t got = pread(m->fd, buf, length, offset);
+    m->requests += 1;
+    if (got > 0) m->bytes += got;
+    return got;
+}
+static long mock_size(void *ctx) {
+    return ((mock_store *)ctx)->size;
+}
+///////////////////////////// MEASURING /////////////////////////////
+
+///////////////////////////// GENERATING ////////////////////////////
+static void w8(FILE *f, unsigned v) { putc(v & 0xFF, f); }
+static void w16(FILE *f, unsigned v, int le) {
+    if (le) { w8(f, v); w8(f, v>>8); } else { w8(f, v>>8); w8(f, v); }
+}
+static void w24(FILE *f, unsigned v, int le) {
+    if (le) { w8(f, v); w8(f, v>>8); w8(f, v>>16); } else { w8(f, v>>16); w8(f, v>>8); w8(f, v); }
+}
+static void w32(FILE *f, unsigned v, int le) {
+    if (le) { w16(f, v, 1); w16(f, v>>16, 1); } else { w16(f, v>>16, 0); w16(f, v, 0); }
+}
+
+/// bytes below 0x80 that never form an xpacket magic or a JPEG marker
+static void filler(FILE *f, long n) {
+    for(long i=0; i<n; i+=1) putc(0x20 + (i * 2654435761u >> 13) % 0x5F, f);
+}
+
+/// the filler in chunk `i` of `n`, with at most `cap` per chunk; the rest goes
+/// in the last chunk
+static long share(long i, long n, long cap) {
+    long each = file_bytes / n;
+    if (each > cap) each = cap;
+    return (i < n-1) ? each : file_bytes - each * (n-1);
+}
+
+static int make_gif(FILE *f) {
+    fwrite("GIF89a", 1, 6, f);
+    w16(f, 640, 1); w16(f, 480, 1);
+    w8(f, 0x80); w8(f, 0); w8(f, 0);           // 2-entry global color table
+    fwrite("\0\0\0\xff\xff\xff", 1, 6, f);
+    for(long i=0; i<chunks; i+=1) {
+        long n = share(i, chunks, file_bytes);
+        w8(f, 0x21); w8(f, 0xFE);                 // comment extension
+        for(; n > 0; n -= 255) {
+            w8(f, n > 255 ? 255 : n);
+            filler(f, n > 255 ? 255 : n);
+        }
+        w8(f, 0);
+    }
+    w8(f, 0x2C); w16(f, 0, 1); w16(f, 0, 1); w16(f, 640, 1); w16(f, 480, 1);
+    w8(f, 0); w8(f, 2);                            // no local table, LZW code size
+    w8(f, 2); w8(f, 0x44); w8(f, 0x01); w8(f, 0);
+    w8(f, 0x3B);
+    return 1;
+}
+
+static int make_jpeg(FILE *f) {
+    w16(f, 0xFFD8, 0);
+    long rest = file_bytes;
+    for(long i=0; i<chunks; i+=1) {
+        long n = share(i, chunks, 65533);
+        if (i == chunks-1) n = (rest > 65533) ? 65533 : rest;
+        w16(f, 0xFFFE, 0); w16(f, n+2, 0);         // COM
+        filler(f, n);
+        rest -= n;
+    }
+    w16(f, 0xFFC0, 0); w16(f, 11, 0);              // SOF0, one component
+    w8(f, 8); w16(f, 480, 0); w16(f, 640, 0); w8(f, 1); w8(f, 1); w8(f, 0x11); w8(f, 0);
+    w16(f, 0xFFDA, 0); w16(f, 8, 0);               // SOS
+    w8(f, 1); w8(f, 1); w8(f, 0); w8(f, 0); w8(f, 63); w8(f, 0);
+    filler(f, rest);                               // entropy-coded data
+    w16(f, 0xFFD9, 0);
+    return 1;
+}
+
+static unsigned crc_table[256];
+static unsigned crc(unsigned c, const unsigned char *buf, size_t n) {
+    if (!crc_table[1])
+        for(unsigned i=0; i<256; i+=1) {
+            unsigned v = i;
+            for(int k=0; k<8; k+=1) v = (v & 1) ? 0xEDB88320u ^ (v >> 1) : v >> 1;
+            crc_table[i] = v;
+        }
+    c = ~c;
+    for(size_t i=0; i<n; i+=1) c = crc_table[(c ^ buf[i]) & 0xFF] ^ (c >> 8);
+    return ~c;
+}
+static void png_chunk(FILE *f, const char *type, const unsigned char *data, size_t n) {
+    w32(f, n, 0);
+    fwrite(type, 1, 4, f);
+    if (n) fwrite(data, 1, n, f);
+    w32(f, crc(crc(0, (const unsigned char *)type, 4), data, n), 0);
+}
+
+static int make_png(FILE *f) {
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, f);
+    unsigned char ihdr[13] = {0,0,2,0x80, 0,0,1,0xE0, 8, 0, 0, 0, 0};
+    png_chunk(f, "IHDR", ihdr, 13);
+    long most = file_bytes / chunks + file_bytes % chunks + 8;
+    unsigned char *buf = malloc(most);
+    if (!buf) return 0;
+    for(long i=0; i<chunks; i+=1) {
+        long n = share(i, chunks, file_bytes);
+        memcpy(buf, "Comment", 8);
+        for(long k=0; k<n; k+=1) buf[8+k] = 0x20 + (k * 2654435761u >> 13) % 0x5F;
+        png_chunk(f, "tEXt", buf, 8+n);
+    }
+    free(buf);
+    png_chunk(f, "IDAT", (const unsigned char *)"\x78\x01\x01\0\0\xff\xff\0\0\0\x01", 11);
+    png_chunk(f, "IEND", NULL, 0);
+    return 1;
+}
+
+/// RIFF needs the file size, so is filled in after
+static void riff_size(FILE *f) {
+    long size = ftell(f);
+    fseek(f, 4, SEEK_SET);
+    w32(f, size-8, 1);
+    fseek(f, 0, SEEK_END);
+}
+static long even(long n) { return n + (n&1); }
+
+static int make_vp8(FILE *f) {
+    long n = even(10 + file_bytes);
+    fwrite("RIFF\0\0\0\0WEBPVP8 ", 1, 16, f);
+    w32(f, n, 1);
+    w24(f, 0, 1);                                  // frame tag
+    w8(f, 0x9D); w8(f, 0x01); w8(f, 0x2A);         // start code
+    w16(f, 640, 1); w16(f, 480, 1);
+    filler(f, n - 10);
+    riff_size(f);
+    return 1;
+}
+
+static int make_vp8l(FILE *f) {
+    long n = even(5 + file_bytes);
+    fwrite("RIFF\0\0\0\0WEBPVP8L", 1, 16, f);
+    w32(f, n, 1);
+    w8(f, 0x2F);
+    w32(f, (640-1) | (480-1) << 14, 1);
+    filler(f, n - 5);
+    riff_size(f);
+    return 1;
+}
+
+static int make_vp8x(FILE *f) {
+    fwrite("RIFF\0\0\0\0WEBPVP8X", 1, 16, f);
+    w32(f, 10, 1);
+    w32(f, 0, 1);
+    w24(f, 640-1, 1); w24(f, 480-1, 1);
+    for(long i=0; i<chunks; i+=1) {
+        long n = even(share(i, chunks, file_bytes));
+        fwrite("JUNK", 1, 4, f);                   // unknown chunks must be skipped
+        w32(f, n, 1);
+        filler(f, n);
+    }
+    fwrite("VP8L", 1, 4, f);
+    w32(f, 6, 1);
+    w8(f, 0x2F); w32(f, (640-1) | (480-1) << 14, 1); w8(f, 0);
+    riff_size(f);
+    return 1;
+}
+
+/// writes the packet with an xpacket wrapper and 2000 bytes of padding
+static void wrapped_packet(FILE *f) {
+    fputs("<?xpacket begin=\"\xEF\xBB\xBF\" id=\"W5M0MpCehiHzreSzNTczkc9d\"?>\n", f);
+    fputs(packet, f);
+    for(int i=0; i<2000; i+=1) putc((i % 100) ? ' ' : '\n', f);
+    fputs("<?xpacket end=\"w\"?>", f);
+}
+
+/// TIFF is read-only, so the packet is generated in the first of `chunks` IFDs
+static int make_tiff(FILE *f) {
+    fwrite("II", 1, 2, f);
+    w16(f, 42, 1);
+    w32(f, 8, 1);
+    long length = 54 + strlen(packet) + 2000 + 19; // as wrapped_packet writes
+    for(long i=0; i<chunks; i+=1) {
+        long entries = (i == 0) ? 3 : 2;
+        long here = ftell(f), data = here + 2 + 12*entries + 4;
+        long n = share(i, chunks, file_bytes);
+        long next = data + n + ((i == 0) ? length : 0);
+        w16(f, entries, 1);
+        w16(f, 256, 1); w16(f, 3, 1); w32(f, 1, 1); w32(f, 640, 1);
+        w16(f, 257, 1); w16(f, 3, 1); w32(f, 1, 1); w32(f, 480, 1);
+        if (i == 0) { w16(f, 700, 1); w16(f, 7, 1); w32(f, length, 1); w32(f, data + n, 1); }
+        w32(f, (i < chunks-1) ? next : 0, 1);
+        filler(f, n);
+        if (i == 0) wrapped_packet(f);
+    }
+    return 1;
+}
+
+/// like a DNG: IFD0 is a thumbnail, and the `chunks` full-size images are
+/// its SubIFDs, the last of which has the packet
+static int make_dng(FILE *f) {
+    fwrite("II", 1, 2, f);
+    w16(f, 42, 1);
+    w32(f, 8, 1);
+    long length = 54 + strlen(packet) + 2000 + 19; // as wrapped_packet writes
+    long array = 8 + 2 + 12*4 + 4, here = array + ((chunks > 1) ? 4*chunks : 0);
+    w16(f, 4, 1);
+    w16(f, 254, 1); w16(f, 4, 1); w32(f, 1, 1); w32(f, 1, 1); // reduced resolution
+    w16(f, 256, 1); w16(f, 3, 1); w32(f, 1, 1); w32(f, 160, 1);
+    w16(f, 257, 1); w16(f, 3, 1); w32(f, 1, 1); w32(f, 120, 1);
+    w16(f, 330, 1); w16(f, 4, 1); w32(f, chunks, 1); w32(f, (chunks > 1) ? array : here, 1);
+    w32(f, 0, 1);
+    for(long i=0; i<chunks; i+=1) {
+        long entries = (i == chunks-1) ? 4 : 3;
+        long n = share(i, chunks, file_bytes);
+        if (chunks > 1) w32(f, here, 1);
+        here += 2 + 12*entries + 4 + n;
+    }
+    for(long i=0; i<chunks; i+=1) {
+        long entries = (i == chunks-1) ? 4 : 3;
+        long data = ftell(f) + 2 + 12*entries + 4;
+        long n = share(i, chunks, file_bytes);
+        w16(f, entries, 1);
+        w16(f, 254, 1); w16(f, 4, 1); w32(f, 1, 1); w32(f, 0, 1);
+        w16(f, 256, 1); w16(f, 3, 1); w32(f, 1, 1); w32(f, 640, 1);
+        w16(f, 257, 1); w16(f, 3, 1); w32(f, 1, 1); w32(f, 480, 1);
+        if (i == chunks-1) { w16(f, 700, 1); w16(f, 7, 1); w32(f, length, 1); w32(f, data + n, 1); }
+        w32(f, 0, 1);
+        filler(f, n);
+        if (i == chunks-1) wrapped_packet(f);
+    }
+    return 1;
+}
+
+/// writes a box header; `length` includes the 8-byte header
+static void box(FILE *f, long length, const char *type) {
+    w32(f, length, 0);
+    fwrite(type, 1, 4, f);
+}
+
+static int make_heif(FILE *f, const char *brand) {
+    box(f, 24, "ftyp");
+    fwrite(brand, 1, 4, f); w32(f, 0, 0); fwrite("mif1", 1, 4, f); fwrite(brand, 1, 4, f);
+    box(f, 8+4+8+8+20, "meta");
+    w32(f, 0, 0);
+    box(f, 8+8+20, "iprp");
+    box(f, 8+20, "ipco");
+    box(f, 20, "ispe");
+    w32(f, 0, 0); w32(f, 640, 0); w32(f, 480, 0);
+    for(long i=0; i<chunks; i+=1) {
+        long n = share(i, chunks, file_bytes);
+        box(f, 8+n, (i < chunks-1) ? "free" : "mdat");
+        filler(f, n);
+    }
+    return 1;
+}
+static int make_heic(FILE *f) { return make_heif(f, "heic"); }
+static int make_avif(FILE *f) { return make_heif(f, "avif"); }
+
+static int make_jp2(FILE *f) {
+    box(f, 12, "jP  ");
+    fwrite("\r\n\x87\n", 1, 4, f);
+    box(f, 20, "ftyp");
+    fwrite("jp2 ", 1, 4, f); w32(f, 0, 0); fwrite("jp2 ", 1, 4, f);
+    box(f, 8+22, "jp2h");
+    box(f, 22, "ihdr");
+    w32(f, 480, 0); w32(f, 640, 0); w16(f, 3, 0); w8(f, 7); w8(f, 7); w8(f, 0); w8(f, 0);
+    for(long i=0; i<chunks; i+=1) {
+        long n = share(i, chunks, file_bytes);
+        if (i < chunks-1) box(f, 8+n, "free");
+        else box(f, 0, "jp2c");                    // to end of file, as in most JPEG 2000
+        filler(f, n);
+    }
+    return 1;
+}
+
+/// other formats are only written over an existing packet, so one is generated
+static int make_other(FILE *f) {
+    filler(f, file_bytes/2);
+    wrapped_packet(f);
+    filler(f, file_bytes - file_bytes/2);
+    return 1;
+}
+///////////////////////////// GENERATING ////////////////////////////
+
+////////////////////////////// RUNNING //////////////////////////////
+static int to_jpeg_ext(const char *ref, const char *dest, const char *xmp) {
+    return xmp_to_jpeg_ext(ref, dest, standard, extended);
+}
+
+typedef struct {
+    const char *name;
+    int (*make)(FILE *f);
+    int (*to)(const char *ref, const char *dest, const char *xmp); // NULL if read only
+    xmp_rdata (*from)(const char *filename);
+} bench_format;
+
+static const bench_format formats[] = {
+    {"gif", make_gif, xmp_to_gif, xmp_from_gif},
+    {"jpeg", make_jpeg, xmp_to_jpeg, xmp_from_jpeg},
+    {"jpeg_extended", make_jpeg, to_jpeg_ext, xmp_from_jpeg},
+    {"png", make_png, xmp_to_png, xmp_from_png},
+    {"webp_vp8", make_vp8, xmp_to_webp, xmp_from_webp},
+    {"webp_vp8l", make_vp8l, xmp_to_webp, xmp_from_webp},
+    {"webp_vp8x", make_vp8x, xmp_to_webp, xmp_from_webp},
+    {"tiff", make_tiff, NULL, xmp_from_tiff},
+    {"dng", make_dng, NULL, xmp_from_tiff},
+    {"heic", make_heic, xmp_to_isobmf, xmp_from_isobmf},
+    {"avif", make_avif, xmp_to_isobmf, xmp_from_isobmf},
+    {"jp2", make_jp2, xmp_to_isobmf, xmp_from_isobmf},
+    {"other", make_other, xmp_to_other, xmp_from_other},
+};
+
+/// whether a file read back holds exactly what was written
+static int read_back(const bench_format *fmt, xmp_rdata *got) {
+    if (got->width <= 0 && !(got->width == -1 && fmt->make == make_other)) return 0;
+    if (fmt->make == make_dng && got->width != 640) return 0; // not the thumbnail's
+    if (fmt->to == to_jpeg_ext)
+        return got->num_packets == 2 && !strcmp(got->packets[0], standard) && !strcmp(got->packets[1], extended);
+    return got->num_packets == 1 && !strcmp(got->packets[0], packet);
+}
+
+static void free_rdata(xmp_rdata *got) {
+    for(size_t k=0; k<got->num_packets; k+=1) free(got->packets[k]);
+    free(got->packets);
+    free(got->spans);
+}
+
+/// whether the dimensions probed are those read, without packets
+static int probed_back(const xmp_rdata *probed, const xmp_rdata *got) {
+    return !probed->error && !probed->num_packets && !probed->num_spans
+        && probed->width == got->width && probed->height == got->height;
+}
+
+/// reads `name` through a mock_store, with or without a coalescer, with
+/// xmp_from_ or (if `probe`) xmp_probe_dimensions; adds the requests made
+/// and bytes returned to `counts`
+static xmp_rdata read_ranged(const bench_format *fmt, const char *name, int coalesce, int probe, long counts[2]) {
+    xmp_rdata got = {0, 0, 0, NULL, XMP_ERR_OPEN, 0, NULL};
+    struct stat st;
+    mock_store m = {open(name, O_RDONLY), 0, 0, 0};
+    if (m.fd < 0 || fstat(m.fd, &st)) { if (m.fd >= 0) close(m.fd); return got; }
+    m.size = st.st_size;
+    xmp_io io = {mock_read_at, mock_size, &m};
+    xmp_coalescer *c = coalesce ? xmp_coalescer_new(&io, 0) : NULL;
+    const xmp_io *old = xmp_use_io(c ? xmp_coalescer_io(c) : &io);
+    got = probe ? xmp_probe_dimensions(fmt->from, NULL) : fmt->from(NULL);
+    xmp_use_io(old);
+    xmp_coalescer_free(c);
+    close(m.fd);
+    counts[0] += m.requests;
+    counts[1] += m.bytes;
+    return got;
+}
+
+/// drops `name`'s data from the page cache, so that reading it goes to the
+/// disk; returns false if that cannot be done here
+static int evict(const char *name) {
+#ifdef POSIX_FADV_DONTNEED
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) return 0;
+    int ok = !fsync(fd) && !posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return ok;
+#else
+    (void)name;
+    return 0;
+#endif
+}
+
+/// reads `names` from a cold cache in turn (after sorting them with
+/// xmp_order_by_location, if `order`, which is timed too), as a batch on a
+/// spinning disk would; returns the seconds taken, -1 if the cache could not
+/// be emptied, or -2 if a packet read back differs
+static double cold_read(const bench_format *fmt, char **names, int order, long *by_extent) {
+    for(int i=0; i<repeat; i+=1) if (!evict(names[i])) return -1;
+    double t = seconds();
+    if (order) *by_extent = xmp_order_by_location(names, repeat);
+    int same = 1;
+    for(int i=0; i<repeat; i+=1) {
+        xmp_rdata got = fmt->from(names[i]);
+        same = same && read_back(fmt, &got);
+        free_rdata(&got);
+    }
+    t = seconds() - t;
+    return same ? t : -2;
+}
+
+/// prints one line of JSON for one format; returns false if it did not round-trip
+static int run(const bench_format *fmt, const char *dir) {
+    char base[1100], name[1100];
+    snprintf(base, sizeof(base), "%s/base.%s", dir, fmt->name);
+    FILE *f = fopen(base, "wb");
+    if (!f) { perror(base); return 0; }
+    int made = fmt->make(f);
+    fclose(f);
+
+    const char *error = NULL;
+    sample w = {0, -1, -1}, r;
+    double bytes = 0;
+    long ranged[2] = {0, 0}, coalesced[2] = {0, 0}; // requests, bytes
+    long probed_ranged[2] = {0, 0}, probed_coalesced[2] = {0, 0};
+    sample pr;
+    double shuffled = -1, sorted = -1;
+    long by_extent = -1;
+    xmp_rdata *got = calloc(repeat, sizeof(xmp_rdata)), *probed = calloc(repeat, sizeof(xmp_rdata));
+
+    if (!made) error = "could not generate file";
+    else if (fmt->make == make_jpeg && fmt->to == xmp_to_jpeg && packet_bytes > 65000)
+        error = "packet too long for one JPEG segment; see jpeg_extended";
+    else if (fmt->to) {
+        start(&w);
+        for(int i=0; i<repeat && !error; i+=1) {
+            snprintf(name, sizeof(name), "%s/out%d.%s", dir, i, fmt->name);
+            if (!fmt->to(base, name, packet)) error = "write failed";
+        }
+        stop(&w);
+    }
+
+    if (!error) {
+        struct stat st;
+        for(int i=0; i<repeat; i+=1) {
+            if (fmt->to) snprintf(name, sizeof(name), "%s/out%d.%s", dir, i, fmt->name);
+            else snprintf(name, sizeof(name), "%s", base);
+            if (!stat(name, &st)) bytes += st.st_size;
+        }
+        start(&r);
+        for(int i=0; i<repeat; i+=1) {
+            if (fmt->to) snprintf(name, sizeof(name), "%s/out%d.%s", dir, i, fmt->name);
+            got[i] = fmt->from(fmt->to ? name : base);
+        }
+        stop(&r);
+        for(int i=0; i<repeat; i+=1)
+            if (!error && !read_back(fmt, &got[i])) error = "packet read back differs from packet written";
+        for(int i=0; i<repeat && !error; i+=1) {
+            if (fmt->to) snprintf(name, sizeof(name), "%s/out%d.%s", dir, i, fmt->name);
+            for(int coalesce=0; coalesce<2; coalesce+=1) {
+                xmp_rdata again = read_ranged(fmt, fmt->to ? name : base, coalesce, 0, coalesce ? coalesced : ranged);
+                if (!read_back(fmt, &again)) error = "packet read through xmp_io differs from packet written";
+                free_rdata(&again);
+                xmp_rdata probed = read_ranged(fmt, fmt->to ? name : base, coalesce, 1, coalesce ? probed_coalesced : probed_ranged);
+                if (!probed_back(&probed, &got[i])) error = "dimensions probed differ from those read";
+                free_rdata(&probed);
+            }
+        }
+
+        start(&pr);
+        for(int i=0; i<repeat; i+=1) {
+            if (fmt->to) snprintf(name, sizeof(name), "%s/out%d.%s", dir, i, fmt->name);
+            probed[i] = xmp_probe_dimensions(fmt->from, fmt->to ? name : base);
+        }
+        stop(&pr);
+        for(int i=0; i<repeat; i+=1) {
+            if (!error && !probed_back(&probed[i], &got[i])) error = "dimensions probed differ from those read";
+            free_rdata(&probed[i]);
+        }
+
+        // the files were written in turn, so are likely in that order on disk;
+        // reading them shuffled is reading a directory in a random order
+        char **names = fmt->to ? calloc(repeat, sizeof(char *)) : NULL;
+        for(int i=0; names && i<repeat; i+=1) {
+            snprintf(name, sizeof(name), "%s/out%d.%s", dir, i, fmt->name);
+            names[i] = strdup(name);
+        }
+        srand(1);
+        for(int i=repeat-1; names && i>0; i-=1) {
+            int j = rand() % (i+1);
+            char *swap = names[i]; names[i] = names[j]; names[j] = swap;
+        }
+        if (names && !error) shuffled = cold_read(fmt, names, 0, &by_extent);
+        if (names && !error && shuffled >= 0) sorted = cold_read(fmt, names, 1, &by_extent);
+        if (shuffled == -2 || sorted == -2) error = "packet read from a cold cache differs from packet written";
+        for(int i=0; names && i<repeat; i+=1) free(names[i]);
+        free(names);
+    }
+
+    printf("{\"format\":\"%s\",\"file_bytes\":%ld,\"packet_bytes\":%ld,\"chunks\":%ld,\"files\":%d",
+        fmt->name, file_bytes, packet_bytes, chunks, repeat);
+    if (error) printf(",\"error\":\"%s\"}\n", error);
+    else {
+        if (fmt->to) {
+            printf(",\"write_MBps\":%.1f,\"write_files_per_s\":%.1f", bytes / w.seconds / 1e6, repeat / w.seconds);
+            print_per_file("write_syscalls_per_file", w.syscalls);
+            print_per_file("write_allocations_per_file", w.allocations);
+        } else {
+            printf(",\"write_MBps\":null,\"write_files_per_s\":null,\"write_syscalls_per_file\":null,\"write_allocations_per_file\":null");
+        }
+        printf(",\"read_MBps\":%.1f,\"read_files_per_s\":%.1f", bytes / r.seconds / 1e6, repeat / r.seconds);
+        print_per_file("read_syscalls_per_file", r.syscalls);
+        print_per_file("read_allocations_per_file", r.allocations);
+        print_per_file("ranged_requests_per_file", ranged[0]);
+        print_per_file("ranged_bytes_per_file", ranged[1]);
+        print_per_file("coalesced_requests_per_file", coalesced[0]);
+        print_per_file("coalesced_bytes_per_file", coalesced[1]);
+        printf(",\"probe_files_per_s\":%.1f", repeat / pr.seconds);
+        print_per_file("probe_syscalls_per_file", pr.syscalls);
+        print_per_file("probe_ranged_requests_per_file", probed_ranged[0]);
+        print_per_file("probe_ranged_bytes_per_file", probed_ranged[1]);
+        print_per_file("probe_coalesced_requests_per_file", probed_coalesced[0]);
+        print_per_file("probe_coalesced_bytes_per_file", probed_coalesced[1]);
+        if (shuffled > 0 && sorted > 0) {
+            printf(",\"cold_shuffled_files_per_s\":%.1f,\"cold_ordered_files_per_s\":%.1f,\"ordered_speedup\":%.2f,\"ordered_by_extent\":%ld",
+                repeat / shuffled, repeat / sorted, shuffled / sorted, by_extent);
+        } else {
+            printf(",\"cold_shuffled_files_per_s\":null,\"cold_ordered_files_per_s\":null,\"ordered_speedup\":null,\"ordered_by_extent\":null");
+        }
+        printf("}\n");
+    }
+    fflush(stdout);
+
+    for(int i=0; i<repeat; i+=1) {
+        free_rdata(&got[i]);
+        snprintf(name, sizeof(name), "%s/out%d.%s", dir, i, fmt->name);
+        if (!keep) unlink(name);
+    }
+    free(got);
+    free(probed);
+    if (!keep) unlink(base);
+    return !error;
+}
+
+/// a packet of exactly `bytes` characters (or its minimum), optionally
+/// pointing to an extended packet
+static char *synthetic_packet(long bytes, const char *guid) {
+    char head[1024];
+    int n = snprintf(head, sizeof(head),
+        "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\"><rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\">"
+        "<rdf:Description rdf:about=\"\" xmlns:dc=\"http://purl.org/dc/elements/1.1/\"%s%s%s>"
+        "<dc:description><rdf:Alt><rdf:li xml:lang=\"x-default\">",
+        guid ? " xmlns:xmpNote=\"http://ns.adobe.com/xmp/note/\" xmpNote:HasExtendedXMP=\"" : "",
+        guid ? guid : "", guid ? "\"" : "");
+    const char *tail = "</rdf:li></rdf:Alt></dc:description></rdf:Description></rdf:RDF></x:xmpmeta>";
+    long text = bytes - n - (long)strlen(tail);
+    if (text < 1) text = 1;
+    char *xml = malloc(n + text + strlen(tail) + 1);
+    memcpy(xml, head, n);
+    for(long i=0; i<text; i+=1) xml[n+i] = "lorem ipsum dolor sit amet "[i % 27];
+    xml[n+text-1] = '.';
+    strcpy(xml + n + text, tail);
+    return xml;
+}
+////////////////////////////// RUNNING //////////////////////////////
+
+/**
+ * Generates files of each format in a temporary directory, writes XMP into
+ * them with the xmp_to_ functions, reads it back with the xmp_from_ functions,
+ * and prints one line of JSON per format (see README.md).
+ * Formats to run may be named after the options; all are run by default.
+ */
+int main(int argc, char *argv[]) {
+    const char *tmp = getenv("TMPDIR");
+    int opt;
+    while ((opt = getopt(argc, argv, "s:p:c:r:d:k")) != -1) {
+        if (opt == 's') file_bytes = atol(optarg);
+        else if (opt == 'p') packet_bytes = atol(optarg);
+        else if (opt == 'c') chunks = atol(optarg);
+        else if (opt == 'r') repeat = atoi(optarg);
+        else if (opt == 'd') tmp = optarg;
+        else if (opt == 'k') keep = 1;
+        else {
+            fprintf(stderr, "usage: %s [-s file_bytes] [-p packet_bytes] [-c chunks] [-r files] [-d dir] [-k] [format ...]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (file_bytes < 0 || packet_bytes < 0 || chunks < 1 || repeat < 1) {
+        fprintf(stderr, "sizes must not be negative, and chunks and files must be at least 1\n");
+        return 2;
+    }
+
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s/xmpblock_bench.XXXXXX", tmp ? tmp : "/tmp");
+    if (!mkdtemp(dir)) { perror(dir); return 1; }
+
+    const char *guid = "0123456789ABCDEF0123456789ABCDEF";
+    packet = synthetic_packet(packet_bytes, NULL);
+    standard = synthetic_packet(512, guid);
+    extended = synthetic_packet(packet_bytes, NULL);
+
+    int failed = 0;
+    for(size_t i=0; i<sizeof(formats)/sizeof(formats[0]); i+=1) {
+        int wanted = (optind == argc);
+        for(int k=optind; k<argc; k+=1) if (!strcmp(argv[k], formats[i].name)) wanted = 1;
+        if (wanted && !run(&formats[i], dir)) failed = 1;
+    }
+
+    if (!keep) rmdir(dir);
+    free(packet); free(standard); free(extended);
+    return failed;
+}
@@ -86,6 +86,19 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
+        dat = xmp_from_svg(argv[i]);
+        if (dat.width) {
+            printf("SVG %s: %d×%d with %lu packets\n", argv[i], dat.width, dat.height, dat.num_packets);
+            for(int i=0; i<dat.num_packets; i+=1) {
+                puts(dat.packets[i]);
+            }
+            if (xmp_to_svg(argv[i], "output.svg", xmp_to_write))
+                printf("wrote output.svg\n");
+            else
+                printf("WARNING: output.svg already exists, not modified\n");
+            continue;
+        }
+
         dat = xmp_from_other(argv[i]);
         if (dat.width) {
             printf("Unknown %s: %lu packets\n", argv[i], dat.num_packets);
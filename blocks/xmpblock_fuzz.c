@@ -0,0 +1,271 @@
+/*
+ * Fuzz harness for the xmp_from_, xmp_to_ and xmp_update_ functions.
+ *
+ * With libFuzzer (or AFL++'s afl-clang-fast, which accepts the same flags):
+ *
+ *     clang -g -O1 -fsanitize=fuzzer,address,undefined -DXMP_STATS xmpblock_fuzz.c xmpblock.c -o xmpblock_fuzz
+ *     ./xmpblock_fuzz -timeout=2 -report_slow_units=1 fuzz_corpus
+ *
+ * Built with -DXMP_FUZZ_STANDALONE instead of -fsanitize=fuzzer, it replays
+ * files (or directories of them) given as arguments, as for AFL's `@@` or
+ * to re-run a crash with any compiler.
+ *
+ * Each input is read by every reader from memory and through an
+ * xmp_coalescer, written into by every writer, and the output read back. XMP_FUZZ_TARGET may name one format
+ * (gif, isobmf, jpeg, png, webp, tiff, svg, other) to fuzz only that one.
+ *
+ * Besides the sanitizers' crashes, an input is reported (by abort) if one
+ * call does more work than a fixed multiple of the bytes involved, which
+ * catches quadratic or looping code while the inputs are still small, or
+ * runs out of xmp_max_milliseconds (XMP_FUZZ_MAX_MS, 1000 by default).
+ * Work is counted by xmp_stats, so needs XMP_STATS; without it, only time
+ * is checked. At exit the throughput and slowest input per byte are printed.
+ */
+#include "xmpblock.h"
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// work allowed per call: a stdio call costs CALL_COST, a byte moved 1
+#define CALL_COST 16
+#define WORK_PER_BYTE 64
+#define WORK_FIXED (1<<16)
+
+static const char packet[] = "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\"><rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\"/></x:xmpmeta>";
+
+typedef struct {
+    const char *name;
+    xmp_rdata (*read)(const char *);
+    int (*write)(const char *, const char *, const char *);
+} target;
+
+static const target targets[] = {
+    {"gif", xmp_from_gif, xmp_to_gif},
+    {"isobmf", xmp_from_isobmf, xmp_to_isobmf},
+    {"jpeg", xmp_from_jpeg, xmp_to_jpeg},
+    {"png", xmp_from_png, xmp_to_png},
+    {"webp", xmp_from_webp, xmp_to_webp},
+    {"tiff", xmp_from_tiff, NULL},
+    {"svg", xmp_from_svg, xmp_to_svg},
+    {"other", xmp_from_other, xmp_to_other},
+};
+#define NUM_TARGETS (sizeof(targets)/sizeof(targets[0]))
+
+static const target *only;         // from XMP_FUZZ_TARGET, or NULL for all
+static char dir[1024], dest[1100], copy[1100];
+
+///////////////////////////// MEASURING /////////////////////////////
+static xmp_stats stats;
+static unsigned long long inputs, input_bytes, total_ns;
+static double worst_ns_per_byte;
+static size_t worst_size;
+
+static unsigned long long now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static void begin(void) { memset(&stats, 0, sizeof(stats)); }
+
+/// aborts if the call since begin() did superlinear work for `bytes` of input
+static void check_work(const char *what, const target *t, size_t bytes) {
+    if (xmp_last_error() == XMP_ERR_TIMEOUT) {
+        fprintf(stderr, "xmpblock_fuzz: %s %s ran over %ld ms for %zu bytes\n", what, t->name, xmp_max_milliseconds, bytes);
+        abort();
+    }
+    unsigned long long work = CALL_COST * (stats.reads + stats.writes + stats.seeks)
+        + stats.bytes_read + stats.bytes_written;
+    if (work > WORK_PER_BYTE * (unsigned long long)bytes + WORK_FIXED) {
+        fprintf(stderr, "xmpblock_fuzz: %s %s did %llu units of work for %zu bytes\n", what, t->name, work, bytes);
+        abort();
+    }
+}
+
+static void report(void) {
+    rmdir(dir);
+    if (!inputs) return;
+    fprintf(stderr, "xmpblock_fuzz: %llu inputs, %.1f MB/s, %.0f inputs/s; slowest %.0f ns/byte (%zu bytes)\n",
+        inputs, input_bytes / (total_ns * 1e-3), inputs / (total_ns * 1e-9), worst_ns_per_byte, worst_size);
+}
+///////////////////////////// MEASURING /////////////////////////////
+
+////////////////////////////// CHECKING /////////////////////////////
+/// `size` is that of the file read, for checking spans
+static void check_rdata(xmp_rdata d, const char *what, size_t size) {
+    if (d.error && (d.num_packets || d.packets || d.width || d.spans)) {
+        fprintf(stderr, "xmpblock_fuzz: %s returned data with error %d\n", what, d.error);
+        abort();
+    }
+    for(size_t i=0; i<d.num_packets; i+=1) {
+        if (!d.packets[i]) abort();
+        (void)strlen(d.packets[i]); // must be NUL-terminated
+        free(d.packets[i]);
+    }
+    free(d.packets);
+    for(size_t i=0; i<d.num_spans; i+=1) {
+        xmp_span *s = &d.spans[i];
+        if (s->offset < 0 || s->length < 0 || s->at < 0 || (size_t)(s->offset + s->length) > size) {
+            fprintf(stderr, "xmpblock_fuzz: %s returned a span outside the file\n", what);
+            abort();
+        }
+    }
+    free(d.spans);
+}
+
+/// an xmp_io over the input, so that readers also run on xmp_io streams
+typedef struct { const uint8_t *data; size_t size; } input_source;
+
+static long input_read_at(void *ctx, long offset, void *buf, size_t length) {
+    input_source *in = ctx;
+    if (offset < 0) return -1;
+    if ((size_t)offset >= in->size) return 0;
+    if (length > in->size - offset) length = in->size - offset;
+    memcpy(buf, in->data + offset, length);
+    return length;
+}
+static long input_size(void *ctx) {
+    return ((input_source *)ctx)->size;
+}
+
+static void fuzz_target(const target *t, const uint8_t *data, size_t size) {
+    begin();
+    check_rdata(xmp_from_memory(t->read, data, size), t->name, size);
+    check_work("reading", t, size);
+
+    // again, with packets too large to read
+    long max = xmp_max_packet_bytes;
+    xmp_max_packet_bytes = 16;
+    begin();
+    check_rdata(xmp_from_memory(t->read, data, size), t->name, size);
+    check_work("locating", t, size);
+    xmp_max_packet_bytes = max;
+
+    // again, locating the packets read as well
+    xmp_use_locations(1);
+    begin();
+    check_rdata(xmp_from_memory(t->read, data, size), t->name, size);
+    check_work("locating every packet", t, size);
+    xmp_use_locations(0);
+
+    // again, through a coalescer with blocks small enough for inputs to span many
+    input_source in = {data, size};
+    xmp_io io = {input_read_at, input_size, &in};
+    xmp_coalescer *c = xmp_coalescer_new(&io, 64);
+    if (c) {
+        begin();
+        check_rdata(xmp_from_io(t->read, xmp_coalescer_io(c)), t->name, size);
+        check_work("reading through xmp_io", t, size);
+        xmp_coalescer_free(c);
+    }
+
+    if (t->write) {
+        begin();
+        xmp_use_memory(size ? (const void *)data : "", size);
+        int ok = t->write(NULL, dest, packet);
+        xmp_use_memory(NULL, 0);
+        check_work("writing", t, size + sizeof(packet) + xmp_writable_padding);
+        if (ok) {
+            struct stat st;
+            stat(dest, &st);
+            begin();
+            check_rdata(t->read(dest), t->name, st.st_size);
+            check_work("reading back", t, st.st_size);
+        }
+        unlink(dest);
+    }
+
+    if (!strcmp(t->name, "isobmf")) {
+        // updates in place need a real file
+        FILE *f = fopen(copy, "wb");
+        if (!f) return;
+        fwrite(data, 1, size, f);
+        fclose(f);
+        begin();
+        xmp_update_isobmf(copy, packet);
+        check_work("updating", t, size + sizeof(packet) + xmp_writable_padding);
+        unlink(copy);
+    } else if (!strcmp(t->name, "other")) {
+        long offset;
+        size_t length;
+        begin();
+        xmp_use_memory(size ? (const void *)data : "", size);
+        char *found = xmp_packet_in_place(NULL, &offset, &length);
+        xmp_use_memory(NULL, 0);
+        check_work("finding in place", t, size);
+        if (found && (offset < 0 || offset + length > size)) abort();
+        free(found);
+    }
+}
+////////////////////////////// CHECKING /////////////////////////////
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    const char *name = getenv("XMP_FUZZ_TARGET");
+    if (name && *name) {
+        for(size_t i=0; i<NUM_TARGETS; i+=1) if (!strcmp(name, targets[i].name)) only = &targets[i];
+        if (!only) { fprintf(stderr, "xmpblock_fuzz: unknown XMP_FUZZ_TARGET %s\n", name); exit(2); }
+    }
+    const char *tmp = getenv("TMPDIR");
+    snprintf(dir, sizeof(dir), "%s/xmpblock_fuzz.XXXXXX", (tmp && *tmp) ? tmp : "/tmp");
+    if (!mkdtemp(dir)) { perror(dir); exit(2); }
+    snprintf(dest, sizeof(dest), "%s/out", dir);
+    snprintf(copy, sizeof(copy), "%s/in", dir);
+    const char *ms = getenv("XMP_FUZZ_MAX_MS");
+    xmp_max_milliseconds = (ms && *ms) ? atol(ms) : 1000;
+    xmp_writable_padding = 100;
+    xmp_use_stats(&stats);
+    atexit(report);
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    unsigned long long start = now_ns();
+    if (only) fuzz_target(only, data, size);
+    else for(size_t i=0; i<NUM_TARGETS; i+=1) fuzz_target(&targets[i], data, size);
+    unsigned long long ns = now_ns() - start;
+
+    inputs += 1;
+    input_bytes += size;
+    total_ns += ns;
+    double per_byte = (double)ns / (size + 1);
+    if (per_byte > worst_ns_per_byte) { worst_ns_per_byte = per_byte; worst_size = size; }
+    return 0;
+}
+
+#ifdef XMP_FUZZ_STANDALONE
+static void run_path(const char *path) {
+    struct stat st;
+    if (stat(path, &st)) { perror(path); return; }
+    if (S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(path);
+        if (!d) { perror(path); return; }
+        struct dirent *e;
+        while ((e = readdir(d))) {
+            if (e->d_name[0] == '.') continue;
+            char sub[4096];
+            snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name);
+            run_path(sub);
+        }
+        closedir(d);
+        return;
+    }
+    FILE *f = fopen(path, "rb");
+    if (!f) { perror(path); return; }
+    uint8_t *buf = malloc(st.st_size + 1);
+    size_t got = buf ? fread(buf, 1, st.st_size, f) : 0;
+    fclose(f);
+    if (buf) LLVMFuzzerTestOneInput(buf, got);
+    free(buf);
+}
+
+int main(int argc, char **argv) {
+    LLVMFuzzerInitialize(&argc, &argv);
+    for(int i=1; i<argc; i+=1) run_path(argv[i]);
+    return 0;
+}
+#endif
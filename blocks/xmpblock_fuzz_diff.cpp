@@ -0,0 +1,171 @@
+/*
+ * Differential fuzz harness: xmpblock.hpp and xmpblock_async.hpp against xmpblock.c.
+ *
+ * With libFuzzer:
+ *
+ *     clang -g -O1 -fsanitize=fuzzer,address,undefined -c xmpblock.c
+ *     clang++ -std=c++20 -g -O1 -fsanitize=fuzzer,address,undefined xmpblock_fuzz_diff.cpp xmpblock.o -o xmpblock_fuzz_diff
+ *     ./xmpblock_fuzz_diff fuzz_corpus
+ *
+ * Built with -DXMP_FUZZ_STANDALONE instead of -fsanitize=fuzzer, it replays
+ * files (or directories of them) given as arguments, as xmpblock_fuzz.c does.
+ *
+ * Each input is read by every format of the C++ reader, xmp::read<F>, and by
+ * the matching xmp_from_ function from memory, then by xmp::read and by the
+ * xmp_from_ functions in the same order, and last by xmp::read_async on a
+ * thread_pool, from a file, with the default window and with one small
+ * enough for inputs to span many. An input is reported (by abort) if the
+ * readers disagree on the error, the dimensions, or the packets. C packets
+ * end at their first NUL, so C++ packets are compared only that far.
+ * XMP_FUZZ_TARGET may name one format (gif, isobmf, jpeg, png, webp, tiff,
+ * other) to compare only that one.
+ */
+#include "xmpblock.hpp"
+#include "xmpblock_async.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <string_view>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+struct target {
+    const char *name;
+    xmp_rdata (*c_read)(const char *);
+    xmp::result (*cpp_read)(xmp::bytes);
+};
+
+const target targets[] = {
+    {"gif", xmp_from_gif, xmp::read<xmp::gif>},
+    {"isobmf", xmp_from_isobmf, xmp::read<xmp::isobmf>},
+    {"jpeg", xmp_from_jpeg, xmp::read<xmp::jpeg>},
+    {"png", xmp_from_png, xmp::read<xmp::png>},
+    {"webp", xmp_from_webp, xmp::read<xmp::webp>},
+    {"tiff", xmp_from_tiff, xmp::read<xmp::tiff>},
+    {"other", xmp_from_other, xmp::read<xmp::other>},
+};
+
+const target *only; // from XMP_FUZZ_TARGET, or nullptr for all
+const char *input = "input"; // the file being replayed, when standalone
+char dir[1024], copy[1100];   // read_async reads files, so each input is copied to one
+
+///////////////////////////// COMPARING /////////////////////////////
+void print_packet(const char *who, std::string_view p) {
+    fprintf(stderr, "  %s packet, %zu bytes: %.*s%s\n", who, p.size(), int(std::min<size_t>(p.size(), 80)), p.data(), p.size() > 80 ? "..." : "");
+}
+
+/// aborts, describing both, unless `c` and `cpp` found the same
+void compare(const char *what, const xmp::rdata &c, const xmp::result &cpp) {
+    bool same = c->error == cpp.error && c->num_packets == cpp.packets.size();
+    if (same && !c->error) same = c->width == cpp.width && c->height == cpp.height;
+    for (size_t i = 0; same && i < cpp.packets.size(); i += 1) {
+        std::string_view p = cpp.packets[i];
+        same = p.substr(0, p.find('\0')) == c.packets()[i];
+    }
+    if (same) return;
+    fprintf(stderr, "xmpblock_fuzz_diff: %s as %s: C error %d, %dx%d, %zu packets; C++ error %d, %dx%d, %zu packets\n",
+        input, what, c->error, c->width, c->height, c->num_packets, cpp.error, cpp.width, cpp.height, cpp.packets.size());
+    for (const char *p : c.packets()) print_packet("C", p);
+    for (std::string_view p : cpp.packets) print_packet("C++", p);
+    abort();
+}
+
+xmp::rdata c_read(const target &t, const uint8_t *data, size_t size) {
+    return xmp::rdata(xmp_from_memory(t.c_read, size ? (const void *)data : "", size));
+}
+
+/// as xmp::read does: the first format whose reader does not say XMP_ERR_FORMAT, else other
+xmp::rdata c_read_any(const uint8_t *data, size_t size) {
+    for (const target &t : targets) {
+        xmp::rdata d = c_read(t, data, size);
+        if (d->error != XMP_ERR_FORMAT || !strcmp(t.name, "other")) return d;
+    }
+    abort(); // other is last
+}
+
+/// `data` read by xmp::read_async from a file, with a window of at least `readahead` bytes
+xmp::result async_read(const uint8_t *data, size_t size, size_t readahead) {
+    static xmp::thread_pool pool(1);
+    FILE *f = fopen(copy, "wb");
+    if (!f || fwrite(data, 1, size, f) != size || fclose(f)) { perror(copy); exit(2); }
+    size_t old = std::exchange(xmp::async_readahead, readahead);
+    std::promise<xmp::result> done;
+    std::future<xmp::result> got = done.get_future();
+    xmp::spawn(xmp::read_async(copy, pool), [&](xmp::result r) { done.set_value(std::move(r)); });
+    xmp::result r = got.get();
+    xmp::async_readahead = old;
+    unlink(copy);
+    return r;
+}
+///////////////////////////// COMPARING /////////////////////////////
+
+} // namespace
+
+extern "C" int LLVMFuzzerInitialize(int *, char ***) {
+    const char *name = getenv("XMP_FUZZ_TARGET");
+    if (name && *name) {
+        for (const target &t : targets) if (!strcmp(name, t.name)) only = &t;
+        if (!only) { fprintf(stderr, "xmpblock_fuzz_diff: unknown XMP_FUZZ_TARGET %s\n", name); exit(2); }
+    }
+    const char *tmp = getenv("TMPDIR");
+    snprintf(dir, sizeof(dir), "%s/xmpblock_fuzz_diff.XXXXXX", (tmp && *tmp) ? tmp : "/tmp");
+    if (!mkdtemp(dir)) { perror(dir); exit(2); }
+    snprintf(copy, sizeof(copy), "%s/in", dir);
+    atexit([] { rmdir(dir); });
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    xmp::bytes b(data, size);
+    for (const target &t : targets) {
+        if (only && only != &t) continue;
+        compare(t.name, c_read(t, data, size), t.cpp_read(b));
+    }
+    if (!only) {
+        xmp::rdata c = c_read_any(data, size);
+        compare("any format", c, xmp::read(b));
+        compare("any format, async", c, async_read(data, size, xmp::async_readahead));
+        compare("any format, async in small reads", c, async_read(data, size, 64));
+    }
+    return 0;
+}
+
+#ifdef XMP_FUZZ_STANDALONE
+static void run_path(const char *path) {
+    struct stat st;
+    if (stat(path, &st)) { perror(path); return; }
+    if (S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(path);
+        if (!d) { perror(path); return; }
+        struct dirent *e;
+        while ((e = readdir(d))) {
+            if (e->d_name[0] == '.') continue;
+            char sub[4096];
+            snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name);
+            run_path(sub);
+        }
+        closedir(d);
+        return;
+    }
+    FILE *f = fopen(path, "rb");
+    if (!f) { perror(path); return; }
+    uint8_t *buf = (uint8_t *)malloc(st.st_size + 1);
+    size_t got = buf ? fread(buf, 1, st.st_size, f) : 0;
+    fclose(f);
+    input = path;
+    if (buf) LLVMFuzzerTestOneInput(buf, got);
+    free(buf);
+}
+
+int main(int argc, char **argv) {
+    LLVMFuzzerInitialize(&argc, &argv);
+    for (int i = 1; i < argc; i += 1) run_path(argv[i]);
+    return 0;
+}
+#endif
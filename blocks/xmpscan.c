@@ -0,0 +1,1642 @@
+/*
+ * xmpscan: reads (or, with --write, replaces) the XMP of many files at once.
+ *
+ *     cc -O2 -pthread xmpscan.c xmpblock.c -o xmpscan
+ *     xmpscan [options] [path ...]
+ *
+ * Paths may be files or directories, which are walked recursively (without
+ * following symbolic links to directories). With no paths, or `-`, paths are
+ * read from standard input, one per line (or ending in NUL bytes, with -0).
+ * Files are read by a pool of threads, so records come out in no fixed order.
+ * Each file's format is guessed from its first bytes, falling back to SVG and
+ * then to scanning for an xpacket wrapper.
+ *
+ * One record is written per file to standard output, as a line of JSON:
+ *
+ *     {"path":"a.jpg","format":"jpeg","width":640,"height":480,
+ *      "blocks":[{"packet":0,"at":0,"offset":78,"length":3902}],
+ *      "packets":["<x:xmpmeta ..."]}
+ *
+ * with `"error":"..."` added if the file could not be read (or written).
+ * `blocks` says where in the file each packet was found, as xmp_span does.
+ * With -b, records are instead a binary stream: the 8 bytes "XMPSCAN1", then
+ * per file, all integers little-endian,
+ *
+ *     u32 length of the rest of the record
+ *     u8  format, numbered as xmpcol_format is (0 none, 1 gif, ... 8 other)
+ *     u8  error, as returned by xmp_last_error
+ *     i32 width, i32 height
+ *     u32 path length, then the path
+ *     u32 block count, then per block u32 packet, u64 at, u64 offset, u64 length
+ *     u32 packet count, then per packet u32 length, then the packet
+ *
+ * which `xmpscan -d` turns back into JSON lines.
+ *
+ * Options:
+ *     -j, --threads N     read N files at a time (default: one per CPU)
+ *     -b, --binary        write binary records instead of JSON
+ *     -0, --null          paths on standard input end in NUL, not newline
+ *     -p, --probe         find dimensions only (see xmp_probe_dimensions)
+ *     -t, --timeout MS    give up on a file after MS milliseconds
+ *     -w, --write FILE    write the XMP packet in FILE into every file, through
+ *                         a new file renamed over the old (TIFF, and formats
+ *                         not recognized, only over an existing packet with
+ *                         room for it); records are then of the files written
+ *     -s, --suffix SUF    with --write, leave files alone and write each to
+ *                         its path with SUF appended, which must not exist
+ *     -d, --dump          read binary records from standard input and write
+ *                         them as JSON lines
+ *     -O, --ordered       find every path first, then read the files in the
+ *                         order their data is on disk (see
+ *                         xmp_order_by_location), for spinning disks; with
+ *                         -j 1 the reads are strictly in that order
+ *
+ * Run as a daemon, with -S, xmpscan instead answers requests on a Unix socket,
+ * keeping up to `-c` files open (1024 by default) with where their packets
+ * are, so that asking again about a file that has not changed costs a stat
+ * and a read per packet. Each request is, little-endian,
+ *
+ *     u32 length of the rest of the request
+ *     u32 id, returned with the answer
+ *     u8  1 read, 2 locate (blocks without packets), 3 probe, 4 update
+ *     u32 path length, then the path
+ *     for an update, the rest is the packet to write
+ *
+ * and is answered by its id followed by a binary record (from its length on,
+ * without the "XMPSCAN1" that starts a stream). A client may send many
+ * requests without waiting; they are answered by `-j` threads as they finish,
+ * so not in order. The daemon hangs up once a client has stopped sending and
+ * been answered. With -C, xmpscan is such a client, sending a request for
+ * each path it is given (a locate with -l, a probe with -p, an update with
+ * -w) and writing the answers as it would have written its own records.
+ *
+ *     -S, --serve SOCKET  answer requests on SOCKET until killed
+ *     -c, --cache N       when serving, keep N files open
+ *     -C, --connect SOCKET  send requests to the daemon at SOCKET
+ *     -l, --locate        with -C, ask where packets are but not for them
+ *
+ * With -W, xmpscan keeps an index of the files under the paths it is given,
+ * reading each again only once it has changed, and writing its record (or,
+ * for a file removed, one with error "could not open file") as it does. The
+ * index is a file of binary records, described under WATCHING below.
+ *
+ *     -W, --watch INDEX   keep INDEX up to date until killed
+ *     -e, --settle MS     read a file once MS milliseconds have passed since
+ *                         it last changed (default 500), so that a burst of
+ *                         writes to it is read once
+ *     -E, --sweep S       every S seconds, compare every file's size and
+ *                         time with the index too, to find changes missed
+ *                         (default an hour, or a minute without inotify)
+ *     -o, --once          sweep once, index the files changed, and exit
+ *
+ * Exits 1 if any file failed with an error other than being of no known
+ * format, 2 if the options were wrong.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // getdelim, getopt_long
+#endif
+#include "xmpblock.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+// set by command-line options
+static int threads = 0;           // 0 for one per CPU
+static int binary = 0;            // records in binary, not JSON
+static int null_separated = 0;    // paths on stdin end in NUL
+static int probe = 0;             // dimensions only
+static const char *suffix = NULL; // with write_packet, where written files go
+static char *write_packet = NULL; // the packet of --write, if given
+static int locate = 0;            // with --connect, where packets are, not what
+static size_t cache_capacity = 1024; // when serving, files kept open
+static int server = -1;           // with --connect, the daemon's socket
+static int ordered = 0;           // read files in the order they are on disk
+
+static const struct {
+    const char *name;
+    xmp_rdata (*read)(const char *filename);
+    int (*write)(const char *ref, const char *dest, const char *xmp);
+} formats[] = { // in the order of xmpcol_format
+    {"none",   NULL,            NULL},
+    {"gif",    xmp_from_gif,    xmp_to_gif},
+    {"isobmf", xmp_from_isobmf, xmp_to_isobmf},
+    {"jpeg",   xmp_from_jpeg,   xmp_to_jpeg},
+    {"png",    xmp_from_png,    xmp_to_png},
+    {"webp",   xmp_from_webp,   xmp_to_webp},
+    {"tiff",   xmp_from_tiff,   xmp_to_other}, // read only, but may have a packet with room
+    {"svg",    xmp_from_svg,    xmp_to_svg},
+    {"other",  xmp_from_other,  xmp_to_other},
+};
+enum { NONE, GIF, ISOBMF, JPEG, PNG, WEBP, TIFF, SVG, OTHER };
+
+////////////////////////////// RECORDS //////////////////////////////
+/// a growable array of bytes, as in xmpcolumns.c
+typedef struct {
+    char *ptr;
+    size_t len, cap;
+    int failed;
+} bytes;
+
+/// makes room for `len` more bytes; returns false if out of memory
+static int reserve(bytes *b, size_t len) {
+    if (b->failed) return 0;
+    if (b->len + len > b->cap) {
+        size_t want = 2*(b->len + len) + 256;
+        char *bigger = realloc(b->ptr, want);
+        if (!bigger) { b->failed = 1; return 0; }
+        b->ptr = bigger;
+        b->cap = want;
+    }
+    return 1;
+}
+static void put(bytes *b, const void *data, size_t len) {
+    if (!len || !reserve(b, len)) return;
+    memcpy(b->ptr + b->len, data, len);
+    b->len += len;
+}
+static void put_le(bytes *b, uint64_t val, int size) {
+    if (!reserve(b, size)) return;
+    for(int i=0; i<size; i+=1) b->ptr[b->len++] = (char)(val >> (8*i));
+}
+static void put_text(bytes *b, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (len < 0 || !reserve(b, len + 1)) return;
+    va_start(args, fmt);
+    vsnprintf(b->ptr + b->len, len + 1, fmt, args);
+    va_end(args);
+    b->len += len;
+}
+/// a JSON string; bytes over 0x7F are copied as they are, so are UTF-8 only
+/// if the path or packet was
+static void put_json_string(bytes *b, const char *s, size_t len) {
+    put(b, "\"", 1);
+    for(size_t i=0; i<len; i+=1) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') { put(b, "\\", 1); put(b, s+i, 1); }
+        else if (c == '\n') put(b, "\\n", 2);
+        else if (c == '\r') put(b, "\\r", 2);
+        else if (c == '\t') put(b, "\\t", 2);
+        else if (c < 0x20) put_text(b, "\\u%04x", c);
+        else put(b, s+i, 1);
+    }
+    put(b, "\"", 1);
+}
+
+static void put_binary_record(bytes *b, const char *path, int format, int error, const xmp_rdata *dat) {
+    size_t start = b->len;
+    put_le(b, 0, 4); // filled in below
+    put_le(b, format, 1);
+    put_le(b, error, 1);
+    put_le(b, (uint32_t)dat->width, 4);
+    put_le(b, (uint32_t)dat->height, 4);
+    put_le(b, strlen(path), 4);
+    put(b, path, strlen(path));
+    put_le(b, dat->num_spans, 4);
+    for(size_t i=0; i<dat->num_spans; i+=1) {
+        put_le(b, dat->spans[i].packet, 4);
+        put_le(b, dat->spans[i].at, 8);
+        put_le(b, dat->spans[i].offset, 8);
+        put_le(b, dat->spans[i].length, 8);
+    }
+    put_le(b, dat->num_packets, 4);
+    for(size_t i=0; i<dat->num_packets; i+=1) {
+        size_t len = strlen(dat->packets[i]);
+        put_le(b, len, 4);
+        put(b, dat->packets[i], len);
+    }
+    if (b->failed) return;
+    size_t length = b->len - start - 4;
+    for(int i=0; i<4; i+=1) b->ptr[start+i] = (char)(length >> (8*i));
+}
+
+/// appends one file's record to `b`; `error` may differ from `dat->error` if
+/// the file could not be written
+static void put_record(bytes *b, const char *path, int format, int error, const xmp_rdata *dat) {
+    if (binary) {
+        put_binary_record(b, path, format, error, dat);
+        return;
+    }
+    put_text(b, "{\"path\":");
+    put_json_string(b, path, strlen(path));
+    put_text(b, ",\"format\":\"%s\",\"width\":%d,\"height\":%d", formats[format].name, dat->width, dat->height);
+    if (error != XMP_OK) {
+        put_text(b, ",\"error\":");
+        const char *why = xmp_error_string(error);
+        put_json_string(b, why, strlen(why));
+    }
+    if (!probe) {
+        put_text(b, ",\"blocks\":[");
+        for(size_t i=0; i<dat->num_spans; i+=1)
+            put_text(b, "%s{\"packet\":%zu,\"at\":%ld,\"offset\":%ld,\"length\":%ld}", i ? "," : "",
+                dat->spans[i].packet, dat->spans[i].at, dat->spans[i].offset, dat->spans[i].length);
+        put_text(b, "],\"packets\":[");
+        for(size_t i=0; i<dat->num_packets; i+=1) {
+            if (i) put(b, ",", 1);
+            put_json_string(b, dat->packets[i], strlen(dat->packets[i]));
+        }
+        put(b, "]", 1);
+    }
+    put(b, "}\n", 2);
+}
+
+static void free_rdata(xmp_rdata *dat) {
+    for(size_t i=0; i<dat->num_packets; i+=1) free(dat->packets[i]);
+    free(dat->packets);
+    free(dat->spans);
+}
+
+static uint64_t get_le(const unsigned char *p, int size) {
+    uint64_t val = 0;
+    for(int i=size-1; i>=0; i-=1) val = (val << 8) | p[i];
+    return val;
+}
+/// the `n` bytes at `*p`, moving past them, or NULL if fewer are left before `end`
+static const unsigned char *take(const unsigned char **p, const unsigned char *end, size_t n) {
+    if ((size_t)(end - *p) < n) return NULL;
+    *p += n;
+    return *p - n;
+}
+
+/// appends the JSON of the `length`-byte binary record at `rec` (after its
+/// length) to `out`; returns false if it is not a whole record
+static int decode_record(const unsigned char *rec, size_t length, bytes *out) {
+    const unsigned char *p = rec, *end = rec + length, *field;
+    xmp_rdata dat = {0, 0, 0, NULL, 0, 0, NULL};
+    char *name = NULL;
+    const unsigned char *fixed = take(&p, end, 14);
+    if (!fixed || fixed[0] > OTHER) goto cut;
+    dat.width = (int32_t)get_le(fixed+2, 4);
+    dat.height = (int32_t)get_le(fixed+6, 4);
+    uint32_t path_len = get_le(fixed+10, 4);
+    const unsigned char *path = take(&p, end, path_len);
+    if (!path || !(field = take(&p, end, 4))) goto cut;
+    // counts are checked against what is left of the record before allocating
+    dat.num_spans = get_le(field, 4);
+    if (dat.num_spans > (size_t)(end - p) / 28) goto cut;
+    dat.spans = malloc(dat.num_spans * sizeof(xmp_span) + 1);
+    if (!dat.spans) goto cut;
+    for(size_t i=0; i<dat.num_spans; i+=1) {
+        field = take(&p, end, 28);
+        dat.spans[i] = (xmp_span){get_le(field, 4), get_le(field+4, 8), get_le(field+12, 8), get_le(field+20, 8)};
+    }
+    if (!(field = take(&p, end, 4))) goto cut;
+    size_t packets = get_le(field, 4);
+    if (packets > (size_t)(end - p) / 4) goto cut;
+    dat.packets = malloc(packets * sizeof(char *) + 1);
+    if (!dat.packets) goto cut;
+    for(; dat.num_packets < packets; dat.num_packets += 1) {
+        const unsigned char *packet;
+        if (!(field = take(&p, end, 4)) || !(packet = take(&p, end, get_le(field, 4)))) goto cut;
+        dat.packets[dat.num_packets] = strndup((const char *)packet, get_le(field, 4));
+    }
+    name = strndup((const char *)path, path_len);
+    if (name) put_record(out, name, fixed[0], fixed[1], &dat);
+    free(name);
+    free_rdata(&dat);
+    return name != NULL;
+
+cut:
+    free_rdata(&dat);
+    return 0;
+}
+
+/// writes the binary records on standard input as JSON lines; returns false
+/// if they were not binary records, or were cut short
+static int dump(void) {
+    char magic[8];
+    if (fread(magic, 1, 8, stdin) != 8 || memcmp(magic, "XMPSCAN1", 8)) return 0;
+    binary = 0;
+    bytes out = {0};
+    unsigned char head[4];
+    size_t got;
+    int ok = 1;
+    while (ok && (got = fread(head, 1, 4, stdin)) == 4) {
+        uint32_t length = get_le(head, 4);
+        unsigned char *rec = malloc(length + 1);
+        out.len = 0;
+        ok = rec && fread(rec, 1, length, stdin) == length && decode_record(rec, length, &out);
+        if (ok) fwrite(out.ptr, 1, out.len, stdout);
+        free(rec);
+    }
+    free(out.ptr);
+    return ok && got == 0;
+}
+////////////////////////////// RECORDS //////////////////////////////
+
+
+/////////////////////////////// FILES ///////////////////////////////
+/// the format that a file starting with the `got` bytes of `head` looks like, or NONE
+static int guess_format(const unsigned char *head, size_t got) {
+    if (got >= 4 && !memcmp(head, "GIF8", 4)) return GIF;
+    if (got >= 4 && !memcmp(head, "\x89PNG", 4)) return PNG;
+    if (got >= 2 && head[0] == 0xFF && head[1] == 0xD8) return JPEG;
+    if (got >= 12 && !memcmp(head, "RIFF", 4) && !memcmp(head+8, "WEBP", 4)) return WEBP;
+    if (got >= 4 && (!memcmp(head, "II*\0", 4) || !memcmp(head, "MM\0*", 4))) return TIFF;
+    if (got >= 8 && (!memcmp(head+4, "ftyp", 4) || !memcmp(head+4, "jP  ", 4))) return ISOBMF;
+    return NONE;
+}
+static int guess_file(const char *path) {
+    unsigned char head[12];
+    FILE *f = fopen(path, "rb");
+    if (!f) return NONE;
+    size_t got = fread(head, 1, sizeof(head), f);
+    fclose(f);
+    return guess_format(head, got);
+}
+
+/// reads `path` (or if `probing`, its dimensions) with the reader of `guess`,
+/// unless it is not of that format after all, then of SVG, then (if `other`)
+/// of any file with an xpacket; sets `format` to the format it was read as.
+/// Probes for dimensions alone skip `other`, which would take every file
+/// without looking.
+static xmp_rdata read_as(const char *path, int guess, int probing, int other, int *format) {
+    int tries[3] = {guess, SVG, other ? OTHER : NONE};
+    xmp_rdata dat = {0, 0, 0, NULL, 0, 0, NULL};
+    dat.error = XMP_ERR_FORMAT;
+    for(int i=0; i<3; i+=1) {
+        if (tries[i] == NONE || (i == 1 && tries[0] == SVG)) continue;
+        dat = probing ? xmp_probe_dimensions(formats[tries[i]].read, path) : formats[tries[i]].read(path);
+        if (dat.error != XMP_ERR_FORMAT) { *format = tries[i]; return dat; }
+        free_rdata(&dat);
+    }
+    *format = NONE;
+    return dat;
+}
+
+/// writes `packet` into `path` (or `path` with suffix), and appends the
+/// record of the file written, or of why it could not be, to `out`;
+/// returns the record's error
+static int write_file(bytes *out, const char *path, const char *packet, size_t worker) {
+    int format, error = XMP_OK;
+    xmp_rdata dat = read_as(path, guess_file(path), 1, 1, &format); // only the format is needed
+    if (!formats[format].write) error = dat.error ? dat.error : XMP_ERR_FORMAT;
+    char *dest = error ? NULL : malloc(strlen(path) + (suffix ? strlen(suffix) : 0) + 64);
+    if (!error && !dest) error = XMP_ERR_MEMORY;
+    if (error) {
+        put_record(out, path, format, error, &dat);
+        free_rdata(&dat);
+        return error;
+    }
+    if (suffix) sprintf(dest, "%s%s", path, suffix);
+    else sprintf(dest, "%s.xmpscan.%ld.%zu", path, (long)getpid(), worker);
+
+    struct stat st;
+    if (!formats[format].write(path, dest, packet)) error = xmp_last_error();
+    else if (!suffix) {
+        // the new file replaces the old one, which it should look like to others
+        if (!stat(path, &st)) chmod(dest, st.st_mode & 07777);
+        if (rename(dest, path)) { unlink(dest); error = XMP_ERR_WRITE; }
+    }
+    if (error != XMP_OK) {
+        put_record(out, path, format, error, &dat);
+    } else {
+        const char *written = suffix ? dest : path;
+        free_rdata(&dat);
+        dat = probe ? xmp_probe_dimensions(formats[format].read, written) : formats[format].read(written);
+        error = dat.error;
+        put_record(out, written, format, error, &dat);
+    }
+    free_rdata(&dat);
+    free(dest);
+    return error;
+}
+/////////////////////////////// FILES ///////////////////////////////
+
+
+////////////////////////////// THREADS //////////////////////////////
+#define QUEUE_ITEMS 1024
+
+/// paths (or, when serving, requests) waiting for a worker
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t filled, emptied;
+    void *items[QUEUE_ITEMS];
+    size_t head, count;
+    int closed;          // no more items will be added
+} queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static long failures; // files with errors other than XMP_ERR_FORMAT, under output_lock
+
+static void failed(const char *path) {
+    pthread_mutex_lock(&output_lock);
+    perror(path);
+    failures += 1;
+    pthread_mutex_unlock(&output_lock);
+}
+
+/// takes ownership of `item`, waiting while the queue is full
+static void push_item(void *item) {
+    pthread_mutex_lock(&queue.lock);
+    while (queue.count == QUEUE_ITEMS) pthread_cond_wait(&queue.emptied, &queue.lock);
+    queue.items[(queue.head + queue.count) % QUEUE_ITEMS] = item;
+    queue.count += 1;
+    pthread_cond_signal(&queue.filled);
+    pthread_mutex_unlock(&queue.lock);
+}
+/// the next item, or NULL once there are no more
+static void *pop_item(void) {
+    pthread_mutex_lock(&queue.lock);
+    while (!queue.count && !queue.closed) pthread_cond_wait(&queue.filled, &queue.lock);
+    void *item = NULL;
+    if (queue.count) {
+        item = queue.items[queue.head];
+        queue.head = (queue.head + 1) % QUEUE_ITEMS;
+        queue.count -= 1;
+        pthread_cond_signal(&queue.emptied);
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return item;
+}
+static void close_queue(void) {
+    pthread_mutex_lock(&queue.lock);
+    queue.closed = 1;
+    pthread_cond_broadcast(&queue.filled);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+static void send_request(char *path);
+
+/// with --ordered, the paths found, to be sorted before any are read
+static struct {
+    char **paths;
+    size_t count, cap;
+} gathered;
+
+/// takes ownership of `path`, queueing it to be read (or with --connect,
+/// asking the daemon to read it)
+static void add_path(char *path) {
+    if (ordered) {
+        if (gathered.count == gathered.cap) {
+            size_t cap = 2*gathered.cap + 1024;
+            char **bigger = realloc(gathered.paths, cap * sizeof(char *));
+            if (!bigger) { failed(path); free(path); return; }
+            gathered.paths = bigger;
+            gathered.cap = cap;
+        }
+        gathered.paths[gathered.count++] = path;
+    }
+    else if (server >= 0) send_request(path);
+    else push_item(path);
+}
+
+/// with --ordered, queues the paths gathered, in the order they are on disk
+static void add_gathered(void) {
+    if (!ordered) return;
+    ordered = 0; // so that add_path now queues
+    xmp_order_by_location(gathered.paths, gathered.count);
+    for(size_t i=0; i<gathered.count; i+=1) add_path(gathered.paths[i]);
+    free(gathered.paths);
+}
+
+/// adds `path`, or if it is a directory every file under it
+static void add_tree(const char *path, int follow) {
+    struct stat st;
+    if ((follow ? stat(path, &st) : lstat(path, &st))) { failed(path); return; }
+    if (S_ISLNK(st.st_mode)) { // to a file, but not to a directory, which could loop
+        if (stat(path, &st) || S_ISDIR(st.st_mode)) return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        char *copy = strdup(path);
+        if (copy) add_path(copy);
+        return;
+    }
+    DIR *d = opendir(path);
+    if (!d) { failed(path); return; }
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        size_t len = strlen(path);
+        char *sub = malloc(len + strlen(e->d_name) + 2);
+        if (!sub) break;
+        sprintf(sub, "%s%s%s", path, (len && path[len-1] == '/') ? "" : "/", e->d_name);
+        add_tree(sub, 0);
+        free(sub);
+    }
+    closedir(d);
+}
+
+/// adds each path on standard input
+static void add_stdin(void) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getdelim(&line, &cap, null_separated ? '\0' : '\n', stdin)) > 0) {
+        if (line[len-1] == (null_separated ? '\0' : '\n')) line[--len] = '\0';
+        if (len) add_tree(line, 1);
+    }
+    free(line);
+}
+
+static void *worker(void *arg) {
+    size_t id = (size_t)arg;
+    xmp_use_locations(!probe);
+    bytes out = {0};
+    char *path;
+    while ((path = pop_item())) {
+        out.len = 0;
+        int error;
+        if (write_packet) error = write_file(&out, path, write_packet, id);
+        else {
+            int format;
+            xmp_rdata dat = read_as(path, guess_file(path), probe, !probe, &format);
+            error = dat.error;
+            put_record(&out, path, format, error, &dat);
+            free_rdata(&dat);
+        }
+        pthread_mutex_lock(&output_lock);
+        if (out.failed) fprintf(stderr, "%s: %s\n", path, xmp_error_string(XMP_ERR_MEMORY));
+        else fwrite(out.ptr, 1, out.len, stdout);
+        if (out.failed || (error != XMP_OK && error != XMP_ERR_FORMAT)) failures += 1;
+        pthread_mutex_unlock(&output_lock);
+        out.failed = 0;
+        free(path);
+    }
+    free(out.ptr);
+    return NULL;
+}
+////////////////////////////// THREADS //////////////////////////////
+
+////////////////////////////// SERVING //////////////////////////////
+enum { OP_READ = 1, OP_LOCATE, OP_PROBE, OP_UPDATE };
+#define MAX_REQUEST (64 << 20)
+
+/**
+ * A file recently asked about: an open descriptor, which requests read
+ * through an xmp_io instead of reopening the file, and what was found in it,
+ * so that a file already located is read by reading its spans alone. An entry
+ * is used only while the file at its path still has the same inode, size and
+ * times as when it was opened.
+ */
+typedef struct entry {
+    char *path;
+    int fd;
+    struct stat st;
+    int users;                   // requests using fd
+    int dropped;                 // out of the cache; closed once unused
+    int format;                  // NONE until read or probed
+    int width, height;
+    int located;                 // spans has every packet in the file
+    int whole;                   // and each of them is one span, as read
+    size_t num_packets, num_spans;
+    xmp_span *spans;
+    struct entry *prev, *next;   // most recently used first
+    struct entry *chain;         // in the same hash bucket
+} entry;
+
+static struct {
+    pthread_mutex_t lock;
+    entry **buckets;
+    size_t num_buckets, count;
+    entry *first, *last;
+} cache = {PTHREAD_MUTEX_INITIALIZER};
+
+static entry **bucket(const char *path) {
+    uint64_t h = 0xcbf29ce484222325ull; // FNV-1a
+    for(const char *c = path; *c; c += 1) h = (h ^ (unsigned char)*c) * 0x100000001b3ull;
+    return &cache.buckets[h & (cache.num_buckets - 1)];
+}
+static entry *find(const char *path) {
+    entry *e = *bucket(path);
+    while (e && strcmp(e->path, path)) e = e->chain;
+    return e;
+}
+static void free_entry(entry *e) {
+    close(e->fd);
+    free(e->path);
+    free(e->spans);
+    free(e);
+}
+/// takes `e` out of the cache, under cache.lock
+static void drop(entry *e) {
+    entry **at = bucket(e->path);
+    while (*at != e) at = &(*at)->chain;
+    *at = e->chain;
+    if (e->prev) e->prev->next = e->next; else cache.first = e->next;
+    if (e->next) e->next->prev = e->prev; else cache.last = e->prev;
+    cache.count -= 1;
+    e->dropped = 1;
+    if (!e->users) free_entry(e);
+}
+static int same_file(const struct stat *a, const struct stat *b) {
+#ifdef __APPLE__
+    long a_ns = a->st_mtimespec.tv_nsec, b_ns = b->st_mtimespec.tv_nsec;
+#else
+    long a_ns = a->st_mtim.tv_nsec, b_ns = b->st_mtim.tv_nsec;
+#endif
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size
+        && a->st_mtime == b->st_mtime && a_ns == b_ns && a->st_ctime == b->st_ctime;
+}
+
+/// the entry of `path`, opening it if it is not cached or has changed since;
+/// NULL if it cannot be opened. The caller must cache_release it.
+static entry *cache_open(const char *path) {
+    struct stat st;
+    if (stat(path, &st)) return NULL;
+    pthread_mutex_lock(&cache.lock);
+    entry *e = find(path);
+    if (e && same_file(&e->st, &st)) {
+        e->users += 1;
+        if (e != cache.first) { // to the front
+            e->prev->next = e->next;
+            if (e->next) e->next->prev = e->prev; else cache.last = e->prev;
+            e->prev = NULL;
+            e->next = cache.first;
+            cache.first->prev = e;
+            cache.first = e;
+        }
+        pthread_mutex_unlock(&cache.lock);
+        return e;
+    }
+    if (e) drop(e);
+    pthread_mutex_unlock(&cache.lock);
+
+    e = calloc(1, sizeof(entry));
+    if (!e) return NULL;
+    e->fd = open(path, O_RDONLY | O_CLOEXEC);
+    e->path = strdup(path);
+    if (e->fd < 0 || !e->path || fstat(e->fd, &e->st)) {
+        if (e->fd >= 0) close(e->fd);
+        free(e->path);
+        free(e);
+        return NULL;
+    }
+    e->users = 1;
+    pthread_mutex_lock(&cache.lock);
+    entry *other = find(path); // opened by another request meanwhile
+    if (other) drop(other);
+    e->chain = *bucket(path);
+    *bucket(path) = e;
+    e->next = cache.first;
+    if (cache.first) cache.first->prev = e; else cache.last = e;
+    cache.first = e;
+    cache.count += 1;
+    while (cache.count > cache_capacity) drop(cache.last);
+    pthread_mutex_unlock(&cache.lock);
+    return e;
+}
+static void cache_release(entry *e) {
+    pthread_mutex_lock(&cache.lock);
+    e->users -= 1;
+    if (e->dropped && !e->users) free_entry(e);
+    pthread_mutex_unlock(&cache.lock);
+}
+static void cache_forget(const char *path) {
+    pthread_mutex_lock(&cache.lock);
+    entry *e = find(path);
+    if (e) drop(e);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/// records what a request found in `e`'s file
+static void cache_store(entry *e, int op, int format, const xmp_rdata *dat) {
+    if (dat->error != XMP_OK) return;
+    xmp_span *spans = NULL;
+    if (op != OP_PROBE && dat->num_spans) {
+        spans = malloc(dat->num_spans * sizeof(xmp_span));
+        if (!spans) return;
+        memcpy(spans, dat->spans, dat->num_spans * sizeof(xmp_span));
+    }
+    pthread_mutex_lock(&cache.lock);
+    e->format = format;
+    e->width = dat->width;
+    e->height = dat->height;
+    if (op != OP_PROBE) {
+        free(e->spans);
+        e->spans = spans;
+        e->num_spans = dat->num_spans;
+        e->num_packets = dat->num_packets;
+        e->located = 1;
+        e->whole = (dat->num_spans == dat->num_packets);
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/// answers a request from what is cached of `e`, if enough is; returns false if not
+static int cache_answer(entry *e, int op, xmp_rdata *dat, int *format) {
+    pthread_mutex_lock(&cache.lock);
+    int known = (op == OP_PROBE) ? e->format != NONE : e->located && (op == OP_LOCATE || e->whole);
+    if (known) {
+        *format = e->format;
+        dat->width = e->width;
+        dat->height = e->height;
+        if (op != OP_PROBE && e->num_spans) {
+            dat->spans = malloc(e->num_spans * sizeof(xmp_span));
+            if (dat->spans) memcpy(dat->spans, e->spans, e->num_spans * sizeof(xmp_span));
+            dat->num_spans = dat->spans ? e->num_spans : 0;
+            known = dat->spans != NULL;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    if (!known || op != OP_READ) return known;
+
+    // each packet is its one span, so is read with one pread
+    dat->packets = calloc(dat->num_spans + 1, sizeof(char *));
+    for(size_t i=0; dat->packets && i<dat->num_spans; i+=1) {
+        xmp_span *span = &dat->spans[i];
+        char *packet = malloc(span->length + 1);
+        if (!packet || span->packet != i || pread(e->fd, packet, span->length, span->offset) != span->length) {
+            free(packet);
+            free_rdata(dat);
+            *dat = (xmp_rdata){0, 0, 0, NULL, 0, 0, NULL};
+            return 0;
+        }
+        packet[span->length] = '\0';
+        dat->packets[i] = packet;
+        dat->num_packets += 1;
+    }
+    return dat->packets != NULL;
+}
+
+static long entry_read_at(void *ctx, long offset, void *buf, size_t length) {
+    return pread(((entry *)ctx)->fd, buf, length, offset);
+}
+static long entry_size(void *ctx) {
+    return ((entry *)ctx)->st.st_size;
+}
+
+/// a client, shared by the thread reading its requests and those answering them
+typedef struct {
+    int fd;
+    pthread_mutex_t lock;        // responses are written whole
+    int users;                   // the reading thread, and requests not yet answered
+} connection;
+
+typedef struct {
+    connection *from;
+    uint32_t id;
+    int op;
+    char *path;
+    char *packet;                // of OP_UPDATE
+} request;
+
+static void connection_release(connection *c) {
+    pthread_mutex_lock(&c->lock);
+    int users = (c->users -= 1);
+    pthread_mutex_unlock(&c->lock);
+    if (users) return;
+    close(c->fd);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+static int read_full(int fd, void *buf, size_t n) {
+    for(size_t done = 0; done < n; ) {
+        ssize_t got = read(fd, (char *)buf + done, n - done);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return 0;
+        done += got;
+    }
+    return 1;
+}
+static int write_full(int fd, const void *buf, size_t n) {
+    for(size_t done = 0; done < n; ) {
+        ssize_t put = write(fd, (const char *)buf + done, n - done);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return 0;
+        done += put;
+    }
+    return 1;
+}
+
+/// appends the record answering `r` to `out`
+static void answer(bytes *out, request *r, size_t worker) {
+    if (r->op == OP_UPDATE) {
+        cache_forget(r->path);
+        write_file(out, r->path, r->packet, worker);
+        return;
+    }
+    xmp_rdata dat = {0, 0, 0, NULL, 0, 0, NULL};
+    int format = NONE;
+    entry *e = cache_open(r->path);
+    if (!e) {
+        put_record(out, r->path, NONE, XMP_ERR_OPEN, &dat);
+        return;
+    }
+    if (!cache_answer(e, r->op, &dat, &format)) {
+        unsigned char head[12];
+        ssize_t got = pread(e->fd, head, sizeof(head), 0);
+        xmp_io io = {entry_read_at, entry_size, e};
+        const xmp_io *old_io = xmp_use_io(&io);
+        int old_locating = xmp_use_locations(r->op != OP_PROBE);
+        dat = read_as(r->path, guess_format(head, got > 0 ? got : 0), r->op == OP_PROBE, r->op != OP_PROBE, &format);
+        xmp_use_locations(old_locating);
+        xmp_use_io(old_io);
+        cache_store(e, r->op, format, &dat);
+    }
+    if (r->op == OP_LOCATE) { // where the packets are, not what
+        for(size_t i=0; i<dat.num_packets; i+=1) free(dat.packets[i]);
+        dat.num_packets = 0;
+    }
+    put_record(out, r->path, format, dat.error, &dat);
+    free_rdata(&dat);
+    cache_release(e);
+}
+
+static void *serve_worker(void *arg) {
+    size_t id = (size_t)arg;
+    xmp_use_locations(1); // for files written, as answer sets it for the rest
+    bytes out = {0};
+    request *r;
+    while ((r = pop_item())) {
+        out.len = 0;
+        put_le(&out, r->id, 4);
+        answer(&out, r, id);
+        if (out.failed) { // say so in a record small enough to fit
+            xmp_rdata none = {0, 0, 0, NULL, 0, 0, NULL};
+            out.len = 0;
+            out.failed = 0;
+            put_le(&out, r->id, 4);
+            put_record(&out, "", NONE, XMP_ERR_MEMORY, &none);
+        }
+        pthread_mutex_lock(&r->from->lock);
+        write_full(r->from->fd, out.ptr, out.len); // a client gone is not our problem
+        pthread_mutex_unlock(&r->from->lock);
+        connection_release(r->from);
+        free(r);
+    }
+    free(out.ptr);
+    return NULL;
+}
+
+/// queues each request read from a client until it hangs up, or sends
+/// something that is not a request
+static void *read_requests(void *arg) {
+    connection *c = arg;
+    unsigned char head[4];
+    while (read_full(c->fd, head, 4)) {
+        uint32_t length = get_le(head, 4);
+        if (length < 9 || length > MAX_REQUEST) break;
+        request *r = malloc(sizeof(request) + length + 2);
+        if (!r) break;
+        char *text = (char *)(r + 1);
+        if (!read_full(c->fd, text, length)) { free(r); break; }
+        r->id = get_le((unsigned char *)text, 4);
+        r->op = (unsigned char)text[4];
+        uint32_t path_len = get_le((unsigned char *)text + 5, 4);
+        if (r->op < OP_READ || r->op > OP_UPDATE || path_len > length - 9
+            || (r->op != OP_UPDATE && path_len != length - 9)) { free(r); break; }
+        // the path, then the packet, each NUL-terminated, where the request was
+        size_t packet_len = length - 9 - path_len;
+        memmove(text, text + 9, path_len);
+        text[path_len] = '\0';
+        memmove(text + path_len + 1, text + 9 + path_len, packet_len);
+        text[path_len + 1 + packet_len] = '\0';
+        r->path = text;
+        r->packet = text + path_len + 1;
+        r->from = c;
+        pthread_mutex_lock(&c->lock);
+        c->users += 1;
+        pthread_mutex_unlock(&c->lock);
+        push_item(r);
+    }
+    connection_release(c);
+    return NULL;
+}
+
+static const char *serving_at;
+static void stop_serving(int sig) {
+    unlink(serving_at);
+    _exit(128 + sig);
+}
+
+/// answers clients connecting to a socket at `path` until killed
+static int serve(const char *path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) { fprintf(stderr, "%s: socket path too long\n", path); return 1; }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) { perror(path); return 1; }
+    if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "%s: already being served\n", path);
+        return 1;
+    }
+    close(fd);
+    struct stat st;
+    if (!lstat(path, &st)) {
+        if (!S_ISSOCK(st.st_mode)) { fprintf(stderr, "%s: exists and is not a socket\n", path); return 1; }
+        unlink(path); // left by a daemon that did not exit cleanly
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 128)) { perror(path); return 1; }
+
+    // a cached entry holds a descriptor, so there must be enough for them all
+    struct rlimit files;
+    size_t spare = threads + 64;
+    if (!getrlimit(RLIMIT_NOFILE, &files) && files.rlim_cur < cache_capacity + spare) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+        getrlimit(RLIMIT_NOFILE, &files);
+        if (files.rlim_cur < cache_capacity + spare)
+            cache_capacity = files.rlim_cur > 2*spare ? files.rlim_cur - spare : files.rlim_cur/2;
+    }
+    cache.num_buckets = 16;
+    while (cache.num_buckets < 2*cache_capacity) cache.num_buckets *= 2;
+    cache.buckets = calloc(cache.num_buckets, sizeof(entry *));
+    if (!cache.buckets) { perror(path); return 1; }
+
+    serving_at = path;
+    signal(SIGINT, stop_serving);
+    signal(SIGTERM, stop_serving);
+    signal(SIGPIPE, SIG_IGN); // clients that hang up are seen as failed writes
+    binary = 1;
+    for(int i=0; i<threads; i+=1) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, serve_worker, (void *)(size_t)i)) { perror(path); return 1; }
+        pthread_detach(t);
+    }
+    for(;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) continue;
+            perror(path);
+            return 1;
+        }
+        connection *c = calloc(1, sizeof(connection));
+        pthread_t t;
+        if (!c) { close(client); continue; }
+        c->fd = client;
+        c->users = 1;
+        pthread_mutex_init(&c->lock, NULL);
+        if (pthread_create(&t, NULL, read_requests, c)) { connection_release(c); continue; }
+        pthread_detach(t);
+    }
+}
+////////////////////////////// SERVING //////////////////////////////
+
+
+///////////////////////////// CONNECTING ////////////////////////////
+static uint32_t requests_sent;
+
+static int connect_to(const char *path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr))) { close(fd); fd = -1; }
+    return fd;
+}
+
+/// asks the daemon about `path`, without waiting for the answer
+static void send_request(char *path) {
+    int op = write_packet ? OP_UPDATE : probe ? OP_PROBE : locate ? OP_LOCATE : OP_READ;
+    size_t path_len = strlen(path), packet_len = write_packet ? strlen(write_packet) : 0;
+    bytes b = {0};
+    put_le(&b, 9 + path_len + packet_len, 4);
+    put_le(&b, requests_sent, 4);
+    put_le(&b, op, 1);
+    put_le(&b, path_len, 4);
+    put(&b, path, path_len);
+    put(&b, write_packet, packet_len);
+    if (!b.failed && write_full(server, b.ptr, b.len)) requests_sent += 1;
+    else failed(path);
+    free(b.ptr);
+    free(path);
+}
+
+/// writes each answer from the daemon to standard output until it hangs up
+static void *receive_answers(void *arg) {
+    (void)arg;
+    bytes out = {0};
+    unsigned char head[8];
+    while (read_full(server, head, 8)) {
+        uint32_t length = get_le(head + 4, 4);
+        unsigned char *rec = malloc(length + 4);
+        if (!rec || !read_full(server, rec + 4, length)) { free(rec); break; }
+        memcpy(rec, head + 4, 4);
+        out.len = 0;
+        int ok = binary ? (put(&out, rec, length + 4), !out.failed) : decode_record(rec + 4, length, &out);
+        int error = length >= 2 ? rec[5] : XMP_ERR_MALFORMED;
+        pthread_mutex_lock(&output_lock);
+        if (ok) fwrite(out.ptr, 1, out.len, stdout);
+        if (!ok || (error != XMP_OK && error != XMP_ERR_FORMAT)) failures += 1;
+        pthread_mutex_unlock(&output_lock);
+        free(rec);
+    }
+    free(out.ptr);
+    return NULL;
+}
+///////////////////////////// CONNECTING ////////////////////////////
+
+///////////////////////////// WATCHING //////////////////////////////
+/**
+ * With -W, xmpscan keeps an index of every file under the paths it is given,
+ * reading only the files that change. The index is a log: "XMPINDX1", then
+ * for each file read, all integers little-endian,
+ *
+ *     u32 length of the rest of the entry
+ *     u64 size, i64 modification time in seconds, u32 and nanoseconds
+ *     a binary record, from its length on
+ *
+ * of which the last for a path is its current one, and one with error
+ * XMP_ERR_OPEN says the file is gone. Once most of the log has been
+ * superseded it is rewritten with only the current entries.
+ *
+ * Changes are found by inotify where there is one. A file is read once it
+ * has gone `settle_ms` without an event, so a burst of writes to it costs one
+ * read. Every `sweep_s` seconds, and when inotify drops events, the trees are
+ * also walked to compare each file's size and time with its entry, which is
+ * all that happens without inotify, and what --once does before exiting.
+ */
+static long settle_ms = 500;       // quiet after a file's last event before it is read
+static long sweep_s = 0;           // between sweeps; 0 for an hour, or a minute without inotify
+static int once = 0;               // sweep, index what changed, and exit
+
+typedef struct known {
+    char *path;
+    int64_t size, mtime, mtime_ns; // as last indexed
+    long offset, length;           // of its entry in the index; length 0 if none
+    unsigned swept;                // the last sweep that found it
+    int64_t due;                   // when to read it, in ms; 0 if not waiting to be
+    struct known *chain;           // in the same hash bucket
+    struct known *next_due;
+} known;
+
+static struct {
+    pthread_mutex_t lock;          // of all below, for the walking thread and workers
+    known **buckets;
+    size_t num_buckets, count;
+    known *first_due;
+    FILE *log;
+    const char *log_path;
+    struct stat log_st;            // so as not to index the index
+    long log_bytes, live_bytes;
+    unsigned sweep;
+    int64_t next_sweep;            // ms
+    int inotify;                   // -1 if none
+    char **dirs;                   // watched, by watch descriptor
+    size_t num_dirs;
+} watch = {PTHREAD_MUTEX_INITIALIZER};
+
+static volatile sig_atomic_t stopping;
+static void stop_watching(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static int64_t now_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+}
+
+static uint64_t hash_path(const char *path) {
+    uint64_t h = 0xcbf29ce484222325ull; // FNV-1a
+    for(const char *c = path; *c; c += 1) h = (h ^ (unsigned char)*c) * 0x100000001b3ull;
+    return h;
+}
+/// the file at `path`, adding it if `add`; NULL if not known (or out of memory)
+static known *lookup(const char *path, int add) {
+    if (watch.count >= watch.num_buckets) { // grow, rehashing the chains
+        size_t n = watch.num_buckets ? 2*watch.num_buckets : 1024;
+        known **bigger = calloc(n, sizeof(known *));
+        if (bigger) {
+            for(size_t i=0; i<watch.num_buckets; i+=1) {
+                for(known *k = watch.buckets[i], *next; k; k = next) {
+                    next = k->chain;
+                    known **at = &bigger[hash_path(k->path) & (n - 1)];
+                    k->chain = *at;
+                    *at = k;
+                }
+            }
+            free(watch.buckets);
+            watch.buckets = bigger;
+            watch.num_buckets = n;
+        }
+        if (!watch.num_buckets) return NULL;
+    }
+    known **at = &watch.buckets[hash_path(path) & (watch.num_buckets - 1)];
+    for(known *k = *at; k; k = k->chain)
+        if (!strcmp(k->path, path)) return k;
+    if (!add) return NULL;
+    known *k = calloc(1, sizeof(known));
+    if (!k || !(k->path = strdup(path))) { free(k); return NULL; }
+    k->chain = *at;
+    *at = k;
+    watch.count += 1;
+    return k;
+}
+
+/// has `k` read at `due` (or later, if already waiting longer), under watch.lock
+static void mark(known *k, int64_t due) {
+    if (!k) return;
+    if (!k->due) {
+        k->next_due = watch.first_due;
+        watch.first_due = k;
+    }
+    if (due > k->due) k->due = due;
+}
+static long mtime_ns(const struct stat *st) {
+#ifdef __APPLE__
+    return st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_nsec;
+#endif
+}
+static int changed(const known *k, const struct stat *st) {
+    return !k->length || k->size != st->st_size || k->mtime != st->st_mtime || k->mtime_ns != mtime_ns(st);
+}
+
+/// appends the binary `record` of the file `k` as it was at `st` (or, if `st`
+/// is NULL, one saying it is gone) to the index, under watch.lock
+static void log_entry(known *k, const struct stat *st, const bytes *record) {
+    bytes b = {0};
+    put_le(&b, 20 + record->len, 4);
+    put_le(&b, st ? st->st_size : 0, 8);
+    put_le(&b, st ? st->st_mtime : 0, 8);
+    put_le(&b, st ? mtime_ns(st) : 0, 4);
+    put(&b, record->ptr, record->len);
+    if (b.failed) { free(b.ptr); return; }
+    if (fwrite(b.ptr, 1, b.len, watch.log) != b.len || fflush(watch.log)) perror(watch.log_path);
+    watch.live_bytes -= k->length;
+    k->length = 0;
+    if (st) {
+        k->size = st->st_size;
+        k->mtime = st->st_mtime;
+        k->mtime_ns = mtime_ns(st);
+        k->offset = watch.log_bytes;
+        k->length = b.len;
+        watch.live_bytes += b.len;
+    }
+    watch.log_bytes += b.len;
+    free(b.ptr);
+}
+
+/// reads the index at `path` into watch, creating it if there is none, and
+/// cutting off any entry left half-written; returns false if it cannot be used
+static int load_index(const char *path) {
+    watch.log_path = path;
+    FILE *f = fopen(path, "r+b");
+    if (!f) {
+        f = fopen(path, "w+b");
+        if (!f || fwrite("XMPINDX1", 1, 8, f) != 8 || fflush(f)) return 0;
+        fstat(fileno(f), &watch.log_st);
+        watch.log = f;
+        watch.log_bytes = 8;
+        return 1;
+    }
+    char magic[8];
+    size_t got = fread(magic, 1, 8, f);
+    if (!got && feof(f) && fwrite("XMPINDX1", 1, 8, f) == 8) got = 8, memcpy(magic, "XMPINDX1", 8); // made empty for us
+    if (got != 8 || memcmp(magic, "XMPINDX1", 8)) { fclose(f); return 0; }
+    long at = 8;
+    unsigned char head[4];
+    while (fread(head, 1, 4, f) == 4) {
+        uint32_t length = get_le(head, 4);
+        unsigned char *rest = malloc(length + 1);
+        if (!rest || length < 38 || fread(rest, 1, length, f) != length) { free(rest); break; }
+        const unsigned char *rec = rest + 24; // the stat, then the record's length
+        uint32_t path_len = get_le(rec + 10, 4);
+        if (path_len > length - 38) { free(rest); break; }
+        char *name = strndup((const char *)rec + 14, path_len);
+        known *k = name ? lookup(name, 1) : NULL;
+        free(name);
+        if (!k) { free(rest); fclose(f); return 0; }
+        watch.live_bytes -= k->length;
+        if (rec[0] == NONE && rec[1] == XMP_ERR_OPEN) k->length = 0;
+        else {
+            k->size = get_le(rest, 8);
+            k->mtime = (int64_t)get_le(rest + 8, 8);
+            k->mtime_ns = get_le(rest + 16, 4);
+            k->offset = at;
+            k->length = length + 4;
+            watch.live_bytes += k->length;
+        }
+        at += length + 4;
+        free(rest);
+    }
+    if (ftruncate(fileno(f), at) || fseek(f, at, SEEK_SET)) { fclose(f); return 0; }
+    fstat(fileno(f), &watch.log_st);
+    watch.log = f;
+    watch.log_bytes = at;
+    return 1;
+}
+
+/// rewrites the index with only the current entries, once they are under half
+/// of it, under watch.lock
+static void compact_index(void) {
+    if (watch.log_bytes < 2*watch.live_bytes + (1 << 20)) return;
+    char *tmp = malloc(strlen(watch.log_path) + 8);
+    if (!tmp) return;
+    sprintf(tmp, "%s.new", watch.log_path);
+    FILE *t = fopen(tmp, "wb");
+    int ok = t && fwrite("XMPINDX1", 1, 8, t) == 8;
+    long at = 8;
+    char *buf = NULL;
+    size_t cap = 0;
+    fflush(watch.log);
+    for(size_t i=0; ok && i<watch.num_buckets; i+=1) {
+        for(known *k = watch.buckets[i]; ok && k; k = k->chain) {
+            if (!k->length) continue;
+            if ((size_t)k->length > cap) {
+                char *bigger = realloc(buf, k->length);
+                if (!bigger) { ok = 0; break; }
+                buf = bigger;
+                cap = k->length;
+            }
+            ok = pread(fileno(watch.log), buf, k->length, k->offset) == k->length
+                && fwrite(buf, 1, k->length, t) == (size_t)k->length;
+            at += k->length;
+        }
+    }
+    free(buf);
+    if (t && (fclose(t) || !ok)) ok = 0;
+    FILE *now = ok && !rename(tmp, watch.log_path) ? fopen(watch.log_path, "r+b") : NULL;
+    if (!now) {
+        if (!ok) unlink(tmp);
+        free(tmp);
+        return;
+    }
+    fseek(now, 0, SEEK_END);
+    // the offsets are where the loop above put each entry, in the same order
+    long offset = 8;
+    for(size_t i=0; i<watch.num_buckets; i+=1) {
+        for(known *k = watch.buckets[i]; k; k = k->chain) {
+            if (!k->length) continue;
+            k->offset = offset;
+            offset += k->length;
+        }
+    }
+    fclose(watch.log);
+    watch.log = now;
+    watch.log_bytes = at;
+    fstat(fileno(now), &watch.log_st);
+    free(tmp);
+}
+
+/// watches the directory `path`, if there is inotify, under watch.lock
+static void watch_dir(const char *path) {
+#ifdef __linux__
+    if (watch.inotify < 0) return;
+    int wd = inotify_add_watch(watch.inotify, path, IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE
+        | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK);
+    if (wd < 0) { perror(path); return; }
+    if ((size_t)wd >= watch.num_dirs) {
+        size_t n = 2*wd + 64;
+        char **bigger = realloc(watch.dirs, n * sizeof(char *));
+        if (!bigger) return;
+        memset(bigger + watch.num_dirs, 0, (n - watch.num_dirs) * sizeof(char *));
+        watch.dirs = bigger;
+        watch.num_dirs = n;
+    }
+    free(watch.dirs[wd]); // a directory moved keeps its descriptor
+    watch.dirs[wd] = strdup(path);
+#else
+    (void)path;
+#endif
+}
+
+/// walks `path`, watching its directories and marking each file under it
+/// that differs from its entry (or, if `all`, every file) to be read now,
+/// under watch.lock
+static void walk(const char *path, int all) {
+    struct stat st;
+    if (lstat(path, &st)) return;
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_dev == watch.log_st.st_dev && st.st_ino == watch.log_st.st_ino) return;
+        known *k = lookup(path, 1);
+        if (!k) return;
+        k->swept = watch.sweep;
+        if (all || changed(k, &st)) mark(k, now_ms());
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) return;
+    watch_dir(path);
+    DIR *d = opendir(path);
+    if (!d) { perror(path); return; }
+    struct dirent *e;
+    size_t len = strlen(path);
+    while ((e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        char *sub = malloc(len + strlen(e->d_name) + 2);
+        if (!sub) break;
+        sprintf(sub, "%s%s%s", path, (len && path[len-1] == '/') ? "" : "/", e->d_name);
+        walk(sub, all);
+        free(sub);
+    }
+    closedir(d);
+}
+
+/// walks every root, then marks files indexed but not found to be read (and
+/// so found gone), under watch.lock
+static void sweep(char **roots, int num_roots) {
+    watch.sweep += 1;
+    for(int i=0; i<num_roots; i+=1) walk(roots[i], 0);
+    for(size_t i=0; i<watch.num_buckets; i+=1)
+        for(known *k = watch.buckets[i]; k; k = k->chain)
+            if (k->length && k->swept != watch.sweep) mark(k, now_ms());
+    watch.next_sweep = now_ms() + 1000LL * sweep_s;
+}
+
+/// marks each file indexed under the directory `path` to be read
+static void mark_under(const char *path, int64_t due) {
+    size_t len = strlen(path);
+    for(size_t i=0; i<watch.num_buckets; i+=1)
+        for(known *k = watch.buckets[i]; k; k = k->chain)
+            if (k->length && !strncmp(k->path, path, len) && k->path[len] == '/') mark(k, due);
+}
+
+/// handles the events waiting on watch.inotify, under watch.lock
+static void read_events(char **roots, int num_roots) {
+#ifdef __linux__
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t got;
+    while ((got = read(watch.inotify, buf, sizeof(buf))) > 0) {
+        for(char *p = buf; p < buf + got; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) { sweep(roots, num_roots); continue; }
+            if (ev->mask & IN_IGNORED && ev->wd >= 0 && (size_t)ev->wd < watch.num_dirs) {
+                free(watch.dirs[ev->wd]);
+                watch.dirs[ev->wd] = NULL;
+                continue;
+            }
+            if (!ev->len || ev->wd < 0 || (size_t)ev->wd >= watch.num_dirs || !watch.dirs[ev->wd]) continue;
+            const char *dir = watch.dirs[ev->wd];
+            char *path = malloc(strlen(dir) + strlen(ev->name) + 2);
+            if (!path) continue;
+            sprintf(path, "%s/%s", dir, ev->name);
+            int64_t due = now_ms() + settle_ms;
+            if (!(ev->mask & IN_ISDIR)) mark(lookup(path, 1), due);
+            else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) walk(path, 1);
+            else if (ev->mask & IN_DELETE) mark_under(path, due);
+            else if (ev->mask & IN_MOVED_FROM) { // the paths below it are now wrong
+                mark_under(path, due);
+                watch.next_sweep = now_ms();
+            }
+            free(path);
+        }
+    }
+#else
+    (void)roots; (void)num_roots;
+#endif
+}
+
+/// queues the files due to be read by `until`, under watch.lock
+static void queue_due(int64_t until) {
+    char **paths = NULL;
+    size_t count = 0, cap = 0;
+    for(known **at = &watch.first_due; *at; ) {
+        known *k = *at;
+        if (k->due > until) { at = &k->next_due; continue; }
+        if (count == cap) {
+            char **bigger = realloc(paths, (cap = 2*cap + 64) * sizeof(char *));
+            if (!bigger) break; // the rest are left for next time
+            paths = bigger;
+        }
+        if (!(paths[count] = strdup(k->path))) break;
+        count += 1;
+        *at = k->next_due;
+        k->due = 0;
+    }
+    pthread_mutex_unlock(&watch.lock); // workers need it to make room in the queue
+    if (ordered) xmp_order_by_location(paths, count);
+    for(size_t i=0; i<count; i+=1) push_item(paths[i]);
+    pthread_mutex_lock(&watch.lock);
+    free(paths);
+}
+
+static void *index_worker(void *arg) {
+    (void)arg;
+    xmp_use_locations(1);
+    bytes record = {0}, out = {0};
+    char *path;
+    while ((path = pop_item())) {
+        struct stat before, after;
+        xmp_rdata dat = {0, 0, 0, NULL, 0, 0, NULL};
+        int present = !lstat(path, &before) && S_ISREG(before.st_mode), format = NONE, error = XMP_ERR_OPEN;
+        if (present && before.st_dev == watch.log_st.st_dev && before.st_ino == watch.log_st.st_ino) {
+            free(path);
+            continue;
+        }
+        if (present) {
+            dat = read_as(path, guess_file(path), 0, 1, &format);
+            error = dat.error;
+        }
+        record.len = 0;
+        record.failed = 0;
+        put_binary_record(&record, path, format, error, &dat);
+        out.len = 0;
+
+        pthread_mutex_lock(&watch.lock);
+        known *k = lookup(path, 1);
+        if (k && present && (lstat(path, &after) || !same_file(&before, &after))) {
+            mark(k, now_ms() + settle_ms); // changed while being read, so read again once settled
+        } else if (k && !record.failed && (present || k->length)) {
+            log_entry(k, present ? &before : NULL, &record);
+            if (binary) put(&out, record.ptr, record.len);
+            else decode_record((unsigned char *)record.ptr + 4, record.len - 4, &out);
+            compact_index();
+        }
+        pthread_mutex_unlock(&watch.lock);
+
+        if (out.len) {
+            pthread_mutex_lock(&output_lock);
+            fwrite(out.ptr, 1, out.len, stdout);
+            fflush(stdout);
+            pthread_mutex_unlock(&output_lock);
+        }
+        free_rdata(&dat);
+        free(path);
+    }
+    free(record.ptr);
+    free(out.ptr);
+    return NULL;
+}
+
+/// keeps the index at `index_path` up to date with the files under `roots`,
+/// printing the record of each file as it is indexed, until killed (or with
+/// --once, until what changed since the index was last updated is in it)
+static int watch_trees(const char *index_path, char **roots, int num_roots) {
+    if (!load_index(index_path)) { fprintf(stderr, "%s: not an index that can be updated\n", index_path); return 1; }
+    watch.inotify = -1;
+#ifdef __linux__
+    if (!once) {
+        watch.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch.inotify < 0) perror("inotify");
+    }
+#endif
+    if (sweep_s <= 0) sweep_s = watch.inotify >= 0 ? 3600 : 60;
+    if (binary) fwrite("XMPSCAN1", 1, 8, stdout);
+    signal(SIGINT, stop_watching);
+    signal(SIGTERM, stop_watching);
+
+    pthread_t *pool = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    while (pool && started < threads && !pthread_create(&pool[started], NULL, index_worker, NULL))
+        started += 1;
+    if (!started) { perror(index_path); return 1; }
+
+    pthread_mutex_lock(&watch.lock);
+    sweep(roots, num_roots);
+    while (!stopping && !once) {
+        int64_t now = now_ms(), wake = watch.next_sweep;
+        for(known *k = watch.first_due; k; k = k->next_due)
+            if (k->due < wake) wake = k->due;
+        queue_due(now);
+        pthread_mutex_unlock(&watch.lock);
+
+        struct pollfd ready = {watch.inotify, POLLIN, 0};
+        int wait = wake - now < 0 ? 0 : wake - now > 60000 ? 60000 : (int)(wake - now);
+        int events = poll(&ready, watch.inotify >= 0, wait);
+
+        pthread_mutex_lock(&watch.lock);
+        if (events > 0) read_events(roots, num_roots);
+        if (now_ms() >= watch.next_sweep) sweep(roots, num_roots);
+    }
+    queue_due(INT64_MAX); // with --once, all of the sweep; if stopped, what was waiting
+    pthread_mutex_unlock(&watch.lock);
+
+    close_queue();
+    for(int i=0; i<started; i+=1) pthread_join(pool[i], NULL);
+    free(pool);
+    fclose(watch.log);
+    if (fflush(stdout)) { perror("stdout"); return 1; }
+    return 0;
+}
+///////////////////////////// WATCHING //////////////////////////////
+
+
+static char *read_whole(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return NULL;
+    char *ans = NULL;
+    size_t cap = 0;
+    ssize_t len = getdelim(&ans, &cap, '\0', f); // packets have no NUL bytes
+    fclose(f);
+    if (len < 0) { free(ans); return NULL; }
+    return ans;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option options[] = {
+        {"threads", required_argument, NULL, 'j'},
+        {"binary",  no_argument,       NULL, 'b'},
+        {"null",    no_argument,       NULL, '0'},
+        {"probe",   no_argument,       NULL, 'p'},
+        {"timeout", required_argument, NULL, 't'},
+        {"write",   required_argument, NULL, 'w'},
+        {"suffix",  required_argument, NULL, 's'},
+        {"dump",    no_argument,       NULL, 'd'},
+        {"serve",   required_argument, NULL, 'S'},
+        {"cache",   required_argument, NULL, 'c'},
+        {"connect", required_argument, NULL, 'C'},
+        {"locate",  no_argument,       NULL, 'l'},
+        {"watch",   required_argument, NULL, 'W'},
+        {"settle",  required_argument, NULL, 'e'},
+        {"sweep",   required_argument, NULL, 'E'},
+        {"once",    no_argument,       NULL, 'o'},
+        {"ordered", no_argument,       NULL, 'O'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt, dumping = 0;
+    const char *serve_at = NULL, *connect_at = NULL, *index_at = NULL;
+    while ((opt = getopt_long(argc, argv, "j:b0pt:w:s:dS:c:C:lW:e:E:oO", options, NULL)) != -1) {
+        if (opt == 'j') threads = atoi(optarg);
+        else if (opt == 'b') binary = 1;
+        else if (opt == '0') null_separated = 1;
+        else if (opt == 'p') probe = 1;
+        else if (opt == 't') xmp_max_milliseconds = atol(optarg);
+        else if (opt == 'w') {
+            write_packet = read_whole(optarg);
+            if (!write_packet) { perror(optarg); return 2; }
+        }
+        else if (opt == 's') suffix = optarg;
+        else if (opt == 'd') dumping = 1;
+        else if (opt == 'S') serve_at = optarg;
+        else if (opt == 'c') cache_capacity = atol(optarg);
+        else if (opt == 'C') connect_at = optarg;
+        else if (opt == 'l') locate = 1;
+        else if (opt == 'W') index_at = optarg;
+        else if (opt == 'e') settle_ms = atol(optarg);
+        else if (opt == 'E') sweep_s = atol(optarg);
+        else if (opt == 'o') once = 1;
+        else if (opt == 'O') ordered = 1;
+        else {
+            fprintf(stderr, "usage: %s [-j threads] [-b] [-0] [-p] [-O] [-t ms] [-w packet.xmp [-s suffix]] [path ...]\n"
+                            "   or: %s -d < records\n"
+                            "   or: %s -S socket [-j threads] [-c files] [-t ms]\n"
+                            "   or: %s -C socket [-b] [-0] [-O] [-p | -l | -w packet.xmp] [path ...]\n"
+                            "   or: %s -W index [-j threads] [-b] [-O] [-t ms] [-e settle_ms] [-E sweep_s] [-o] path ...\n",
+                            argv[0], argv[0], argv[0], argv[0], argv[0]);
+            return 2;
+        }
+    }
+    if (dumping) {
+        if (!dump()) { fprintf(stderr, "%s: not a complete stream of binary records\n", argv[0]); return 1; }
+        return 0;
+    }
+    if (suffix && (!write_packet || connect_at)) { fprintf(stderr, "%s: -s needs -w, and not -C\n", argv[0]); return 2; }
+    if ((long)cache_capacity < 1) cache_capacity = 1;
+    if (threads < 1) threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    if (serve_at) return serve(serve_at);
+    if (index_at) {
+        if (optind == argc) { fprintf(stderr, "%s: -W needs paths to watch\n", argv[0]); return 2; }
+        return watch_trees(index_at, argv + optind, argc - optind);
+    }
+
+    if (binary) fwrite("XMPSCAN1", 1, 8, stdout);
+    if (connect_at) {
+        server = connect_to(connect_at);
+        if (server < 0) { perror(connect_at); return 1; }
+        signal(SIGPIPE, SIG_IGN);
+        pthread_t receiver;
+        if (pthread_create(&receiver, NULL, receive_answers, NULL)) { perror(argv[0]); return 1; }
+        if (optind == argc) add_stdin();
+        for(int i=optind; i<argc; i+=1) {
+            if (!strcmp(argv[i], "-")) add_stdin();
+            else add_tree(argv[i], 1);
+        }
+        add_gathered();
+        shutdown(server, SHUT_WR); // the daemon hangs up once it has answered
+        pthread_join(receiver, NULL);
+        close(server);
+        free(write_packet);
+        if (fflush(stdout)) { perror(argv[0]); return 1; }
+        return failures ? 1 : 0;
+    }
+
+    pthread_t *pool = malloc(threads * sizeof(pthread_t));
+    if (!pool) { perror(argv[0]); return 1; }
+    int started = 0;
+    while (started < threads && !pthread_create(&pool[started], NULL, worker, (void *)(size_t)started))
+        started += 1;
+    if (!started) { perror(argv[0]); return 1; }
+
+    if (optind == argc) add_stdin();
+    for(int i=optind; i<argc; i+=1) {
+        if (!strcmp(argv[i], "-")) add_stdin();
+        else add_tree(argv[i], 1);
+    }
+    add_gathered();
+
+    close_queue();
+    for(int i=0; i<started; i+=1) pthread_join(pool[i], NULL);
+    free(pool);
+    free(write_packet);
+    if (fflush(stdout)) { perror(argv[0]); return 1; }
+    return failures ? 1 : 0;
+}
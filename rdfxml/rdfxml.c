@@ -0,0 +1,1078 @@
+#include "rdfxml.h"
+#include <stdlib.h> // malloc, free
+#include <stdint.h> // uint32_t
+#include <string.h> // memchr, memcmp, memcpy, strlen
+
+// compile-time limits; the parser lives on the stack and never allocates
+#define RDFXML_MAX_DEPTH 64
+#define RDFXML_MAX_NAMESPACES 128
+
+static const char RDF_NS[] = "http://www.w3.org/1999/02/22-rdf-syntax-ns#";
+static const char XML_NS[] = "http://www.w3.org/XML/1998/namespace";
+
+////////////////////////////// HELPERS //////////////////////////////
+static const rdfxml_slice empty = {"", 0};
+
+int rdfxml_equals(rdfxml_slice s, const char *str) {
+    size_t len = strlen(str);
+    return s.len == len && !memcmp(s.ptr, str, len);
+}
+static int slices_equal(rdfxml_slice a, rdfxml_slice b) {
+    return a.len == b.len && !memcmp(a.ptr, b.ptr, a.len);
+}
+static rdfxml_slice slice(const char *from, const char *to) {
+    rdfxml_slice ans = {from, to - from};
+    return ans;
+}
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+/// position just after the first `needle` at or after `p`, or NULL
+static const char *find_after(const char *p, const char *end, const char *needle) {
+    size_t len = strlen(needle);
+    while (p + len <= end) {
+        p = memchr(p, needle[0], end - p - len + 1);
+        if (!p) return NULL;
+        if (!memcmp(p, needle, len)) return p + len;
+        p += 1;
+    }
+    return NULL;
+}
+/// end of a tag starting at `p`, skipping quoted attribute values; the
+/// position of its '>' or NULL
+static const char *tag_end(const char *p, const char *end) {
+    while (p < end) {
+        if (*p == '"' || *p == '\'') {
+            const char *close = memchr(p+1, *p, end - p - 1);
+            if (!close) return NULL;
+            p = close + 1;
+        } else if (*p == '>') {
+            return p;
+        } else {
+            p += 1;
+        }
+    }
+    return NULL;
+}
+
+/// iterates over the attributes in [*p, end); returns 0 when done
+static int next_attribute(const char **p, const char *end, rdfxml_slice *name, rdfxml_slice *value) {
+    const char *s = *p;
+    while (s < end && is_space(*s)) s += 1;
+    if (s >= end || *s == '/') return 0;
+    const char *n = s;
+    while (s < end && *s != '=' && !is_space(*s)) s += 1;
+    *name = slice(n, s);
+    while (s < end && is_space(*s)) s += 1;
+    if (s >= end || *s != '=') return 0;
+    s += 1;
+    while (s < end && is_space(*s)) s += 1;
+    if (s >= end || (*s != '"' && *s != '\'')) return 0;
+    const char *close = memchr(s+1, *s, end - s - 1);
+    if (!close) return 0;
+    *value = slice(s+1, close);
+    *p = close + 1;
+    return 1;
+}
+////////////////////////////// HELPERS //////////////////////////////
+
+/////////////////////////////// PARSER //////////////////////////////
+enum { OUTSIDE, RDF, NODE, PROPERTY, RESOURCE, LITERAL, SKIP };
+
+typedef struct {
+    int kind;
+    rdfxml_slice qname;   // as written, to match the end tag
+    rdfxml_slice lang;
+    const char *content;  // just after the start tag
+    size_t num_ns;        // namespace bindings in scope before this element
+    size_t li;            // rdf:li children seen so far
+    int has_children;
+    int emitted;          // a property already reported by attributes
+} rdfxml_element;
+
+struct rdfxml_query {
+    size_t count;
+    struct { size_t first, depth; } paths[RDFXML_MAX_QUERY];
+    rdfxml_step *steps; // all paths' steps, pointing into `text`
+    char *text;
+};
+typedef unsigned long long rdfxml_mask; // one bit per query path
+
+/// where a node or rdf:Bag can take new children: just after its start tag,
+/// or if it is an empty element, at the "/>" that must become an end tag
+typedef struct {
+    const char *at;
+    int empty;
+    rdfxml_slice qname;
+} patch_container;
+
+enum { SITE_NONE, SITE_ATTRIBUTE, SITE_ELEMENT };
+
+/// what rdfxml_patch_ functions need to know about a packet
+typedef struct {
+    rdfxml_step target;
+
+    // the first top-level node, or the first with a prefix for target.ns
+    const char *attrs_end;     // where new attributes go
+    patch_container node;
+    rdfxml_slice prefix;       // bound to target.ns there, if ptr is set
+    rdfxml_slice rdf_prefix;   // bound to the RDF namespace there, if ptr is set
+
+    // the first top-level statement of target
+    int found;
+    const char *start, *end;   // all of its bytes
+    rdfxml_slice qname;        // element name as written
+    int literal;               // `value` is its text
+    rdfxml_slice value;
+    size_t depth;              // of the element on the parser's stack
+    patch_container bag;       // its rdf:Bag, if bag.at is set
+} patch_site;
+
+typedef struct {
+    rdfxml_callback callback;
+    void *user;
+    int stopped;
+
+    // only when running a query
+    const rdfxml_query *query;
+    rdfxml_match_callback match;
+    rdfxml_mask found;
+    rdfxml_mask live[RDFXML_MAX_DEPTH+1]; // paths still possible after path[i-1]
+    size_t named[RDFXML_MAX_DEPTH+1];     // steps of path[0..i-1] that are not rdf:li
+    int skip;                             // the current element matches no path
+
+    // only when patching
+    patch_site *site;
+
+    rdfxml_element stack[RDFXML_MAX_DEPTH];
+    size_t depth;
+    struct { rdfxml_slice prefix, uri; unsigned id; } ns[RDFXML_MAX_NAMESPACES];
+    size_t num_ns;
+    rdfxml_step path[RDFXML_MAX_DEPTH];
+    size_t path_len;
+    rdfxml_slice about;
+} rdfxml_parser;
+
+static int is_rdf(const rdfxml_step *name, const char *local);
+
+static int same_namespace(const rdfxml_step *a, const rdfxml_step *b) {
+    // interned namespaces compare by number; others by URI
+    if (a->ns_id || b->ns_id) return a->ns_id == b->ns_id;
+    return slices_equal(a->ns, b->ns);
+}
+static int same_predicate(const rdfxml_step *a, const rdfxml_step *b) {
+    return slices_equal(a->local, b->local) && same_namespace(a, b);
+}
+
+/// the query paths still possible after adding `step` to a path that had
+/// `named` non-rdf:li steps and left `live` possible
+static rdfxml_mask step_mask(const rdfxml_query *q, rdfxml_mask live, size_t named, rdfxml_step step) {
+    if (step.index) return live;
+    rdfxml_mask ans = 0;
+    for(size_t i=0; i<q->count; i+=1) {
+        if (!(live & (1ull<<i))) continue;
+        if (q->paths[i].depth <= named) ans |= 1ull<<i; // inside a match already
+        else {
+            if (same_predicate(&q->steps[q->paths[i].first + named], &step)) ans |= 1ull<<i;
+        }
+    }
+    return ans;
+}
+
+/// reports a triple to the query paths it is inside of
+static int emit_match(rdfxml_parser *x, const rdfxml_triple *t) {
+    const rdfxml_query *q = x->query;
+    if (is_rdf(&t->predicate, "type")) return 1;
+    rdfxml_mask m = step_mask(q, x->live[t->depth], x->named[t->depth], t->predicate);
+    size_t named = x->named[t->depth] + (t->predicate.index ? 0 : 1);
+    for(size_t i=0; i<q->count && m; i+=1) {
+        if (!(m & (1ull<<i)) || q->paths[i].depth > named) continue;
+        x->found |= 1ull<<i;
+        if (x->match(i, t, x->user)) { x->stopped = 1; break; }
+    }
+    return !x->stopped;
+}
+
+static int emit(rdfxml_parser *x, size_t depth, rdfxml_step predicate, int kind, rdfxml_slice object_ns, rdfxml_slice object, rdfxml_slice lang) {
+    rdfxml_triple t;
+    t.about = x->about;
+    t.path = x->path;
+    t.depth = depth;
+    t.predicate = predicate;
+    t.object_kind = kind;
+    t.object_ns = object_ns;
+    t.object = object;
+    t.lang = lang;
+    if (x->query) return emit_match(x, &t);
+    if (x->callback(&t, x->user)) x->stopped = 1;
+    return !x->stopped;
+}
+
+/// splits a qualified name and finds its namespace; attributes without a
+/// prefix have no namespace, elements without one use the default namespace
+static rdfxml_step resolve(rdfxml_parser *x, rdfxml_slice qname, int attribute) {
+    const char *colon = memchr(qname.ptr, ':', qname.len);
+    rdfxml_slice prefix = empty;
+    rdfxml_step ans = {empty, qname, 0, 0};
+    if (colon) {
+        prefix = slice(qname.ptr, colon);
+        ans.local = slice(colon+1, qname.ptr + qname.len);
+        if (rdfxml_equals(prefix, "xml")) {
+            ans.ns = slice(XML_NS, XML_NS + sizeof(XML_NS) - 1);
+            ans.ns_id = RDFXML_NS_XML;
+            return ans;
+        }
+    } else if (attribute) {
+        return ans;
+    }
+    for(size_t i=x->num_ns; i>0; i-=1) {
+        if (slices_equal(x->ns[i-1].prefix, prefix)) {
+            ans.ns = x->ns[i-1].uri;
+            ans.ns_id = x->ns[i-1].id;
+            break;
+        }
+    }
+    return ans;
+}
+static int is_rdf(const rdfxml_step *name, const char *local) {
+    return name->ns_id == RDFXML_NS_RDF && rdfxml_equals(name->local, local);
+}
+/// rdf: attributes that are syntax rather than properties
+static int is_syntax(const rdfxml_step *name) {
+    if (name->ns_id == RDFXML_NS_XML) return 1;
+    if (name->ns_id != RDFXML_NS_RDF) return 0;
+    return is_rdf(name, "about") || is_rdf(name, "nodeID")
+        || is_rdf(name, "ID") || is_rdf(name, "resource")
+        || is_rdf(name, "parseType") || is_rdf(name, "datatype");
+}
+
+/// reports attributes that abbreviate properties of the subject at `depth`
+static int emit_attributes(rdfxml_parser *x, const char *attrs, const char *end, size_t depth, rdfxml_slice lang, int *any) {
+    rdfxml_slice name, value;
+    while (next_attribute(&attrs, end, &name, &value)) {
+        if (rdfxml_equals(name, "xmlns") || (name.len > 6 && !memcmp(name.ptr, "xmlns:", 6))) continue;
+        rdfxml_step predicate = resolve(x, name, 1);
+        if (is_syntax(&predicate)) continue;
+        if (x->site && !depth && !x->site->found && same_predicate(&predicate, &x->site->target)) {
+            const char *start = name.ptr;
+            while (is_space(start[-1])) start -= 1;
+            x->site->found = SITE_ATTRIBUTE;
+            x->site->start = start;
+            x->site->end = value.ptr + value.len + 1;
+            x->site->literal = 1;
+            x->site->value = value;
+        }
+        int kind = is_rdf(&predicate, "type") ? RDFXML_RESOURCE : RDFXML_LITERAL;
+        if (!emit(x, depth, predicate, kind, empty, value, lang)) return 0;
+        if (any) *any = 1;
+    }
+    return 1;
+}
+
+/// a query is done once every path has been found and its values finished
+static void check_done(rdfxml_parser *x) {
+    if (x->query && !x->path_len && x->found == x->live[0]) x->stopped = 1;
+}
+
+/// the prefix bound to namespace `ns` in scope, if any; `.ptr` is NULL if none
+static rdfxml_slice prefix_for(rdfxml_parser *x, const rdfxml_step *ns) {
+    rdfxml_slice none = {NULL, 0};
+    for(size_t i=x->num_ns; i>0; i-=1) {
+        if (!x->ns[i-1].prefix.len) continue;
+        rdfxml_step bound = {x->ns[i-1].uri, empty, 0, x->ns[i-1].id};
+        if (!same_namespace(&bound, ns)) continue;
+        // and not redeclared since
+        size_t j = i;
+        while (j < x->num_ns && !slices_equal(x->ns[j].prefix, x->ns[i-1].prefix)) j += 1;
+        if (j == x->num_ns) return x->ns[i-1].prefix;
+    }
+    return none;
+}
+
+/// notes a top-level node as a place new properties could go
+static void mark_node(rdfxml_parser *x, rdfxml_slice qname, const char *attrs_end, const char *content) {
+    patch_site *site = x->site;
+    rdfxml_slice prefix = prefix_for(x, &site->target);
+    if (site->attrs_end && (site->prefix.ptr || !prefix.ptr)) return;
+    rdfxml_step rdf = {{RDF_NS, sizeof(RDF_NS)-1}, empty, 0, RDFXML_NS_RDF};
+    site->attrs_end = attrs_end;
+    site->node.empty = (*attrs_end == '/');
+    site->node.at = site->node.empty ? attrs_end : content;
+    site->node.qname = qname;
+    site->prefix = prefix;
+    site->rdf_prefix = prefix_for(x, &rdf);
+}
+
+static int end_element(rdfxml_parser *x, rdfxml_slice qname, const char *content_end, const char *after) {
+    if (!x->depth) return 0;
+    rdfxml_element *el = &x->stack[x->depth-1];
+    if (!slices_equal(el->qname, qname)) return 0;
+
+    patch_site *site = x->site;
+    if (site && site->found == SITE_ELEMENT && !site->end && x->depth == site->depth) {
+        site->end = after;
+        // content_end == after only for an empty element, ending "/>"
+        if (el->kind == PROPERTY && !el->has_children && !el->emitted && content_end != after) {
+            site->literal = 1;
+            site->value = slice(el->content, content_end);
+        }
+    } else if (site && site->bag.qname.ptr == el->qname.ptr) {
+        site->bag.empty = (content_end == after);
+        site->bag.at = site->bag.empty ? after - 2 : content_end;
+    }
+
+    if (el->kind == PROPERTY && !el->has_children && !el->emitted) {
+        if (!emit(x, x->path_len-1, x->path[x->path_len-1], RDFXML_LITERAL, empty, slice(el->content, content_end), el->lang)) return 1;
+    } else if (el->kind == LITERAL) {
+        if (!emit(x, x->path_len-1, x->path[x->path_len-1], RDFXML_XMLLITERAL, empty, slice(el->content, content_end), el->lang)) return 1;
+    }
+    if (el->kind == PROPERTY || el->kind == RESOURCE || el->kind == LITERAL) x->path_len -= 1;
+    if (el->kind == NODE && x->depth >= 2 && x->stack[x->depth-2].kind == RDF) x->about = empty;
+    x->num_ns = el->num_ns;
+    x->depth -= 1;
+    check_done(x);
+    return 1;
+}
+
+static int start_element(rdfxml_parser *x, rdfxml_slice qname, const char *attrs, const char *end, const char *content) {
+    if (x->depth >= RDFXML_MAX_DEPTH) return 0;
+    rdfxml_element *parent = x->depth ? &x->stack[x->depth-1] : NULL;
+    rdfxml_element *el = &x->stack[x->depth];
+    el->qname = qname;
+    el->lang = parent ? parent->lang : empty;
+    el->content = content;
+    el->num_ns = x->num_ns;
+    el->li = 0;
+    el->has_children = 0;
+    el->emitted = 0;
+    x->depth += 1;
+
+    // namespace declarations apply to the tag they are in, so go first
+    rdfxml_slice name, value;
+    const char *p = attrs;
+    while (next_attribute(&p, end, &name, &value)) {
+        if (rdfxml_equals(name, "xmlns") || (name.len > 6 && !memcmp(name.ptr, "xmlns:", 6))) {
+            if (x->num_ns >= RDFXML_MAX_NAMESPACES) return 0;
+            x->ns[x->num_ns].prefix = (name.len > 6) ? slice(name.ptr+6, name.ptr+name.len) : empty;
+            x->ns[x->num_ns].uri = value;
+            x->ns[x->num_ns].id = rdfxml_known_namespace(value);
+            x->num_ns += 1;
+        }
+    }
+
+    rdfxml_slice id = empty, resource = empty, parse_type = empty;
+    int has_id = 0, has_resource = 0, has_nodeid = 0;
+    p = attrs;
+    while (next_attribute(&p, end, &name, &value)) {
+        rdfxml_step attr = resolve(x, name, 1);
+        if (attr.ns_id == RDFXML_NS_XML && rdfxml_equals(attr.local, "lang")) el->lang = value;
+        else if (is_rdf(&attr, "about") || is_rdf(&attr, "ID")) { id = value; has_id = 1; }
+        else if (is_rdf(&attr, "nodeID")) { id = value; has_id = 1; has_nodeid = 1; }
+        else if (is_rdf(&attr, "resource")) { resource = value; has_resource = 1; }
+        else if (is_rdf(&attr, "parseType")) parse_type = value;
+    }
+
+    rdfxml_step step = resolve(x, qname, 0);
+    int pkind = parent ? parent->kind : OUTSIDE;
+    if (parent) parent->has_children = 1;
+
+    if (pkind == OUTSIDE) {
+        el->kind = is_rdf(&step, "RDF") ? RDF : OUTSIDE;
+    } else if (pkind == RDF || pkind == PROPERTY) {
+        // a resource
+        el->kind = NODE;
+        if (pkind == RDF) x->about = has_id ? id : empty;
+        if (x->site && pkind == RDF) mark_node(x, qname, end, content);
+        if (x->site && x->site->found == SITE_ELEMENT && !x->site->end
+        && x->depth == x->site->depth + 1 && is_rdf(&step, "Bag"))
+            x->site->bag.qname = qname;
+        if (!is_rdf(&step, "Description")) {
+            // hidden type: <ns:Name> is <rdf:Description> with rdf:type ns:Name
+            rdfxml_step type = {{RDF_NS, sizeof(RDF_NS)-1}, {"type", 4}, 0, RDFXML_NS_RDF};
+            if (!emit(x, x->path_len, type, RDFXML_RESOURCE, step.ns, step.local, el->lang)) return 1;
+        }
+        if (!emit_attributes(x, attrs, end, x->path_len, el->lang, NULL)) return 1;
+        check_done(x);
+    } else if (pkind == NODE || pkind == RESOURCE) {
+        // a predicate
+        if (is_rdf(&step, "li")) step.index = (parent->li += 1);
+        if (x->site && !x->path_len && !x->site->found && same_predicate(&step, &x->site->target)) {
+            x->site->found = SITE_ELEMENT;
+            x->site->start = qname.ptr - 1;
+            x->site->qname = qname;
+            x->site->depth = x->depth;
+        }
+        if (x->query) {
+            size_t at = x->path_len;
+            x->live[at+1] = step_mask(x->query, x->live[at], x->named[at], step);
+            x->named[at+1] = x->named[at] + (step.index ? 0 : 1);
+            if (!x->live[at+1]) {
+                // nothing wanted in here; leave it to skip_subtree
+                x->num_ns = el->num_ns;
+                x->depth -= 1;
+                x->skip = 1;
+                return 1;
+            }
+        }
+        x->path[x->path_len++] = step;
+
+        if (rdfxml_equals(parse_type, "Resource")) el->kind = RESOURCE;
+        else if (rdfxml_equals(parse_type, "Literal")) el->kind = LITERAL;
+        else el->kind = PROPERTY;
+
+        if (has_resource || (has_nodeid && el->kind == PROPERTY)) {
+            el->emitted = 1;
+            int kind = has_resource ? RDFXML_RESOURCE : RDFXML_NODEID;
+            if (!emit(x, x->path_len-1, step, kind, empty, has_resource ? resource : id, el->lang)) return 1;
+        }
+        // other attributes are properties of an implied blank resource
+        if (el->kind != LITERAL && !emit_attributes(x, attrs, end, x->path_len, el->lang, &el->emitted)) return 1;
+    } else {
+        el->kind = SKIP;
+    }
+    return 1;
+}
+
+/// position just after the end tag matching a start tag named `qname`
+/// that ended just before `p`, or NULL. Only tags named `qname` are examined.
+static const char *skip_subtree(const char *p, const char *end, rdfxml_slice qname) {
+    int depth = 1;
+    while (p < end) {
+        const char *lt = memchr(p, '<', end - p);
+        if (!lt) return NULL;
+        p = lt + 1;
+        if (end - p >= 3 && !memcmp(p, "!--", 3)) {
+            p = find_after(p+3, end, "-->");
+            if (!p) return NULL;
+            continue;
+        }
+        if (end - p >= 8 && !memcmp(p, "![CDATA[", 8)) {
+            p = find_after(p+8, end, "]]>");
+            if (!p) return NULL;
+            continue;
+        }
+        int closing = (*p == '/');
+        const char *name = p + closing;
+        if (end - name <= (long)qname.len || memcmp(name, qname.ptr, qname.len)) continue;
+        char after = name[qname.len];
+        if (after != '>' && after != '/' && !is_space(after)) continue;
+        const char *gt = tag_end(name, end);
+        if (!gt) return NULL;
+        if (closing) depth -= 1;
+        else if (gt[-1] != '/') depth += 1;
+        p = gt + 1;
+        if (!depth) return p;
+    }
+    return NULL;
+}
+
+static int run(rdfxml_parser *x, const char *xml, size_t length) {
+    const char *p = xml, *end = xml + length;
+
+    x->stopped = x->skip = 0;
+    x->depth = x->num_ns = x->path_len = 0;
+    x->about = empty;
+
+    while (p < end && !x->stopped) {
+        const char *lt = memchr(p, '<', end - p);
+        if (!lt) break;
+        p = lt + 1;
+        if (p >= end) return 0;
+
+        if (end - p >= 3 && !memcmp(p, "!--", 3)) {
+            p = find_after(p+3, end, "-->");
+        } else if (end - p >= 8 && !memcmp(p, "![CDATA[", 8)) {
+            p = find_after(p+8, end, "]]>");
+        } else if (*p == '?') {
+            p = find_after(p+1, end, "?>");
+        } else if (*p == '!') {
+            p = find_after(p+1, end, ">");
+        } else if (*p == '/') {
+            const char *gt = memchr(p, '>', end - p);
+            if (!gt) return 0;
+            const char *name_end = gt;
+            while (name_end > p+1 && is_space(name_end[-1])) name_end -= 1;
+            if (!end_element(x, slice(p+1, name_end), lt, gt+1)) return 0;
+            p = gt + 1;
+        } else {
+            const char *name = p;
+            while (p < end && !is_space(*p) && *p != '/' && *p != '>') p += 1;
+            const char *gt = tag_end(p, end);
+            if (!gt) return 0;
+            int empty_element = (gt[-1] == '/');
+            rdfxml_slice qname = slice(name, p);
+            if (!start_element(x, qname, p, empty_element ? gt-1 : gt, gt+1)) return 0;
+            if (x->skip) {
+                x->skip = 0;
+                p = empty_element ? gt + 1 : skip_subtree(gt + 1, end, qname);
+            } else {
+                if (empty_element && !x->stopped && !end_element(x, qname, gt+1, gt+1)) return 0;
+                p = gt + 1;
+            }
+        }
+        if (!p) return 0;
+    }
+    return x->stopped || x->depth == 0;
+}
+
+int rdfxml_parse(const char *xml, size_t length, rdfxml_callback callback, void *user) {
+    rdfxml_parser x;
+    x.callback = callback;
+    x.user = user;
+    x.query = NULL;
+    x.site = NULL;
+    return run(&x, xml, length);
+}
+/////////////////////////////// PARSER //////////////////////////////
+
+/////////////////////////////// QUERY ///////////////////////////////
+rdfxml_query *rdfxml_query_compile(const char *const *paths, size_t count) {
+    if (count > RDFXML_MAX_QUERY) return NULL;
+    size_t chars = 0, steps = 0;
+    for(size_t i=0; i<count; i+=1) {
+        chars += strlen(paths[i]) + 1;
+        for(const char *c = paths[i]; *c; c += 1) if (*c == '{') steps += 1;
+    }
+
+    rdfxml_query *q = malloc(sizeof(rdfxml_query));
+    if (!q) return NULL;
+    q->count = count;
+    q->text = malloc(chars);
+    q->steps = malloc((steps ? steps : 1) * sizeof(rdfxml_step));
+    if (!q->text || !q->steps) { rdfxml_query_free(q); return NULL; }
+
+    char *text = q->text;
+    size_t step = 0;
+    for(size_t i=0; i<count; i+=1) {
+        size_t len = strlen(paths[i]);
+        memcpy(text, paths[i], len + 1);
+        q->paths[i].first = step;
+        // {namespace}local, repeated with optional '/' separators
+        char *c = text;
+        while (*c) {
+            if (*c == '/' && c != text) c += 1;
+            char *close = (*c == '{') ? strchr(c, '}') : NULL;
+            if (!close) { rdfxml_query_free(q); return NULL; }
+            char *local = close + 1, *stop = local;
+            while (*stop && *stop != '/' && *stop != '{') stop += 1;
+            if (stop == local) { rdfxml_query_free(q); return NULL; }
+            q->steps[step].ns = slice(c+1, close);
+            q->steps[step].local = slice(local, stop);
+            q->steps[step].index = 0;
+            q->steps[step].ns_id = rdfxml_known_namespace(q->steps[step].ns);
+            step += 1;
+            c = stop;
+        }
+        q->paths[i].depth = step - q->paths[i].first;
+        if (!q->paths[i].depth) { rdfxml_query_free(q); return NULL; }
+        text += len + 1;
+    }
+    return q;
+}
+
+void rdfxml_query_free(rdfxml_query *q) {
+    if (!q) return;
+    free(q->steps);
+    free(q->text);
+    free(q);
+}
+
+int rdfxml_query_run(const rdfxml_query *q, const char *xml, size_t length, rdfxml_match_callback callback, void *user) {
+    rdfxml_parser x;
+    x.query = q;
+    x.match = callback;
+    x.user = user;
+    x.site = NULL;
+    x.found = 0;
+    x.live[0] = (q->count >= 64) ? ~0ull : (1ull << q->count) - 1;
+    x.named[0] = 0;
+    if (!q->count) return 1;
+    return run(&x, xml, length);
+}
+/////////////////////////////// QUERY ///////////////////////////////
+
+/////////////////////////////// PATCH ///////////////////////////////
+static int ignore_triple(const rdfxml_triple *t, void *user) {
+    (void)t; (void)user;
+    return 0;
+}
+
+/// parses one `{namespace}local` name; the result points into `property`
+static int parse_property(const char *property, rdfxml_step *out) {
+    const char *close = (*property == '{') ? strchr(property, '}') : NULL;
+    if (!close || !close[1] || strchr(close+1, '/') || strchr(close+1, '{')) return 0;
+    out->ns = slice(property+1, close);
+    out->local = slice(close+1, close+1+strlen(close+1));
+    out->index = 0;
+    out->ns_id = rdfxml_known_namespace(out->ns);
+    return 1;
+}
+
+/// finds where `target` is or could go; false if malformed or there is no node
+static int locate(const char *packet, size_t length, rdfxml_step target, patch_site *site) {
+    rdfxml_parser x;
+    memset(site, 0, sizeof(patch_site));
+    site->target = target;
+    x.callback = ignore_triple;
+    x.user = NULL;
+    x.query = NULL;
+    x.site = site;
+    return run(&x, packet, length) && site->attrs_end;
+}
+
+/// a growable string for building the bytes to splice in
+typedef struct {
+    char *ptr;
+    size_t len, cap;
+    int failed;
+} patch_text;
+
+static void put(patch_text *t, const char *s, size_t len) {
+    if (t->failed) return;
+    if (t->len + len > t->cap) {
+        size_t want = 2*(t->len + len) + 64;
+        char *bigger = realloc(t->ptr, want);
+        if (!bigger) { t->failed = 1; return; }
+        t->ptr = bigger;
+        t->cap = want;
+    }
+    memcpy(t->ptr + t->len, s, len);
+    t->len += len;
+}
+static void put_str(patch_text *t, const char *s) { put(t, s, strlen(s)); }
+static void put_slice(patch_text *t, rdfxml_slice s) { put(t, s.ptr, s.len); }
+/// escaped for use as either text or an attribute value in either kind of quotes
+static void put_escaped(patch_text *t, const char *s, size_t len) {
+    for(size_t i=0; i<len; i+=1) {
+        switch(s[i]) {
+            case '&': put_str(t, "&amp;"); break;
+            case '<': put_str(t, "&lt;"); break;
+            case '>': put_str(t, "&gt;"); break;
+            case '"': put_str(t, "&quot;"); break;
+            case '\'': put_str(t, "&apos;"); break;
+            case '\t': put_str(t, "&#x9;"); break;
+            case '\n': put_str(t, "&#xA;"); break;
+            case '\r': put_str(t, "&#xD;"); break;
+            default: put(t, s+i, 1);
+        }
+    }
+}
+/// `prefix:local`, using the prefix already bound to the namespace if there is
+/// one; with `declare`, binds `prefix` if there was not
+static void put_name(patch_text *t, const patch_site *site, const char *prefix, int declare) {
+    if (site->prefix.ptr) put_slice(t, site->prefix);
+    else put_str(t, prefix);
+    put_str(t, ":");
+    put_slice(t, site->target.local);
+    if (declare && !site->prefix.ptr) {
+        put_str(t, " xmlns:");
+        put_str(t, prefix);
+        put_str(t, "=\"");
+        put_escaped(t, site->target.ns.ptr, site->target.ns.len);
+        put_str(t, "\"");
+    }
+}
+
+/// replaces [from, to) of `packet` with `text`, moving the rest of the
+/// packet into or out of the padding before its xpacket trailer.
+/// Changes nothing and returns false if the padding is too small or the
+/// packet is not marked writable.
+static int splice(char *packet, size_t length, const char *from, const char *to, const patch_text *text) {
+    static const char trailer[] = "<?xpacket end=";
+    size_t n = sizeof(trailer) - 1;
+    if (text->failed || length < n + 5) return 0;
+    char *end = packet + length - n - 5;
+    while (end > packet && memcmp(end, trailer, n)) end -= 1;
+    if (memcmp(end, trailer, n) || end[n+1] != 'w') return 0;
+    char *pad = end;
+    while (pad > to && is_space(pad[-1])) pad -= 1;
+
+    char *f = packet + (from - packet), *t = packet + (to - packet);
+    long delta = (long)text->len - (long)(t - f);
+    if (delta > end - pad) return 0;
+    memmove(t + delta, t, pad - t);
+    if (text->len) memcpy(f, text->ptr, text->len);
+    if (delta < 0) memset(pad + delta, ' ', -delta);
+    return 1;
+}
+
+int rdfxml_patch_set(char *packet, size_t length, const char *property, const char *prefix, const char *value) {
+    rdfxml_step target;
+    patch_site site;
+    patch_text text = {NULL, 0, 0, 0};
+    const char *from, *to;
+    if (!parse_property(property, &target) || !locate(packet, length, target, &site)) return 0;
+
+    if (site.found && site.literal) {
+        // just the value
+        from = site.value.ptr;
+        to = from + site.value.len;
+        put_escaped(&text, value, strlen(value));
+    } else if (site.found) {
+        // structured: replace the element with a simple one
+        from = site.start;
+        to = site.end;
+        put_str(&text, "<");
+        put_slice(&text, site.qname);
+        put_str(&text, ">");
+        put_escaped(&text, value, strlen(value));
+        put_str(&text, "</");
+        put_slice(&text, site.qname);
+        put_str(&text, ">");
+    } else {
+        // new: an attribute of the node
+        if (!site.prefix.ptr && !prefix) return 0;
+        from = to = site.attrs_end;
+        if (!site.prefix.ptr) {
+            put_str(&text, " xmlns:");
+            put_str(&text, prefix);
+            put_str(&text, "=\"");
+            put_escaped(&text, target.ns.ptr, target.ns.len);
+            put_str(&text, "\"");
+        }
+        put_str(&text, " ");
+        put_name(&text, &site, prefix, 0);
+        put_str(&text, "=\"");
+        put_escaped(&text, value, strlen(value));
+        put_str(&text, "\"");
+    }
+    int ok = splice(packet, length, from, to, &text);
+    free(text.ptr);
+    return ok;
+}
+
+int rdfxml_patch_remove(char *packet, size_t length, const char *property) {
+    rdfxml_step target;
+    patch_site site;
+    patch_text text = {NULL, 0, 0, 0};
+    if (!parse_property(property, &target) || !locate(packet, length, target, &site)) return 0;
+    if (!site.found) return 1;
+    const char *from = site.start;
+    while (from > packet && is_space(from[-1])) from -= 1;
+    return splice(packet, length, from, site.end, &text);
+}
+
+int rdfxml_patch_append(char *packet, size_t length, const char *property, const char *prefix, const char *value) {
+    rdfxml_step target;
+    patch_site site;
+    patch_text text = {NULL, 0, 0, 0};
+    const char *from, *to;
+    if (!parse_property(property, &target) || !locate(packet, length, target, &site)) return 0;
+
+    if (site.found == SITE_ELEMENT && site.bag.at) {
+        // a new rdf:li at the end of the rdf:Bag, with its prefix
+        const char *colon = memchr(site.bag.qname.ptr, ':', site.bag.qname.len);
+        rdfxml_slice rdf = slice(site.bag.qname.ptr, colon ? colon + 1 : site.bag.qname.ptr);
+        from = to = site.bag.at;
+        if (site.bag.empty) { put_str(&text, ">"); to += 2; }
+        put_str(&text, "<");
+        put_slice(&text, rdf);
+        put_str(&text, "li>");
+        put_escaped(&text, value, strlen(value));
+        put_str(&text, "</");
+        put_slice(&text, rdf);
+        put_str(&text, "li>");
+        if (site.bag.empty) {
+            put_str(&text, "</");
+            put_slice(&text, site.bag.qname);
+            put_str(&text, ">");
+        }
+    } else if (site.found) {
+        return 0; // not a bag
+    } else {
+        // a new property holding a one-entry rdf:Bag
+        if ((!site.prefix.ptr && !prefix) || !site.rdf_prefix.ptr) return 0;
+        from = to = site.node.at;
+        if (site.node.empty) { put_str(&text, ">"); to += 2; }
+        put_str(&text, "<");
+        put_name(&text, &site, prefix, 1);
+        put_str(&text, "><");
+        put_slice(&text, site.rdf_prefix);
+        put_str(&text, ":Bag><");
+        put_slice(&text, site.rdf_prefix);
+        put_str(&text, ":li>");
+        put_escaped(&text, value, strlen(value));
+        put_str(&text, "</");
+        put_slice(&text, site.rdf_prefix);
+        put_str(&text, ":li></");
+        put_slice(&text, site.rdf_prefix);
+        put_str(&text, ":Bag></");
+        put_name(&text, &site, prefix, 0);
+        put_str(&text, ">");
+        if (site.node.empty) {
+            put_str(&text, "</");
+            put_slice(&text, site.node.qname);
+            put_str(&text, ">");
+        }
+    }
+    int ok = splice(packet, length, from, to, &text);
+    free(text.ptr);
+    return ok;
+}
+/////////////////////////////// PATCH ///////////////////////////////
+
+////////////////////////////// UNESCAPE /////////////////////////////
+static size_t put_utf8(unsigned long c, char *out) {
+    if (c < 0x80) { out[0] = c; return 1; }
+    if (c < 0x800) { out[0] = 0xC0|(c>>6); out[1] = 0x80|(c&0x3F); return 2; }
+    if (c < 0x10000) { out[0] = 0xE0|(c>>12); out[1] = 0x80|((c>>6)&0x3F); out[2] = 0x80|(c&0x3F); return 3; }
+    out[0] = 0xF0|(c>>18); out[1] = 0x80|((c>>12)&0x3F); out[2] = 0x80|((c>>6)&0x3F); out[3] = 0x80|(c&0x3F);
+    return 4;
+}
+
+size_t rdfxml_unescape(rdfxml_slice text, char *out) {
+    const char *p = text.ptr, *end = text.ptr + text.len;
+    size_t n = 0;
+    while (p < end) {
+        if (*p == '&') {
+            const char *semi = memchr(p, ';', end - p);
+            rdfxml_slice ref = slice(p+1, semi ? semi : p+1);
+            if (!semi) { out[n++] = *p++; continue; }
+            if (rdfxml_equals(ref, "lt")) out[n++] = '<';
+            else if (rdfxml_equals(ref, "gt")) out[n++] = '>';
+            else if (rdfxml_equals(ref, "amp")) out[n++] = '&';
+            else if (rdfxml_equals(ref, "quot")) out[n++] = '"';
+            else if (rdfxml_equals(ref, "apos")) out[n++] = '\'';
+            else if (ref.len > 1 && ref.ptr[0] == '#') {
+                unsigned long c = 0;
+                int hex = (ref.ptr[1] == 'x');
+                for(const char *d = ref.ptr + 1 + hex; d < semi; d += 1) {
+                    int v = (*d >= '0' && *d <= '9') ? *d - '0'
+                        : (hex && *d >= 'a' && *d <= 'f') ? *d - 'a' + 10
+                        : (hex && *d >= 'A' && *d <= 'F') ? *d - 'A' + 10 : -1;
+                    if (v < 0 || c > 0x10FFFF) { c = 0xFFFD; break; }
+                    c = c * (hex ? 16 : 10) + v;
+                }
+                // a character reference is never shorter than its UTF-8
+                n += put_utf8(c > 0x10FFFF ? 0xFFFD : c, out + n);
+            } else {
+                // unknown entity: copy as written
+                memcpy(out + n, p, semi + 1 - p);
+                n += semi + 1 - p;
+            }
+            p = semi + 1;
+        } else if (*p == '<' && end - p >= 9 && !memcmp(p, "<![CDATA[", 9)) {
+            const char *close = find_after(p+9, end, "]]>");
+            const char *stop = close ? close - 3 : end;
+            memcpy(out + n, p+9, stop - (p+9));
+            n += stop - (p+9);
+            p = close ? close : end;
+        } else {
+            out[n++] = *p++;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+////////////////////////////// UNESCAPE /////////////////////////////
+
+////////////////////////////// INTERN ///////////////////////////////
+#define NS(uri) {uri, sizeof(uri) - 1}
+/// in RDFXML_NS_ order
+static const rdfxml_slice known_namespaces[RDFXML_NS_KNOWN + 1] = {
+    {"", 0},
+    NS("http://www.w3.org/1999/02/22-rdf-syntax-ns#"),
+    NS("http://www.w3.org/XML/1998/namespace"),
+    NS("adobe:ns:meta/"),
+    NS("http://purl.org/dc/elements/1.1/"),
+    NS("http://purl.org/dc/terms/"),
+    NS("http://ns.adobe.com/xap/1.0/"),
+    NS("http://ns.adobe.com/xap/1.0/rights/"),
+    NS("http://ns.adobe.com/xap/1.0/mm/"),
+    NS("http://ns.adobe.com/xap/1.0/bj/"),
+    NS("http://ns.adobe.com/xap/1.0/t/pg/"),
+    NS("http://ns.adobe.com/xmp/1.0/DynamicMedia/"),
+    NS("http://ns.adobe.com/xap/1.0/g/"),
+    NS("http://ns.adobe.com/xap/1.0/g/img/"),
+    NS("http://ns.adobe.com/xmp/Identifier/qual/1.0/"),
+    NS("http://ns.adobe.com/xap/1.0/sType/ResourceEvent#"),
+    NS("http://ns.adobe.com/xap/1.0/sType/ResourceRef#"),
+    NS("http://ns.adobe.com/xap/1.0/sType/Dimensions#"),
+    NS("http://ns.adobe.com/xap/1.0/sType/Version#"),
+    NS("http://ns.adobe.com/xmp/sType/Area#"),
+    NS("http://ns.adobe.com/photoshop/1.0/"),
+    NS("http://ns.adobe.com/pdf/1.3/"),
+    NS("http://ns.adobe.com/tiff/1.0/"),
+    NS("http://ns.adobe.com/exif/1.0/"),
+    NS("http://cipa.jp/exif/1.0/"),
+    NS("http://ns.adobe.com/exif/1.0/aux/"),
+    NS("http://ns.adobe.com/camera-raw-settings/1.0/"),
+    NS("http://ns.adobe.com/lightroom/1.0/"),
+    NS("http://iptc.org/std/Iptc4xmpCore/1.0/xmlns/"),
+    NS("http://iptc.org/std/Iptc4xmpExt/2008-02-29/"),
+    NS("http://ns.useplus.org/ldf/xmp/1.0/"),
+    NS("http://www.metadataworkinggroup.com/schemas/regions/"),
+    NS("http://www.metadataworkinggroup.com/schemas/keywords/"),
+    NS("http://ns.google.com/photos/1.0/panorama/"),
+};
+#undef NS
+
+static uint32_t fnv1a(uint32_t h, const char *p, size_t len) {
+    for(size_t i=0; i<len; i+=1) h = (h ^ (unsigned char)p[i]) * 16777619u;
+    return h;
+}
+#define FNV_BASIS 2166136261u
+
+/// (fnv1a(uri) * KNOWN_SEED) >> 26 is distinct for every known namespace;
+/// the seed was found by trying odd multipliers until there were no collisions.
+/// If the list above changes, so must this table; rdfxml_example checks that
+/// every namespace still maps to its own id.
+#define KNOWN_SEED 128211u
+static const unsigned char known_slots[64] = {
+     0, 13,  0,  0, 26, 25, 10,  0, 12, 18, 32, 22,  2,  0,  0, 11,
+     0,  0,  0, 15,  0,  0, 24,  0,  5,  0,  3,  0,  0, 29, 33, 27,
+     1,  0, 20,  0, 21,  0,  0,  0,  9, 31, 30, 19,  0,  0,  0,  0,
+     8,  0, 23,  0, 16,  0, 14, 17, 28,  4,  0,  7,  0,  0,  6,  0,
+};
+
+unsigned rdfxml_known_namespace(rdfxml_slice uri) {
+    uint32_t h = fnv1a(FNV_BASIS, uri.ptr, uri.len) * KNOWN_SEED;
+    unsigned id = known_slots[h >> 26];
+    return (id && slices_equal(known_namespaces[id], uri)) ? id : 0;
+}
+
+/// strings are copied into chunks of at least this size, never moved
+#define ARENA_CHUNK 4096
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used, size;
+    char data[];
+} arena_chunk;
+
+typedef struct {
+    unsigned ns;
+    rdfxml_slice local;
+} predicate_entry;
+
+struct rdfxml_interner {
+    arena_chunk *arena;
+    rdfxml_slice *ns;          ///< URIs of ids above RDFXML_NS_KNOWN
+    size_t num_ns, cap_ns;
+    predicate_entry *preds;    ///< predicate id i is preds[i-1]
+    size_t num_preds, cap_preds;
+    // open addressing, linear probing; each slot is an id or 0 if empty
+    unsigned *ns_table, *pred_table;
+    size_t ns_slots, pred_slots;
+};
+
+static const char *arena_copy(rdfxml_interner *in, rdfxml_slice s) {
+    arena_chunk *c = in->arena;
+    if (!c || c->size - c->used < s.len) {
+        size_t size = s.len > ARENA_CHUNK ? s.len : ARENA_CHUNK;
+        c = malloc(sizeof(arena_chunk) + size);
+        if (!c) return NULL;
+        c->next = in->arena;
+        c->used = 0;
+        c->size = size;
+        in->arena = c;
+    }
+    char *ans = c->data + c->used;
+    memcpy(ans, s.ptr, s.len);
+    c->used += s.len;
+    return ans;
+}
+
+/// doubles `*items` (of `size` bytes each) if it is full; returns false if out of memory
+static int reserve(void **items, size_t *cap, size_t count, size_t size) {
+    if (count < *cap) return 1;
+    size_t want = *cap ? *cap * 2 : 64;
+    void *bigger = realloc(*items, want * size);
+    if (!bigger) return 0;
+    *items = bigger;
+    *cap = want;
+    return 1;
+}
+
+static uint32_t pred_hash(unsigned ns, rdfxml_slice local) {
+    return fnv1a(FNV_BASIS ^ (ns * 0x9E3779B9u), local.ptr, local.len);
+}
+
+/// rebuilds a table with twice the slots once it is half full
+static int grow_table(rdfxml_interner *in, int preds) {
+    unsigned **table = preds ? &in->pred_table : &in->ns_table;
+    size_t *slots = preds ? &in->pred_slots : &in->ns_slots;
+    size_t count = preds ? in->num_preds : in->num_ns;
+    if ((count + 1) * 2 <= *slots) return 1;
+    size_t want = *slots ? *slots * 2 : 128;
+    unsigned *bigger = calloc(want, sizeof(unsigned));
+    if (!bigger) return 0;
+    for(size_t i=0; i<count; i+=1) {
+        uint32_t h = preds ? pred_hash(in->preds[i].ns, in->preds[i].local)
+                           : fnv1a(FNV_BASIS, in->ns[i].ptr, in->ns[i].len);
+        size_t at = h & (want - 1);
+        while (bigger[at]) at = (at + 1) & (want - 1);
+        bigger[at] = preds ? i + 1 : i + 1 + RDFXML_NS_KNOWN;
+    }
+    free(*table);
+    *table = bigger;
+    *slots = want;
+    return 1;
+}
+
+rdfxml_interner *rdfxml_interner_new(void) {
+    return calloc(1, sizeof(rdfxml_interner));
+}
+
+void rdfxml_interner_free(rdfxml_interner *in) {
+    if (!in) return;
+    while (in->arena) {
+        arena_chunk *next = in->arena->next;
+        free(in->arena);
+        in->arena = next;
+    }
+    free(in->ns);
+    free(in->preds);
+    free(in->ns_table);
+    free(in->pred_table);
+    free(in);
+}
+
+unsigned rdfxml_namespace_id(rdfxml_interner *in, rdfxml_slice uri) {
+    unsigned id = rdfxml_known_namespace(uri);
+    if (id) return id;
+    if (!grow_table(in, 0)) return 0;
+    size_t at = fnv1a(FNV_BASIS, uri.ptr, uri.len) & (in->ns_slots - 1);
+    for(; in->ns_table[at]; at = (at + 1) & (in->ns_slots - 1)) {
+        id = in->ns_table[at];
+        if (slices_equal(in->ns[id - 1 - RDFXML_NS_KNOWN], uri)) return id;
+    }
+    if (!reserve((void **)&in->ns, &in->cap_ns, in->num_ns, sizeof(rdfxml_slice))) return 0;
+    rdfxml_slice copy = {arena_copy(in, uri), uri.len};
+    if (!copy.ptr) return 0;
+    in->ns[in->num_ns] = copy;
+    in->num_ns += 1;
+    return in->ns_table[at] = in->num_ns + RDFXML_NS_KNOWN;
+}
+
+unsigned rdfxml_predicate_id(rdfxml_interner *in, const rdfxml_step *predicate) {
+    unsigned ns = predicate->ns_id ? predicate->ns_id : rdfxml_namespace_id(in, predicate->ns);
+    if (!ns || !grow_table(in, 1)) return 0;
+    size_t at = pred_hash(ns, predicate->local) & (in->pred_slots - 1);
+    for(; in->pred_table[at]; at = (at + 1) & (in->pred_slots - 1)) {
+        const predicate_entry *e = &in->preds[in->pred_table[at] - 1];
+        if (e->ns == ns && slices_equal(e->local, predicate->local)) return in->pred_table[at];
+    }
+    if (!reserve((void **)&in->preds, &in->cap_preds, in->num_preds, sizeof(predicate_entry))) return 0;
+    predicate_entry e = {ns, {arena_copy(in, predicate->local), predicate->local.len}};
+    if (!e.local.ptr) return 0;
+    in->preds[in->num_preds] = e;
+    in->num_preds += 1;
+    return in->pred_table[at] = in->num_preds;
+}
+
+rdfxml_slice rdfxml_namespace_uri(const rdfxml_interner *in, unsigned id) {
+    if (id <= RDFXML_NS_KNOWN) return known_namespaces[id];
+    if (!in || id - RDFXML_NS_KNOWN > in->num_ns) return empty;
+    return in->ns[id - 1 - RDFXML_NS_KNOWN];
+}
+
+rdfxml_slice rdfxml_predicate_local(const rdfxml_interner *in, unsigned id) {
+    if (!id || id > in->num_preds) return empty;
+    return in->preds[id - 1].local;
+}
+
+unsigned rdfxml_predicate_namespace(const rdfxml_interner *in, unsigned id) {
+    if (!id || id > in->num_preds) return 0;
+    return in->preds[id - 1].ns;
+}
+////////////////////////////// INTERN ///////////////////////////////
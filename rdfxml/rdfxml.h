@@ -0,0 +1,193 @@
+#include <stddef.h> // for size_t
+
+/**
+ * A run of bytes inside the buffer being parsed; not NUL-terminated.
+ * Text and attribute values are exactly as written in the XML, so they may
+ * contain entity references or CDATA sections; see rdfxml_unescape.
+ */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} rdfxml_slice;
+
+/// A predicate: namespace URI and local name.
+/// `index` is the 1-based position of an `rdf:li` in its container, or 0.
+/// `ns_id` is the rdfxml_known_namespace of `ns`, or 0 if it is not well known.
+typedef struct {
+    rdfxml_slice ns;
+    rdfxml_slice local;
+    size_t index;
+    unsigned ns_id;
+} rdfxml_step;
+
+enum {
+    RDFXML_LITERAL,    ///< `object` is text
+    RDFXML_RESOURCE,   ///< `object` is an IRI (with `object_ns` prepended)
+    RDFXML_NODEID,     ///< `object` is a file-local rdf:nodeID
+    RDFXML_XMLLITERAL, ///< `object` is the XML content of an rdf:parseType="Literal"
+};
+
+/**
+ * One assertion, passed to the callback of rdfxml_parse.
+ * The subject is the top-level resource identified by `about` (its rdf:about
+ * or rdf:nodeID, empty if neither) followed by the `depth` predicates in `path`.
+ * For example, an entry of dc:title is `path` = [dc:title], `predicate` = rdf:li
+ * with `index` 1, and `object` = the text of that entry.
+ *
+ * All slices point into the parsed buffer, except namespaces of the RDF
+ * vocabulary itself (as in `rdf:type`), which point to static storage.
+ * Nothing in a triple remains valid after the callback returns.
+ */
+typedef struct {
+    rdfxml_slice about;
+    const rdfxml_step *path;
+    size_t depth;
+    rdfxml_step predicate;
+    int object_kind;
+    rdfxml_slice object_ns; ///< non-empty only for the object of an implied rdf:type
+    rdfxml_slice object;
+    rdfxml_slice lang;      ///< xml:lang in scope, or empty
+} rdfxml_triple;
+
+/// Return 0 to continue parsing, non-zero to stop.
+typedef int (*rdfxml_callback)(const rdfxml_triple *triple, void *user);
+
+/**
+ * Parses the acyclic RDF/XML used by XMP (see guide.md), calling `callback`
+ * once per triple in document order. Nothing is allocated; limits on element
+ * nesting and namespace declarations are fixed at compile time.
+ * `rdf:nodeID` and `rdf:resource` pointers are reported, not followed.
+ *
+ * returns true on success (including if stopped by the callback), false if
+ * the XML is malformed or exceeds the nesting limits.
+ */
+int rdfxml_parse(const char *xml, size_t length, rdfxml_callback callback, void *user);
+
+/// Query paths in one rdfxml_query; each is one bit of a 64-bit mask.
+#define RDFXML_MAX_QUERY 64
+
+/// A compiled set of property paths; see rdfxml_query_compile.
+typedef struct rdfxml_query rdfxml_query;
+
+/**
+ * Compiles property paths for rdfxml_query_run. Each path is one or more
+ * predicates in `{namespace}local` form, optionally separated by `/`,
+ * for example `{http://purl.org/dc/elements/1.1/}title` or
+ * `{http://iptc.org/std/Iptc4xmpExt/2008-02-29/}LocationShown/{http://iptc.org/std/Iptc4xmpExt/2008-02-29/}City`.
+ * `rdf:li` entries and hidden types between predicates are not written.
+ * Returns NULL if a path is malformed, there are over RDFXML_MAX_QUERY, or
+ * memory runs out.
+ */
+rdfxml_query *rdfxml_query_compile(const char *const *paths, size_t count);
+void rdfxml_query_free(rdfxml_query *query);
+
+/// Called with the index (in the compiled list) of the path the triple is in.
+/// Return 0 to continue, non-zero to stop.
+typedef int (*rdfxml_match_callback)(size_t path, const rdfxml_triple *triple, void *user);
+
+/**
+ * Like rdfxml_parse, but only reports triples at or below one of the compiled
+ * paths. Elements that cannot lead to a path are skipped without parsing
+ * their contents, and parsing stops once every path has been found and the
+ * top-level property containing it has ended.
+ */
+int rdfxml_query_run(const rdfxml_query *query, const char *xml, size_t length, rdfxml_match_callback callback, void *user);
+
+/**
+ * Edits a complete XMP packet in place by replacing only the bytes that
+ * change, moving the rest of the packet into or out of the padding before its
+ * `<?xpacket end="w"?>` trailer, so that `length` stays the same and the
+ * packet can be written back over the original (see xmp_update_in_place in
+ * blocks/xmpblock.h).
+ *
+ * `property` is a top-level property in `{namespace}local` form, as for
+ * rdfxml_query_compile. If its namespace has no prefix where the property is
+ * added, `prefix` (which must not be bound to another namespace there) is
+ * declared for it; it may be NULL if the namespace is known to be bound.
+ *
+ * Each returns true on success. On failure (a malformed or read-only packet,
+ * too little padding, or a property that is not the expected kind) the packet
+ * is unchanged, and the caller can instead rebuild the packet and rewrite the
+ * file.
+ */
+/// Sets a property to a simple text value, replacing any existing value.
+int rdfxml_patch_set(char *packet, size_t length, const char *property, const char *prefix, const char *value);
+/// Removes a property and its value, if it is present.
+int rdfxml_patch_remove(char *packet, size_t length, const char *property);
+/// Adds an entry to the end of a property's rdf:Bag, creating it if needed.
+int rdfxml_patch_append(char *packet, size_t length, const char *property, const char *prefix, const char *value);
+
+/// Decodes entity references and CDATA sections of `text` into `out`, which
+/// needs room for `text.len + 1` bytes. Returns the length written.
+size_t rdfxml_unescape(rdfxml_slice text, char *out);
+
+/// Compares a slice to a NUL-terminated string.
+int rdfxml_equals(rdfxml_slice s, const char *str);
+
+/// Well-known namespaces, numbered the same in every program and run.
+/// RDFXML_NS_KNOWN is the largest; interned namespaces are numbered above it.
+enum {
+    RDFXML_NS_RDF = 1,      ///< http://www.w3.org/1999/02/22-rdf-syntax-ns#
+    RDFXML_NS_XML,          ///< http://www.w3.org/XML/1998/namespace
+    RDFXML_NS_X,            ///< adobe:ns:meta/
+    RDFXML_NS_DC,           ///< http://purl.org/dc/elements/1.1/
+    RDFXML_NS_DCTERMS,      ///< http://purl.org/dc/terms/
+    RDFXML_NS_XMP,          ///< http://ns.adobe.com/xap/1.0/
+    RDFXML_NS_XMPRIGHTS,    ///< http://ns.adobe.com/xap/1.0/rights/
+    RDFXML_NS_XMPMM,        ///< http://ns.adobe.com/xap/1.0/mm/
+    RDFXML_NS_XMPBJ,        ///< http://ns.adobe.com/xap/1.0/bj/
+    RDFXML_NS_XMPTPG,       ///< http://ns.adobe.com/xap/1.0/t/pg/
+    RDFXML_NS_XMPDM,        ///< http://ns.adobe.com/xmp/1.0/DynamicMedia/
+    RDFXML_NS_XMPG,         ///< http://ns.adobe.com/xap/1.0/g/
+    RDFXML_NS_XMPGIMG,      ///< http://ns.adobe.com/xap/1.0/g/img/
+    RDFXML_NS_XMPIDQ,       ///< http://ns.adobe.com/xmp/Identifier/qual/1.0/
+    RDFXML_NS_STEVT,        ///< http://ns.adobe.com/xap/1.0/sType/ResourceEvent#
+    RDFXML_NS_STREF,        ///< http://ns.adobe.com/xap/1.0/sType/ResourceRef#
+    RDFXML_NS_STDIM,        ///< http://ns.adobe.com/xap/1.0/sType/Dimensions#
+    RDFXML_NS_STVER,        ///< http://ns.adobe.com/xap/1.0/sType/Version#
+    RDFXML_NS_STAREA,       ///< http://ns.adobe.com/xmp/sType/Area#
+    RDFXML_NS_PHOTOSHOP,    ///< http://ns.adobe.com/photoshop/1.0/
+    RDFXML_NS_PDF,          ///< http://ns.adobe.com/pdf/1.3/
+    RDFXML_NS_TIFF,         ///< http://ns.adobe.com/tiff/1.0/
+    RDFXML_NS_EXIF,         ///< http://ns.adobe.com/exif/1.0/
+    RDFXML_NS_EXIFEX,       ///< http://cipa.jp/exif/1.0/
+    RDFXML_NS_AUX,          ///< http://ns.adobe.com/exif/1.0/aux/
+    RDFXML_NS_CRS,          ///< http://ns.adobe.com/camera-raw-settings/1.0/
+    RDFXML_NS_LR,           ///< http://ns.adobe.com/lightroom/1.0/
+    RDFXML_NS_IPTC4XMPCORE, ///< http://iptc.org/std/Iptc4xmpCore/1.0/xmlns/
+    RDFXML_NS_IPTC4XMPEXT,  ///< http://iptc.org/std/Iptc4xmpExt/2008-02-29/
+    RDFXML_NS_PLUS,         ///< http://ns.useplus.org/ldf/xmp/1.0/
+    RDFXML_NS_MWG_RS,       ///< http://www.metadataworkinggroup.com/schemas/regions/
+    RDFXML_NS_MWG_KW,       ///< http://www.metadataworkinggroup.com/schemas/keywords/
+    RDFXML_NS_GPANO,        ///< http://ns.google.com/photos/1.0/panorama/
+    RDFXML_NS_KNOWN = RDFXML_NS_GPANO
+};
+
+/// The RDFXML_NS_ number of a namespace URI, or 0 if it is not one of them.
+/// Uses a perfect hash, so costs one pass over the URI and one comparison.
+unsigned rdfxml_known_namespace(rdfxml_slice uri);
+
+/**
+ * Maps namespaces and predicates to small integers, so that code handling
+ * many files can compare, hash, and store them as numbers. Strings are
+ * copied, so ids and the slices returned for them stay valid until the
+ * interner is freed. An interner is meant for one batch on one thread;
+ * it has no locks.
+ */
+typedef struct rdfxml_interner rdfxml_interner;
+
+rdfxml_interner *rdfxml_interner_new(void);
+void rdfxml_interner_free(rdfxml_interner *in);
+
+/// Known namespaces get their RDFXML_NS_ number; others are numbered from
+/// RDFXML_NS_KNOWN+1 in order of first use. Returns 0 if out of memory.
+unsigned rdfxml_namespace_id(rdfxml_interner *in, rdfxml_slice uri);
+
+/// Numbers (namespace, local name) pairs from 1 in order of first use,
+/// ignoring `index`. Returns 0 if out of memory.
+unsigned rdfxml_predicate_id(rdfxml_interner *in, const rdfxml_step *predicate);
+
+/// The strings behind ids; empty (or 0) for ids that were never returned.
+rdfxml_slice rdfxml_namespace_uri(const rdfxml_interner *in, unsigned id);
+rdfxml_slice rdfxml_predicate_local(const rdfxml_interner *in, unsigned id);
+unsigned rdfxml_predicate_namespace(const rdfxml_interner *in, unsigned id);
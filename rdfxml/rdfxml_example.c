@@ -0,0 +1,69 @@
+#include "rdfxml.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static void print_slice(rdfxml_slice s) {
+    fwrite(s.ptr, 1, s.len, stdout);
+}
+static void print_step(const rdfxml_step *step) {
+    putchar('<'); print_slice(step->ns); print_slice(step->local); putchar('>');
+    if (step->index) printf("[%lu]", step->index);
+}
+
+static int show(const rdfxml_triple *t, void *user) {
+    putchar('{'); print_slice(t->about); putchar('}');
+    for(size_t i=0; i<t->depth; i+=1) { putchar(' '); print_step(&t->path[i]); }
+    printf("  ");
+    print_step(&t->predicate);
+    printf("  ");
+    if (t->object_kind == RDFXML_LITERAL) {
+        char *text = malloc(t->object.len + 1);
+        rdfxml_unescape(t->object, text);
+        printf("\"%s\"", text);
+        free(text);
+        if (t->lang.len) { putchar('@'); print_slice(t->lang); }
+    } else if (t->object_kind == RDFXML_XMLLITERAL) {
+        putchar('"'); print_slice(t->object); printf("\"^^rdf:XMLLiteral");
+    } else if (t->object_kind == RDFXML_NODEID) {
+        printf("_:"); print_slice(t->object);
+    } else {
+        putchar('<'); print_slice(t->object_ns); print_slice(t->object); putchar('>');
+    }
+    putchar('\n');
+    return 0;
+}
+
+/// false, naming the first, if a well-known namespace does not hash back to its
+/// own RDFXML_NS_ number, as happens if the list changes without known_slots
+static int known_namespaces_ok(void) {
+    for(unsigned id=1; id<=RDFXML_NS_KNOWN; id+=1) {
+        rdfxml_slice uri = rdfxml_namespace_uri(NULL, id);
+        if (rdfxml_known_namespace(uri) != id) {
+            fprintf(stderr, "namespace %u (", id);
+            fwrite(uri.ptr, 1, uri.len, stderr);
+            fprintf(stderr, ") is looked up as %u\n", rdfxml_known_namespace(uri));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/// prints the triples in XMP sidecar (.xmp) files, or other files containing only RDF/XML
+int main(int argc, char *argv[]) {
+    if (!known_namespaces_ok()) return 1;
+    for(int i=1; i<argc; i+=1) {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) { perror(argv[i]); continue; }
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        char *xml = malloc(size);
+        size = fread(xml, 1, size, f);
+        fclose(f);
+
+        printf("%s:\n", argv[i]);
+        if (!rdfxml_parse(xml, size, show, NULL))
+            printf("WARNING: %s is malformed\n", argv[i]);
+        free(xml);
+    }
+}
@@ -0,0 +1,156 @@
+#include "xmlscan.h"
+#include <string.h> // memcpy, memset, memcmp
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define XMLSCAN_X86 1
+#endif
+
+/////////////////////////// CLASSIFICATION //////////////////////////
+void xmlscan_classify_scalar(const char *src, xmlscan_block *out) {
+    memset(out, 0, sizeof(xmlscan_block));
+    for(int i=0; i<64; i+=1) {
+        uint64_t bit = 1ull << i;
+        switch(src[i]) {
+            case '<': out->lt |= bit; break;
+            case '>': out->gt |= bit; break;
+            case '"': out->quote |= bit; break;
+            case '\'': out->apos |= bit; break;
+            case '=': out->eq |= bit; break;
+            case ':': out->colon |= bit; break;
+            case ' ': case '\t': case '\n': case '\r': out->space |= bit; break;
+        }
+    }
+}
+
+#ifdef XMLSCAN_X86
+// SSE2 is part of x86-64, so is always available there
+__attribute__((target("sse2")))
+static uint64_t match_sse2(const __m128i *v, char c) {
+    __m128i want = _mm_set1_epi8(c);
+    uint64_t ans = 0;
+    for(int i=0; i<4; i+=1)
+        ans |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], want)) << (16*i);
+    return ans;
+}
+__attribute__((target("sse2")))
+static void classify_sse2(const char *src, xmlscan_block *out) {
+    __m128i v[4];
+    for(int i=0; i<4; i+=1) v[i] = _mm_loadu_si128((const __m128i *)(src + 16*i));
+    out->lt = match_sse2(v, '<');
+    out->gt = match_sse2(v, '>');
+    out->quote = match_sse2(v, '"');
+    out->apos = match_sse2(v, '\'');
+    out->eq = match_sse2(v, '=');
+    out->colon = match_sse2(v, ':');
+    out->space = match_sse2(v, ' ') | match_sse2(v, '\t') | match_sse2(v, '\n') | match_sse2(v, '\r');
+}
+
+__attribute__((target("avx2")))
+static uint64_t match_avx2(__m256i lo, __m256i hi, char c) {
+    __m256i want = _mm256_set1_epi8(c);
+    uint32_t l = _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, want));
+    uint32_t h = _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, want));
+    return l | ((uint64_t)h << 32);
+}
+__attribute__((target("avx2")))
+static void classify_avx2(const char *src, xmlscan_block *out) {
+    __m256i lo = _mm256_loadu_si256((const __m256i *)src);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(src + 32));
+    out->lt = match_avx2(lo, hi, '<');
+    out->gt = match_avx2(lo, hi, '>');
+    out->quote = match_avx2(lo, hi, '"');
+    out->apos = match_avx2(lo, hi, '\'');
+    out->eq = match_avx2(lo, hi, '=');
+    out->colon = match_avx2(lo, hi, ':');
+    // ' ' is 0x20 and '\t', '\n', '\r' are 0x09, 0x0A, 0x0D: a byte-shuffle
+    // lookup on the low nibble, checked against the byte itself
+    const __m256i table = _mm256_setr_epi8(
+        ' ', 0, 0, 0, 0, 0, 0, 0, 0, '\t', '\n', 0, 0, '\r', 0, 0,
+        ' ', 0, 0, 0, 0, 0, 0, 0, 0, '\t', '\n', 0, 0, '\r', 0, 0);
+    uint32_t l = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_shuffle_epi8(table, lo), lo));
+    uint32_t h = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_shuffle_epi8(table, hi), hi));
+    out->space = l | ((uint64_t)h << 32);
+}
+#endif
+
+typedef void (*classifier)(const char *src, xmlscan_block *out);
+
+static classifier best_classifier(void) {
+#ifdef XMLSCAN_X86
+    if (__builtin_cpu_supports("avx2")) return classify_avx2;
+    if (__builtin_cpu_supports("sse2")) return classify_sse2;
+#endif
+    return xmlscan_classify_scalar;
+}
+
+void xmlscan_classify(const char *src, xmlscan_block *out) {
+    best_classifier()(src, out);
+}
+/////////////////////////// CLASSIFICATION //////////////////////////
+
+//////////////////////////////// TAGS ///////////////////////////////
+enum { TEXT, TAG, DOUBLE, SINGLE, COMMENT, CDATA };
+
+static size_t find_tags(const char *xml, size_t length, uint32_t *bounds, size_t cap, classifier classify) {
+    size_t n = 0, open = 0;
+    int state = TEXT;
+    char tail[64];
+    xmlscan_block b;
+
+    for(size_t base = 0; base < length; base += 64) {
+        if (length - base >= 64) classify(xml + base, &b);
+        else {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, xml + base, length - base);
+            classify(tail, &b);
+        }
+        // only these four characters can change state, and they are rare in
+        // the whitespace, text, and base64 that make up most packets
+        uint64_t m = b.lt | b.gt | b.quote | b.apos;
+        while (m) {
+            int i = __builtin_ctzll(m);
+            m &= m - 1;
+            size_t at = base + i;
+            char c = xml[at];
+            if (state == TEXT) {
+                if (c != '<') continue;
+                open = at;
+                if (length - at >= 4 && !memcmp(xml + at, "<!--", 4)) state = COMMENT;
+                else if (length - at >= 9 && !memcmp(xml + at, "<![CDATA[", 9)) state = CDATA;
+                else state = TAG;
+                if (n < cap) bounds[n] = at;
+                n += 1;
+            } else if (state == TAG) {
+                if (c == '"') state = DOUBLE;
+                else if (c == '\'') state = SINGLE;
+                else if (c == '>') {
+                    state = TEXT;
+                    if (n < cap) bounds[n] = at;
+                    n += 1;
+                }
+            } else if (state == DOUBLE) {
+                if (c == '"') state = TAG;
+            } else if (state == SINGLE) {
+                if (c == '\'') state = TAG;
+            } else if (c == '>') {
+                const char *end = (state == COMMENT) ? "--" : "]]";
+                size_t min = open + ((state == COMMENT) ? 4 : 9);
+                if (at >= min + 2 && !memcmp(xml + at - 2, end, 2)) {
+                    state = TEXT;
+                    if (n < cap) bounds[n] = at;
+                    n += 1;
+                }
+            }
+        }
+    }
+    return n;
+}
+
+size_t xmlscan_tags(const char *xml, size_t length, uint32_t *bounds, size_t cap) {
+    return find_tags(xml, length, bounds, cap, best_classifier());
+}
+size_t xmlscan_tags_scalar(const char *xml, size_t length, uint32_t *bounds, size_t cap) {
+    return find_tags(xml, length, bounds, cap, xmlscan_classify_scalar);
+}
+//////////////////////////////// TAGS ///////////////////////////////
@@ -0,0 +1,28 @@
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t, uint64_t
+
+/**
+ * Bit i of each mask is set if byte i of a 64-byte block is that character.
+ * `space` is any of ' ', '\t', '\n', and '\r'.
+ */
+typedef struct {
+    uint64_t lt, gt, quote, apos, eq, space, colon;
+} xmlscan_block;
+
+/// Classifies exactly 64 bytes, using SIMD instructions where available.
+void xmlscan_classify(const char *src, xmlscan_block *out);
+void xmlscan_classify_scalar(const char *src, xmlscan_block *out);
+
+/**
+ * Finds every markup construct (tag, comment, CDATA section, processing
+ * instruction, or declaration) in `xml`, ignoring `<` and `>` inside quoted
+ * attribute values, comments, and CDATA. Puts the offset of each one's `<`
+ * and then its `>` in `bounds`, so the text between constructs is what lies
+ * between `bounds[2k+1]` and `bounds[2k+2]`.
+ *
+ * Returns the number of offsets found; if more than `cap`, only the first
+ * `cap` are stored. 2*`length`/3 + 2 is always enough. An odd result means
+ * the last construct was not closed.
+ */
+size_t xmlscan_tags(const char *xml, size_t length, uint32_t *bounds, size_t cap);
+size_t xmlscan_tags_scalar(const char *xml, size_t length, uint32_t *bounds, size_t cap);
@@ -0,0 +1,63 @@
+#include "xmlscan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// builds a packet shaped like Lightroom's: mostly indentation, a long
+/// xmpMM:History, and a base64 thumbnail
+static char *synthetic_packet(size_t history, size_t thumbnail, size_t *length) {
+    size_t cap = 4096 + history * 400 + thumbnail * 2;
+    char *xml = malloc(cap), *p = xml;
+    p += sprintf(p, "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\">\n <rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\">\n"
+        "  <rdf:Description rdf:about=\"\" xmlns:xmpMM=\"http://ns.adobe.com/xap/1.0/mm/\" xmlns:stEvt=\"http://ns.adobe.com/xap/1.0/sType/ResourceEvent#\""
+        " xmlns:xmp=\"http://ns.adobe.com/xap/1.0/\" xmlns:xmpGImg=\"http://ns.adobe.com/xap/1.0/g/img/\" xmp:CreatorTool=\"Adobe Photoshop Lightroom Classic 9.0 (Windows)\">\n"
+        "   <xmpMM:History>\n    <rdf:Seq>\n");
+    for(size_t i=0; i<history; i+=1)
+        p += sprintf(p, "     <rdf:li\n      stEvt:action=\"saved\"\n      stEvt:instanceID=\"xmp.iid:%08lx-1234-5678-9abc-def012345678\"\n"
+            "      stEvt:when=\"2020-01-01T12:00:00-07:00\"\n      stEvt:softwareAgent=\"Adobe Photoshop Lightroom Classic 9.0 (Windows)\"\n      stEvt:changed=\"/metadata\"/>\n", i);
+    p += sprintf(p, "    </rdf:Seq>\n   </xmpMM:History>\n   <xmp:Thumbnails>\n    <rdf:Alt>\n     <rdf:li rdf:parseType=\"Resource\">\n      <xmpGImg:image>");
+    for(size_t i=0; i<thumbnail; i+=1) {
+        *p++ = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[(i * 2654435761u >> 7) & 63];
+        if (i % 76 == 75) { memcpy(p, "&#xA;", 5); p += 5; }
+    }
+    p += sprintf(p, "</xmpGImg:image>\n     </rdf:li>\n    </rdf:Alt>\n   </xmp:Thumbnails>\n  </rdf:Description>\n </rdf:RDF>\n</x:xmpmeta>");
+    for(int i=0; i<2000; i+=1) *p++ = (i % 100) ? ' ' : '\n';
+    *length = p - xml;
+    return xml;
+}
+
+static double seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/// prints one line of JSON per packet size: bytes, tags found, and MB/s of
+/// finding tag bounds with the scalar and SIMD classifiers
+int main(int argc, char *argv[]) {
+    int repeat = (argc > 1) ? atoi(argv[1]) : 200;
+    size_t shapes[][2] = {{10, 2000}, {100, 20000}, {500, 100000}, {1000, 300000}};
+
+    for(int s=0; s<4; s+=1) {
+        size_t length;
+        char *xml = synthetic_packet(shapes[s][0], shapes[s][1], &length);
+        size_t cap = 2*length/3 + 2;
+        uint32_t *a = malloc(cap * sizeof(uint32_t)), *b = malloc(cap * sizeof(uint32_t));
+
+        size_t na = 0, nb = 0;
+        double t0 = seconds();
+        for(int r=0; r<repeat; r+=1) na = xmlscan_tags_scalar(xml, length, a, cap);
+        double t1 = seconds();
+        for(int r=0; r<repeat; r+=1) nb = xmlscan_tags(xml, length, b, cap);
+        double t2 = seconds();
+
+        if (na != nb || memcmp(a, b, na * sizeof(uint32_t)))
+            fprintf(stderr, "WARNING: scalar and SIMD results differ\n");
+        printf("{\"bytes\":%lu,\"bounds\":%lu,\"scalar_MBps\":%.1f,\"simd_MBps\":%.1f}\n",
+            length, na,
+            length * (double)repeat / (t1 - t0) / 1e6,
+            length * (double)repeat / (t2 - t1) / 1e6);
+        free(a); free(b); free(xml);
+    }
+}